@@ -0,0 +1,120 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+/* Compile-to-disk throughput on a large generated source, plus the cost of
+ * writing the finished image: one buffered write against the previous
+ * writer's one ofstream::write per field and per instruction. Then compile
+ * time of data-table sources with more and more distinct literals, which
+ * stays linear as long as the constant pool is hash indexed. */
+
+#define N_BLOCKS (1 << 15)
+#define N_ROUNDS 10
+#define MAX_LITERALS (1 << 18)
+
+static std::string make_source() {
+    std::string src = "(define x 3)\n";
+    for (int i = 0; i < N_BLOCKS; i++) {
+        std::string k = std::to_string(i % 200);
+        src += "(define x (if (< x " + k + ") (* x 2.5) (- x " + k + ")))\n";
+    }
+    src += "x\n";
+    return src;
+}
+
+// n distinct int and float literals, about as many repeated ones
+static std::string make_table(int n) {
+    std::string src = "(define t 0)\n";
+    for (int i = 0; i < n; i += 2) {
+        std::string k = std::to_string(i);
+        src += "(set! t (+ t " + k + " 1)) (set! t (* t " + k + ".5 2))\n";
+    }
+    src += "t\n";
+    return src;
+}
+
+static std::unique_ptr<Lisp::Lambda> analyze(const std::string& src) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    return sa.verify();
+}
+
+static void write_per_field(const std::vector<std::unique_ptr<BVM::Prototype>>& protos, const std::string& path) {
+    std::ofstream out(path, std::ios::binary);
+    size_t n_protos = protos.size();
+    out.write(reinterpret_cast<const char*>(&n_protos), 8);
+    for (auto& f : protos) {
+        int n_consts = f->consts.size();
+        long n_insts = f->instructions.size();
+        out.write(reinterpret_cast<const char*>(&f->next_reg), 4);
+        out.write(reinterpret_cast<const char*>(&n_consts), 4);
+        for (auto v : f->consts) {
+            BVM::BoltType type = v.get_type();
+            out.write(reinterpret_cast<const char*>(&type), 4);
+            double d = v.is_double() ? v.as_double() : v.as_int();
+            out.write(reinterpret_cast<const char*>(&d), sizeof(double));
+        }
+        out.write(reinterpret_cast<const char*>(&n_insts), 8);
+        for (uint32_t inst : f->instructions)
+            out.write(reinterpret_cast<const char*>(&inst), 4);
+    }
+}
+
+template<typename F>
+static double time_ms(F body) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++)
+        body();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / N_ROUNDS;
+}
+
+int main() {
+    std::string path = (std::filesystem::temp_directory_path() / "bench_compile.bolt").string();
+    std::string src = make_source();
+    auto program = analyze(src);
+
+    double compile_ms = time_ms([&]() {
+        Lisp::Compiler compiler(path);
+        compiler.compile(program.get());
+    });
+    double image_mb = std::filesystem::file_size(path) / (1024.0 * 1024.0);
+
+    Lisp::Compiler compiler("/dev/null");
+    compiler.compile(program.get());
+    double buffered_ms = time_ms([&]() {
+        std::vector<uint8_t> image = compiler.serialize();
+        std::ofstream out(path, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(image.data()), image.size());
+    });
+    double per_field_ms = time_ms([&]() { write_per_field(compiler.get_objs(), path); });
+
+    printf("source: %.2f MiB, image: %.2f MiB\n", src.size() / (1024.0 * 1024.0), image_mb);
+    printf("compile to disk:     %8.3f ms (%.1f MiB/s of source)\n", compile_ms, src.size() / (1024.0 * 1024.0) / (compile_ms / 1e3));
+    printf("buffered writer:     %8.3f ms (%.1f MiB/s)\n", buffered_ms, image_mb / (buffered_ms / 1e3));
+    printf("per-field writes:    %8.3f ms\n", per_field_ms);
+    std::filesystem::remove(path);
+
+    printf("\n%10s %10s %12s %14s\n", "literals", "consts", "compile ms", "ns / literal");
+    for (int n = MAX_LITERALS / 8; n <= MAX_LITERALS; n *= 2) {
+        auto table = analyze(make_table(n));
+        size_t n_consts = 0;
+        double ms = time_ms([&]() {
+            Lisp::Compiler compiler("/dev/null");
+            compiler.compile(table.get());
+            n_consts = compiler.get_objs()[0]->consts.size();
+        });
+        printf("%10d %10zu %12.3f %14.1f\n", n, n_consts, ms, ms * 1e6 / n);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+/* Compiles the same arithmetic-heavy program with and without the *RK
+ * constant operand forms and reports static instruction count, dispatches
+ * per run and run() throughput. */
+
+#define N_BLOCKS 64
+#define N_ROUNDS (1 << 14)
+
+static std::string make_source() {
+    std::string src = "(define x 3)\n";
+    for (int i = 0; i < N_BLOCKS; i++) {
+        src += "(define x (if (< x 10) (* x 20) (- x 10)))\n";
+        src += "(define x (+ 1 (/ x 2)))\n";
+    }
+    src += "x\n";
+    return src;
+}
+
+struct Result {
+    size_t n_insts;
+    size_t n_dispatches;
+    double runs_per_sec;
+    int value;
+};
+
+static Result measure(const std::string& src, Lisp::CompilerOptions options) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler("/dev/null", options);
+    compiler.compile(program.get());
+
+    Result res{};
+    BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+    for (auto& proto : compiler.release_objs()) {
+        res.n_insts += proto->instructions.size();
+        vm->load_callable(std::move(proto));
+    }
+
+    vm->setup_entry_point();
+    while (vm->execute(vm->fetch()) == BVM::Interrupt::Ok)
+        res.n_dispatches++;
+    res.n_dispatches++; // the final ret
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++) {
+        vm->setup_entry_point();
+        vm->run();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    res.runs_per_sec = N_ROUNDS / elapsed.count();
+    res.value = vm->get_return_value().as_int();
+    delete vm;
+    return res;
+}
+
+int main() {
+    std::string src = make_source();
+    Result reg = measure(src, {.constant_operands = false});
+    Result rk = measure(src, {.constant_operands = true});
+
+    printf("%-20s %10s %12s %12s\n", "", "insts", "dispatches", "runs/s");
+    printf("%-20s %10zu %12zu %12.0f\n", "register operands", reg.n_insts, reg.n_dispatches, reg.runs_per_sec);
+    printf("%-20s %10zu %12zu %12.0f\n", "constant operands", rk.n_insts, rk.n_dispatches, rk.runs_per_sec);
+    printf("dispatch reduction: %.1f%%, speedup: %.2fx\n",
+            100.0 * (1.0 - (double) rk.n_dispatches / reg.n_dispatches), rk.runs_per_sec / reg.runs_per_sec);
+    if (reg.value != rk.value)
+        printf("result mismatch: %d vs %d\n", reg.value, rk.value);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "bolt_virtual_machine/emitter.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+/* Measures raw dispatch cost: the old execution model (fetch + execute() per
+ * instruction, one call and one Interrupt round trip each) against run(). */
+
+#define N_INSTS (1 << 10)
+#define N_ROUNDS (1 << 14)
+
+static std::unique_ptr<BVM::Prototype> make_mov_chain() {
+    auto proto = std::make_unique<BVM::Prototype>();
+    proto->next_reg = 8;
+    for (int i = 0; i < N_INSTS; i++)
+        proto->instructions.push_back(BVM::Emitter::mov(i % 8, (i + 1) % 8));
+    proto->instructions.push_back(BVM::Emitter::ret(0));
+    return proto;
+}
+
+static double measure(BVM::VirtualMachine& vm, const std::function<void()>& body) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++) {
+        vm.setup_entry_point();
+        for (int r = 0; r < 8; r++)
+            vm.set_register_value(r, BVM::BoltValue::from_int(r));
+        body();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return (double) (N_INSTS + 1) * N_ROUNDS / elapsed.count();
+}
+
+int main() {
+    BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+    vm->load_callable(make_mov_chain());
+
+    double stepped = measure(*vm, [vm]() {
+        while (vm->execute(vm->fetch()) == BVM::Interrupt::Ok);
+    });
+    double threaded = measure(*vm, [vm]() { vm->run(); });
+
+#ifdef BVM_COMPUTED_GOTO
+    const char* mode = "computed goto";
+#else
+    const char* mode = "switch";
+#endif
+    printf("execute() per instruction: %8.2f Minsts/s\n", stepped / 1e6);
+    printf("run() (%s):     %8.2f Minsts/s\n", mode, threaded / 1e6);
+    printf("speedup: %.2fx\n", threaded / stepped);
+    delete vm;
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include <chrono>
+#include <cstdio>
+
+/* List-building workloads against plain new/delete per cell:
+ * - short: many small lists that die young, the case the nursery is for
+ * - long:  one long list kept alive while it grows, every cell is promoted
+ * Reports allocation rate and pause times of both generations. */
+
+#define N_CELLS (10 * 1000 * 1000)
+
+struct Cell { BVM::BoltValue car, cdr; };
+
+static void run(const char* name, int list_len) {
+    BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 1;
+    main_func->instructions = {BVM::Emitter::ret(0)};
+    vm->load_callable(std::move(main_func));
+    vm->setup_entry_point();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < N_CELLS / list_len; r++) {
+        vm->set_register_value(0, BVM::BoltValue::nil());
+        for (int i = 0; i < list_len; i++) {
+            BVM::Cons* cell = vm->new_cons(BVM::BoltValue::from_int(i), vm->get_register_value(0));
+            vm->set_register_value(0, BVM::BoltValue::from_cons(cell));
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < N_CELLS / list_len; r++) {
+        Cell* list = nullptr;
+        for (int i = 0; i < list_len; i++)
+            list = new Cell{BVM::BoltValue::from_int(i), BVM::BoltValue::from_cons(reinterpret_cast<BVM::Cons*>(list))};
+        while (list) {
+            Cell* next = reinterpret_cast<Cell*>(list->cdr.as_cons());
+            delete list;
+            list = next;
+        }
+    }
+    std::chrono::duration<double> malloc_elapsed = std::chrono::steady_clock::now() - start;
+
+    const BVM::GCStats& s = vm->get_gc_stats();
+    printf("%s lists (%d cells)\n", name, list_len);
+    printf("  nursery:    %8.2f Mcells/s\n", N_CELLS / elapsed.count() / 1e6);
+    printf("  new/delete: %8.2f Mcells/s\n", N_CELLS / malloc_elapsed.count() / 1e6);
+    printf("  minor: %lu collections, max pause %.3f ms, mean %.3f ms, %.2f MiB promoted\n",
+            s.minor_collections, s.max_minor_pause_ns / 1e6,
+            s.minor_collections ? s.total_minor_pause_ns / 1e6 / s.minor_collections : 0.0,
+            s.bytes_promoted / (1024.0 * 1024.0));
+    printf("  major: %lu collections, max pause %.3f ms\n", s.collections, s.max_pause_ns / 1e6);
+    delete vm;
+}
+
+int main() {
+    run("short", 32);
+    run("long", 100000);
+    return 0;
+}
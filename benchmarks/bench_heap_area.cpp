@@ -0,0 +1,99 @@
+#include "heap_area.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+/* HeapArea against new/delete and malloc/free on object-sized requests
+ * (closures, cons cells, short symbols):
+ * - bulk:  allocate N blocks, free them all
+ * - churn: a live set of N blocks where random blocks are freed and
+ *          reallocated, with random sizes */
+
+#define N_BLOCKS (1 << 16)
+#define N_ROUNDS 50
+#define N_CHURN (1 << 22)
+
+static const size_t SIZES[] = {24, 32, 48, 64, 17};
+
+struct Allocator {
+    const char* name;
+    void* (*alloc)(void* ctx, size_t size);
+    void (*free)(void* ctx, void* p, size_t size);
+};
+
+template<typename F>
+static double time_ms(F body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void run(const Allocator& a, void* ctx, const BVM::HeapArea* area = nullptr) {
+    std::vector<void*> blocks(N_BLOCKS);
+    std::vector<size_t> sizes(N_BLOCKS);
+    double bulk = time_ms([&]() {
+        for (int r = 0; r < N_ROUNDS; r++) {
+            for (int i = 0; i < N_BLOCKS; i++)
+                blocks[i] = a.alloc(ctx, 48);
+            for (int i = 0; i < N_BLOCKS; i++)
+                a.free(ctx, blocks[i], 48);
+        }
+    });
+
+    std::mt19937 rng(42);
+    for (int i = 0; i < N_BLOCKS; i++) {
+        sizes[i] = SIZES[rng() % 5];
+        blocks[i] = a.alloc(ctx, sizes[i]);
+    }
+    std::vector<uint32_t> picks(N_CHURN);
+    for (auto& p : picks)
+        p = rng();
+    double churn = time_ms([&]() {
+        for (uint32_t p : picks) {
+            size_t i = p % N_BLOCKS;
+            a.free(ctx, blocks[i], sizes[i]);
+            sizes[i] = SIZES[(p >> 16) % 5];
+            blocks[i] = a.alloc(ctx, sizes[i]);
+        }
+    });
+    if (area) {
+        const BVM::HeapAreaStats& s = area->get_stats();
+        printf("HeapArea live set after churn: %.2f MiB reserved in %zu runs, occupancy %.2f, "
+                "internal fragmentation %.2f, external %.2f\n",
+                s.reserved_bytes / (1024.0 * 1024.0), s.n_runs, s.occupancy(),
+                s.internal_fragmentation(), s.external_fragmentation());
+    }
+    for (int i = 0; i < N_BLOCKS; i++)
+        a.free(ctx, blocks[i], sizes[i]);
+
+    double bulk_ops = 2.0 * N_BLOCKS * N_ROUNDS;
+    double churn_ops = 2.0 * N_CHURN;
+    printf("%-12s bulk %8.2f Mops/s   churn %8.2f Mops/s\n", a.name, bulk_ops / bulk / 1e3, churn_ops / churn / 1e3);
+}
+
+int main() {
+    Allocator area = {
+        "HeapArea",
+        [](void* ctx, size_t size) { return static_cast<BVM::HeapArea*>(ctx)->allocate(size); },
+        [](void* ctx, void* p, size_t size) { static_cast<BVM::HeapArea*>(ctx)->free(p, size); },
+    };
+    Allocator cpp = {
+        "new/delete",
+        [](void*, size_t size) { return ::operator new(size); },
+        [](void*, void* p, size_t size) { ::operator delete(p, size); },
+    };
+    Allocator c = {
+        "malloc/free",
+        [](void*, size_t size) { return std::malloc(size); },
+        [](void*, void* p, size_t) { std::free(p); },
+    };
+
+    BVM::HeapArea heap;
+    run(area, &heap, &heap);
+    run(cpp, nullptr);
+    run(c, nullptr);
+    return 0;
+}
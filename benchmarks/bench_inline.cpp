@@ -0,0 +1,113 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+/* Compiles scripts built around small helper lambdas with calls to them
+ * kept and with them inlined, on both code generators, and reports static
+ * instruction count, calls and dispatches per run and interpreted run()
+ * throughput - the JIT is off so the bytecode itself is what is measured. */
+
+#define N_ROUNDS 64
+
+struct Workload {
+    const char* name;
+    std::string src;
+};
+
+static std::vector<Workload> make_workloads() {
+    std::string helpers = "(define sq (lambda (x) (* x x))) (define abs (lambda (x) (if (< x 0) (- 0 x) x)))\n"
+                          "(define clamp (lambda (x lo hi) (if (< x lo) lo (if (> x hi) hi x))))\n";
+    std::string norm = helpers + "(define dist (lambda (a b) (+ (sq (- a b)) (abs (- b a)))))\n"
+                                 "(define run (lambda (n acc) (if (= n 0) acc"
+                                 " (run (- n 1) (+ acc (clamp (dist n 7) 0 100))))))\n"
+                                 "(run 2000 0)\n";
+    std::string accessors = "(define lo (lambda (p) (- p (* (/ p 16) 16)))) (define hi (lambda (p) (/ p 16)))\n"
+                            "(define pack (lambda (h l) (+ (* h 16) l)))\n"
+                            "(define swap (lambda (p) (pack (lo p) (hi p))))\n"
+                            "(define run (lambda (n acc) (if (= n 0) acc (run (- n 1) (+ acc (swap (lo n)))))))\n"
+                            "(run 2000 0)\n";
+    return {
+        {"norm", norm},
+        {"accessors", accessors},
+        {"fib", "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 15)\n"},
+    };
+}
+
+struct Result {
+    size_t n_insts = 0;
+    size_t n_calls = 0;
+    size_t n_dispatches = 0;
+    double runs_per_sec = 0;
+    BVM::BoltValue value;
+};
+
+static Result measure(const std::string& src, Lisp::CompilerOptions options) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler("/dev/null", options);
+    compiler.compile(program.get());
+
+    Result res;
+    BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+    vm->set_jit(false);
+    for (auto& proto : compiler.release_objs()) {
+        res.n_insts += proto->instructions.size();
+        vm->load_callable(std::move(proto));
+    }
+
+    vm->setup_entry_point();
+    for (;;) {
+        uint32_t inst = vm->fetch();
+        BVM::Opcode op = BVM::VirtualMachine::decode_op(inst);
+        res.n_calls += op == BVM::Opcode::OpCall || op == BVM::Opcode::OpTailCall;
+        res.n_dispatches++;
+        if (vm->execute(inst) != BVM::Interrupt::Ok)
+            break;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++) {
+        vm->setup_entry_point();
+        vm->run();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    res.runs_per_sec = N_ROUNDS / elapsed.count();
+    res.value = vm->get_return_value();
+    delete vm;
+    return res;
+}
+
+static void report(const char* name, const char* variant, const Result& res, const Result* called) {
+    printf("%-10s %-12s %8zu %8zu %12zu %10.0f", name, variant, res.n_insts, res.n_calls, res.n_dispatches,
+            res.runs_per_sec);
+    if (called)
+        printf("  (%.1f%% fewer dispatches, %.2fx)", 100.0 * (1.0 - (double) res.n_dispatches / called->n_dispatches),
+                res.runs_per_sec / called->runs_per_sec);
+    if (called && !(res.value == called->value))
+        printf("  result mismatch");
+    printf("\n");
+}
+
+int main() {
+    printf("%-10s %-12s %8s %8s %12s %10s\n", "", "", "insts", "calls", "dispatches", "runs/s");
+    for (auto& w : make_workloads()) {
+        Result called = measure(w.src, {.inline_depth = 0});
+        Result inlined = measure(w.src, {});
+        Result ssa_called = measure(w.src, {.ssa = true, .inline_depth = 0});
+        Result ssa_inlined = measure(w.src, {.ssa = true});
+        report(w.name, "called", called, nullptr);
+        report("", "inlined", inlined, &called);
+        report("", "ssa called", ssa_called, nullptr);
+        report("", "ssa inlined", ssa_inlined, &ssa_called);
+    }
+    return 0;
+}
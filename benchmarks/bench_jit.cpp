@@ -0,0 +1,80 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+/* Runs the same programs interpreted, with the baseline JIT alone and with
+ * loop traces on top of it and reports run() throughput of each and the
+ * JIT's compile statistics. */
+
+#define N_ROUNDS 64
+
+struct Workload {
+    const char* name;
+    const char* src;
+};
+
+static const Workload workloads[] = {
+    {"fib", "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 22)"},
+    {"tail loop", "(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1))))) (loop 200000 0)"},
+    {"arith", "(define f (lambda (x) (+ (* x 3) (- x 7) (* (+ x 1) (- x 1)))))"
+              "(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc (f (- n (* (/ n 2) 2))))))))"
+              "(loop 100000 0)"},
+    {"float loop", "(define loop (lambda (n x) (if (= n 0) x (loop (- n 1) (+ (* x 0.999) (/ n 3)))))) (loop 200000 0.5)"},
+};
+
+struct Result {
+    double runs_per_sec;
+    BVM::BoltValue value;
+    BVM::JitStats stats;
+};
+
+static Result measure(const char* src, bool jit, bool tracing) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler("/dev/null");
+    compiler.compile(program.get());
+
+    BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+    vm->set_jit(jit);
+    vm->set_tracing(tracing);
+    for (auto& proto : compiler.release_objs())
+        vm->load_callable(std::move(proto));
+
+    Result res{};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++) {
+        vm->setup_entry_point();
+        vm->run();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    res.runs_per_sec = N_ROUNDS / elapsed.count();
+    res.value = vm->get_return_value();
+    res.stats = vm->get_jit_stats();
+    delete vm;
+    return res;
+}
+
+int main() {
+    printf("%-12s %12s %12s %12s %8s %10s %8s %10s\n", "", "interp/s", "jit/s", "traced/s", "speedup",
+            "compiled", "traces", "bytes");
+    for (const Workload& w : workloads) {
+        Result interp = measure(w.src, false, false);
+        Result jit = measure(w.src, true, false);
+        Result traced = measure(w.src, true, true);
+        printf("%-12s %12.1f %12.1f %12.1f %7.2fx %10lu %8lu %10lu\n", w.name, interp.runs_per_sec, jit.runs_per_sec,
+                traced.runs_per_sec, traced.runs_per_sec / interp.runs_per_sec, (unsigned long) traced.stats.compiled,
+                (unsigned long) traced.stats.traces, (unsigned long) traced.stats.code_bytes);
+        if (!(interp.value == jit.value) || !(interp.value == traced.value))
+            printf("%-12s result mismatch\n", w.name);
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+/* Time to get a large compiled image ready to run: map + validate + lower,
+ * with and without verifying the checksum. */
+
+#define N_BLOCKS (1 << 15)
+#define N_ROUNDS 20
+
+static std::string make_source() {
+    std::string src = "(define x 3)\n";
+    for (int i = 0; i < N_BLOCKS; i++)
+        src += "(define x (if (< x 10) (* x 20) (- x 10)))\n";
+    src += "x\n";
+    return src;
+}
+
+static double measure(const std::string& path, bool verify) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++) {
+        BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+        vm->load_program(path.c_str(), verify);
+        delete vm;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / N_ROUNDS;
+}
+
+int main() {
+    std::string path = (std::filesystem::temp_directory_path() / "bench_load.bolt").string();
+    {
+        Lisp::Lexer lexer(make_source());
+        lexer.tokenize();
+        auto toks = lexer.get_tokens();
+        Lisp::Parser parser(toks);
+        auto nodes = parser.parse();
+        Lisp::SemanticAnalyzer sa(nodes);
+        std::unique_ptr<Lisp::Lambda> program = sa.verify();
+        Lisp::Compiler compiler(path, {});
+        compiler.compile(program.get());
+    }
+
+    double size_mb = std::filesystem::file_size(path) / (1024.0 * 1024.0);
+    double verified = measure(path, true);
+    double unverified = measure(path, false);
+    printf("image: %.2f MiB\n", size_mb);
+    printf("load + checksum: %8.3f ms\n", verified);
+    printf("load:            %8.3f ms\n", unverified);
+    std::filesystem::remove(path);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include <chrono>
+#include <cstdio>
+
+/* Cost of running on an instruction budget: a tight counting loop run to
+ * completion in one go, then resumed slice after slice for several slice
+ * lengths. */
+
+#define N_ITERS 20000000
+
+static double measure(BVM::VirtualMachine& vm, int64_t slice, long* yields) {
+    *yields = 0;
+    vm.setup_entry_point();
+    auto start = std::chrono::steady_clock::now();
+    vm.set_budget(slice);
+    while (vm.run() == BVM::Interrupt::Yield) {
+        vm.set_budget(slice);
+        (*yields)++;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (vm.get_return_value().as_int() != N_ITERS)
+        printf("wrong result %d\n", vm.get_return_value().as_int());
+    return elapsed.count();
+}
+
+int main() {
+    BVM::VirtualMachine vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(N_ITERS), BVM::BoltValue::from_int(1)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(0, 0),
+        BVM::Emitter::lt_rk(1, 0, 1),
+        BVM::Emitter::jmp_if_false(1, 2),
+        BVM::Emitter::add_rk(0, 0, 2),
+        BVM::Emitter::jmp(-4),
+        BVM::Emitter::ret(0),
+    };
+    vm.load_callable(std::move(main_func));
+
+    long yields;
+    double base = measure(vm, BUDGET_UNLIMITED, &yields);
+    printf("%-12s %10s %10s %10s\n", "slice", "ms", "yields", "overhead");
+    printf("%-12s %10.1f %10ld %9.1f%%\n", "unlimited", base, yields, 0.0);
+    for (int64_t slice : {1000000, 10000, 100}) {
+        double ms = measure(vm, slice, &yields);
+        printf("%-12ld %10.1f %10ld %9.1f%%\n", (long) slice, ms, yields, 100.0 * (ms / base - 1.0));
+    }
+    return 0;
+}
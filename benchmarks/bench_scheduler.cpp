@@ -0,0 +1,84 @@
+#include "bolt_virtual_machine/scheduler.hpp"
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+/* An embarrassingly parallel workload - main spawns N_TASKS counting loops
+ * and joins them all - run with 1, 2, 4 ... workers up to one per hardware
+ * thread. */
+
+#define N_TASKS 64
+#define N_ITERS 200000
+#define N_ROUNDS 5
+
+static std::shared_ptr<const BVM::Program> make_program() {
+    auto program = std::make_shared<BVM::Program>();
+    uint8_t join = program->find_native("join");
+
+    // main(work, n): spawns work(n) N_TASKS times, returns the sum of the results
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3 + N_TASKS + 2;
+    main_func->consts = {BVM::BoltValue::from_int(0)};
+    uint8_t acc = 2, tmp = 3 + N_TASKS;
+    main_func->instructions.push_back(BVM::Emitter::load_const(acc, 0));
+    for (uint8_t i = 0; i < N_TASKS; i++) {
+        main_func->instructions.push_back(BVM::Emitter::mov(tmp, 0));
+        main_func->instructions.push_back(BVM::Emitter::mov(tmp + 1, 1));
+        main_func->instructions.push_back(BVM::Emitter::schedule(tmp, 1));
+        main_func->instructions.push_back(BVM::Emitter::mov(3 + i, tmp));
+    }
+    for (uint8_t i = 0; i < N_TASKS; i++) {
+        main_func->instructions.push_back(BVM::Emitter::mov(tmp + 1, 3 + i));
+        main_func->instructions.push_back(BVM::Emitter::call_native(tmp, 1, join));
+        main_func->instructions.push_back(BVM::Emitter::add(acc, acc, tmp));
+    }
+    main_func->instructions.push_back(BVM::Emitter::ret(acc));
+    program->load_callable(std::move(main_func));
+
+    // work(n): for (i = 0; i < n; i++) acc = acc + 1
+    auto work = std::make_unique<BVM::Prototype>();
+    work->arity = 1;
+    work->next_reg = 4;
+    work->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(1)};
+    work->instructions = {
+        BVM::Emitter::load_const(1, 0),
+        BVM::Emitter::load_const(2, 0),
+        BVM::Emitter::lt(3, 1, 0),
+        BVM::Emitter::jmp_if_false(3, 3),
+        BVM::Emitter::add_rk(2, 2, 1),
+        BVM::Emitter::add_rk(1, 1, 1),
+        BVM::Emitter::jmp(-5),
+        BVM::Emitter::ret(2),
+    };
+    program->load_callable(std::move(work));
+    program->freeze();
+    return program;
+}
+
+int main() {
+    auto program = make_program();
+    unsigned max_workers = std::max(1u, std::thread::hardware_concurrency());
+    double base = 0;
+    printf("%8s %12s %10s\n", "workers", "tasks/s", "speedup");
+    for (unsigned n = 1; n <= max_workers; n *= 2) {
+        BVM::Scheduler scheduler(program, n);
+        BVM::VirtualMachine vm(program);
+        int result = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < N_ROUNDS; r++) {
+            vm.setup_entry_point();
+            vm.set_register_value(0, BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(1))));
+            vm.set_register_value(1, BVM::BoltValue::from_int(N_ITERS));
+            scheduler.run(vm);
+            result = vm.get_return_value().as_int();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double rate = N_ROUNDS * N_TASKS / elapsed.count();
+        if (n == 1)
+            base = rate;
+        printf("%8u %12.0f %9.2fx\n", n, rate, rate / base);
+        if (result != N_TASKS * N_ITERS)
+            printf("wrong result %d\n", result);
+    }
+    return 0;
+}
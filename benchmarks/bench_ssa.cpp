@@ -0,0 +1,106 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+/* Compiles each workload on the direct path without and with the peephole
+ * pass and through the SSA optimizer and reports static instruction count, the largest frame, dispatches per
+ * run and interpreted run() throughput - the JIT is off so the bytecode
+ * itself is what is measured. */
+
+#define N_ROUNDS 64
+
+struct Workload {
+    const char* name;
+    std::string src;
+};
+
+static std::vector<Workload> make_workloads() {
+    std::string arith = "(define step (lambda (x y)"
+                        " (define a (+ x 1)) (define b (* a 2)) (define c (- b y))"
+                        " (define d (if (< c 0) (- 0 c) c)) (+ (* d 3) (* (+ x 1) 2))))\n"
+                        "(define run (lambda (n acc) (if (= n 0) acc (run (- n 1) (step acc n)))))\n"
+                        "(run 2000 1)\n";
+    std::string closures = "(define make (lambda (k) (define n 0) (lambda (d) (set! n (+ n (* d k))) n)))\n"
+                           "(define c (make 3))\n"
+                           "(define run (lambda (n) (c n) (if (= n 0) (c 0) (run (- n 1)))))\n"
+                           "(run 2000)\n";
+    std::string folded = "(define f (lambda (x) (define k (* 60 60)) (define m (+ k 24))"
+                         " (if (< m 0) 0 (+ (* x k) (- m (* 2 12))))))\n"
+                         "(define run (lambda (n acc) (if (= n 0) acc (run (- n 1) (+ acc (f n))))))\n"
+                         "(run 2000 0)\n";
+    return {
+        {"fib", "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 15)\n"},
+        {"arith", arith},
+        {"closures", closures},
+        {"folded", folded},
+    };
+}
+
+struct Result {
+    size_t n_insts = 0;
+    uint32_t max_frame = 0;
+    size_t n_dispatches = 0;
+    double runs_per_sec = 0;
+    BVM::BoltValue value;
+};
+
+static Result measure(const std::string& src, Lisp::CompilerOptions options) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler("/dev/null", options);
+    compiler.compile(program.get());
+
+    Result res;
+    BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+    vm->set_jit(false);
+    for (auto& proto : compiler.release_objs()) {
+        res.n_insts += proto->instructions.size();
+        res.max_frame = std::max(res.max_frame, proto->next_reg);
+        vm->load_callable(std::move(proto));
+    }
+
+    vm->setup_entry_point();
+    while (vm->execute(vm->fetch()) == BVM::Interrupt::Ok)
+        res.n_dispatches++;
+    res.n_dispatches++; // the final ret
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++) {
+        vm->setup_entry_point();
+        vm->run();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    res.runs_per_sec = N_ROUNDS / elapsed.count();
+    res.value = vm->get_return_value();
+    delete vm;
+    return res;
+}
+
+int main() {
+    printf("%-10s %-7s %8s %7s %12s %10s\n", "", "", "insts", "frame", "dispatches", "runs/s");
+    for (auto& w : make_workloads()) {
+        Result plain = measure(w.src, {.ssa = false, .peephole = false});
+        Result direct = measure(w.src, {.ssa = false});
+        Result ssa = measure(w.src, {.ssa = true});
+        printf("%-10s %-7s %8zu %7u %12zu %10.0f\n", w.name, "plain", plain.n_insts, plain.max_frame,
+                plain.n_dispatches, plain.runs_per_sec);
+        printf("%-10s %-7s %8zu %7u %12zu %10.0f\n", "", "direct", direct.n_insts, direct.max_frame,
+                direct.n_dispatches, direct.runs_per_sec);
+        printf("%-10s %-7s %8zu %7u %12zu %10.0f  (%.1f%% fewer dispatches, %.2fx)\n", "", "ssa", ssa.n_insts,
+                ssa.max_frame, ssa.n_dispatches, ssa.runs_per_sec,
+                100.0 * (1.0 - (double) ssa.n_dispatches / direct.n_dispatches), ssa.runs_per_sec / direct.runs_per_sec);
+        if (!(plain.value == direct.value) || !(direct.value == ssa.value))
+            printf("%-10s result mismatch\n", "");
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "bolt_virtual_machine/emitter.h"
+#include <chrono>
+#include <cstdio>
+
+/* Register traffic under the active BoltValue representation. Built twice,
+ * see CMakeLists.txt: bench_value_layout_tagged and bench_value_layout_nanbox.
+ * - moves: a loop-sized body of register to register moves
+ * - calls: calls with 4 arguments, each copied into the callee frame
+ * - int_arith / float_arith: a counted loop doing a multiply-add per step
+ *   on ints or doubles */
+
+#define N_INSTS (1 << 10)
+#define N_ROUNDS (1 << 14)
+
+struct Workload {
+    const char* name;
+    std::unique_ptr<BVM::Prototype> main;
+    std::unique_ptr<BVM::Prototype> callee;
+    long insts_per_round;
+};
+
+static Workload make_moves() {
+    auto proto = std::make_unique<BVM::Prototype>();
+    proto->next_reg = 16;
+    for (int i = 0; i < N_INSTS; i++)
+        proto->instructions.push_back(BVM::Emitter::mov(i % 16, (i * 7 + 3) % 16));
+    proto->instructions.push_back(BVM::Emitter::ret(0));
+    return {"moves", std::move(proto), nullptr, N_INSTS + 1};
+}
+
+static Workload make_calls() {
+    auto callee = std::make_unique<BVM::Prototype>();
+    callee->arity = 4;
+    callee->next_reg = 4;
+    callee->instructions = {
+        BVM::Emitter::mov(0, 3),
+        BVM::Emitter::mov(1, 2),
+        BVM::Emitter::ret(0),
+    };
+    auto proto = std::make_unique<BVM::Prototype>();
+    proto->next_reg = 16;
+    int n_calls = N_INSTS / 4;
+    for (int i = 0; i < n_calls; i++) {
+        proto->instructions.push_back(BVM::Emitter::call(8, 4));
+        proto->instructions.push_back(BVM::Emitter::mov(8, 0));
+    }
+    proto->instructions.push_back(BVM::Emitter::ret(0));
+    return {"calls", std::move(proto), std::move(callee), n_calls * 5L + 1};
+}
+
+/* i = 0; while (i < n) { acc = acc * k + i; i = i + 1 } */
+static Workload make_arith(const char* name, BVM::BoltValue acc, BVM::BoltValue k) {
+    const int n = N_INSTS;
+    auto proto = std::make_unique<BVM::Prototype>();
+    proto->next_reg = 16;
+    proto->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(n), BVM::BoltValue::from_int(1), acc, k};
+    proto->instructions = {
+        BVM::Emitter::load_const(1, 0),
+        BVM::Emitter::load_const(2, 1),
+        BVM::Emitter::load_const(3, 2),
+        BVM::Emitter::load_const(4, 3),
+        BVM::Emitter::load_const(5, 4),
+        BVM::Emitter::lt(6, 1, 2),
+        BVM::Emitter::jmp_if_false(6, 4),
+        BVM::Emitter::mul(4, 4, 5),
+        BVM::Emitter::add(4, 4, 1),
+        BVM::Emitter::add(1, 1, 3),
+        BVM::Emitter::jmp(-6),
+        BVM::Emitter::ret(4),
+    };
+    return {name, std::move(proto), nullptr, 5 + n * 6L + 3};
+}
+
+static void run_workload(Workload w) {
+    BVM::VirtualMachine* vm = new BVM::VirtualMachine();
+    const BVM::Prototype* callee = w.callee.get();
+    vm->load_callable(std::move(w.main));
+    if (w.callee)
+        vm->load_callable(std::move(w.callee));
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_ROUNDS; i++) {
+        vm->setup_entry_point();
+        for (int r = 0; r < 16; r++)
+            vm->set_register_value(r, BVM::BoltValue::from_int(r));
+        BVM::BoltValue clsr = BVM::BoltValue::from_func(vm->new_closure(callee));
+        vm->set_register_value(0, clsr);
+        vm->set_register_value(8, clsr);
+        vm->run();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%-12s %8.2f Minsts/s\n", w.name, (double) w.insts_per_round * N_ROUNDS / elapsed.count() / 1e6);
+    delete vm;
+}
+
+int main() {
+#ifdef BVM_NAN_BOXING
+    printf("layout: nan-boxed, sizeof(BoltValue) = %zu\n", sizeof(BVM::BoltValue));
+#else
+    printf("layout: tagged, sizeof(BoltValue) = %zu\n", sizeof(BVM::BoltValue));
+#endif
+    run_workload(make_moves());
+    run_workload(make_calls());
+    run_workload(make_arith("int_arith", BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(1)));
+    run_workload(make_arith("float_arith", BVM::BoltValue::from_double(0), BVM::BoltValue::from_double(0.5)));
+    return 0;
+}
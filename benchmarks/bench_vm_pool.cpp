@@ -0,0 +1,98 @@
+#include "bolt_virtual_machine/vm_pool.hpp"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Cost of starting a short script: a fresh vm that loads the image itself
+ * against a context taken from a pool sharing one loaded program, then
+ * pooled throughput across threads. */
+
+#define N_BLOCKS 256
+#define N_RUNS 2000
+
+static std::string make_source() {
+    std::string src = "(define x 3)\n";
+    for (int i = 0; i < N_BLOCKS; i++)
+        src += "(define x (if (< x 10) (* x 20) (- x 10)))\n";
+    src += "x\n";
+    return src;
+}
+
+template<typename F>
+static double per_run_us(int n, F&& f) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        f();
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / n;
+}
+
+int main() {
+    std::string path = (std::filesystem::temp_directory_path() / "bench_vm_pool.bolt").string();
+    {
+        Lisp::Lexer lexer(make_source());
+        lexer.tokenize();
+        auto toks = lexer.get_tokens();
+        Lisp::Parser parser(toks);
+        auto nodes = parser.parse();
+        Lisp::SemanticAnalyzer sa(nodes);
+        std::unique_ptr<Lisp::Lambda> program = sa.verify();
+        Lisp::Compiler compiler(path, {});
+        compiler.compile(program.get());
+    }
+
+    int expected = 0;
+    double fresh = per_run_us(N_RUNS, [&] {
+        BVM::VirtualMachine vm;
+        vm.load_program(path.c_str());
+        vm.setup_entry_point();
+        vm.run();
+        expected = vm.get_return_value().as_int();
+    });
+
+    auto program = std::make_shared<BVM::Program>();
+    program->load_program(path.c_str());
+    program->freeze();
+    BVM::VmPool pool(program);
+    int mismatches = 0;
+    double pooled = per_run_us(N_RUNS, [&] {
+        auto vm = pool.acquire();
+        vm->setup_entry_point();
+        vm->run();
+        mismatches += vm->get_return_value().as_int() != expected;
+    });
+
+    printf("%-28s %10.2f us/run\n", "fresh vm + load", fresh);
+    printf("%-28s %10.2f us/run\n", "pooled context", pooled);
+
+    unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<int> errors = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < n_threads; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < N_RUNS; i++) {
+                auto vm = pool.acquire();
+                vm->setup_entry_point();
+                vm->run();
+                errors += vm->get_return_value().as_int() != expected;
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%u threads, pooled:          %10.0f runs/s, %zu contexts\n",
+            n_threads, n_threads * N_RUNS / elapsed.count(), pool.n_idle());
+    if (mismatches || errors)
+        printf("result mismatch in %d runs\n", mismatches + errors.load());
+    std::filesystem::remove(path);
+    return 0;
+}
@@ -0,0 +1,342 @@
+#ifndef BVM_ASSEMBLER_H
+#define BVM_ASSEMBLER_H
+
+#include "bolt_virtual_machine/vm.hpp"
+#include "bolt_virtual_machine/jit.hpp"
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+/* Machine code generation shared by the JIT's two compilers, the baseline
+ * templates (jit.cpp) and the loop traces (trace.cpp). Only included where
+ * BVM_JIT is defined. */
+
+namespace BVM {
+
+    /* The few x86-64 encodings the JIT is made of. Code goes to a buffer
+     * first, jumps to labels and to absolute addresses are patched when it
+     * is copied into the arena. Memory operands are always [base + disp32]. */
+    class Assembler {
+        public:
+            enum Reg : uint8_t {
+                RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+                R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+            };
+            enum Cond : uint8_t {
+                O = 0x0, B = 0x2, AE = 0x3, E = 0x4, NE = 0x5, BE = 0x6, A = 0x7, P = 0xA,
+                L = 0xC, GE = 0xD, LE = 0xE, G = 0xF,
+            };
+
+            static inline Cond negate(Cond cc) { return static_cast<Cond>(cc ^ 1); }
+
+        private:
+            struct Fixup {
+                size_t at;
+                int label;
+            };
+            struct AbsFixup {
+                size_t at;
+                const uint8_t* target;
+            };
+
+            std::vector<uint8_t> buf_;
+            std::vector<int64_t> labels_; // offset in buf_, -1 until bound
+            std::vector<Fixup> fixups_;
+            std::vector<AbsFixup> abs_fixups_;
+
+            inline void byte(uint8_t b) { buf_.push_back(b); }
+            inline void dword(uint32_t v) {
+                for (int i = 0; i < 4; i++)
+                    byte(v >> (8 * i));
+            }
+            inline void qword(uint64_t v) {
+                dword(v);
+                dword(v >> 32);
+            }
+            inline void rex(bool w, uint8_t reg, uint8_t base) {
+                uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+                if (r != 0x40)
+                    byte(r);
+            }
+            // opcode reg, [base + disp32] - reg is an opcode extension for some
+            inline void op_mem(bool w, std::initializer_list<uint8_t> opcode, uint8_t reg, uint8_t base, int32_t disp) {
+                rex(w, reg, base);
+                for (uint8_t b : opcode)
+                    byte(b);
+                byte(0x80 | ((reg & 7) << 3) | (base & 7));
+                if ((base & 7) == RSP)
+                    byte(0x24);
+                dword(disp);
+            }
+            inline void sse(uint8_t prefix, uint8_t opcode, int xmm, Reg base, int32_t disp) {
+                byte(prefix);
+                op_mem(false, {0x0F, opcode}, xmm, base, disp);
+            }
+            inline void sse_rr(uint8_t prefix, uint8_t opcode, int dst, int src, bool w = false) {
+                byte(prefix);
+                rex(w, dst, src);
+                byte(0x0F);
+                byte(opcode);
+                byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+            }
+            // opcode rm, reg between registers
+            inline void op_rr(bool w, uint8_t opcode, uint8_t rm, uint8_t reg) {
+                rex(w, reg, rm);
+                byte(opcode);
+                byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+            }
+            inline void rel32(int label) {
+                fixups_.push_back({buf_.size(), label});
+                dword(0);
+            }
+            inline void abs32(const uint8_t* target) {
+                abs_fixups_.push_back({buf_.size(), target});
+                dword(0);
+            }
+
+        public:
+            inline size_t size() const { return buf_.size(); }
+            inline int new_label() {
+                labels_.push_back(-1);
+                return labels_.size() - 1;
+            }
+            inline void bind(int label) { labels_[label] = buf_.size(); }
+
+            inline void load32(Reg dst, Reg base, int32_t disp) { op_mem(false, {0x8B}, dst, base, disp); }
+            inline void store32(Reg base, int32_t disp, Reg src) { op_mem(false, {0x89}, src, base, disp); }
+            inline void load64(Reg dst, Reg base, int32_t disp) { op_mem(true, {0x8B}, dst, base, disp); }
+            inline void store64(Reg base, int32_t disp, Reg src) { op_mem(true, {0x89}, src, base, disp); }
+            inline void store_imm32(Reg base, int32_t disp, uint32_t imm) {
+                op_mem(false, {0xC7}, 0, base, disp);
+                dword(imm);
+            }
+            inline void cmp_imm32(Reg base, int32_t disp, uint32_t imm) {
+                op_mem(false, {0x81}, 7, base, disp);
+                dword(imm);
+            }
+            inline void cmp_imm8(Reg base, int32_t disp, uint8_t imm) {
+                op_mem(false, {0x80}, 7, base, disp);
+                byte(imm);
+            }
+            inline void sub64_imm32(Reg base, int32_t disp, uint32_t imm) {
+                op_mem(true, {0x81}, 5, base, disp);
+                dword(imm);
+            }
+            inline void dec32(Reg base, int32_t disp) { op_mem(false, {0xFF}, 1, base, disp); }
+            inline void add64_imm8(Reg base, int32_t disp, uint8_t imm) {
+                op_mem(true, {0x83}, 0, base, disp);
+                byte(imm);
+            }
+            // dst = zero extended byte at [base + disp]
+            inline void load8(Reg dst, Reg base, int32_t disp) { op_mem(false, {0x0F, 0xB6}, dst, base, disp); }
+            inline void cmp64(Reg base, int32_t disp, Reg r) { op_mem(true, {0x39}, r, base, disp); }
+            inline void cmp_ecx(Reg base, int32_t disp) { op_mem(false, {0x3B}, RCX, base, disp); }
+
+            // eax op= [base + disp]
+            inline void add_eax(Reg base, int32_t disp) { op_mem(false, {0x03}, RAX, base, disp); }
+            inline void sub_eax(Reg base, int32_t disp) { op_mem(false, {0x2B}, RAX, base, disp); }
+            inline void imul_eax(Reg base, int32_t disp) { op_mem(false, {0x0F, 0xAF}, RAX, base, disp); }
+            inline void cmp_eax(Reg base, int32_t disp) { op_mem(false, {0x3B}, RAX, base, disp); }
+            // eax op= imm
+            inline void add_eax(uint32_t imm) { byte(0x05); dword(imm); }
+            inline void sub_eax(uint32_t imm) { byte(0x2D); dword(imm); }
+            inline void imul_eax(uint32_t imm) { byte(0x69); byte(0xC0); dword(imm); }
+            inline void cmp_eax(uint32_t imm) { byte(0x3D); dword(imm); }
+            // eax = cc ? 1 : 0
+            inline void set_eax(Cond cc) {
+                byte(0x0F); byte(0x90 | cc); byte(0xC0);
+                byte(0x0F); byte(0xB6); byte(0xC0);
+            }
+
+            // xmm op= [base + disp], the templates only use xmm0 and xmm1
+            inline void movsd_load(int xmm, Reg base, int32_t disp) { sse(0xF2, 0x10, xmm, base, disp); }
+            inline void movsd_store(int xmm, Reg base, int32_t disp) { sse(0xF2, 0x11, xmm, base, disp); }
+            // the int at [base + disp] as a double
+            inline void cvtsi2sd(int xmm, Reg base, int32_t disp) { sse(0xF2, 0x2A, xmm, base, disp); }
+            // xmm op= xmm
+            inline void movsd(int dst, int src) { sse_rr(0xF2, 0x10, dst, src); }
+            inline void addsd(int dst, int src) { sse_rr(0xF2, 0x58, dst, src); }
+            inline void mulsd(int dst, int src) { sse_rr(0xF2, 0x59, dst, src); }
+            inline void subsd(int dst, int src) { sse_rr(0xF2, 0x5C, dst, src); }
+            inline void divsd(int dst, int src) { sse_rr(0xF2, 0x5E, dst, src); }
+            inline void ucomisd(int x, int y) { sse_rr(0x66, 0x2E, x, y); }
+            // xmm = the int in r
+            inline void cvtsi2sd(int xmm, Reg r) { sse_rr(0xF2, 0x2A, xmm, r); }
+            // xmm = the bits of r
+            inline void movq(int xmm, Reg r) { sse_rr(0x66, 0x6E, xmm, r, true); }
+            // edx:eax = sign extended eax, then eax = edx:eax / ecx and edx the remainder
+            inline void cdq() { byte(0x99); }
+            inline void idiv_ecx() { byte(0xF7); byte(0xF9); }
+            inline void test_ecx() { byte(0x85); byte(0xC9); }
+            inline void test_edx() { byte(0x85); byte(0xD2); }
+            inline void sub_ecx(uint32_t imm) { byte(0x81); byte(0xE9); dword(imm); }
+            inline void cmp_ecx(uint32_t imm) { byte(0x81); byte(0xF9); dword(imm); }
+
+            inline void mov(Reg dst, Reg src) {
+                rex(true, src, dst);
+                byte(0x89);
+                byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+            }
+            inline void mov_imm32(Reg dst, uint32_t imm) {
+                rex(false, 0, dst);
+                byte(0xB8 | (dst & 7));
+                dword(imm);
+            }
+            inline void mov_imm64(Reg dst, uint64_t imm) {
+                rex(true, 0, dst);
+                byte(0xB8 | (dst & 7));
+                qword(imm);
+            }
+            inline void and_(Reg dst, Reg src) {
+                rex(true, src, dst);
+                byte(0x21);
+                byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+            }
+            inline void test_rax() { byte(0x48); byte(0x85); byte(0xC0); }
+            inline void cmp(Reg x, Reg y) { op_rr(true, 0x39, x, y); }
+            // 32-bit dst op= src
+            inline void mov32(Reg dst, Reg src) { op_rr(false, 0x89, dst, src); }
+            inline void add32(Reg dst, Reg src) { op_rr(false, 0x01, dst, src); }
+            inline void sub32(Reg dst, Reg src) { op_rr(false, 0x29, dst, src); }
+            inline void cmp32(Reg x, Reg y) { op_rr(false, 0x39, x, y); }
+            inline void test32(Reg x, Reg y) { op_rr(false, 0x85, x, y); }
+            inline void imul32(Reg dst, Reg src) {
+                rex(false, dst, src);
+                byte(0x0F); byte(0xAF);
+                byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+            }
+            inline void call(Reg target) { rex(false, 0, target); byte(0xFF); byte(0xD0 | (target & 7)); }
+            inline void jmp(Reg target) { rex(false, 0, target); byte(0xFF); byte(0xE0 | (target & 7)); }
+            inline void push(Reg r) { rex(false, 0, r); byte(0x50 | (r & 7)); }
+            inline void pop(Reg r) { rex(false, 0, r); byte(0x58 | (r & 7)); }
+            inline void ret() { byte(0xC3); }
+
+            inline void jmp(int label) { byte(0xE9); rel32(label); }
+            inline void jcc(Cond cc, int label) { byte(0x0F); byte(0x80 | cc); rel32(label); }
+            inline void jmp(const uint8_t* target) { byte(0xE9); abs32(target); }
+            inline void jcc(Cond cc, const uint8_t* target) { byte(0x0F); byte(0x80 | cc); abs32(target); }
+
+            /* copies the code into the arena, nullptr when it is full. The
+             * address of each label is label_addr(base, label) afterwards. */
+            const uint8_t* link(CodeArena& arena) {
+                uint8_t* dst = arena.reserve(buf_.size());
+                if (dst == nullptr)
+                    return nullptr;
+                for (const Fixup& f : fixups_) {
+                    int32_t rel = labels_.at(f.label) - static_cast<int64_t>(f.at + 4);
+                    std::memcpy(&buf_[f.at], &rel, 4);
+                }
+                for (const AbsFixup& f : abs_fixups_) {
+                    int64_t rel = f.target - (dst + f.at + 4);
+                    if (rel != static_cast<int32_t>(rel))
+                        return nullptr;
+                    int32_t rel32 = rel;
+                    std::memcpy(&buf_[f.at], &rel32, 4);
+                }
+                arena.write(buf_.data(), buf_.size());
+                return dst;
+            }
+            inline const uint8_t* label_addr(const uint8_t* base, int label) const {
+                return base + labels_.at(label);
+            }
+    };
+
+    /* what native code hands back: the instruction to continue at in the
+     * high half, the Interrupt + 1 in the low one so 0 can mean "go on" */
+    static inline uint64_t exit_word(size_t ip, uint32_t status) {
+        return static_cast<uint64_t>(ip) << 32 | (status + 1);
+    }
+
+    static inline uint64_t exit_word(size_t ip, Interrupt interrupt) {
+        return exit_word(ip, static_cast<uint32_t>(interrupt));
+    }
+
+    // register r of the frame, relative to the frame base in rbx
+    static inline int32_t operand(uint8_t r) {
+        return -static_cast<int32_t>(r * sizeof(BoltValue));
+    }
+
+    static inline bool is_compare(Opcode op) {
+        switch(op) {
+            case Opcode::OpLt: case Opcode::OpLte: case Opcode::OpBt: case Opcode::OpBte:
+            case Opcode::OpEq: case Opcode::OpNe:
+            case Opcode::OpLtRK: case Opcode::OpLteRK: case Opcode::OpBtRK: case Opcode::OpBteRK:
+            case Opcode::OpEqRK: case Opcode::OpNeRK:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /* ucomisd sets the flags like an unsigned compare and reports a NaN
+     * operand as below and equal, so x < y is asked as y > x to come out
+     * false on NaNs like the interpreter's compare does */
+    static Assembler::Cond double_condition(Opcode op, bool& swap) {
+        swap = op == Opcode::OpLt || op == Opcode::OpLtRK || op == Opcode::OpLte || op == Opcode::OpLteRK;
+        switch(op) {
+            case Opcode::OpLt: case Opcode::OpLtRK: case Opcode::OpBt: case Opcode::OpBtRK:
+                return Assembler::A;
+            default:
+                return Assembler::AE;
+        }
+    }
+
+    static Assembler::Cond condition(Opcode op) {
+        switch(op) {
+            case Opcode::OpLt: case Opcode::OpLtRK: return Assembler::L;
+            case Opcode::OpLte: case Opcode::OpLteRK: return Assembler::LE;
+            case Opcode::OpBt: case Opcode::OpBtRK: return Assembler::G;
+            case Opcode::OpBte: case Opcode::OpBteRK: return Assembler::GE;
+            case Opcode::OpEq: case Opcode::OpEqRK: return Assembler::E;
+            default: return Assembler::NE;
+        }
+    }
+
+    /* frame register at [src_base + src] to [dst_base + dst], a word at a
+     * time through scratch */
+    static inline void emit_copy_value(Assembler& a, Assembler::Reg src_base, int32_t src,
+            Assembler::Reg dst_base, int32_t dst, Assembler::Reg scratch) {
+        for (size_t off = 0; off < sizeof(BoltValue); off += 8) {
+            a.load64(scratch, src_base, src + off);
+            a.store64(dst_base, dst + off, scratch);
+        }
+    }
+
+    // offset of UpvalObj::location, which is not a standard layout type
+    static inline int32_t upval_location_offset() {
+        static const int32_t offset = [] {
+            UpvalObj u{};
+            return static_cast<int32_t>(reinterpret_cast<char*>(&u.location) - reinterpret_cast<char*>(&u));
+        }();
+        return offset;
+    }
+
+    /* rax = where upvalue index of the running closure lives, clobbers rcx.
+     * The closure sits right above the frame base. */
+    static inline void emit_upval_location(Assembler& a, uint8_t index) {
+        a.load64(Assembler::RAX, Assembler::RBX, sizeof(BoltValue));
+        if (BoltValue::POINTER_MASK != ~static_cast<uint64_t>(0)) {
+            a.mov_imm64(Assembler::RCX, BoltValue::POINTER_MASK);
+            a.and_(Assembler::RAX, Assembler::RCX);
+        }
+        a.load64(Assembler::RAX, Assembler::RAX, sizeof(ClosureObj) + index * sizeof(UpvalObj*));
+        a.load64(Assembler::RAX, Assembler::RAX, upval_location_offset());
+    }
+
+    // jumps to fail unless [base + disp] holds a double, clobbers rcx
+    static inline void emit_guard_double(Assembler& a, Assembler::Reg base, int32_t disp, int fail) {
+        constexpr int32_t TAG = BoltValue::TAG_WORD_OFFSET;
+        if (BoltValue::DOUBLE_TAG_WORD_SPAN == 1) {
+            a.cmp_imm32(base, disp + TAG, BoltValue::DOUBLE_TAG_WORD_MIN);
+            a.jcc(Assembler::NE, fail);
+            return;
+        }
+        a.load32(Assembler::RCX, base, disp + TAG);
+        if (BoltValue::DOUBLE_TAG_WORD_MIN != 0)
+            a.sub_ecx(BoltValue::DOUBLE_TAG_WORD_MIN);
+        a.cmp_ecx(BoltValue::DOUBLE_TAG_WORD_SPAN);
+        a.jcc(Assembler::AE, fail);
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef BVM_BYTECODE_H
+#define BVM_BYTECODE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* Bolt File Layout (version 1, little endian)
+ * FileHeader
+ * [SectionEntry]          - n_sections entries, right after the header
+ * sections                - each starts at a multiple of SECTION_ALIGN
+ *
+ * Every prototype owns one Proto, Consts and Code section, and an Upvals
+ * section when it captures anything, all tagged with its index.
+ * Prototype 0 is the entry point. Code sections are laid out so the loader
+ * can map the file and run the instructions in place, nothing in them is
+ * copied. The checksum covers every byte after the header. */
+
+namespace BVM {
+
+    constexpr char BOLT_MAGIC[4] = {'B', 'O', 'L', 'T'};
+    constexpr uint16_t BOLT_VERSION = 1;
+    constexpr size_t SECTION_ALIGN = 64; // cache line, and enough for any field
+
+    struct FileHeader {
+        char magic[4];
+        uint16_t version;
+        uint16_t header_size;
+        uint32_t n_protos;
+        uint32_t n_sections;
+        uint64_t file_size;
+        uint64_t checksum;
+    };
+
+    enum class SectionKind : uint32_t {
+        Proto,  // one ProtoRecord
+        Consts, // ProtoRecord::n_consts ConstRecords
+        Code,   // raw 32-bit instructions
+        Upvals, // UpvalRecords, optional
+    };
+
+    struct SectionEntry {
+        SectionKind kind;
+        uint32_t proto;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct ProtoRecord {
+        int32_t arity;
+        uint32_t n_locals;
+        uint32_t next_reg;
+        uint32_t n_consts;
+    };
+
+    /* payload is an int64 for ints, the bit pattern for doubles and 0/1 for
+     * booleans, type is a BoltType */
+    struct ConstRecord {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t payload;
+    };
+
+    // in_stack is 0 or 1, see UpvalDesc
+    struct UpvalRecord {
+        uint8_t in_stack;
+        uint8_t index;
+    };
+
+    static_assert(sizeof(FileHeader) == 32);
+    static_assert(sizeof(SectionEntry) == 24);
+    static_assert(sizeof(ProtoRecord) == 16);
+    static_assert(sizeof(ConstRecord) == 16);
+    static_assert(sizeof(UpvalRecord) == 2);
+
+    inline constexpr uint64_t align_section(uint64_t offset) {
+        return (offset + SECTION_ALIGN - 1) & ~static_cast<uint64_t>(SECTION_ALIGN - 1);
+    }
+
+    /* FNV-1a over 64-bit words, cheap enough to verify on every load. The
+     * result only depends on the bytes fed in, not on how they are split. */
+    class Checksum {
+        private:
+            static constexpr uint64_t PRIME = 0x100000001b3;
+            uint64_t hash_ = 0xcbf29ce484222325;
+            uint8_t tail_[8];
+            size_t n_tail_ = 0;
+
+            inline void mix(const uint8_t* word) {
+                uint64_t w;
+                std::memcpy(&w, word, 8);
+                hash_ = (hash_ ^ w) * PRIME;
+            }
+
+        public:
+            inline void update(const void* data, size_t size) {
+                const uint8_t* p = static_cast<const uint8_t*>(data);
+                while (n_tail_ && size) {
+                    tail_[n_tail_++] = *p++;
+                    size--;
+                    if (n_tail_ == 8) {
+                        mix(tail_);
+                        n_tail_ = 0;
+                    }
+                }
+                if (n_tail_)
+                    return;
+                for (; size >= 8; p += 8, size -= 8)
+                    mix(p);
+                std::memcpy(tail_, p, size);
+                n_tail_ = size;
+            }
+
+            inline uint64_t digest() const {
+                uint64_t h = hash_;
+                for (size_t i = 0; i < n_tail_; i++)
+                    h = (h ^ tail_[i]) * PRIME;
+                return h;
+            }
+    };
+
+    /* read-only private mapping of a whole file, unmapped on destruction */
+    class MappedFile {
+        private:
+            const uint8_t* data_ = nullptr;
+            size_t size_ = 0;
+        public:
+            explicit MappedFile(const char* path);
+            ~MappedFile();
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            inline const uint8_t* data() const { return data_; }
+            inline size_t size() const { return size_; }
+    };
+}
+
+#endif
@@ -23,12 +23,32 @@ namespace BVM {
             EMIT_BINOP_DEF(bte);
             EMIT_BINOP_DEF(lt);
             EMIT_BINOP_DEF(bt);
+            // rs is an index into the constant pool
+            EMIT_BINOP_DEF(add_rk);
+            EMIT_BINOP_DEF(sub_rk);
+            EMIT_BINOP_DEF(mul_rk);
+            EMIT_BINOP_DEF(div_rk);
+            EMIT_BINOP_DEF(lt_rk);
+            EMIT_BINOP_DEF(lte_rk);
+            EMIT_BINOP_DEF(bt_rk);
+            EMIT_BINOP_DEF(bte_rk);
+            EMIT_BINOP_DEF(eq_rk);
+            EMIT_BINOP_DEF(ne_rk);
             static uint32_t mov(uint8_t rd, uint8_t rt);
-            static uint32_t ret();
-            static uint32_t jmp_if_false(uint8_t rd, uint32_t rt);
+            static uint32_t ret(uint8_t rd);
+            static uint32_t jmp(int32_t offset);
+            static uint32_t jmp_if_false(uint8_t rd, int16_t offset);
             static uint32_t load_const(uint8_t rd, uint16_t idx);
-            static uint32_t call(uint8_t rd);
+            static uint32_t call(uint8_t rd, uint8_t nargs);
             static uint32_t call_native(uint8_t rd, uint8_t nargs, uint8_t idx);
+            // call rd in place of the running frame, its result is returned directly
+            static uint32_t tail_call(uint8_t rd, uint8_t nargs);
+            // spawns a task calling rd like call would, rd receives its handle
+            static uint32_t schedule(uint8_t rd, uint8_t nargs);
+            // a closure of prototype proto, capturing what its upvals describe
+            static uint32_t closure(uint8_t rd, uint16_t proto);
+            static uint32_t get_upval(uint8_t rd, uint8_t idx);
+            static uint32_t set_upval(uint8_t rd, uint8_t idx);
     };
 
 }
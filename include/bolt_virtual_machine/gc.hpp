@@ -0,0 +1,169 @@
+#ifndef BVM_GC_H
+#define BVM_GC_H
+
+#include "bolt_virtual_machine/value.hpp"
+#include "heap_area.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#define GC_INITIAL_THRESHOLD (1 << 20) // bytes allocated before the first collection
+#define GC_GROWTH_FACTOR 2             // next threshold = live bytes * factor
+#define NURSERY_CELLS (1 << 14)        // cons cells per nursery semispace
+#define PROMOTE_AGE 1                  // minor collections survived before promotion
+
+namespace BVM {
+
+    enum class GCKind : uint8_t {
+        Closure,
+        Cons,
+        Upval,
+    };
+
+    /* GC objects must be allocated through a Heap - an object reachable from
+     * vm values that the heap does not own is never swept, and must not
+     * reference objects that are.
+     * In the nursery next is the forwarding pointer once a cell was copied. */
+    struct GCObj {
+        bool is_marked = false;
+        GCKind kind;
+        uint8_t age = 0;             // minor collections survived
+        bool is_remembered = false;  // old object in the remembered set
+        GCObj* next = nullptr;
+    };
+
+    struct Cons : GCObj {
+        static constexpr GCKind KIND = GCKind::Cons;
+        BoltValue car;
+        BoltValue cdr;
+    };
+
+    struct GCStats {
+        uint64_t collections = 0;
+        uint64_t objects_freed = 0;   // over all collections
+        uint64_t bytes_freed = 0;     // over all collections
+        uint64_t last_pause_ns = 0;
+        uint64_t max_pause_ns = 0;
+        uint64_t total_pause_ns = 0;
+        size_t live_bytes = 0;        // allocated and not yet freed
+        size_t live_objects = 0;
+        size_t threshold = GC_INITIAL_THRESHOLD;
+
+        uint64_t minor_collections = 0;
+        uint64_t bytes_promoted = 0;  // copied from the nursery to the old generation
+        uint64_t last_minor_pause_ns = 0;
+        uint64_t max_minor_pause_ns = 0;
+        uint64_t total_minor_pause_ns = 0;
+    };
+
+    /* Two generations:
+     * - the nursery, two semispaces of cons cells. Cells are bump allocated
+     *   and a minor collection copies the live ones Cheney style into the
+     *   other semispace, or promotes them once they are PROMOTE_AGE old.
+     * - the old generation, a precise mark and sweep over an intrusive list
+     *   of every object allocated there (closures, upvalues and promoted
+     *   cells), with
+     *   the memory coming from a HeapArea.
+     *   Marking uses an explicit stack so long cons lists cannot overflow the
+     *   native stack.
+     * Old objects pointing into the nursery are found through the remembered
+     * set, maintained by write_barrier(). A major collection first promotes
+     * the whole nursery so marking never sees a young object.
+     * The heap does not know the roots: the owner marks them with
+     * mark_value() between begin() and finish(), or updates them with
+     * evacuate() between begin_minor() and finish_minor(). */
+    class Heap {
+        private:
+            HeapArea area_; // backs the old generation
+            GCObj* objects_ = nullptr;
+            std::vector<GCObj*> mark_stack_;
+            GCStats stats_;
+            size_t min_threshold_ = GC_INITIAL_THRESHOLD;
+            uint64_t pause_start_ = 0;
+
+            std::unique_ptr<Cons[]> spaces_[2];
+            Cons* from_ = nullptr;
+            Cons* to_ = nullptr;
+            size_t capacity_ = 0;
+            size_t top_ = 0;    // next free cell in from_
+            size_t to_top_ = 0; // cells copied into to_ during a minor collection
+            bool tenure_all_ = false;
+            std::vector<Cons*> promoted_; // promoted cells whose fields are not evacuated yet
+            std::vector<GCObj*> remembered_;
+
+            inline bool in_from(const GCObj* obj) const { return obj >= from_ && obj < from_ + capacity_; }
+            inline bool in_to(const GCObj* obj) const { return obj >= to_ && obj < to_ + capacity_; }
+            inline void remember(GCObj* holder) {
+                if (!holder->is_remembered) {
+                    holder->is_remembered = true;
+                    remembered_.push_back(holder);
+                }
+            }
+            inline bool is_young_value(BoltValue v) const {
+                return v.get_type() == BoltType::Cons && is_young(v.as_cons());
+            }
+            inline bool has_young_field(const Cons* cell) const {
+                return is_young_value(cell->car) || is_young_value(cell->cdr);
+            }
+
+            void link(GCObj* obj, size_t size);
+            void trace(GCObj* obj);
+            void sweep();
+            static size_t size_of(const GCObj* obj);
+            void destroy(GCObj* obj);
+
+        public:
+            Heap(size_t nursery_cells = NURSERY_CELLS);
+            ~Heap();
+            Heap(const Heap&) = delete;
+            Heap& operator=(const Heap&) = delete;
+
+            // T names its GCKind in T::KIND, size covers any trailing array
+            template<typename T>
+            T* alloc(size_t size = sizeof(T)) {
+                T* obj = area_.create<T>(size);
+                obj->kind = T::KIND;
+                link(obj, size);
+                return obj;
+            }
+
+            inline bool should_collect() const { return stats_.live_bytes >= stats_.threshold; }
+
+            // bump allocation, nullptr once the nursery is full
+            inline Cons* alloc_cons() {
+                if (top_ == capacity_) [[unlikely]]
+                    return nullptr;
+                Cons* cell = &from_[top_++];
+                cell->kind = GCKind::Cons;
+                cell->age = 0;
+                cell->next = nullptr;
+                return cell;
+            }
+
+            inline bool is_young(const GCObj* obj) const { return in_from(obj) || in_to(obj); }
+
+            // must run before a value is stored into a field of a heap object
+            inline void write_barrier(GCObj* holder, BoltValue v) {
+                if (v.get_type() == BoltType::Cons && is_young(v.as_cons()) && !is_young(holder))
+                    remember(holder);
+            }
+
+            void begin_minor(bool tenure_all);
+            BoltValue evacuate(BoltValue v);
+            void finish_minor();
+            inline size_t nursery_capacity() const { return capacity_; }
+            void resize_nursery(size_t cells); // only while the nursery is empty
+
+            void begin();
+            void mark_value(BoltValue v);
+            void mark_object(GCObj* obj);
+            void finish(); // traces from the marked roots and sweeps
+
+            void set_threshold(size_t bytes);
+            inline const GCStats& get_stats() const { return stats_; }
+            inline const HeapAreaStats& get_area_stats() const { return area_.get_stats(); }
+    };
+}
+
+#endif
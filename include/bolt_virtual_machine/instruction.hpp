@@ -1,28 +1,162 @@
 #ifndef BVM_INSTRUCTION_H
 #define BVM_INSTRUCTION_H
 
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+/* every opcode the vm understands - the enum and the interpreter's dispatch
+ * table are both generated from this list so they can never get out of sync */
+#define BVM_OPCODES(X) \
+    X(OpAdd) \
+    X(OpDiv) \
+    X(OpMul) \
+    X(OpSub) \
+    X(OpMov) \
+    X(OpSchedule) \
+    X(OpRet) \
+    X(OpDefine) \
+    X(OpJmp) \
+    X(OpEq) \
+    X(OpNe) \
+    X(OpBt) \
+    X(OpLt) \
+    X(OpBte) \
+    X(OpLte) \
+    X(OpJmpIfFalse) \
+    X(OpConst) \
+    X(OpCall) \
+    X(OpCallNative) \
+    X(OpAddRK) \
+    X(OpSubRK) \
+    X(OpMulRK) \
+    X(OpDivRK) \
+    X(OpLtRK) \
+    X(OpLteRK) \
+    X(OpBtRK) \
+    X(OpBteRK) \
+    X(OpEqRK) \
+    X(OpNeRK) \
+    X(OpTailCall) \
+    X(OpClosure) \
+    X(OpGetUpval) \
+    X(OpSetUpval) \
+
+/* *RK opcodes take their second operand from the constant pool: the rs byte
+ * is a constant index instead of a register. OpTailCall is OpCall in tail
+ * position, the callee takes over the caller's frame. OpClosure's 16-bit
+ * operand is a prototype index in the program, the upvalue opcodes take an
+ * upvalue index of the running closure in rt. */
+
+/* Quickened opcodes never appear in bytecode. The interpreter rewrites a
+ * generic instruction into one of these after observing its operand types:
+ * II/FF variants assume int/int or double/double operands and fall back to
+ * the generic opcode when that guard fails, *Jmp variants additionally fuse
+ * the following OpJmpIfFalse on the result and OpConstAddII fuses a constant
+ * load with the OpAdd consuming it. */
+#define BVM_QUICK_OPCODES(X) \
+    X(OpAddII) \
+    X(OpAddFF) \
+    X(OpSubII) \
+    X(OpSubFF) \
+    X(OpMulII) \
+    X(OpMulFF) \
+    X(OpDivFF) \
+    X(OpLtII) \
+    X(OpLtFF) \
+    X(OpLteII) \
+    X(OpLteFF) \
+    X(OpBtII) \
+    X(OpBtFF) \
+    X(OpBteII) \
+    X(OpBteFF) \
+    X(OpEqII) \
+    X(OpNeII) \
+    X(OpLtIIJmp) \
+    X(OpLteIIJmp) \
+    X(OpBtIIJmp) \
+    X(OpBteIIJmp) \
+    X(OpEqIIJmp) \
+    X(OpNeIIJmp) \
+    X(OpConstAddII) \
+    X(OpAddRKII) \
+    X(OpSubRKII) \
+    X(OpMulRKII) \
+    X(OpLtRKII) \
+    X(OpLteRKII) \
+    X(OpBtRKII) \
+    X(OpBteRKII) \
+    X(OpEqRKII) \
+    X(OpNeRKII) \
+    X(OpLtRKIIJmp) \
+    X(OpLteRKIIJmp) \
+    X(OpBtRKIIJmp) \
+    X(OpBteRKIIJmp) \
+    X(OpEqRKIIJmp) \
+    X(OpNeRKIIJmp) \
+
 namespace BVM {
-    enum class Opcode {
-        OpAdd,
-        OpDiv,
-        OpMul,
-        OpSub,
-        OpMov,
-        OpSchedule,
-        OpRet,
-        OpDefine,
-        OpJmp,
-        OpEq,
-        OpNe,
-        OpBt,
-        OpLt,
-        OpBte,
-        OpLte,
-        OpJmpIfFalse,
-        OpConst,
-        OpCall,
-        OpCallNative,
+    enum class Opcode : uint8_t {
+#define BVM_OPCODE_ENUM(op) op,
+        BVM_OPCODES(BVM_OPCODE_ENUM)
+        BVM_QUICK_OPCODES(BVM_OPCODE_ENUM)
+#undef BVM_OPCODE_ENUM
+        OpCount,
+    };
+
+    // opcodes that may appear in bytecode, quickened ones start right after
+#define BVM_OPCODE_COUNT(op) + 1
+    constexpr uint8_t N_BYTECODE_OPS = 0 BVM_OPCODES(BVM_OPCODE_COUNT);
+#undef BVM_OPCODE_COUNT
+
+    struct BoltValue;
+
+    /* Instruction as seen by the interpreter: each raw 32-bit instruction of a
+     * prototype is lowered once, when the prototype is loaded, so the hot loop
+     * never shifts and masks operands again.
+     * handler - address of the opcode's label in the threaded interpreter
+     * k       - constant operand resolved to its slot in the constant pool
+     * imm     - immediate operand (jump offset, argument count, pool index)
+     * rd/rt/rs - register operands as offsets from fp_
+     * deopts  - guard failures so far, quickening stops at QUICKEN_LIMIT
+ * count   - times a backward jump or self tail call was taken, which
+ *           makes the loop it closes a candidate for a trace */
+    struct alignas(32) DecodedInst {
+        const void* handler;
+        const BoltValue* k;
+        int32_t imm;
+        int16_t rd;
+        int16_t rt;
+        int16_t rs;
+        Opcode op;
+        uint8_t deopts;
+        uint32_t count;
     };
+
+    static_assert(sizeof(DecodedInst) == 32, "two decoded instructions per cache line");
+
+    /* keeps the start of a decoded stream on a cache line boundary */
+    template<typename T>
+    struct CacheAlignedAllocator {
+        using value_type = T;
+        static constexpr std::align_val_t alignment{64};
+
+        CacheAlignedAllocator() = default;
+        template<typename U>
+        CacheAlignedAllocator(const CacheAlignedAllocator<U>&) noexcept {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(::operator new(n * sizeof(T), alignment));
+        }
+        void deallocate(T* p, size_t) noexcept {
+            ::operator delete(p, alignment);
+        }
+        template<typename U>
+        bool operator==(const CacheAlignedAllocator<U>&) const noexcept { return true; }
+    };
+
+    using DecodedStream = std::vector<DecodedInst, CacheAlignedAllocator<DecodedInst>>;
 }
 
 
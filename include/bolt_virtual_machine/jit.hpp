@@ -0,0 +1,159 @@
+#ifndef BVM_JIT_H
+#define BVM_JIT_H
+
+#include "bolt_virtual_machine/vm.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <unordered_map>
+#include <vector>
+
+/* Baseline JIT: once a prototype has been called often enough its bytecode
+ * is translated instruction by instruction into x86-64 machine code, each
+ * opcode from a fixed template. Registers stay where the interpreter keeps
+ * them, in the frame on the value stack, so native code and the interpreter
+ * can hand a frame back and forth at any instruction:
+ * - moves, constants, jumps and the int fast paths of arithmetic and
+ *   comparisons run inline, anything their type guards reject and every
+ *   other opcode goes through execute() via a call to Jit::step
+ * - calls, tail calls and returns go through Jit::transfer, which goes on
+ *   in the native code of the frame they land in, or leaves native code for
+ *   the interpreter when that frame has none. Frames stay on the value
+ *   stack either way, native code never recurses on the C++ stack.
+ * Loops get a second tier, see trace.cpp: once a loop header has been
+ * reached often enough one iteration is recorded with the types it sees
+ * and compiled into a trace that keeps numbers unboxed in machine
+ * registers and leaves for the interpreter when a guard fails.
+ * Only built for x86-64 System V targets, and never with BVM_NO_JIT. */
+#if defined(__x86_64__) && defined(__unix__) && !defined(BVM_NO_JIT)
+#define BVM_JIT
+#endif
+
+#define JIT_ARENA_SIZE (16 << 20) // executable memory per context, committed on use
+#define TRACE_MAX_LENGTH 256 // instructions in one recorded iteration
+#define TRACE_ATTEMPTS 3 // recordings of a loop before it is left alone
+#define TRACE_OFF UINT32_MAX // trace threshold that never triggers
+
+namespace BVM {
+
+#ifdef BVM_JIT
+    /* Executable memory of one context, reserved once. Pages are never
+     * writable and executable at the same time: write() flips the pages it
+     * touches to read-write and back to read-execute when it is done. */
+    class CodeArena {
+        private:
+            uint8_t* base_ = nullptr;
+            size_t size_ = 0;
+            size_t used_ = 0;
+            size_t page_;
+        public:
+            CodeArena(size_t size = JIT_ARENA_SIZE);
+            ~CodeArena();
+            CodeArena(const CodeArena&) = delete;
+            CodeArena& operator=(const CodeArena&) = delete;
+
+            // address the next write() will copy to, nullptr when full
+            uint8_t* reserve(size_t size);
+            // copies size bytes to reserve(size), which has to be called first
+            void write(const uint8_t* code, size_t size);
+            inline size_t used() const { return used_; }
+    };
+
+    /* one instruction of a recorded loop iteration and the types of the
+     * values it read: rt and rs, a branch's condition, the upvalue loaded
+     * or a tail call's arguments - and of what a division wrote */
+    struct TraceStep {
+        uint32_t ip;
+        uint32_t inst;
+        std::vector<BoltType> types;
+        bool self = false; // the upvalue loaded was the running closure
+    };
+
+    class Jit {
+        private:
+            struct Compiled {
+                std::vector<const uint8_t*> native; // entry of every instruction, plus one for the end
+                uint32_t calls = 0;
+                uint32_t self_calls = 0; // tail calls to itself, a loop with its header at 0
+                bool failed = false; // uses something the templates cannot express, never retried
+            };
+
+            // a loop in one prototype, by prototype id << 32 | header ip
+            struct Loop {
+                const uint8_t* trace = nullptr;
+                uint32_t attempts = 0; // recordings that did not end in a trace
+            };
+
+            CodeArena arena_;
+            const uint8_t* enter_ = nullptr; // trampoline from C++ into native code
+            const uint8_t* leave_ = nullptr; // its way back, every exit jumps here with the exit word in rax
+            const uint8_t* leave_rdx_ = nullptr; // same, the exit word still in rdx
+            std::vector<Compiled> protos_;   // by prototype id
+            std::unordered_map<uint64_t, Loop> loops_;
+            std::deque<int32_t> loop_counters_; // native backward jumps left before one asks for a trace
+            uint32_t threshold_;
+            uint32_t trace_threshold_ = TRACE_THRESHOLD;
+            JitStats stats_;
+            std::exception_ptr pending_; // thrown by execute() under native code, rethrown by run()
+
+            // where native code goes on, returned in rax:rdx
+            struct Transfer {
+                const uint8_t* target; // nullptr to leave native code
+                uint64_t value;        // frame base to go on with, or the exit word
+            };
+
+            bool trampoline();
+            bool compile(const Prototype* proto);
+            static uint64_t step(VirtualMachine* vm, uint32_t ip, uint32_t inst);
+            template<Opcode OP>
+            static Transfer transfer(VirtualMachine* vm, uint32_t ip, uint32_t inst);
+            // a hot backward jump to ip in native code
+            static Transfer hot_loop(VirtualMachine* vm, uint32_t ip, uint32_t inst);
+            Interrupt enter(VirtualMachine& vm, const uint8_t* target);
+
+            bool record(VirtualMachine& vm, std::vector<TraceStep>& steps, Interrupt& interrupt);
+            const uint8_t* compile_trace(VirtualMachine& vm, size_t header, const std::vector<TraceStep>& steps);
+
+        public:
+            explicit Jit(uint32_t threshold = JIT_THRESHOLD);
+
+            /* native code of proto's instructions, nullptr while it is still
+             * interpreted - counting a call compiles it once it is hot */
+            inline const uint8_t* const* lookup(const Prototype* proto, bool count) {
+                if (proto->id >= protos_.size()) [[unlikely]]
+                    protos_.resize(proto->id + 1);
+                Compiled& c = protos_[proto->id];
+                if (!c.native.empty())
+                    return c.native.data();
+                if (count && !c.failed && ++c.calls >= threshold_ && compile(proto))
+                    return c.native.data();
+                return nullptr;
+            }
+
+            /* runs the frame of vm from ip_ on until it leaves native code.
+             * Ok means the interpreter takes over at ip_, anything else
+             * stopped execution the way it would have in the interpreter. */
+            Interrupt run(VirtualMachine& vm, const uint8_t* const* code);
+
+            /* vm's frame is at the header of a loop that got hot: the trace
+             * to run from there, nullptr when there is none and recording
+             * one did not work out. Recording runs an iteration, after
+             * which the frame may be anywhere in the prototype - at the
+             * header again only when a trace is returned. */
+            const uint8_t* trace(VirtualMachine& vm, Interrupt& interrupt);
+            // runs a trace from the header vm is at until it exits, like run()
+            inline Interrupt run_trace(VirtualMachine& vm, const uint8_t* trace) { return enter(vm, trace); }
+
+            inline void set_threshold(uint32_t calls) { threshold_ = calls; }
+            inline void set_trace_threshold(uint32_t hits) { trace_threshold_ = hits; }
+            inline uint32_t trace_threshold() const { return trace_threshold_; }
+            inline const JitStats& get_stats() const { return stats_; }
+    };
+#else
+    // never instantiated, VirtualMachine::jit_ just stays null
+    class Jit {};
+#endif
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef BVM_SCHEDULER_H
+#define BVM_SCHEDULER_H
+
+#include "bolt_virtual_machine/vm_pool.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define TASK_NURSERY_CELLS (1 << 10) // tasks are many and short, their nurseries are small
+
+namespace BVM {
+
+    /* A green task: a pooled context set up to call a closure, run to
+     * completion by whichever worker picks it up. It keeps its context
+     * until joined so the result stays in the heap it was built in. */
+    struct Task {
+        VmPool::Lease vm;
+        Interrupt status = Interrupt::Ok;
+        std::atomic<bool> done = false;
+        uint64_t started = 0; // when it first ran, in Scheduler::next_start_ order, 0 until then
+
+        explicit Task(VmPool::Lease lease) : vm(std::move(lease)) {}
+    };
+
+    /* Runs tasks of one frozen program on a fixed set of OS threads. Every
+     * worker owns a deque: tasks spawned on a worker go to the back of its
+     * own deque and are popped from there (newest first, their data is
+     * still warm), idle workers steal the oldest task from the front of
+     * someone else's. A join waiting for an unfinished task runs other
+     * tasks in the meantime instead of blocking its thread, so nested
+     * spawn/join cannot starve the pool. It only picks tasks that first ran
+     * after the one it is nested in: resuming an older, preempted task on
+     * top of it could wait for a task buried under the joiner, which is
+     * then stuck below a join itself.
+     * With a slice every task runs on a budget of that many reductions and
+     * a task that spends it is queued again behind the others, so a long
+     * running task cannot hold up short ones on the same worker. */
+    class Scheduler {
+        private:
+            struct Worker {
+                std::mutex mutex;
+                std::deque<Task*> tasks;
+            };
+
+            VmPool pool_; // outlives tasks_, whose leases return to it
+            std::vector<std::unique_ptr<Worker>> workers_;
+            std::vector<std::thread> threads_;
+
+            std::mutex tasks_mutex_;
+            std::unordered_map<int, std::unique_ptr<Task>> tasks_; // spawned and not joined yet
+            int next_id_ = 0;
+
+            std::atomic<size_t> queued_ = 0;
+            std::atomic<uint64_t> next_start_ = 0;
+            std::atomic<size_t> next_victim_ = 0;
+            std::mutex idle_mutex_;
+            std::condition_variable idle_cv_;
+            bool stopping_ = false;
+            int64_t slice_;
+
+            void push(Task* task, bool behind = false); // behind queues it to be run last
+            // own deque first, then steal - only tasks not started or started after `after`
+            Task* pop(size_t self, uint64_t after = 0);
+            void run_task(Task* task);
+            void work(size_t self);
+            void wake();
+        public:
+            // n_workers 0 means one per hardware thread
+            Scheduler(std::shared_ptr<const Program> program, unsigned n_workers = 0, int64_t slice = BUDGET_UNLIMITED,
+                    size_t stack_slots = DEFAULT_STACK_SLOTS, size_t nursery_cells = TASK_NURSERY_CELLS);
+            ~Scheduler(); // runs whatever is still queued, then stops the workers
+            Scheduler(const Scheduler&) = delete;
+            Scheduler& operator=(const Scheduler&) = delete;
+
+            /* runs vm, set up to execute this scheduler's program, on the
+             * calling thread - tasks it spawns run on the workers. When its
+             * slice is up the calling thread runs a queued task before
+             * resuming vm. */
+            Interrupt run(VirtualMachine& vm);
+
+            // called by OpSchedule, returns the handle join takes
+            int spawn(BoltValue callee, NativeArgs args);
+            /* waits for the task, imports its result into vm and forgets it,
+             * an interrupt the task stopped with is passed on */
+            Interrupt join(VirtualMachine& vm, int id, BoltValue& res);
+
+            inline size_t n_workers() const { return workers_.size(); }
+    };
+}
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef BVM_VALUE_H
+#define BVM_VALUE_H
+
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+
+/* Two interchangeable representations sit behind the same BoltValue API:
+ * - tagged (default): a union next to a BoltType tag, 16 bytes per value
+ * - BVM_NAN_BOXING: 8 bytes, doubles are stored as themselves and every
+ *   other type is packed into the payload of a negative quiet NaN
+ * Nothing outside this header may depend on which one is in use, except
+ * through the layout constants each of them publishes for code generators:
+ * - an int or boolean is a 32-bit payload at offset 0 plus the 32-bit word
+ *   TAG_WORD_OFFSET bytes in, which equals INT_TAG_WORD or BOOL_TAG_WORD
+ * - a double is the 64-bit word at offset 0, its tag word is in the range
+ *   [DOUBLE_TAG_WORD_MIN, DOUBLE_TAG_WORD_MIN + DOUBLE_TAG_WORD_SPAN). When
+ *   DOUBLE_TAG_WORD_STORED the tag word is separate and a double written
+ *   there needs DOUBLE_TAG_WORD_MIN next to it. NaNs are only ever stored
+ *   through from_double.
+ * - a pointer is the 64-bit word at offset 0 and-ed with POINTER_MASK */
+
+namespace BVM {
+
+    enum class BoltType {
+        Integer,
+        Float,
+        Cons,
+        Symbol,
+        Nil,
+        Closure,
+        Boolean,
+    };
+
+    class BoltValue;
+    struct ClosureObj;
+    struct Cons;
+
+#ifdef BVM_NAN_BOXING
+
+    /* Boxed values have the top 13 bits set (sign + exponent + quiet bit) and
+     * carry their tag in bits 48-50, leaving 48 bits of payload - enough for
+     * an int or a user space pointer. Tag 0 is never used so that the
+     * canonical negative NaN still reads as a double. */
+    class BoltValue {
+        private:
+            uint64_t bits_;
+
+            static constexpr uint64_t BOX_MASK = 0xFFF8000000000000;
+            static constexpr uint64_t TAG_MASK = 0xFFFF000000000000;
+            static constexpr uint64_t PAYLOAD_MASK = 0x0000FFFFFFFFFFFF;
+            static constexpr uint64_t CANONICAL_NAN = 0x7FF8000000000000;
+
+            static constexpr uint64_t TAG_INT = 0xFFF9000000000000;
+            static constexpr uint64_t TAG_BOOL = 0xFFFA000000000000;
+            static constexpr uint64_t TAG_NIL = 0xFFFB000000000000;
+            static constexpr uint64_t TAG_CLOSURE = 0xFFFC000000000000;
+            static constexpr uint64_t TAG_CONS = 0xFFFD000000000000;
+            static constexpr uint64_t TAG_SYMBOL = 0xFFFE000000000000;
+
+            static inline BoltValue box(uint64_t tag, uint64_t payload) {
+                BoltValue v;
+                v.bits_ = tag | (payload & PAYLOAD_MASK);
+                return v;
+            }
+
+            template<typename T>
+            static inline BoltValue box_ptr(uint64_t tag, T* ptr) {
+                return box(tag, reinterpret_cast<uintptr_t>(ptr));
+            }
+
+            template<typename T>
+            inline T* unbox_ptr() const {
+                return reinterpret_cast<T*>(static_cast<uintptr_t>(bits_ & PAYLOAD_MASK));
+            }
+
+        public:
+            static constexpr size_t TAG_WORD_OFFSET = 4;
+            static constexpr uint32_t INT_TAG_WORD = TAG_INT >> 32;
+            static constexpr uint32_t BOOL_TAG_WORD = TAG_BOOL >> 32;
+            static constexpr uint64_t POINTER_MASK = PAYLOAD_MASK;
+            static constexpr uint32_t DOUBLE_TAG_WORD_MIN = 0;
+            static constexpr uint32_t DOUBLE_TAG_WORD_SPAN = BOX_MASK >> 32;
+            static constexpr bool DOUBLE_TAG_WORD_STORED = false;
+
+            BoltValue() = default;
+
+            static inline BoltValue from_int(int v) { return box(TAG_INT, static_cast<uint32_t>(v)); }
+            static inline BoltValue from_bool(bool v) { return box(TAG_BOOL, v); }
+            static inline BoltValue from_func(ClosureObj* v) { return box_ptr(TAG_CLOSURE, v); }
+            static inline BoltValue from_cons(Cons* v) { return box_ptr(TAG_CONS, v); }
+            static inline BoltValue from_symbol(char* v) { return box_ptr(TAG_SYMBOL, v); }
+            static inline BoltValue nil() { return box(TAG_NIL, 0); }
+            static inline BoltValue from_double(double v) {
+                BoltValue r;
+                r.bits_ = std::isnan(v) ? CANONICAL_NAN : std::bit_cast<uint64_t>(v);
+                return r;
+            }
+
+            inline bool is_double() const { return (bits_ & BOX_MASK) != BOX_MASK; }
+            inline bool is_int() const { return (bits_ & TAG_MASK) == TAG_INT; }
+            inline bool is_number() const { return is_double() || is_int(); }
+            inline bool is_false() const { return bits_ == TAG_BOOL; }
+
+            /* both operands are ints iff neither differs from the int tag
+             * anywhere above the 32-bit payload */
+            static inline bool both_int(BoltValue a, BoltValue b) {
+                return (((a.bits_ ^ TAG_INT) | (b.bits_ ^ TAG_INT)) >> 32) == 0;
+            }
+
+            inline BoltType get_type() const {
+                if (is_double())
+                    return BoltType::Float;
+                switch(bits_ & TAG_MASK) {
+                    case TAG_INT: return BoltType::Integer;
+                    case TAG_BOOL: return BoltType::Boolean;
+                    case TAG_CLOSURE: return BoltType::Closure;
+                    case TAG_CONS: return BoltType::Cons;
+                    case TAG_SYMBOL: return BoltType::Symbol;
+                    default: return BoltType::Nil;
+                }
+            }
+
+            inline int as_int() const { return static_cast<int32_t>(bits_); }
+            inline bool as_bool() const { return bits_ & 1; }
+            inline double as_double() const { return std::bit_cast<double>(bits_); }
+            inline ClosureObj* as_func() const { return unbox_ptr<ClosureObj>(); }
+            inline Cons* as_cons() const { return unbox_ptr<Cons>(); }
+            inline char* as_symbol() const { return unbox_ptr<char>(); }
+
+            /* numeric value of an int or double */
+            inline double to_double() const { return is_int() ? as_int() : as_double(); }
+
+            bool operator==(const BoltValue& other) const;
+    };
+
+    static_assert(sizeof(BoltValue) == 8, "NaN-boxed values must fit a machine word");
+
+#else
+
+    class BoltValue {
+        private:
+            union {
+                bool bool_;
+                int int_;
+                double double_;
+                Cons* cons_;
+                char* symbol_;
+                ClosureObj* func_;
+            };
+            BoltType type_;
+
+        public:
+            // the tag follows the 8-byte union
+            static constexpr size_t TAG_WORD_OFFSET = 8;
+            static constexpr uint32_t INT_TAG_WORD = static_cast<uint32_t>(BoltType::Integer);
+            static constexpr uint32_t BOOL_TAG_WORD = static_cast<uint32_t>(BoltType::Boolean);
+            static constexpr uint64_t POINTER_MASK = ~static_cast<uint64_t>(0);
+            static constexpr uint32_t DOUBLE_TAG_WORD_MIN = static_cast<uint32_t>(BoltType::Float);
+            static constexpr uint32_t DOUBLE_TAG_WORD_SPAN = 1;
+            static constexpr bool DOUBLE_TAG_WORD_STORED = true;
+
+            BoltValue() = default;
+
+            static inline BoltValue from_int(int v) { BoltValue r; r.int_ = v; r.type_ = BoltType::Integer; return r; }
+            static inline BoltValue from_bool(bool v) { BoltValue r; r.bool_ = v; r.type_ = BoltType::Boolean; return r; }
+            static inline BoltValue from_double(double v) { BoltValue r; r.double_ = v; r.type_ = BoltType::Float; return r; }
+            static inline BoltValue from_func(ClosureObj* v) { BoltValue r; r.func_ = v; r.type_ = BoltType::Closure; return r; }
+            static inline BoltValue from_cons(Cons* v) { BoltValue r; r.cons_ = v; r.type_ = BoltType::Cons; return r; }
+            static inline BoltValue from_symbol(char* v) { BoltValue r; r.symbol_ = v; r.type_ = BoltType::Symbol; return r; }
+            static inline BoltValue nil() { BoltValue r; r.cons_ = nullptr; r.type_ = BoltType::Nil; return r; }
+
+            inline bool is_double() const { return type_ == BoltType::Float; }
+            inline bool is_int() const { return type_ == BoltType::Integer; }
+            inline bool is_number() const { return is_double() || is_int(); }
+            inline bool is_false() const { return type_ == BoltType::Boolean && !bool_; }
+
+            static inline bool both_int(BoltValue a, BoltValue b) {
+                return a.type_ == BoltType::Integer && b.type_ == BoltType::Integer;
+            }
+
+            inline BoltType get_type() const { return type_; }
+
+            inline int as_int() const { return int_; }
+            inline bool as_bool() const { return bool_; }
+            inline double as_double() const { return double_; }
+            inline ClosureObj* as_func() const { return func_; }
+            inline Cons* as_cons() const { return cons_; }
+            inline char* as_symbol() const { return symbol_; }
+
+            /* numeric value of an int or double */
+            inline double to_double() const { return is_int() ? as_int() : as_double(); }
+
+            bool operator==(const BoltValue& other) const;
+    };
+
+#endif
+
+    inline bool BoltValue::operator==(const BoltValue& other) const {
+        if (get_type() != other.get_type())
+            return false;
+        switch(get_type()) {
+            case BoltType::Integer: return as_int() == other.as_int();
+            case BoltType::Float: return as_double() == other.as_double();
+            case BoltType::Boolean: return as_bool() == other.as_bool();
+            case BoltType::Closure: return as_func() == other.as_func();
+            case BoltType::Cons: return as_cons() == other.as_cons();
+            case BoltType::Symbol: return as_symbol() == other.as_symbol();
+            case BoltType::Nil: return true;
+            default: throw std::runtime_error("BoltValue: Comparison Not Implemented");
+        }
+    }
+}
+
+/* agrees with ==, whichever representation is in use: 0.0 and -0.0 hash
+ * alike, the type is part of the hash as it is of == */
+template<>
+struct std::hash<BVM::BoltValue> {
+    size_t operator()(const BVM::BoltValue& v) const noexcept {
+        uint64_t payload = 0;
+        switch (v.get_type()) {
+            case BVM::BoltType::Integer: payload = static_cast<uint32_t>(v.as_int()); break;
+            case BVM::BoltType::Float: payload = v.as_double() == 0.0 ? 0 : std::bit_cast<uint64_t>(v.as_double()); break;
+            case BVM::BoltType::Boolean: payload = v.as_bool(); break;
+            case BVM::BoltType::Closure: payload = reinterpret_cast<uintptr_t>(v.as_func()); break;
+            case BVM::BoltType::Cons: payload = reinterpret_cast<uintptr_t>(v.as_cons()); break;
+            case BVM::BoltType::Symbol: payload = reinterpret_cast<uintptr_t>(v.as_symbol()); break;
+            case BVM::BoltType::Nil: break;
+        }
+        // the finalizer of MurmurHash3, spreads payloads differing in few bits over the whole word
+        uint64_t h = payload ^ static_cast<uint64_t>(v.get_type()) << 56;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+#endif
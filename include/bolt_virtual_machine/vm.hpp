@@ -6,21 +6,38 @@
 #include <functional>
 #include <istream>
 #include <string>
-#define STACK_SIZE (1 << 12)
-#define METADATA_SIZE 3
-
-/** Stack Layout (top to bottom)
- * old_fp
- * ret_addr
- * callable_ref
- * locals
+#define DEFAULT_STACK_SLOTS (1 << 20) // stack limit, reserved up front but committed on use
+#define QUICKEN_LIMIT 2 // guard failures after which an instruction stays generic
+#define BUDGET_UNLIMITED INT64_MAX
+#define JIT_THRESHOLD 1000 // calls before a prototype is compiled to machine code
+#define TRACE_THRESHOLD 100 // times a loop header is reached before the loop is traced
+
+/** Stack Layout (top to bottom), one register window per frame
+ * callable_ref  <- fp_ + 1, the caller's register rd
+ * register r    <- fp_ - r
+ * The arguments rd + 1 ... of a call are the callee's registers 0 ..., the
+ * callee's window starts right below the callee in the caller's and nothing
+ * is copied. Caller registers past the arguments are the callee's to
+ * clobber. What the caller needs back (fp_, sp_, return address) is saved
+ * in a CallFrame off the value stack.
  */
 
+/* threaded dispatch relies on the labels-as-values extension - the portable
+ * switch loop is used everywhere else or when BVM_NO_COMPUTED_GOTO is defined */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(BVM_NO_COMPUTED_GOTO)
+#define BVM_COMPUTED_GOTO
+#endif
+
 
 #include <cstdint>
 #include <vector>
+#include "bytecode.hpp"
+#include "gc.hpp"
 #include "instruction.hpp"
+#include "value.hpp"
 #include <memory>
+#include <span>
+#include <unordered_map>
 
 namespace BVM {
 
@@ -42,49 +59,114 @@ namespace BVM {
         StackUnderFlow,
         DivisionByZero,
         IncompatibleTypes,
+        ArityMismatch,
+        NoScheduler,    // OpSchedule or join outside of a Scheduler
+        TaskFailed,     // a joined task threw instead of returning
+        Yield,          // the budget ran out, run() again to resume
+        Halt,
         Ok
     };
 
-    struct BoltValue;
-
-    using Cons = std::pair<BoltValue, BoltValue>;
-
-    enum class BoltType {
-        Integer,
-        Float,
-        Cons,
-        Symbol,
-        Nil,
-        Closure,
-        Boolean,
-    };
-
-    /*GC objects must be manually managed - use with caution*/
-    struct GCObj {
-        bool is_marked = false;
-        GCObj* next;
+    /* where a closure finds an upvalue when it is created: register index of
+     * the frame creating it when in_stack, else upvalue index of the closure
+     * that frame runs */
+    struct UpvalDesc {
+        bool in_stack;
+        uint8_t index;
     };
 
+    /* constants are immediates only, a prototype is shared by every context
+     * running its program and must never point into one context's heap */
     struct Prototype {
         int arity;
         unsigned int n_locals;
         std::vector<BoltValue> consts;
+        std::vector<UpvalDesc> upvals;
         std::vector<uint32_t> instructions;
+        std::span<const uint32_t> image; // instructions mapped from a bytecode file
         unsigned int next_reg;
+        uint32_t id = 0; // index in its program
+        /* lowered once at load time and never written afterwards - every
+         * context threads and quickens its own copy */
+        DecodedStream decoded;
+
+        // raw instructions, wherever they live
+        inline std::span<const uint32_t> code() const {
+            return image.empty() ? std::span<const uint32_t>(instructions) : image;
+        }
     };
 
 
     class VirtualMachine;
+    class Scheduler;
+    class Jit;
+
+    struct QuickenStats {
+        uint64_t quickened = 0; // instructions rewritten into a specialized form
+        uint64_t hits = 0;      // specialized executions whose type guard held
+        uint64_t misses = 0;    // guard failures that deoptimized an instruction
+    };
+
+    struct JitStats {
+        uint64_t compiled = 0;   // prototypes translated to machine code
+        uint64_t failed = 0;     // prototypes the JIT gave up on
+        uint64_t code_bytes = 0; // machine code emitted
+        uint64_t entries = 0;    // times the interpreter handed a frame to native code
+        uint64_t traces = 0;     // loops compiled to traces
+        uint64_t trace_aborts = 0; // recordings that did not end in a trace
+        uint64_t trace_exits = 0;  // guards that failed and left a trace
+    };
+
+    /* arguments of a native call - args[i] is register rd + 1 + i of the
+     * caller, read in place since registers grow down the stack */
+    class NativeArgs {
+        private:
+            const BoltValue* base_;
+            uint8_t n_;
+        public:
+            NativeArgs(const BoltValue* base, uint8_t n) : base_(base), n_(n) {}
+            inline const BoltValue& operator[](size_t i) const { return *(base_ - i); }
+            inline uint8_t size() const { return n_; }
+    };
+
+    using NativeFn = Interrupt (*)(VirtualMachine& vm, NativeArgs args, BoltValue& res);
+    using NativeBinaryFn = Interrupt (*)(BoltValue x, BoltValue y, BoltValue& res);
+
+    #define NATIVE_VARIADIC -1
+    #define MAX_NATIVES 256 // native ids are a single byte in call_native
+
+    /* fn handles any argument count, binary (optional) is the fast entry
+     * taken for exactly two arguments */
+    struct NativeEntry {
+        std::string name;
+        NativeFn fn;
+        int arity;
+        NativeBinaryFn binary;
+    };
 
     struct NativeClosure {
-        void (*cfunc)(VirtualMachine*);
+        NativeFn fn;
     };
     
     struct VirtualClosure {
         const Prototype* proto;
+        uint32_t n_upvals;
+    };
+
+    /* A captured variable. While the frame owning it runs the upvalue is open
+     * and location points at the variable's register, every closure sharing
+     * it sees the same slot. Returning from the frame closes it: the value
+     * moves into closed and location follows. */
+    struct UpvalObj : GCObj {
+        static constexpr GCKind KIND = GCKind::Upval;
+        BoltValue* location;
+        BoltValue closed;
+        UpvalObj* next_open; // open upvalues of a context, by ascending location
     };
 
+    // a bytecode closure is followed by the n_upvals upvalues it captured
     struct ClosureObj : GCObj {
+        static constexpr GCKind KIND = GCKind::Closure;
         enum {
             CLSR_NATIVE,
             CLSR_VIRTUAL,
@@ -93,59 +175,269 @@ namespace BVM {
             NativeClosure as_native;
             VirtualClosure as_virtual;
         };
+
+        inline UpvalObj** upvals() { return reinterpret_cast<UpvalObj**>(this + 1); }
+        inline size_t size() const {
+            return sizeof(ClosureObj) + (type == CLSR_VIRTUAL ? as_virtual.n_upvals * sizeof(UpvalObj*) : 0);
+        }
     };
 
 
-    struct BoltValue {
-        union {
-            bool as_bool;
-            int as_int;
-            double as_double;
-            Cons* as_cons;
-            char* as_symbol;
-            ClosureObj* as_func;
-        };
-        BoltType type;
-
-        bool operator==(const BoltValue& other) const {
-            if (this->type != other.type)
-                return false;
-            switch(this->type) {
-                case BoltType::Integer: return this->as_int == other.as_int;
-                case BoltType::Float: return this->as_double == other.as_double;
-                case BoltType::Boolean: return this->as_bool == other.as_bool;
-                case BoltType::Closure: return this->as_func == other.as_func;
-                default: throw std::runtime_error("BoltValue: Comparison Not Implemented");
+    /* The loaded code of a program: prototypes, their constants, the mapped
+     * bytecode files backing them and the native table their call_native
+     * ids refer to. A frozen program is immutable and can be shared by any
+     * number of contexts (VirtualMachines) on any number of threads. */
+    class Program {
+        private:
+            std::vector<std::unique_ptr<Prototype>> callables_;
+            std::vector<NativeEntry> natives_;
+            std::vector<std::unique_ptr<MappedFile>> images_; // backing the image of loaded prototypes
+            bool frozen_ = false;
+
+            void lower(Prototype* proto);
+            void check_mutable(const char* what) const;
+        public:
+            Program(); // registers the builtin natives
+            Program(const Program&) = delete;
+            Program& operator=(const Program&) = delete;
+
+            /* maps a compiled .bolt file and loads its prototypes, their
+             * instructions are used in place from the mapping */
+            void load_program(const char* file, bool verify_checksum = true);
+            void load_callable(std::unique_ptr<Prototype> callable);
+
+            /* Adds a native function callable through call_native with the
+             * returned id. Ids are stable and handed out in registration
+             * order, the builtins take the ids of their Primitives value.
+             * Natives must be registered before loading code that uses them. */
+            uint8_t register_native(std::string name, NativeFn fn, int arity = NATIVE_VARIADIC, NativeBinaryFn binary = nullptr);
+            int find_native(const std::string& name) const; // -1 if not registered
+
+            // loading or registering anything after this throws
+            inline void freeze() { frozen_ = true; }
+            inline bool is_frozen() const { return frozen_; }
+
+            inline const NativeEntry& get_native(uint8_t id) const {
+                return natives_.at(id);
             }
-        }
+            inline size_t n_natives() const {
+                return natives_.size();
+            }
+            inline const Prototype* get_callable(size_t id) const {
+                return callables_.at(id).get();
+            }
+            inline size_t n_callables() const {
+                return callables_.size();
+            }
+    };
+
+    /* saved by every call, the callee's ret restores the caller from it */
+    struct CallFrame {
+        int32_t fp;
+        int32_t sp;
+        uint32_t ip;
     };
 
+    static_assert(sizeof(CallFrame) == 12, "a quarter of the three stack slots it replaces");
+
+    /* One execution context: stack, registers, heap and the quickened copies
+     * of the code it ran. Constructed without a program it owns a private
+     * one that can be loaded through the vm until it is shared. */
     class VirtualMachine {
         private:
-            BoltValue stack_[STACK_SIZE];
+            /* reserved as a single mapping, the os only backs the pages the
+             * stack actually reaches - indices count from the low end, the
+             * stack grows down from stack_size_ and overflows at 0 */
+            BoltValue* stack_ = nullptr;
+            int32_t stack_size_ = 0;
+            /* CallFrames of every active caller, in the same mapping - every
+             * call moves fp_ down at least one slot, so there are never more
+             * of them than stack slots */
+            CallFrame* frames_ = nullptr;
+            int32_t depth_ = 0;
             size_t ip_ = 0;
-            int16_t sp_ = STACK_SIZE;
-            int16_t fp_ = STACK_SIZE;
-            std::vector<std::unique_ptr<Prototype>> callables_;
+            int32_t sp_ = 0;
+            int32_t fp_ = 0;
+            DecodedInst* code_ = nullptr; // decoded stream of the running prototype
+            std::shared_ptr<Program> program_;
+            std::vector<DecodedStream> streams_; // this context's copy of each prototype's code, by id
+            BoltValue ret_val_;
+            Heap heap_;
+            QuickenStats quicken_stats_;
+            Scheduler* scheduler_ = nullptr; // set while running under a scheduler
+            int64_t budget_ = BUDGET_UNLIMITED;
+            UpvalObj* open_upvals_ = nullptr;
+            std::unique_ptr<Jit> jit_; // null while the JIT is off
+
+            friend class Jit;
+
+            Interrupt call(uint8_t rd, uint8_t n_args);
+            Interrupt tail_call(uint8_t rd, uint8_t n_args);
+            Interrupt schedule(uint8_t rd, uint8_t n_args);
+            void enter(BoltValue func);
+            Interrupt call_native(uint8_t rd, uint8_t n_args, uint8_t id);
+            Interrupt ret(uint8_t rd);
+            void make_closure(uint8_t rd, uint32_t id);
+            UpvalObj* new_upval();
+            UpvalObj* capture(BoltValue* slot);
+            // closes every open upvalue at or below level, the whole stack by default
+            void close_upvals(const BoltValue* level = nullptr);
+            inline void close_frame_upvals() {
+                if (open_upvals_ != nullptr && open_upvals_->location <= stack_ + fp_) [[unlikely]]
+                    close_upvals(stack_ + fp_);
+            }
+            using ImportMemo = std::unordered_map<const GCObj*, GCObj*>;
+            BoltValue import_value(BoltValue v, int depth, ImportMemo& memo);
+            Interrupt dispatch(const void* const** labels);
+            DecodedInst* instantiate(const Prototype* proto);
+            // decoded code of proto as run by this context, copied on first use
+            inline DecodedInst* stream(const Prototype* proto) {
+                if (proto->id >= streams_.size() || streams_[proto->id].empty()) [[unlikely]]
+                    return instantiate(proto);
+                return streams_[proto->id].data();
+            }
+            void clear_registers(unsigned int from, unsigned int to);
+            inline void maybe_collect() {
+                if (heap_.should_collect()) [[unlikely]]
+                    collect_garbage();
+            }
+            // extra_a/extra_b are rooted too, and updated if they move
+            void collect_young(bool tenure_all, BoltValue& extra_a, BoltValue& extra_b);
+            void collect_garbage(BoltValue& extra_a, BoltValue& extra_b);
         public:
-            VirtualMachine();
+            // stack_slots is the deepest the stack may grow before StackOverFlow
+            VirtualMachine(size_t stack_slots = DEFAULT_STACK_SLOTS);
+            // a context running a shared program, which has to be frozen
+            VirtualMachine(std::shared_ptr<const Program> program, size_t stack_slots = DEFAULT_STACK_SLOTS,
+                    size_t nursery_cells = NURSERY_CELLS);
             ~VirtualMachine();
-            void load_program(const char* file);
-            void load_program(std::vector<uint32_t> program);
+            VirtualMachine(const VirtualMachine&) = delete;
+            VirtualMachine& operator=(const VirtualMachine&) = delete;
+
+            // these load into the vm's own program and throw once it is shared
+            inline void load_program(const char* file, bool verify_checksum = true) {
+                program_->load_program(file, verify_checksum);
+            }
             inline void load_callable(std::unique_ptr<Prototype> callable) {
-                callables_.push_back(std::move(callable));
+                program_->load_callable(std::move(callable));
+            }
+            inline uint8_t register_native(std::string name, NativeFn fn, int arity = NATIVE_VARIADIC, NativeBinaryFn binary = nullptr) {
+                return program_->register_native(std::move(name), fn, arity, binary);
             }
+            inline int find_native(const std::string& name) const {
+                return program_->find_native(name);
+            }
+
+            // freezes the program so further contexts can run it
+            inline std::shared_ptr<const Program> share_program() {
+                program_->freeze();
+                return program_;
+            }
+
             void setup_entry_point();
-            inline Prototype* get_callable(size_t id) {
-                return callables_.at(id).get();
+            /* sets up a call of callee with args as the outermost frame, both
+             * are imported from the heap of the context they come from */
+            void setup_call(BoltValue callee, NativeArgs args);
+            /* copies v out of another context's heap into this one: closures
+             * are recreated along with what they captured - by value, the
+             * copy no longer shares variables with the original - and lists
+             * copied cell by cell, they must not be cyclic. Allocates, see
+             * new_cons. */
+            BoltValue import_value(BoltValue v);
+            /* drops everything the last execution left behind - the stack,
+             * the return value and every heap object - but keeps the stack
+             * mapping, the heap's memory and the quickened code */
+            void reset();
+
+            /* Heap allocation - may collect first, so every value the caller
+             * still needs must be reachable from the stack or the arguments */
+            ClosureObj* new_closure(const Prototype* proto);
+            ClosureObj* new_native_closure(NativeFn fn);
+            Cons* new_cons(BoltValue car, BoltValue cdr);
+
+            // stores into heap objects go through the write barrier
+            inline void set_car(Cons* cell, BoltValue v) {
+                heap_.write_barrier(cell, v);
+                cell->car = v;
+            }
+            inline void set_cdr(Cons* cell, BoltValue v) {
+                heap_.write_barrier(cell, v);
+                cell->cdr = v;
+            }
+            // an open upvalue writes to the stack, which needs no barrier
+            inline void set_upval(UpvalObj* up, BoltValue v) {
+                if (up->location == &up->closed)
+                    heap_.write_barrier(up, v);
+                *up->location = v;
+            }
+
+            /* roots are the live part of the stack (sp_ up to the top, every
+             * frame's registers and callable) and the return value. Cons
+             * cells move during a collection, raw Cons pointers do not
+             * survive one. */
+            inline void collect_garbage() {
+                BoltValue a = BoltValue::nil(), b = BoltValue::nil();
+                collect_garbage(a, b);
+            }
+            inline void collect_young() {
+                BoltValue a = BoltValue::nil(), b = BoltValue::nil();
+                collect_young(false, a, b);
+            }
+            void set_nursery_size(size_t cells);
+            inline void set_gc_threshold(size_t bytes) { heap_.set_threshold(bytes); }
+            inline const GCStats& get_gc_stats() const { return heap_.get_stats(); }
+            inline const HeapAreaStats& get_heap_area_stats() const { return heap_.get_area_stats(); }
+            inline const NativeEntry& get_native(uint8_t id) const {
+                return program_->get_native(id);
+            }
+            inline const Prototype* get_callable(size_t id) const {
+                return program_->get_callable(id);
+            }
+            inline const Program& get_program() const {
+                return *program_;
+            }
+            inline Scheduler* get_scheduler() const {
+                return scheduler_;
+            }
+            inline void set_scheduler(Scheduler* scheduler) {
+                scheduler_ = scheduler;
             }
             inline BoltValue get_stack_entry(size_t entry) {
                 return stack_[entry];
             }
+            inline size_t get_stack_size() const {
+                return stack_size_;
+            }
+            // callers of the running frame, 0 in the outermost one
+            inline int32_t get_call_depth() const {
+                return depth_;
+            }
+            inline BoltValue get_return_value() const {
+                return ret_val_;
+            }
+            inline const QuickenStats& get_quicken_stats() const {
+                return quicken_stats_;
+            }
+
+            /* The JIT (see jit.hpp) is on by default where it is built,
+             * threshold is the number of calls after which a prototype is
+             * compiled. Turning it off drops the code compiled so far. */
+            void set_jit(bool enabled, uint32_t threshold = JIT_THRESHOLD);
+            inline bool jit_enabled() const { return jit_ != nullptr; }
+            /* Loops - backward jumps and tail calls of a prototype to itself -
+             * are traced once their header was reached threshold times.
+             * Applies to the JIT while it is on, which starts out tracing
+             * at TRACE_THRESHOLD. */
+            void set_tracing(bool enabled, uint32_t threshold = TRACE_THRESHOLD);
+            JitStats get_jit_stats() const;
+
+            inline const Prototype* frame_proto() const noexcept {
+                return stack_[fp_ + 1].as_func()->as_virtual.proto;
+            }
 
             // god help us all if the compiler decides not to inline these
             inline uint32_t fetch() noexcept {
-                return stack_[fp_].as_func->as_virtual.proto->instructions[ip_++];
+                return frame_proto()->code()[ip_++];
             }
 
             static inline Opcode decode_op(uint32_t inst) noexcept {
@@ -164,14 +456,35 @@ namespace BVM {
                 return (uint8_t) (inst >> 24);
             }
 
-            inline BoltValue get_register_value(uint8_t r) noexcept { return stack_[fp_ - METADATA_SIZE - r]; }
+            // signed jump offsets, relative to the instruction after the jump
+            static inline int32_t decode_offset16(uint32_t inst) noexcept {
+                return (int16_t) (inst >> 16);
+            }
+
+            static inline int32_t decode_offset24(uint32_t inst) noexcept {
+                return ((int32_t) inst) >> 8;
+            }
+
+            inline BoltValue& reg(uint8_t r) noexcept { return stack_[fp_ - r]; }
+
+            inline BoltValue get_register_value(uint8_t r) noexcept { return stack_[fp_ - r]; }
 
             inline void set_register_value(uint8_t r, BoltValue value) noexcept {
-                stack_[fp_ - METADATA_SIZE - r] = value;
+                stack_[fp_ - r] = value;
             }
 
+            /* Reductions run() may spend before it stops with Yield. Only
+             * backward jumps and calls are charged - a backward jump the
+             * length of its loop body, a call one - so straight-line code
+             * costs nothing and every loop or recursion still hits a check.
+             * Not refilled by run(), single steps through execute() are free. */
+            inline void set_budget(int64_t reductions) { budget_ = reductions; }
+            inline int64_t get_budget() const { return budget_; }
+
+            /* executes a single instruction - run() is the fast path, this is
+             * kept for stepping and for tests */
             Interrupt execute(uint32_t inst);
-            void run();
+            Interrupt run(); // returns what stopped execution, Halt on a normal return
             void handle_interrupt(Interrupt interrupt);
 
             inline void push(BoltValue v) {
@@ -181,130 +494,6 @@ namespace BVM {
                 return stack_[sp_++];
             }
 
-            inline void native_add(int n_args) {
-                BoltValue res = {.as_int = 0, .type = BoltType::Integer};
-                for (int i = 0; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (res.type != BoltType::Float && r.type == BoltType::Float)
-                        res.type = BoltType::Float;
-                    res.as_double += r.as_double;
-                }
-                set_register_value(n_args, res);
-            }
-
-            inline void native_sub(int n_args) {
-                BoltValue res = {.as_int = 0, .type = BoltType::Integer};
-                for (int i = 0; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (res.type != BoltType::Float && r.type == BoltType::Float)
-                        res.type = BoltType::Float;
-                    res.as_double -= r.as_double;
-                }
-                set_register_value(n_args, res);
-            }
-
-            inline void native_mul(uint8_t dst, int n_args) {
-                BoltValue res = {.as_int = 1, .type = BoltType::Integer};
-                for (int i = 0; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (res.type != BoltType::Float && r.type == BoltType::Float)
-                        res.type = BoltType::Float;
-                    res.as_double *= r.as_double;
-                }
-                set_register_value(n_args, res);
-            }
-
-            inline void native_div(int n_args) {
-                BoltValue res = {.as_int = 1, .type = BoltType::Integer};
-                for (int i = 0; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (res.type != BoltType::Float && r.type == BoltType::Float)
-                        res.type = BoltType::Float;
-                    res.as_double /= r.as_double;
-                }
-
-                set_register_value(n_args, res);
-            }
-
-            inline void native_lt(int n_args) {
-                BoltValue res = {.as_bool = true, .type = BoltType::Boolean};
-                BoltValue prev = get_register_value(0);
-                for (int i = 1; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (prev.as_double >= r.as_double) {
-                        res.as_bool = false;
-                        break;
-                    }
-                }
-                set_register_value(n_args, res);
-            }
-
-            inline void native_lte(int n_args) {
-                BoltValue res = {.as_bool = true, .type = BoltType::Boolean};
-                BoltValue prev = get_register_value(0);
-                for (int i = 1; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (prev.as_double > r.as_double) {
-                        res.as_bool = false;
-                        break;
-                    }
-                }
-                set_register_value(n_args, res);
-            }
-
-            inline void native_bt(int n_args) {
-                BoltValue res = {.as_bool = true, .type = BoltType::Boolean};
-                BoltValue prev = get_register_value(0);
-                for (int i = 1; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (prev.as_double <= r.as_double) {
-                        res.as_bool = false;
-                        break;
-                    }
-                }
-                set_register_value(n_args, res);
-            }
-
-            inline void native_bte(int n_args) {
-                BoltValue res = {.as_bool = true, .type = BoltType::Boolean};
-                BoltValue prev = get_register_value(0);
-                for (int i = 1; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (prev.as_double < r.as_double) {
-                        res.as_bool = false;
-                        break;
-                    }
-                }
-                set_register_value(n_args, res);
-            }
-
-
-            inline void native_ne(int n_args) {
-                BoltValue res = {.as_bool = true, .type = BoltType::Boolean};
-                BoltValue prev = get_register_value(0);
-                for (int i = 1; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (prev.as_double == r.as_double) {
-                        res.as_bool = false;
-                        break;
-                    }
-                }
-                set_register_value(n_args, res);
-            }
-
-            inline void native_eq(int n_args) {
-                BoltValue res = {.as_bool = true, .type = BoltType::Boolean};
-                BoltValue prev = get_register_value(0);
-                for (int i = 1; i < n_args; i++) {
-                    BoltValue r = get_register_value(i);
-                    if (prev.as_double != r.as_double) {
-                        res.as_bool = false;
-                        break;
-                    }
-                }
-                set_register_value(n_args, res);
-            }
-
     };
 }
 
@@ -0,0 +1,57 @@
+#ifndef BVM_VM_POOL_H
+#define BVM_VM_POOL_H
+
+#include "bolt_virtual_machine/vm.hpp"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace BVM {
+
+    /* Recycles execution contexts of one shared program. A released context
+     * is reset and kept, so the next acquire costs a lock instead of a stack
+     * mapping, a nursery and a fresh copy of the decoded code - and it runs
+     * code that is already quickened. Safe to use from any thread. */
+    class VmPool {
+        public:
+            // a context on loan from the pool, given back when destroyed
+            class Lease {
+                private:
+                    VmPool* pool_ = nullptr;
+                    std::unique_ptr<VirtualMachine> vm_;
+                public:
+                    Lease(VmPool* pool, std::unique_ptr<VirtualMachine> vm) : pool_(pool), vm_(std::move(vm)) {}
+                    Lease(Lease&& other) noexcept = default;
+                    Lease& operator=(Lease&& other) noexcept;
+                    ~Lease();
+
+                    inline VirtualMachine* operator->() const { return vm_.get(); }
+                    inline VirtualMachine& operator*() const { return *vm_; }
+                    inline VirtualMachine* get() const { return vm_.get(); }
+            };
+
+        private:
+            std::shared_ptr<const Program> program_;
+            size_t stack_slots_;
+            size_t nursery_cells_;
+            size_t max_idle_;
+            mutable std::mutex mutex_;
+            std::vector<std::unique_ptr<VirtualMachine>> idle_;
+
+            void release(std::unique_ptr<VirtualMachine> vm);
+        public:
+            /* program must be frozen, at most max_idle contexts are kept
+             * around once released */
+            VmPool(std::shared_ptr<const Program> program, size_t max_idle = 64,
+                    size_t stack_slots = DEFAULT_STACK_SLOTS, size_t nursery_cells = NURSERY_CELLS);
+            VmPool(const VmPool&) = delete;
+            VmPool& operator=(const VmPool&) = delete;
+
+            // a reset context, setup_entry_point() still has to be called
+            Lease acquire();
+            size_t n_idle() const;
+            inline const Program& get_program() const { return *program_; }
+    };
+}
+
+#endif
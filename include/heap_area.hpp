@@ -3,30 +3,121 @@
 
 #include <cstddef>
 #include <cstdint>
-#include <list>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#define HEAP_GRANULE 16                // every block is a multiple of this, and aligned to it
+#define HEAP_MAX_SMALL 512             // larger requests are mapped on their own
+#define HEAP_RUN_SIZE (64 * 1024)      // bytes mapped at once for a size class
+
 namespace BVM {
 
-    struct Chunk {
-        size_t offset;
-        size_t len;
-        bool is_free;
+    struct HeapAreaStats {
+        size_t reserved_bytes = 0;  // mapped from the os, runs and large blocks
+        size_t used_bytes = 0;      // handed out, rounded up to the block size
+        size_t requested_bytes = 0; // handed out, as asked for
+        size_t free_bytes = 0;      // sitting on free lists
+        size_t n_runs = 0;
+        size_t n_large = 0;
+
+        // share of the reserved memory holding live blocks
+        inline double occupancy() const { return reserved_bytes ? (double) used_bytes / reserved_bytes : 0; }
+        // share of the handed out memory lost to rounding up to a size class
+        inline double internal_fragmentation() const { return used_bytes ? 1.0 - (double) requested_bytes / used_bytes : 0; }
+        // share of the free memory that is not at the end of a run
+        inline double external_fragmentation() const {
+            size_t idle = reserved_bytes - used_bytes;
+            return idle ? (double) free_bytes / idle : 0;
+        }
     };
 
+    /* Segregated size-class allocator. Each class carves fixed-size blocks
+     * out of HEAP_RUN_SIZE runs mapped with mmap, freed blocks are kept on a
+     * per-class free list threaded through the blocks themselves, so both
+     * allocate and free are O(1) and never touch the system allocator.
+     * Memory goes back to the os only when the area is destroyed. Callers
+     * pass the size back on free, blocks carry no header. */
     class HeapArea {
         private:
-            uint8_t* mem;
-            size_t capacity;
-            std::list<Chunk> free_list;
+            struct FreeBlock {
+                FreeBlock* next;
+            };
+
+            struct SizeClass {
+                size_t block_size;
+                FreeBlock* free_list = nullptr;
+                uint8_t* bump = nullptr;     // uncarved tail of the newest run
+                uint8_t* bump_end = nullptr;
+            };
+
+            std::vector<SizeClass> classes_;
+            uint8_t class_of_[HEAP_MAX_SMALL / HEAP_GRANULE + 1]; // granules -> class
+            std::vector<void*> runs_;
+            std::unordered_map<void*, size_t> large_; // block -> mapped bytes
+            HeapAreaStats stats_;
+
+            void* map(size_t bytes);
+            void unmap(void* p, size_t bytes);
+            void* refill(SizeClass& c);
 
         public:
             HeapArea();
             ~HeapArea();
-            void allocate(size_t block_size);
-            void write();
+            HeapArea(const HeapArea&) = delete;
+            HeapArea& operator=(const HeapArea&) = delete;
+
+            inline void* allocate(size_t size) {
+                if (size > HEAP_MAX_SMALL) [[unlikely]]
+                    return allocate_large(size);
+                SizeClass& c = classes_[class_of_[(size + HEAP_GRANULE - 1) / HEAP_GRANULE]];
+                void* p;
+                if (c.free_list) {
+                    p = c.free_list;
+                    c.free_list = c.free_list->next;
+                    stats_.free_bytes -= c.block_size;
+                } else if (c.bump + c.block_size <= c.bump_end) {
+                    p = c.bump;
+                    c.bump += c.block_size;
+                } else {
+                    p = refill(c);
+                }
+                stats_.used_bytes += c.block_size;
+                stats_.requested_bytes += size;
+                return p;
+            }
+
+            inline void free(void* p, size_t size) {
+                if (size > HEAP_MAX_SMALL) [[unlikely]]
+                    return free_large(p, size);
+                SizeClass& c = classes_[class_of_[(size + HEAP_GRANULE - 1) / HEAP_GRANULE]];
+                FreeBlock* block = static_cast<FreeBlock*>(p);
+                block->next = c.free_list;
+                c.free_list = block;
+                stats_.used_bytes -= c.block_size;
+                stats_.requested_bytes -= size;
+                stats_.free_bytes += c.block_size;
+            }
+
+            void* allocate_large(size_t size);
+            void free_large(void* p, size_t size);
+
+            // size is larger than sizeof(T) for objects with a trailing array
             template<typename T>
-            T read_as();
+            T* create(size_t size = sizeof(T)) {
+                static_assert(alignof(T) <= HEAP_GRANULE);
+                return new (allocate(size)) T();
+            }
 
+            template<typename T>
+            void destroy(T* obj, size_t size = sizeof(T)) {
+                obj->~T();
+                free(obj, size);
+            }
 
+            // block size a request of size bytes ends up in
+            size_t block_size(size_t size) const;
+            inline const HeapAreaStats& get_stats() const { return stats_; }
     };
 }
 
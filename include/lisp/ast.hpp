@@ -170,16 +170,29 @@ namespace Lisp {
         const BVM::BoltValue* binding;
         SymbolType type;
         BVM::Primitives pid;
+        bool captured = false; // a nested lambda refers to this variable
+    };
+
+    /* a variable of an enclosing lambda, read through the closure: in_stack
+     * and index mean the same as in BVM::UpvalDesc */
+    struct Upvalue {
+        std::string name;
+        bool in_stack;
+        uint8_t index;
     };
 
     // NOTE: change this to a class 
     struct Scope {
-        Scope* parent;
+        Scope* parent = nullptr;
         std::unordered_map<std::string, Symbol> symbol_table;
+        std::vector<Upvalue> upvals;
         int n_vars = 0;
 
         const Symbol* lookup(const std::string& name) const;
+        // redefining a variable keeps its register
         void insert(const std::string id, Symbol sym);
+        int find_upval(const std::string& name) const; // -1 if name is not an upvalue
+        int add_upval(const std::string& name, bool in_stack, uint8_t index);
     };
 
     class AtomicNode : public ASTNode {
@@ -265,6 +278,19 @@ namespace Lisp {
             Define();
     };
 
+    class SetExpr : public ASTNode {
+        private:
+            std::string id_;
+            std::unique_ptr<ASTNode> expr_;
+        public:
+            void set_id(std::string id);
+            void set_expr(std::unique_ptr<ASTNode> expr);
+            const std::string& get_id() const;
+            const ASTNode* get_expr() const;
+            const std::string print() const override;
+            SetExpr();
+    };
+
     class Cons : public ASTNode {
         private:
             std::unique_ptr<ASTNode> a_;
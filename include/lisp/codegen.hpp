@@ -3,6 +3,10 @@
 
 #include "bolt_virtual_machine/vm.hpp"
 #include "lisp/semantics.hpp"
+#include "lisp/inliner.hpp"
+#include "lisp/peephole.hpp"
+#include "lisp/ssa.hpp"
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <stack>
@@ -10,18 +14,40 @@
 
 namespace Lisp {
 
-    /* Bolt File Layout 
-     * n_funcs
-     * [func_objs]
-     * */
+    // compile() writes the bolt file format described in bytecode.hpp
 
-    /* Function Objects 
-     * n_locals
-     * n_consts
-     * [constants]
-     * n_insts
-     * [instructions]
-     * */
+    struct CompilerOptions {
+        // use the *RK instruction forms when an operand is a literal
+        bool constant_operands = true;
+        // build every lambda in SSA form and optimize it before emitting it, see ssa.hpp
+        bool ssa = false;
+        // clean up every prototype's bytecode once it is emitted, see peephole.hpp
+        bool peephole = true;
+        // calls to lambdas of at most inline_size nodes are compiled in place, see inliner.hpp
+        unsigned int inline_size = 16;
+        // expansions inside expansions, 0 turns inlining off
+        unsigned int inline_depth = 2;
+    };
+
+    struct BinopEncoding {
+        uint32_t (*rr)(uint8_t, uint8_t, uint8_t);
+        uint32_t (*rk)(uint8_t, uint8_t, uint8_t);
+        bool has_mirror;
+        NativeFunc mirror; // same test with the operands swapped: (< k x) is (> x k)
+    };
+
+    // the binary instruction of each native op
+    extern const std::unordered_map<NativeFunc, BinopEncoding> binops;
+
+    /* constants that may share a slot of the pool: == but with 0.0 and -0.0
+     * apart, 1 divided by each is a different infinity - folding can
+     * produce either */
+    struct SameConstant {
+        bool operator()(BVM::BoltValue a, BVM::BoltValue b) const;
+    };
+
+    // slot of each constant in a prototype's pool
+    using ConstIndex = std::unordered_map<BVM::BoltValue, size_t, std::hash<BVM::BoltValue>, SameConstant>;
 
     class Compiler {
 
@@ -29,30 +55,71 @@ namespace Lisp {
 
         private:
             std::ofstream out_;
+            CompilerOptions options_;
             std::stack<const Scope*> active_scopes_;
             std::vector<std::unique_ptr<BVM::Prototype>> func_objs_;
             std::stack<BVM::Prototype*> active_objs_;
+            std::stack<ConstIndex> const_indices_; // of the active prototypes' pools
+            std::stack<unsigned int> frame_sizes_; // high watermark of next_reg per active prototype
+            SsaStats ssa_stats_;
+            std::vector<PeepholeStats> peephole_stats_;
+            Inliner inliner_;
+            /* the lambdas being compiled in place of a call into the active
+             * prototype, the innermost last, with the register their first
+             * variable was renamed to */
+            std::vector<std::pair<const Scope*, unsigned int>> inlined_;
+
+            BVM::BoltValue atom_value(const AtomicNode* node) const;
+            size_t add_const(BVM::BoltValue value);
+            bool compile_binop(const ProcCall* node);
+            // a symbol read straight from its own register, nothing is allocated for it
+            bool reads_in_place(const ASTNode* node) const;
+            // the scope names are found from, an inlined lambda's while its body is compiled
+            const Scope* current_scope() const;
+            // name is a variable of the running frame, of the active lambda or one inlined into it
+            bool in_register(const std::string& name) const;
+            unsigned int var_reg(const std::string& name) const;
+            void compile_inline(const ProcCall* node, const Lambda* callee, bool tail);
+            // compiles node into a new prototype and returns its id
+            uint16_t compile_prototype(const Lambda* node);
+            void compile_body(const Lambda* node);
+            void compile_ssa(const Lambda* node);
+            // registers of proto the closures it creates capture
+            RegisterSet captured_registers(const BVM::Prototype* proto) const;
 
         public:
-            Compiler(std::string filename);
+            Compiler(std::string filename, CompilerOptions options = {});
             void compile(const Lambda* node);
-            unsigned int compile_expr(const ASTNode* node);
+            std::vector<uint8_t> serialize() const; // the bolt image of everything compiled so far
+            /* tail is set when the value of node is the value of the
+             * enclosing lambda, calls there are emitted as tail calls */
+            unsigned int compile_expr(const ASTNode* node, bool tail = false);
             void compile_atom(const AtomicNode* node);
-            void compile_list(const ASTNode* node);
+            void compile_list(const ASTNode* node, bool tail = false);
             void compile_define(const Define* node);
             void compile_lambda(const Lambda* node);
-            void compile_if(const IfExpr* node);
+            void compile_if(const IfExpr* node, bool tail = false);
             void compile_list_expr(const ListExpr* node);
-            void compile_proc_call(const ProcCall* node);
+            void compile_proc_call(const ProcCall* node, bool tail = false);
+            void compile_set(const SetExpr* node);
+
+            inline unsigned int alloc_reg() {
+                unsigned int reg = active_objs_.top()->next_reg++;
+                frame_sizes_.top() = std::max(frame_sizes_.top(), reg + 1);
+                return reg;
+            }
 
             inline void dealloc_expr(const ASTNode* expr) {
                 auto fo = active_objs_.top();
-                if (expr->get_type() != NodeType::Atomic 
-                        || static_cast<const AtomicNode*>(expr)->get_value()->get_type() != SExprType::SymbolLiteral)
+                if (!reads_in_place(expr))
                     fo->next_reg--;
             }
 
+            inline const SsaStats& get_ssa_stats() const { return ssa_stats_; }
+            // instruction counts of every prototype before and after the peephole pass, in the order they were finished
+            inline const std::vector<PeepholeStats>& get_peephole_stats() const { return peephole_stats_; }
             const std::vector<std::unique_ptr<BVM::Prototype>>& get_objs();
+            std::vector<std::unique_ptr<BVM::Prototype>> release_objs();
 
     };
 }
@@ -6,10 +6,10 @@ namespace Lisp {
     class Disassembler {
         private:
             std::string out_;
-            const BVM::FuncObj* func_;
+            const BVM::Prototype* func_;
 
         public:
-            Disassembler(const BVM::FuncObj* func);
+            Disassembler(const BVM::Prototype* func);
             const std::string& disassemble();
             void decode_mov();
             void decode_jmp_if_false();
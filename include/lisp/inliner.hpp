@@ -0,0 +1,54 @@
+#ifndef LISP_INLINER_H
+#define LISP_INLINER_H
+
+#include "lisp/semantics.hpp"
+#include <unordered_map>
+
+/* Calls to small lambdas are compiled in place of the call, on both code
+ * generators: the arguments go where the callee's parameters would be, its
+ * body follows with its variables renamed into the caller's frame and no
+ * frame is pushed. A lambda qualifies when
+ * - it is the value of a define among the expressions of the enclosing
+ *   lambda's body, the only define of that name there, and no set! names
+ *   it, so every call compiled after that define calls it
+ * - its body is at most max_size nodes, creates no closures and does not
+ *   name itself
+ * and a call inlines it when whatever the body reads from the lambdas
+ * around it is readable where the call is, or is the callee of a call that
+ * is inlined in turn, at most max_depth calls deep. */
+
+namespace Lisp {
+
+    class Inliner {
+        private:
+            struct Candidate {
+                const Lambda* lambda;
+                unsigned int size;   // nodes of the body
+                unsigned int n_vars; // parameters and defines
+            };
+
+            unsigned int max_size_;
+            unsigned int max_depth_;
+            std::unordered_map<const Lambda*, std::pair<const Symbol*, Candidate>> pending_; // not compiled yet
+            std::unordered_map<const Symbol*, Candidate> candidates_;
+
+            const Candidate* candidate(const ProcCall* call, const Scope& scope, unsigned int depth) const;
+            // registers an expansion at depth needs, 0 when it cannot be expanded where real is compiled
+            unsigned int frame_size(const Candidate& c, const Scope& real, unsigned int depth) const;
+
+        public:
+            Inliner(unsigned int max_size, unsigned int max_depth);
+            // finds the lambdas among node's expressions that qualify
+            void scan(const Lambda* node);
+            // calls compiled from now on may inline node if it qualifies
+            void compiled(const Lambda* node);
+            /* the lambda to compile in place of call, which is compiled from
+             * scope into the prototype of real with depth calls being
+             * inlined already and base the first register free for the
+             * expansion - nullptr to call it */
+            const Lambda* expand(const ProcCall* call, const Scope& scope, const Scope& real, unsigned int depth,
+                    unsigned int base) const;
+    };
+}
+
+#endif
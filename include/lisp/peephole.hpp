@@ -0,0 +1,37 @@
+#ifndef LISP_PEEPHOLE_H
+#define LISP_PEEPHOLE_H
+
+#include "bolt_virtual_machine/vm.hpp"
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/* A last pass over the bytecode of one prototype once it is emitted, for
+ * what the code generators leave behind:
+ * - jumps to jumps go straight to the last one, a jump to a ret is that ret
+ * - a jmp_if_false on a register known to hold a constant always or never
+ *   jumps, binops of constants are folded to find them
+ * - an instruction whose result only a mov right after it reads writes the
+ *   mov's destination instead, self moves and dead stores go away
+ * - code no path reaches anymore is dropped and jump offsets fixed up
+ * Registers closures share as open upvalues are never assumed dead or
+ * constant, a write to one is visible through the upvalue. */
+
+namespace Lisp {
+
+    using RegisterSet = std::bitset<UINT8_MAX + 1>;
+
+    struct PeepholeStats {
+        uint16_t proto;
+        size_t before; // instructions
+        size_t after;
+    };
+
+    /* captured holds the registers closures of proto capture, constants
+     * folded go to the pool through add_const */
+    PeepholeStats peephole(BVM::Prototype& proto, uint16_t id, const RegisterSet& captured,
+            const std::function<size_t(BVM::BoltValue)>& add_const);
+}
+
+#endif
@@ -52,6 +52,7 @@ namespace Lisp {
             std::unique_ptr<Define> verify_define(std::unique_ptr<List> sexpr);
             std::unique_ptr<Lambda> verify_lambda(std::unique_ptr<List> sexpr);
             std::unique_ptr<IfExpr> verify_if(std::unique_ptr<List> sexpr);
+            std::unique_ptr<SetExpr> verify_set(std::unique_ptr<List> sexpr);
             std::unique_ptr<ProcCall> verify_proc_call(std::unique_ptr<List> sexpr);
             bool has_value(std::unique_ptr<SExpr> sexpr);
     };
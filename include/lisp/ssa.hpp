@@ -0,0 +1,115 @@
+#ifndef LISP_SSA_H
+#define LISP_SSA_H
+
+#include "bolt_virtual_machine/vm.hpp"
+#include "lisp/inliner.hpp"
+#include "lisp/semantics.hpp"
+#include <functional>
+#include <vector>
+
+/* The optimizing path of the compiler: one lambda at a time is turned into
+ * SSA form, optimized and lowered back to bytecode with its registers
+ * assigned by a linear scan instead of the stack discipline of the direct
+ * path.
+ * - values are instructions, every one is defined once. Uncaptured
+ *   variables only exist while building, an if joins the values they have
+ *   at the end of its branches in phis.
+ * - captured variables stay in their registers, closures share them as
+ *   open upvalues, and are read and written with ReadVar and WriteVar
+ * - blocks come from ifs only, so the graph has no cycles and blocks are
+ *   kept in an order where each comes after its predecessors. A branch
+ *   always targets blocks with no other predecessor, a block with several
+ *   ends every one of them with a jump. */
+
+namespace Lisp {
+
+    enum class SsaOp : uint8_t {
+        Const,      // konst
+        Param,      // imm: the parameter's number
+        Copy,       // args[0], what define and set! of an uncaptured variable leave
+        Phi,        // one argument per predecessor of the block, in the same order
+        Binop,      // native: the op, of args[0] and args[1]
+        CallNative, // native, imm: its id, args: its arguments
+        Call,       // args[0]: the callee, the rest its arguments
+        GetUpval,   // imm: the upvalue
+        SetUpval,   // imm: the upvalue, args[0]: the value
+        ReadVar,    // imm: register of a captured variable
+        WriteVar,   // imm: register of a captured variable, args[0]: the value
+        Closure,    // imm: the prototype
+    };
+
+    enum class SsaExit : uint8_t {
+        Jump,     // to succ[0]
+        Branch,   // on operands[0], to succ[0] when it holds and succ[1] when it is false
+        Return,   // operands[0]
+        TailCall, // operands[0]: the callee, the rest its arguments
+    };
+
+    struct SsaInst {
+        SsaOp op;
+        int block;
+        int imm = 0;
+        NativeFunc native = NativeFunc::Add;
+        BVM::BoltValue konst = BVM::BoltValue::nil();
+        std::vector<int> args;
+        bool dead = false;
+    };
+
+    struct SsaBlock {
+        std::vector<int> insts; // phis first
+        std::vector<int> preds;
+        SsaExit exit = SsaExit::Return;
+        std::vector<int> operands;
+        int succ[2] = {-1, -1};
+        bool dead = false;
+    };
+
+    // what the passes did, summed over every lambda compiled
+    struct SsaStats {
+        size_t folded = 0; // instructions computed and branches decided at compile time
+        size_t copies = 0; // copies and phis of a single value replaced by their source
+        size_t cse = 0;    // instructions replaced by an equal one that dominates them
+        size_t dead = 0;   // instructions removed as unused
+    };
+
+    struct SsaFunction {
+        int arity = 0;
+        std::vector<SsaInst> insts;
+        std::vector<SsaBlock> blocks; // blocks[0] is the entry
+        std::vector<int> pin_of;      // register a captured variable gets for its register in the scope, -1 if not
+        std::vector<uint8_t> pinned;  // those registers, the lambda cannot use them for anything else
+        std::vector<uint16_t> children; // prototypes of the lambdas right inside this one
+
+        int add_block();
+        int add_inst(int block, SsaOp op, std::vector<int> args = {}, int imm = 0);
+        // to and its phis forget about from
+        void remove_edge(int from, int to);
+    };
+
+    /* false when node uses something only the direct path compiles, a
+     * string literal or a special form or native taken as a value */
+    bool ssa_supported(const Lambda* node);
+    /* nested lambdas are handed to compile_nested, which returns the id of
+     * the prototype it compiled; the calls inliner expands are built in
+     * place, their variables become values like the lambda's own */
+    SsaFunction build_ssa(const Lambda* node, const std::function<uint16_t(const Lambda*)>& compile_nested,
+            const Inliner* inliner = nullptr);
+
+    /* what the VM's arithmetic and comparisons compute for constant
+     * operands, false where they would interrupt instead */
+    bool fold_binop(NativeFunc op, BVM::BoltValue x, BVM::BoltValue y, BVM::BoltValue& res);
+
+    // native ops of constants, branches on them and phis of a single value
+    void fold_constants(SsaFunction& fn, SsaStats& stats);
+    void propagate_copies(SsaFunction& fn, SsaStats& stats);
+    void eliminate_common_subexprs(SsaFunction& fn, SsaStats& stats);
+    // keeps anything that can fail at run time, an unused (+ x 1) still checks x
+    void eliminate_dead_code(SsaFunction& fn, SsaStats& stats);
+    void optimize(SsaFunction& fn, SsaStats& stats);
+
+    /* writes fn's instructions, constants and frame size to proto; throws
+     * when fn needs more than MAX_REGS registers */
+    void lower_ssa(const SsaFunction& fn, BVM::Prototype& proto, const std::function<size_t(BVM::BoltValue)>& add_const);
+}
+
+#endif
@@ -0,0 +1,37 @@
+#include "bolt_virtual_machine/bytecode.hpp"
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace BVM {
+
+    MappedFile::MappedFile(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(std::string("load_program: cannot open ") + path);
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw std::runtime_error(std::string("load_program: cannot stat ") + path);
+        }
+        size_ = st.st_size;
+        if (size_ > 0) {
+            void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error(std::string("load_program: cannot map ") + path);
+            }
+            data_ = static_cast<const uint8_t*>(p);
+        }
+        // the mapping keeps the file alive
+        close(fd);
+    }
+
+    MappedFile::~MappedFile() {
+        if (data_)
+            munmap(const_cast<uint8_t*>(data_), size_);
+    }
+}
@@ -18,25 +18,59 @@ namespace BVM {
     EMIT_BINOP_IMPL(lt, Opcode::OpLt);
     EMIT_BINOP_IMPL(eq, Opcode::OpEq);
     EMIT_BINOP_IMPL(ne, Opcode::OpNe);
+    EMIT_BINOP_IMPL(add_rk, Opcode::OpAddRK);
+    EMIT_BINOP_IMPL(sub_rk, Opcode::OpSubRK);
+    EMIT_BINOP_IMPL(mul_rk, Opcode::OpMulRK);
+    EMIT_BINOP_IMPL(div_rk, Opcode::OpDivRK);
+    EMIT_BINOP_IMPL(lt_rk, Opcode::OpLtRK);
+    EMIT_BINOP_IMPL(lte_rk, Opcode::OpLteRK);
+    EMIT_BINOP_IMPL(bt_rk, Opcode::OpBtRK);
+    EMIT_BINOP_IMPL(bte_rk, Opcode::OpBteRK);
+    EMIT_BINOP_IMPL(eq_rk, Opcode::OpEqRK);
+    EMIT_BINOP_IMPL(ne_rk, Opcode::OpNeRK);
     uint32_t Emitter::mov(uint8_t rd, uint8_t rt) {
         return static_cast<uint8_t>(Opcode::OpMov) | rd << 8 | rt << 16;
     }
-    uint32_t Emitter::ret() { return static_cast<uint32_t>(Opcode::OpRet); }
-    uint32_t Emitter::jmp_if_false(uint8_t rd, uint32_t target) {
-        return static_cast<uint8_t>(Opcode::OpJmpIfFalse) | rd << 8 | target << 16;
+    uint32_t Emitter::ret(uint8_t rd) { return static_cast<uint8_t>(Opcode::OpRet) | rd << 8; }
+    uint32_t Emitter::jmp(int32_t offset) {
+        return static_cast<uint8_t>(Opcode::OpJmp) | static_cast<uint32_t>(offset) << 8;
+    }
+
+    uint32_t Emitter::jmp_if_false(uint8_t rd, int16_t offset) {
+        return static_cast<uint8_t>(Opcode::OpJmpIfFalse) | rd << 8 | static_cast<uint16_t>(offset) << 16;
     }
 
     uint32_t Emitter::load_const(uint8_t rd, uint16_t idx) {
         return static_cast<uint8_t>(Opcode::OpConst) | rd << 8 | idx << 16;
     }
 
-    uint32_t Emitter::call(uint8_t rd) {
-        return static_cast<uint8_t>(Opcode::OpCall) | rd << 8;
+    uint32_t Emitter::call(uint8_t rd, uint8_t nargs) {
+        return static_cast<uint8_t>(Opcode::OpCall) | rd << 8 | nargs << 16;
+    }
+
+    uint32_t Emitter::tail_call(uint8_t rd, uint8_t nargs) {
+        return static_cast<uint8_t>(Opcode::OpTailCall) | rd << 8 | nargs << 16;
     }
 
     uint32_t Emitter::call_native(uint8_t rd, uint8_t nargs, uint8_t idx) {
         return static_cast<uint8_t>(Opcode::OpCallNative) | rd << 8 | nargs << 16 | idx << 24;
     }
 
+    uint32_t Emitter::schedule(uint8_t rd, uint8_t nargs) {
+        return static_cast<uint8_t>(Opcode::OpSchedule) | rd << 8 | nargs << 16;
+    }
+
+    uint32_t Emitter::closure(uint8_t rd, uint16_t proto) {
+        return static_cast<uint8_t>(Opcode::OpClosure) | rd << 8 | proto << 16;
+    }
+
+    uint32_t Emitter::get_upval(uint8_t rd, uint8_t idx) {
+        return static_cast<uint8_t>(Opcode::OpGetUpval) | rd << 8 | idx << 16;
+    }
+
+    uint32_t Emitter::set_upval(uint8_t rd, uint8_t idx) {
+        return static_cast<uint8_t>(Opcode::OpSetUpval) | rd << 8 | idx << 16;
+    }
+
 
 }
@@ -0,0 +1,224 @@
+#include "bolt_virtual_machine/gc.hpp"
+#include "bolt_virtual_machine/vm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace BVM {
+
+    static inline uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    Heap::Heap(size_t nursery_cells) {
+        resize_nursery(nursery_cells);
+    }
+
+    Heap::~Heap() {
+        while (objects_) {
+            GCObj* next = objects_->next;
+            destroy(objects_);
+            objects_ = next;
+        }
+    }
+
+    size_t Heap::size_of(const GCObj* obj) {
+        switch(obj->kind) {
+            case GCKind::Closure: return static_cast<const ClosureObj*>(obj)->size();
+            case GCKind::Cons: return sizeof(Cons);
+            case GCKind::Upval: return sizeof(UpvalObj);
+        }
+        return 0;
+    }
+
+    void Heap::destroy(GCObj* obj) {
+        switch(obj->kind) {
+            case GCKind::Closure: area_.destroy(static_cast<ClosureObj*>(obj), size_of(obj)); break;
+            case GCKind::Cons: area_.destroy(static_cast<Cons*>(obj)); break;
+            case GCKind::Upval: area_.destroy(static_cast<UpvalObj*>(obj)); break;
+        }
+    }
+
+    void Heap::link(GCObj* obj, size_t size) {
+        obj->next = objects_;
+        objects_ = obj;
+        stats_.live_bytes += size;
+        stats_.live_objects++;
+    }
+
+    void Heap::begin() {
+        pause_start_ = now_ns();
+        mark_stack_.clear();
+    }
+
+    void Heap::mark_object(GCObj* obj) {
+        if (obj == nullptr || obj->is_marked)
+            return;
+        obj->is_marked = true;
+        mark_stack_.push_back(obj);
+    }
+
+    void Heap::mark_value(BoltValue v) {
+        switch(v.get_type()) {
+            case BoltType::Closure: mark_object(v.as_func()); break;
+            case BoltType::Cons: mark_object(v.as_cons()); break;
+            default: break;
+        }
+    }
+
+    void Heap::trace(GCObj* obj) {
+        switch(obj->kind) {
+            case GCKind::Cons: {
+                Cons* cell = static_cast<Cons*>(obj);
+                mark_value(cell->car);
+                mark_value(cell->cdr);
+                break;
+            }
+            case GCKind::Closure: {
+                // prototypes are owned by the vm, not by the heap
+                ClosureObj* clsr = static_cast<ClosureObj*>(obj);
+                if (clsr->type == ClosureObj::CLSR_VIRTUAL) {
+                    for (uint32_t i = 0; i < clsr->as_virtual.n_upvals; i++)
+                        mark_object(clsr->upvals()[i]);
+                }
+                break;
+            }
+            case GCKind::Upval:
+                // an open upvalue's value is on the stack, a root already
+                mark_value(static_cast<UpvalObj*>(obj)->closed);
+                break;
+        }
+    }
+
+    void Heap::sweep() {
+        GCObj** link = &objects_;
+        while (*link) {
+            GCObj* obj = *link;
+            if (obj->is_marked) {
+                obj->is_marked = false;
+                link = &obj->next;
+                continue;
+            }
+            *link = obj->next;
+            stats_.bytes_freed += size_of(obj);
+            stats_.live_bytes -= size_of(obj);
+            stats_.objects_freed++;
+            stats_.live_objects--;
+            destroy(obj);
+        }
+    }
+
+    void Heap::finish() {
+        while (!mark_stack_.empty()) {
+            GCObj* obj = mark_stack_.back();
+            mark_stack_.pop_back();
+            trace(obj);
+        }
+        sweep();
+
+        stats_.threshold = std::max(min_threshold_, stats_.live_bytes * GC_GROWTH_FACTOR);
+        uint64_t pause = now_ns() - pause_start_;
+        stats_.collections++;
+        stats_.last_pause_ns = pause;
+        stats_.total_pause_ns += pause;
+        stats_.max_pause_ns = std::max(stats_.max_pause_ns, pause);
+    }
+
+    void Heap::resize_nursery(size_t cells) {
+        if (top_ != 0)
+            throw std::runtime_error("resize_nursery: nursery is not empty");
+        capacity_ = std::max<size_t>(cells, 1);
+        spaces_[0] = std::make_unique<Cons[]>(capacity_);
+        spaces_[1] = std::make_unique<Cons[]>(capacity_);
+        from_ = spaces_[0].get();
+        to_ = spaces_[1].get();
+    }
+
+    void Heap::begin_minor(bool tenure_all) {
+        pause_start_ = now_ns();
+        tenure_all_ = tenure_all;
+        to_top_ = 0;
+    }
+
+    /* returns where v lives after this minor collection, copying its cell on
+     * first sight and leaving a forwarding pointer behind */
+    BoltValue Heap::evacuate(BoltValue v) {
+        if (v.get_type() != BoltType::Cons || !in_from(v.as_cons()))
+            return v;
+        Cons* cell = v.as_cons();
+        if (cell->next)
+            return BoltValue::from_cons(static_cast<Cons*>(cell->next));
+
+        Cons* copy;
+        if (tenure_all_ || cell->age >= PROMOTE_AGE) {
+            copy = alloc<Cons>();
+            stats_.bytes_promoted += sizeof(Cons);
+            promoted_.push_back(copy);
+        } else {
+            copy = &to_[to_top_++];
+            copy->kind = GCKind::Cons;
+            copy->next = nullptr;
+            copy->age = cell->age + 1;
+        }
+        copy->car = cell->car;
+        copy->cdr = cell->cdr;
+        cell->next = copy;
+        return BoltValue::from_cons(copy);
+    }
+
+    /* the owner has evacuated its roots - what is left is everything they
+     * reach: remembered old objects first, then the copied cells (the scan
+     * pointer chasing to_top_) and the promoted ones until both run dry */
+    void Heap::finish_minor() {
+        std::vector<GCObj*> remembered;
+        remembered.swap(remembered_);
+        for (GCObj* obj : remembered) {
+            obj->is_remembered = false;
+            if (obj->kind == GCKind::Upval) {
+                UpvalObj* up = static_cast<UpvalObj*>(obj);
+                up->closed = evacuate(up->closed);
+                if (is_young_value(up->closed))
+                    remember(up);
+                continue;
+            }
+            Cons* cell = static_cast<Cons*>(obj);
+            cell->car = evacuate(cell->car);
+            cell->cdr = evacuate(cell->cdr);
+            if (has_young_field(cell))
+                remember(cell);
+        }
+
+        size_t scan = 0;
+        while (scan < to_top_ || !promoted_.empty()) {
+            for (; scan < to_top_; scan++) {
+                to_[scan].car = evacuate(to_[scan].car);
+                to_[scan].cdr = evacuate(to_[scan].cdr);
+            }
+            while (!promoted_.empty()) {
+                Cons* cell = promoted_.back();
+                promoted_.pop_back();
+                cell->car = evacuate(cell->car);
+                cell->cdr = evacuate(cell->cdr);
+                // a promoted cell may still point at a cell that stayed young
+                if (has_young_field(cell))
+                    remember(cell);
+            }
+        }
+
+        std::swap(from_, to_);
+        top_ = to_top_;
+        to_top_ = 0;
+
+        uint64_t pause = now_ns() - pause_start_;
+        stats_.minor_collections++;
+        stats_.last_minor_pause_ns = pause;
+        stats_.total_minor_pause_ns += pause;
+        stats_.max_minor_pause_ns = std::max(stats_.max_minor_pause_ns, pause);
+    }
+
+    void Heap::set_threshold(size_t bytes) {
+        min_threshold_ = bytes;
+        stats_.threshold = std::max(bytes, stats_.live_bytes * GC_GROWTH_FACTOR);
+    }
+}
@@ -0,0 +1,82 @@
+#include "heap_area.hpp"
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace BVM {
+
+    // spaced so rounding up wastes at most a quarter of a block
+    static const size_t CLASS_SIZES[] = {16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512};
+
+    HeapArea::HeapArea() {
+        size_t c = 0;
+        for (size_t size : CLASS_SIZES)
+            classes_.push_back({.block_size = size});
+        for (size_t g = 0; g <= HEAP_MAX_SMALL / HEAP_GRANULE; g++) {
+            while (CLASS_SIZES[c] < g * HEAP_GRANULE)
+                c++;
+            class_of_[g] = c;
+        }
+    }
+
+    HeapArea::~HeapArea() {
+        for (void* run : runs_)
+            munmap(run, HEAP_RUN_SIZE);
+        for (auto& [p, bytes] : large_)
+            munmap(p, bytes);
+    }
+
+    void* HeapArea::map(size_t bytes) {
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+        stats_.reserved_bytes += bytes;
+        return p;
+    }
+
+    void HeapArea::unmap(void* p, size_t bytes) {
+        munmap(p, bytes);
+        stats_.reserved_bytes -= bytes;
+    }
+
+    /* the class ran out of blocks: map a new run and carve from it, the
+     * tail of the previous run that is too short for a block is lost */
+    void* HeapArea::refill(SizeClass& c) {
+        uint8_t* run = static_cast<uint8_t*>(map(HEAP_RUN_SIZE));
+        runs_.push_back(run);
+        stats_.n_runs++;
+        c.bump = run + c.block_size;
+        c.bump_end = run + HEAP_RUN_SIZE;
+        return run;
+    }
+
+    static inline size_t page_round(size_t size) {
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        return (size + page - 1) / page * page;
+    }
+
+    void* HeapArea::allocate_large(size_t size) {
+        size_t bytes = page_round(size);
+        void* p = map(bytes);
+        large_[p] = bytes;
+        stats_.used_bytes += bytes;
+        stats_.requested_bytes += size;
+        stats_.n_large++;
+        return p;
+    }
+
+    void HeapArea::free_large(void* p, size_t size) {
+        size_t bytes = page_round(size);
+        large_.erase(p);
+        unmap(p, bytes);
+        stats_.used_bytes -= bytes;
+        stats_.requested_bytes -= size;
+        stats_.n_large--;
+    }
+
+    size_t HeapArea::block_size(size_t size) const {
+        if (size > HEAP_MAX_SMALL)
+            return page_round(size);
+        return classes_[class_of_[(size + HEAP_GRANULE - 1) / HEAP_GRANULE]].block_size;
+    }
+}
@@ -0,0 +1,528 @@
+#include "bolt_virtual_machine/jit.hpp"
+
+#ifdef BVM_JIT
+
+#include "bolt_virtual_machine/assembler.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_THREW 0xFFFF // exit status of a C++ exception caught under native code
+
+namespace BVM {
+
+    CodeArena::CodeArena(size_t size) : size_(size), page_(sysconf(_SC_PAGESIZE)) {
+        size_ = (size_ + page_ - 1) & ~(page_ - 1);
+    }
+
+    CodeArena::~CodeArena() {
+        if (base_ != nullptr)
+            munmap(base_, size_);
+    }
+
+    /* mapped on first use, most contexts never compile anything */
+    uint8_t* CodeArena::reserve(size_t size) {
+        if (base_ == nullptr) {
+            void* p = mmap(nullptr, size_, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (p == MAP_FAILED)
+                return nullptr;
+            base_ = static_cast<uint8_t*>(p);
+        }
+        if (size > size_ - used_)
+            return nullptr;
+        return base_ + used_;
+    }
+
+    void CodeArena::write(const uint8_t* code, size_t size) {
+        uint8_t* dst = base_ + used_;
+        uint8_t* first = base_ + (used_ & ~(page_ - 1));
+        size_t len = dst + size - first;
+        if (mprotect(first, len, PROT_READ | PROT_WRITE) != 0)
+            throw std::runtime_error("jit: cannot make code writable");
+        std::memcpy(dst, code, size);
+        if (mprotect(first, len, PROT_READ | PROT_EXEC) != 0)
+            throw std::runtime_error("jit: cannot make code executable");
+        // functions start on 16 bytes
+        used_ = std::min(size_, (used_ + size + 15) & ~static_cast<size_t>(15));
+    }
+
+    Jit::Jit(uint32_t threshold) : threshold_(threshold) {}
+
+    /* native code runs with the frame base in rbx, the vm in r12 and the
+     * budget in r13, everything else is scratch between instructions */
+    using Enter = uint64_t (*)(BoltValue* frame, int64_t* budget, const uint8_t* target, VirtualMachine* vm);
+
+    Interrupt Jit::run(VirtualMachine& vm, const uint8_t* const* code) {
+        return enter(vm, code[vm.ip_]);
+    }
+
+    Interrupt Jit::enter(VirtualMachine& vm, const uint8_t* target) {
+        stats_.entries++;
+        Enter enter = reinterpret_cast<Enter>(reinterpret_cast<uintptr_t>(enter_));
+        uint64_t word = enter(vm.stack_ + vm.fp_, &vm.budget_, target, &vm);
+        vm.ip_ = word >> 32;
+        if (pending_) {
+            std::exception_ptr e = pending_;
+            pending_ = nullptr;
+            std::rethrow_exception(e);
+        }
+        return static_cast<Interrupt>(static_cast<uint32_t>(word) - 1);
+    }
+
+    /* the way back into the interpreter for one instruction - exceptions
+     * must not unwind through native frames, they wait in pending_ */
+    uint64_t Jit::step(VirtualMachine* vm, uint32_t ip, uint32_t inst) {
+        try {
+            vm->ip_ = ip + 1;
+            Interrupt interrupt = vm->execute(inst);
+            return interrupt == Interrupt::Ok ? 0 : exit_word(ip + 1, interrupt);
+        } catch (...) {
+            vm->jit_->pending_ = std::current_exception();
+            return exit_word(ip + 1, JIT_THREW);
+        }
+    }
+
+    /* Frames change under calls, tail calls and returns, the interpreter's
+     * bookkeeping runs them and native code continues in whatever frame
+     * they end up in. The callee's call counts towards compiling it, and a
+     * call is charged to the budget like in the interpreter. A tail call of
+     * a prototype to itself is a loop and goes on in its trace once there
+     * is one. */
+    template<Opcode OP>
+    Jit::Transfer Jit::transfer(VirtualMachine* vm, uint32_t ip, uint32_t inst) {
+        try {
+            uint8_t rd = VirtualMachine::decode_rd(inst);
+            uint8_t n_args = VirtualMachine::decode_rt(inst);
+            const Prototype* caller = vm->frame_proto();
+            vm->ip_ = ip + 1;
+            Interrupt interrupt;
+            if constexpr (OP == Opcode::OpCall)
+                interrupt = vm->call(rd, n_args);
+            else if constexpr (OP == Opcode::OpTailCall)
+                interrupt = vm->tail_call(rd, n_args);
+            else
+                interrupt = vm->ret(rd);
+            if (OP != Opcode::OpRet && interrupt == Interrupt::Ok && (vm->budget_ -= 1) <= 0)
+                interrupt = Interrupt::Yield;
+            Jit& jit = *vm->jit_;
+            if (OP == Opcode::OpTailCall && interrupt == Interrupt::Ok && vm->frame_proto() == caller
+                    && ++jit.protos_[caller->id].self_calls >= jit.trace_threshold_) {
+                if (const uint8_t* trace = jit.trace(*vm, interrupt))
+                    return {trace, reinterpret_cast<uintptr_t>(vm->stack_ + vm->fp_)};
+                jit.protos_[caller->id].self_calls = 0;
+            }
+            if (interrupt == Interrupt::Ok) {
+                if (const uint8_t* const* native = vm->jit_->lookup(vm->frame_proto(), OP != Opcode::OpRet))
+                    return {native[vm->ip_], reinterpret_cast<uintptr_t>(vm->stack_ + vm->fp_)};
+            }
+            return {nullptr, exit_word(vm->ip_, interrupt)};
+        } catch (...) {
+            vm->jit_->pending_ = std::current_exception();
+            return {nullptr, exit_word(vm->ip_, JIT_THREW)};
+        }
+    }
+
+    /* the loop at ip went round often enough in native code to be traced,
+     * which continues in the trace or wherever recording one left off */
+    Jit::Transfer Jit::hot_loop(VirtualMachine* vm, uint32_t ip, uint32_t) {
+        try {
+            vm->ip_ = ip;
+            Interrupt interrupt;
+            Jit& jit = *vm->jit_;
+            uintptr_t frame = reinterpret_cast<uintptr_t>(vm->stack_ + vm->fp_);
+            if (const uint8_t* trace = jit.trace(*vm, interrupt))
+                return {trace, frame};
+            if (interrupt == Interrupt::Ok)
+                return {jit.protos_[vm->frame_proto()->id].native[vm->ip_], frame};
+            return {nullptr, exit_word(vm->ip_, interrupt)};
+        } catch (...) {
+            vm->jit_->pending_ = std::current_exception();
+            return {nullptr, exit_word(vm->ip_, JIT_THREW)};
+        }
+    }
+
+    // helper(vm, ip, inst)
+    template<typename F>
+    static void emit_helper(Assembler& a, uint32_t ip, uint32_t inst, F* helper) {
+        a.mov(Assembler::RDI, Assembler::R12);
+        a.mov_imm32(Assembler::RSI, ip);
+        a.mov_imm32(Assembler::RDX, inst);
+        a.mov_imm64(Assembler::RAX, reinterpret_cast<uintptr_t>(helper));
+        a.call(Assembler::RAX);
+    }
+
+    static void emit_step(Assembler& a, uint32_t ip, uint32_t inst, const uint8_t* leave,
+            uint64_t (*step)(VirtualMachine*, uint32_t, uint32_t)) {
+        emit_helper(a, ip, inst, step);
+        a.test_rax();
+        a.jcc(Assembler::NE, leave);
+    }
+
+    // goes where the Transfer a helper returned says
+    static void emit_transfer(Assembler& a, const uint8_t* leave_rdx) {
+        a.test_rax();
+        a.jcc(Assembler::E, leave_rdx);
+        a.mov(Assembler::RBX, Assembler::RDX);
+        a.jmp(Assembler::RAX);
+    }
+
+    static void emit_exit(Assembler& a, uint64_t word, const uint8_t* leave) {
+        a.mov_imm64(Assembler::RAX, word);
+        a.jmp(leave);
+    }
+
+    /* enter_ and leave_, made once before the first native code: saves the
+     * callee saved registers native code uses and jumps to the target */
+    bool Jit::trampoline() {
+        using A = Assembler;
+        if (enter_ != nullptr)
+            return true;
+        A t;
+        for (A::Reg r : {A::RBX, A::R12, A::R13, A::R14, A::R15})
+            t.push(r);
+        t.mov(A::RBX, A::RDI);
+        t.mov(A::R12, A::RCX);
+        t.mov(A::R13, A::RSI);
+        t.jmp(A::RDX);
+        int leave_rdx = t.new_label();
+        t.bind(leave_rdx);
+        t.mov(A::RAX, A::RDX);
+        int leave = t.new_label();
+        t.bind(leave);
+        for (A::Reg r : {A::R15, A::R14, A::R13, A::R12, A::RBX})
+            t.pop(r);
+        t.ret();
+        const uint8_t* base = t.link(arena_);
+        if (base == nullptr)
+            return false;
+        enter_ = base;
+        leave_ = t.label_addr(base, leave);
+        leave_rdx_ = t.label_addr(base, leave_rdx);
+        return true;
+    }
+
+    /* Instructions are laid out in bytecode order, each behind a label the
+     * interpreter can enter at. Fast paths fall through to the next
+     * instruction, what their guards branch to - the double variant of an
+     * int fast path, a call to step() or the budget exit of a backward jump
+     * - is cold and placed after the last instruction. */
+    bool Jit::compile(const Prototype* proto) {
+        using A = Assembler;
+        Compiled& c = protos_[proto->id];
+        c.failed = true;
+        stats_.failed++;
+
+        if (!trampoline())
+            return false;
+
+        std::span<const uint32_t> code = proto->code();
+        const size_t n = code.size();
+        constexpr int32_t TAG = BoltValue::TAG_WORD_OFFSET;
+        A a;
+        std::vector<int> at(n + 1);
+        for (int& l : at)
+            l = a.new_label();
+        std::vector<std::function<void()>> cold;
+
+        auto jump_target = [&](size_t i, int32_t offset, size_t& target) {
+            int64_t t = static_cast<int64_t>(i) + 1 + offset;
+            if (t < 0 || t > static_cast<int64_t>(n))
+                return false;
+            target = t;
+            return true;
+        };
+        // the interpreter charges a taken backward jump the distance it goes back
+        auto charge = [&](int32_t offset, size_t target) {
+            if (offset >= 0)
+                return;
+            int yield = a.new_label();
+            a.sub64_imm32(A::R13, 0, -offset);
+            a.jcc(A::LE, yield);
+            cold.push_back([&a, yield, target, this] {
+                a.bind(yield);
+                emit_exit(a, exit_word(target, Interrupt::Yield), leave_);
+            });
+        };
+        // a taken backward jump also counts towards tracing the loop it closes
+        auto jump = [&](int32_t offset, size_t target) {
+            charge(offset, target);
+            if (offset < 0 && trace_threshold_ != TRACE_OFF) {
+                int32_t reset = std::min<uint32_t>(trace_threshold_, INT32_MAX);
+                int32_t* counter = &loop_counters_.emplace_back(reset);
+                int hot = a.new_label();
+                a.mov_imm64(A::RAX, reinterpret_cast<uintptr_t>(counter));
+                a.dec32(A::RAX, 0);
+                a.jcc(A::LE, hot);
+                cold.push_back([&a, hot, target, reset, this] {
+                    a.bind(hot);
+                    a.store_imm32(A::RAX, 0, reset);
+                    emit_helper(a, target, 0, hot_loop);
+                    emit_transfer(a, leave_rdx_);
+                });
+            }
+            a.jmp(at[target]);
+        };
+        // a label that runs instruction i in the interpreter and goes on after it
+        auto slow_path = [&](size_t i) {
+            int slow = a.new_label();
+            cold.push_back([&a, &at, slow, i, inst = code[i], this] {
+                a.bind(slow);
+                emit_step(a, i, inst, leave_, step);
+                a.jmp(at[i + 1]);
+            });
+            return slow;
+        };
+        auto copy_value = [&](A::Reg src_base, int32_t src, int32_t dst, A::Reg scratch) {
+            emit_copy_value(a, src_base, src, A::RBX, dst, scratch);
+        };
+        auto guard_double = [&a](A::Reg base, int32_t disp, int fail) {
+            emit_guard_double(a, base, disp, fail);
+        };
+        /* a compare followed by a forward jump on its result decides the
+         * jump right away, the slow path still falls into the jump */
+        auto fused_target = [&](size_t i, uint8_t rd, size_t& target) {
+            return i + 1 < n && VirtualMachine::decode_op(code[i + 1]) == Opcode::OpJmpIfFalse
+                && VirtualMachine::decode_rd(code[i + 1]) == rd
+                && VirtualMachine::decode_offset16(code[i + 1]) >= 0
+                && jump_target(i + 1, VirtualMachine::decode_offset16(code[i + 1]), target);
+        };
+        auto store_bool = [&](A::Cond cc, size_t i, uint8_t rd) {
+            a.set_eax(cc);
+            a.store32(A::RBX, operand(rd), A::RAX);
+            a.store_imm32(A::RBX, operand(rd) + TAG, BoltValue::BOOL_TAG_WORD);
+            size_t target;
+            if (fused_target(i, rd, target)) {
+                a.jcc(A::negate(cc), at[target]);
+                a.jmp(at[i + 2]);
+            }
+        };
+        // xmm = the number at [rbx + disp], an int converted the way to_double() does
+        auto load_number = [&](int xmm, int32_t disp, int slow) {
+            int not_int = a.new_label(), done = a.new_label();
+            a.cmp_imm32(A::RBX, disp + TAG, BoltValue::INT_TAG_WORD);
+            a.jcc(A::NE, not_int);
+            a.cvtsi2sd(xmm, A::RBX, disp);
+            a.jmp(done);
+            a.bind(not_int);
+            guard_double(A::RBX, disp, slow);
+            a.movsd_load(xmm, A::RBX, disp);
+            a.bind(done);
+        };
+        /* any two numbers as doubles, which is what the interpreter does
+         * unless both are ints. k is the constant operand of an RK form. */
+        auto number_path = [&](size_t i, Opcode op, uint8_t rd, uint8_t rt, uint8_t rs, const BoltValue* k, int slow) {
+            load_number(0, operand(rt), slow);
+            if (k != nullptr) {
+                a.mov_imm64(A::RAX, std::bit_cast<uint64_t>(k->to_double()));
+                a.movq(1, A::RAX);
+            } else {
+                load_number(1, operand(rs), slow);
+            }
+            if (is_compare(op)) {
+                bool swap;
+                A::Cond cc = double_condition(op, swap);
+                if (swap)
+                    a.ucomisd(1, 0);
+                else
+                    a.ucomisd(0, 1);
+                store_bool(cc, i, rd);
+                return;
+            }
+            switch(op) {
+                case Opcode::OpAdd: case Opcode::OpAddRK: a.addsd(0, 1); break;
+                case Opcode::OpSub: case Opcode::OpSubRK: a.subsd(0, 1); break;
+                case Opcode::OpMul: case Opcode::OpMulRK: a.mulsd(0, 1); break;
+                default: a.divsd(0, 1); break;
+            }
+            // leaves canonicalizing a NaN to from_double
+            a.ucomisd(0, 0);
+            a.jcc(A::P, slow);
+            a.movsd_store(0, A::RBX, operand(rd));
+            if (BoltValue::DOUBLE_TAG_WORD_STORED)
+                a.store_imm32(A::RBX, operand(rd) + TAG, BoltValue::DOUBLE_TAG_WORD_MIN);
+        };
+
+        for (size_t i = 0; i < n; i++) {
+            a.bind(at[i]);
+            uint32_t inst = code[i];
+            Opcode op = VirtualMachine::decode_op(inst);
+            uint8_t rd = VirtualMachine::decode_rd(inst);
+            uint8_t rt = VirtualMachine::decode_rt(inst);
+            uint8_t rs = VirtualMachine::decode_rs(inst);
+
+            switch(op) {
+                case Opcode::OpMov:
+                    copy_value(A::RBX, operand(rt), operand(rd), A::RAX);
+                    break;
+
+                case Opcode::OpConst: {
+                    const BoltValue& k = proto->consts[inst >> 16];
+                    if (k.is_int()) {
+                        a.store_imm32(A::RBX, operand(rd), k.as_int());
+                        a.store_imm32(A::RBX, operand(rd) + TAG, BoltValue::INT_TAG_WORD);
+                    } else {
+                        a.mov_imm64(A::RAX, reinterpret_cast<uintptr_t>(&k));
+                        copy_value(A::RAX, 0, operand(rd), A::RCX);
+                    }
+                    break;
+                }
+
+                /* ints inline, other numbers out of line: the fast paths the
+                 * interpreter quickens to. An int result that overflows or a
+                 * quotient that is not whole takes the number path as well. */
+                case Opcode::OpAdd: case Opcode::OpSub: case Opcode::OpMul: case Opcode::OpDiv:
+                case Opcode::OpAddRK: case Opcode::OpSubRK: case Opcode::OpMulRK: case Opcode::OpDivRK:
+                case Opcode::OpLt: case Opcode::OpLte: case Opcode::OpBt: case Opcode::OpBte:
+                case Opcode::OpEq: case Opcode::OpNe:
+                case Opcode::OpLtRK: case Opcode::OpLteRK: case Opcode::OpBtRK: case Opcode::OpBteRK:
+                case Opcode::OpEqRK: case Opcode::OpNeRK: {
+                    const BoltValue* k = nullptr;
+                    if (op >= Opcode::OpAddRK && op <= Opcode::OpNeRK)
+                        k = &proto->consts[rs];
+                    bool is_div = op == Opcode::OpDiv || op == Opcode::OpDivRK;
+                    bool is_eq = op == Opcode::OpEq || op == Opcode::OpNe || op == Opcode::OpEqRK || op == Opcode::OpNeRK;
+                    // dividing by 0 or -1 is left to the interpreter's error and overflow handling
+                    bool int_path = (k == nullptr || k->is_int())
+                        && !(is_div && k != nullptr && (k->as_int() == 0 || k->as_int() == -1));
+                    // ucomisd cannot tell equal from unordered on its own
+                    bool num_path = !is_eq && (k == nullptr || k->is_number());
+                    if (!int_path && !num_path) {
+                        emit_step(a, i, inst, leave_, step);
+                        break;
+                    }
+                    int slow = slow_path(i);
+                    if (!int_path) {
+                        // an int divided by an int 0 or -1 must not become a double
+                        if (is_div && k->is_int()) {
+                            a.cmp_imm32(A::RBX, operand(rt) + TAG, BoltValue::INT_TAG_WORD);
+                            a.jcc(A::E, slow);
+                        }
+                        number_path(i, op, rd, rt, rs, k, slow);
+                        break;
+                    }
+
+                    int num = slow;
+                    if (num_path) {
+                        num = a.new_label();
+                        cold.push_back([=, &a, &at, &number_path] {
+                            a.bind(num);
+                            number_path(i, op, rd, rt, rs, k, slow);
+                            a.jmp(at[i + 1]);
+                        });
+                    }
+                    a.cmp_imm32(A::RBX, operand(rt) + TAG, BoltValue::INT_TAG_WORD);
+                    a.jcc(A::NE, num);
+                    if (k == nullptr) {
+                        a.cmp_imm32(A::RBX, operand(rs) + TAG, BoltValue::INT_TAG_WORD);
+                        a.jcc(A::NE, num);
+                    }
+                    uint32_t imm = k != nullptr ? k->as_int() : 0;
+                    a.load32(A::RAX, A::RBX, operand(rt));
+                    if (is_compare(op)) {
+                        if (k != nullptr)
+                            a.cmp_eax(imm);
+                        else
+                            a.cmp_eax(A::RBX, operand(rs));
+                        store_bool(condition(op), i, rd);
+                        break;
+                    }
+                    if (is_div) {
+                        if (k != nullptr) {
+                            a.mov_imm32(A::RCX, imm);
+                        } else {
+                            a.load32(A::RCX, A::RBX, operand(rs));
+                            a.test_ecx();
+                            a.jcc(A::E, slow);
+                            a.cmp_ecx(static_cast<uint32_t>(-1));
+                            a.jcc(A::E, slow);
+                        }
+                        a.cdq();
+                        a.idiv_ecx();
+                        a.test_edx();
+                        a.jcc(A::NE, num);
+                    } else {
+                        switch(op) {
+                            case Opcode::OpAdd: a.add_eax(A::RBX, operand(rs)); break;
+                            case Opcode::OpSub: a.sub_eax(A::RBX, operand(rs)); break;
+                            case Opcode::OpMul: a.imul_eax(A::RBX, operand(rs)); break;
+                            case Opcode::OpAddRK: a.add_eax(imm); break;
+                            case Opcode::OpSubRK: a.sub_eax(imm); break;
+                            default: a.imul_eax(imm); break;
+                        }
+                        a.jcc(A::O, num);
+                    }
+                    a.store32(A::RBX, operand(rd), A::RAX);
+                    a.store_imm32(A::RBX, operand(rd) + TAG, BoltValue::INT_TAG_WORD);
+                    break;
+                }
+
+                case Opcode::OpJmp: {
+                    size_t target;
+                    int32_t offset = VirtualMachine::decode_offset24(inst);
+                    if (!jump_target(i, offset, target))
+                        return false;
+                    jump(offset, target);
+                    break;
+                }
+
+                case Opcode::OpJmpIfFalse: {
+                    size_t target;
+                    int32_t offset = VirtualMachine::decode_offset16(inst);
+                    if (!jump_target(i, offset, target))
+                        return false;
+                    a.cmp_imm32(A::RBX, operand(rd) + TAG, BoltValue::BOOL_TAG_WORD);
+                    a.jcc(A::NE, at[i + 1]);
+                    a.cmp_imm8(A::RBX, operand(rd), 0);
+                    a.jcc(A::NE, at[i + 1]);
+                    jump(offset, target);
+                    break;
+                }
+
+                case Opcode::OpGetUpval:
+                    emit_upval_location(a, rt);
+                    copy_value(A::RAX, 0, operand(rd), A::RCX);
+                    break;
+
+                case Opcode::OpCall:
+                case Opcode::OpTailCall:
+                case Opcode::OpRet:
+                    if (op == Opcode::OpCall)
+                        emit_helper(a, i, inst, transfer<Opcode::OpCall>);
+                    else if (op == Opcode::OpTailCall)
+                        emit_helper(a, i, inst, transfer<Opcode::OpTailCall>);
+                    else
+                        emit_helper(a, i, inst, transfer<Opcode::OpRet>);
+                    emit_transfer(a, leave_rdx_);
+                    break;
+
+                default:
+                    emit_step(a, i, inst, leave_, step);
+                    break;
+            }
+        }
+        // running off the end is the interpreter's business as well
+        a.bind(at[n]);
+        emit_exit(a, exit_word(n, Interrupt::Ok), leave_);
+
+        for (auto& block : cold)
+            block();
+
+        const uint8_t* base = a.link(arena_);
+        if (base == nullptr)
+            return false;
+        c.native.resize(n + 1);
+        for (size_t i = 0; i <= n; i++)
+            c.native[i] = a.label_addr(base, at[i]);
+        c.failed = false;
+        stats_.failed--;
+        stats_.compiled++;
+        stats_.code_bytes += a.size();
+        return true;
+    }
+}
+
+#endif
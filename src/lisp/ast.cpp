@@ -1,6 +1,7 @@
 #include "lisp/ast.hpp"
 #include <cassert>
 #include <format>
+#include <stdexcept>
 #include <string>
 
 namespace Lisp {
@@ -16,10 +17,32 @@ namespace Lisp {
     }
 
     void Scope::insert(const std::string id, Symbol sym) {
-        if (sym.type == SymbolType::Variable)
+        if (sym.type == SymbolType::Variable) {
+            auto it = symbol_table.find(id);
+            if (it != symbol_table.end() && it->second.type == SymbolType::Variable)
+                return;
             n_vars++;
+        }
         symbol_table[id] = sym;
     }
+
+    int Scope::find_upval(const std::string& name) const {
+        for (size_t i = 0; i < upvals.size(); i++) {
+            if (upvals[i].name == name)
+                return i;
+        }
+        return -1;
+    }
+
+    int Scope::add_upval(const std::string& name, bool in_stack, uint8_t index) {
+        int i = find_upval(name);
+        if (i >= 0)
+            return i;
+        if (upvals.size() > UINT8_MAX)
+            throw std::runtime_error("too many captured variables");
+        upvals.push_back({name, in_stack, index});
+        return upvals.size() - 1;
+    }
     
 
     StringAtom::StringAtom(std::string value)  {
@@ -298,6 +321,33 @@ namespace Lisp {
 
     }
 
+    SetExpr::SetExpr() { type_ = NodeType::Set; }
+
+    const std::string& SetExpr::get_id() const {
+        return id_;
+    }
+
+    const ASTNode* SetExpr::get_expr() const {
+        return expr_.get();
+    }
+
+    void SetExpr::set_id(std::string id) {
+        id_ = std::move(id);
+    }
+
+    void SetExpr::set_expr(std::unique_ptr<ASTNode> expr) {
+        expr_ = std::move(expr);
+    }
+
+    const std::string SetExpr::print() const {
+        std::string res = "( set! ";
+        res += id_ + " ";
+        res += expr_->print() + " )";
+
+        return res;
+
+    }
+
     ProcCall::ProcCall() { type_ = NodeType::ProcCall; }
 
     void ProcCall::add_arg(std::unique_ptr<ASTNode> arg) {
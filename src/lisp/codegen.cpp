@@ -1,5 +1,7 @@
 #include "bolt_virtual_machine/vm.hpp"
+#include <bit>
 #include <cstdint>
+#include <cstring>
 #include <format>
 #include <lisp/codegen.hpp>
 #include <bolt_virtual_machine/emitter.h>
@@ -9,116 +11,338 @@ namespace Lisp {
 
     const std::vector<std::unique_ptr<BVM::Prototype>>& Compiler::get_objs() { return func_objs_; }
 
-    Compiler::Compiler(std::string filename) {
+    std::vector<std::unique_ptr<BVM::Prototype>> Compiler::release_objs() { return std::move(func_objs_); }
+
+    Compiler::Compiler(std::string filename, CompilerOptions options)
+            : options_(options), inliner_(options.inline_size, options.inline_depth) {
         out_.open(filename, std::ios::binary);
     }
 
+    const std::unordered_map<NativeFunc, BinopEncoding> binops = {
+        {NativeFunc::Add, {BVM::Emitter::add, BVM::Emitter::add_rk, true, NativeFunc::Add}},
+        {NativeFunc::Sub, {BVM::Emitter::sub, BVM::Emitter::sub_rk, false}},
+        {NativeFunc::Mul, {BVM::Emitter::mul, BVM::Emitter::mul_rk, true, NativeFunc::Mul}},
+        {NativeFunc::Div, {BVM::Emitter::div, BVM::Emitter::div_rk, false}},
+        {NativeFunc::Lt, {BVM::Emitter::lt, BVM::Emitter::lt_rk, true, NativeFunc::Bt}},
+        {NativeFunc::Lte, {BVM::Emitter::lte, BVM::Emitter::lte_rk, true, NativeFunc::Bte}},
+        {NativeFunc::Bt, {BVM::Emitter::bt, BVM::Emitter::bt_rk, true, NativeFunc::Lt}},
+        {NativeFunc::Bte, {BVM::Emitter::bte, BVM::Emitter::bte_rk, true, NativeFunc::Lte}},
+        {NativeFunc::Eq, {BVM::Emitter::eq, BVM::Emitter::eq_rk, true, NativeFunc::Eq}},
+        {NativeFunc::Ne, {BVM::Emitter::ne, BVM::Emitter::ne_rk, true, NativeFunc::Ne}},
+    };
+
+    static inline bool is_literal(const ASTNode* node) {
+        if (node->get_type() != NodeType::Atomic)
+            return false;
+        SExprType type = static_cast<const AtomicNode*>(node)->get_value()->get_type();
+        return type == SExprType::IntLiteral || type == SExprType::FloatLiteral || type == SExprType::BoolLiteral;
+    }
+
+    static inline bool is_symbol(const ASTNode* node) {
+        return node->get_type() == NodeType::Atomic
+            && static_cast<const AtomicNode*>(node)->get_value()->get_type() == SExprType::SymbolLiteral;
+    }
+
+    static inline const std::string& symbol_name(const ASTNode* node) {
+        return static_cast<const SymbolAtom*>(static_cast<const AtomicNode*>(node)->get_value())->get_value();
+    }
+
+    /* a name is read from a register of the running lambda unless the
+     * analyzer made it an upvalue, which has to be loaded first */
+    bool Compiler::reads_in_place(const ASTNode* node) const {
+        if (!is_symbol(node))
+            return false;
+        const std::string& name = symbol_name(node);
+        return in_register(name) || active_scopes_.top()->find_upval(name) < 0;
+    }
+
+    const Scope* Compiler::current_scope() const {
+        return inlined_.empty() ? active_scopes_.top() : inlined_.back().first;
+    }
+
+    /* what an inlined lambda reads from the lambdas around it the active
+     * one reads too, Inliner::expand makes sure of that */
+    bool Compiler::in_register(const std::string& name) const {
+        if (!inlined_.empty() && inlined_.back().first->symbol_table.contains(name))
+            return true;
+        return active_scopes_.top()->symbol_table.contains(name);
+    }
+
+    unsigned int Compiler::var_reg(const std::string& name) const {
+        if (!inlined_.empty() && inlined_.back().first->symbol_table.contains(name))
+            return inlined_.back().first->symbol_table.at(name).reg + inlined_.back().second;
+        return active_scopes_.top()->lookup(name)->reg;
+    }
+
 
     void Compiler::compile(const Lambda* program) {
         compile_lambda(program);
+        std::vector<uint8_t> image = serialize();
+        out_.write(reinterpret_cast<const char*>(image.data()), image.size());
+        out_.flush();
+    }
 
-        // write functions to output
-        size_t n_protos = func_objs_.size();
-        out_.write(reinterpret_cast<const char*>(&n_protos), 8);
-        for (auto& f : func_objs_) {
-            int n_consts = f->consts.size();
-            long n_insts = f->instructions.size();
-            out_.write(reinterpret_cast<const char*>(&f->next_reg), 4);
-            out_.write(reinterpret_cast<const char*>(&n_consts), 4);
+    static BVM::ConstRecord serialize_const(BVM::BoltValue v) {
+        BVM::ConstRecord c = {.type = static_cast<uint32_t>(v.get_type()), .reserved = 0, .payload = 0};
+        switch(v.get_type()) {
+            case BVM::BoltType::Boolean:
+                c.payload = v.as_bool();
+                break;
+            case BVM::BoltType::Float:
+                c.payload = std::bit_cast<uint64_t>(v.as_double());
+                break;
+            case BVM::BoltType::Integer:
+                c.payload = static_cast<uint64_t>(static_cast<int64_t>(v.as_int()));
+                break;
+            case BVM::BoltType::Nil:
+                break;
+            default:
+                throw std::runtime_error("compile: constant type not serializable");
+        }
+        return c;
+    }
+
+    /* Builds the whole image in one zeroed buffer: the layout is computed up
+     * front so every section is copied straight to its final offset and the
+     * padding between sections is already in place. */
+    std::vector<uint8_t> Compiler::serialize() const {
+        const uint32_t n_protos = func_objs_.size();
+        uint32_t n_sections = 0;
+        for (auto& f : func_objs_)
+            n_sections += f->upvals.empty() ? 3 : 4;
+        std::vector<BVM::SectionEntry> sections;
+        std::vector<uint32_t> first(n_protos); // index of each prototype's Proto section
+        sections.reserve(n_sections);
+        uint64_t offset = BVM::align_section(sizeof(BVM::FileHeader) + n_sections * sizeof(BVM::SectionEntry));
+        for (uint32_t i = 0; i < n_protos; i++) {
+            const BVM::Prototype* f = func_objs_[i].get();
+            uint64_t sizes[] = {
+                sizeof(BVM::ProtoRecord),
+                f->consts.size() * sizeof(BVM::ConstRecord),
+                f->instructions.size() * sizeof(uint32_t),
+                f->upvals.size() * sizeof(BVM::UpvalRecord),
+            };
+            BVM::SectionKind kinds[] = {BVM::SectionKind::Proto, BVM::SectionKind::Consts, BVM::SectionKind::Code,
+                BVM::SectionKind::Upvals};
+            first[i] = sections.size();
+            for (int s = 0; s < (f->upvals.empty() ? 3 : 4); s++) {
+                sections.push_back({.kind = kinds[s], .proto = i, .offset = offset, .size = sizes[s]});
+                offset = BVM::align_section(offset + sizes[s]);
+            }
+        }
+
+        std::vector<uint8_t> image(offset);
+        uint8_t* base = image.data();
+        std::memcpy(base + sizeof(BVM::FileHeader), sections.data(), n_sections * sizeof(BVM::SectionEntry));
+        for (uint32_t i = 0; i < n_protos; i++) {
+            const BVM::Prototype* f = func_objs_[i].get();
+            const BVM::SectionEntry* own = &sections[first[i]];
+            BVM::ProtoRecord rec = {
+                .arity = f->arity,
+                .n_locals = f->n_locals,
+                .next_reg = f->next_reg,
+                .n_consts = static_cast<uint32_t>(f->consts.size()),
+            };
+            std::memcpy(base + own[0].offset, &rec, sizeof(rec));
+
+            uint8_t* consts = base + own[1].offset;
             for (auto v : f->consts) {
-                out_.write(reinterpret_cast<const char*>(&v.type), 4);
-                switch(v.type) {
-                    case BVM::BoltType::Boolean:
-                        out_.write(reinterpret_cast<const char*>(&v.as_bool), 1);
-                        break;
-                    case BVM::BoltType::Float:
-                        out_.write(reinterpret_cast<const char*>(&v.as_double), sizeof(double));
-                        break;
-                    case BVM::BoltType::Integer:
-                        out_.write(reinterpret_cast<const char*>(&v.as_int), sizeof(int));
-                        break;
-                    default:
-                        std::runtime_error("compile: not Implemented");
-                }
+                BVM::ConstRecord c = serialize_const(v);
+                std::memcpy(consts, &c, sizeof(c));
+                consts += sizeof(c);
             }
-            out_.write(reinterpret_cast<const char*>(&n_insts), 8);
-            for ( uint32_t inst : f->instructions) {
-                out_.write(reinterpret_cast<const char*>(&inst), 4);
+
+            std::memcpy(base + own[2].offset, f->instructions.data(), own[2].size);
+
+            uint8_t* upvals = f->upvals.empty() ? nullptr : base + own[3].offset;
+            for (auto desc : f->upvals) {
+                BVM::UpvalRecord u = {.in_stack = desc.in_stack, .index = desc.index};
+                std::memcpy(upvals, &u, sizeof(u));
+                upvals += sizeof(u);
             }
         }
+
+        BVM::Checksum checksum;
+        checksum.update(base + sizeof(BVM::FileHeader), offset - sizeof(BVM::FileHeader));
+        BVM::FileHeader header = {
+            .magic = {},
+            .version = BVM::BOLT_VERSION,
+            .header_size = sizeof(BVM::FileHeader),
+            .n_protos = n_protos,
+            .n_sections = n_sections,
+            .file_size = offset,
+            .checksum = checksum.digest(),
+        };
+        std::memcpy(header.magic, BVM::BOLT_MAGIC, sizeof(header.magic));
+        std::memcpy(base, &header, sizeof(header));
+        return image;
     }
 
-    unsigned int Compiler::compile_expr(const ASTNode* node) {
-        auto fo = active_objs_.top();
+    unsigned int Compiler::compile_expr(const ASTNode* node, bool tail) {
         auto scope = active_scopes_.top();
         unsigned int reg;
         if (node->get_type() == NodeType::Atomic) {
             const AtomicNode* atom = static_cast<const AtomicNode*>(node);
             if (atom->get_value()->get_type() != SExprType::SymbolLiteral)
-                reg = fo->next_reg++;
+                reg = alloc_reg();
+            else if (reads_in_place(atom))
+                reg = var_reg(symbol_name(atom));
             else {
-                const std::string& name = static_cast<const StringAtom*>(atom->get_value())->get_value();
-                reg = scope->lookup(name)->reg;
+                reg = alloc_reg();
+                active_objs_.top()->instructions.push_back(BVM::Emitter::get_upval(reg, scope->find_upval(symbol_name(atom))));
             }
             compile_atom(atom);
         }
         else {
-            reg = fo->next_reg++;
-            compile_list(node);
+            reg = alloc_reg();
+            compile_list(node, tail);
         }
         return reg;
     }
+    /* (set! var expr) writes the variable's own register or, for a captured
+     * one, the upvalue it is shared through */
+    void Compiler::compile_set(const SetExpr* node) {
+        auto fo = active_objs_.top();
+        auto scope = active_scopes_.top();
+        const ASTNode* expr = node->get_expr();
+        unsigned int r1 = compile_expr(expr);
+        if (in_register(node->get_id()))
+            fo->instructions.push_back(BVM::Emitter::mov(var_reg(node->get_id()), r1));
+        else
+            fo->instructions.push_back(BVM::Emitter::set_upval(r1, scope->find_upval(node->get_id())));
+        dealloc_expr(expr);
+    }
+
     /* (define var expr) */
     void Compiler::compile_define(const Define* node) {
         auto fo = active_objs_.top();
         unsigned int r1;
-        auto scope = active_scopes_.top();
         const ASTNode* expr = node->get_expr();
         r1 = compile_expr(expr);
-        uint8_t dst = scope->lookup(node->get_id())->reg;
+        uint8_t dst = var_reg(node->get_id());
         fo->instructions.push_back(BVM::Emitter::mov(dst, r1));
         dealloc_expr(expr);
     }
 
+    /* A nested lambda is compiled into its own prototype and evaluates to
+     * a closure over it, created in the register compile_expr allocated for
+     * it in the enclosing lambda. */
     void Compiler::compile_lambda(const Lambda* node) {
+        BVM::Prototype* parent = active_objs_.empty() ? nullptr : active_objs_.top();
+        uint16_t id = compile_prototype(node);
+        if (parent)
+            parent->instructions.push_back(BVM::Emitter::closure(parent->next_reg - 1, id));
+    }
+
+    uint16_t Compiler::compile_prototype(const Lambda* node) {
+        size_t id = func_objs_.size();
+        if (id > UINT16_MAX)
+            throw std::runtime_error("compile: too many lambdas");
         auto nfo = std::make_unique<BVM::Prototype>();
         auto& params = node->get_parameters();
         int arity = params.size();
         int n_locals = node->get_const_scope().symbol_table.size();
         BVM::Prototype* ptr = nfo.get();
+        ptr->arity = arity;
         ptr->n_locals = n_locals;
+        for (auto& up : node->get_const_scope().upvals)
+            ptr->upvals.push_back({up.in_stack, up.index});
 
+        active_objs_.push(ptr);
+        const_indices_.emplace();
+        active_scopes_.push(&node->get_const_scope());
+        frame_sizes_.push(0);
+        func_objs_.push_back(std::move(nfo));
+        inliner_.scan(node);
+        if (options_.ssa && ssa_supported(node))
+            compile_ssa(node);
+        else
+            compile_body(node);
+        if (options_.peephole) {
+            auto add = [this](BVM::BoltValue v) { return add_const(v); };
+            peephole_stats_.push_back(peephole(*ptr, id, captured_registers(ptr), add));
+        }
+        inliner_.compiled(node);
+        frame_sizes_.pop();
+        active_scopes_.pop();
+        const_indices_.pop();
+        active_objs_.pop();
+        return id;
+    }
+
+    void Compiler::compile_body(const Lambda* node) {
+        BVM::Prototype* ptr = active_objs_.top();
         // pre-allocate virtual registers for variables
         for (auto&[_, v]: node->get_const_scope().symbol_table) {
             if (v.type == SymbolType::Variable)
                 ptr->next_reg++;
         }
+        frame_sizes_.top() = ptr->next_reg;
 
-        active_objs_.push(ptr);
-        active_scopes_.push(&node->get_const_scope());
-        func_objs_.push_back(std::move(nfo));
+        // the value of the last expression is the value of the lambda
+        auto& exprs = node->get_exprs();
+        for (size_t i = 0; i < exprs.size(); i++) {
+            bool last = i + 1 == exprs.size();
+            unsigned int reg = compile_expr(exprs[i].get(), last);
+            if (last)
+                ptr->instructions.push_back(BVM::Emitter::ret(reg));
+            else
+                dealloc_expr(exprs[i].get());
+        }
+        if (exprs.empty()) {
+            unsigned int reg = alloc_reg();
+            ptr->instructions.push_back(BVM::Emitter::load_const(reg, add_const(BVM::BoltValue::nil())));
+            ptr->instructions.push_back(BVM::Emitter::ret(reg));
+        }
+
+        ptr->next_reg = std::max(frame_sizes_.top(), ptr->arity + ptr->n_locals);
+    }
 
-        for (auto& e : node->get_exprs()) {
-            compile_expr(e.get());
+    /* Nested lambdas are compiled while the SSA form is built. Captured
+     * variables move to the registers build_ssa packs them into, so the
+     * upvalues of the lambdas right inside that point at them move along. */
+    void Compiler::compile_ssa(const Lambda* node) {
+        BVM::Prototype* ptr = active_objs_.top();
+        SsaFunction fn = build_ssa(node, [this](const Lambda* nested) { return compile_prototype(nested); }, &inliner_);
+        for (uint16_t child : fn.children) {
+            for (auto& desc : func_objs_[child]->upvals) {
+                if (desc.in_stack)
+                    desc.index = fn.pin_of[desc.index];
+            }
         }
-        
-        ptr->next_reg = arity + n_locals;
-        active_objs_.pop();
+        optimize(fn, ssa_stats_);
+        lower_ssa(fn, *ptr, [this](BVM::BoltValue v) { return add_const(v); });
+    }
+
+    RegisterSet Compiler::captured_registers(const BVM::Prototype* proto) const {
+        RegisterSet captured;
+        for (uint32_t inst : proto->instructions) {
+            if (BVM::VirtualMachine::decode_op(inst) != BVM::Opcode::OpClosure)
+                continue;
+            for (auto& desc : func_objs_[inst >> 16]->upvals) {
+                if (desc.in_stack)
+                    captured.set(desc.index);
+            }
+        }
+        return captured;
     }
 
-    void Compiler::compile_list(const ASTNode* node) {
+    void Compiler::compile_list(const ASTNode* node, bool tail) {
         switch(node->get_type()) {
             case NodeType::Define:
                 compile_define(static_cast<const Define*>(node));
                 break;
             case NodeType::IfExpr:
-                compile_if(static_cast<const IfExpr*>(node));
+                compile_if(static_cast<const IfExpr*>(node), tail);
                 break;
             case NodeType::Lambda:
                 compile_lambda(static_cast<const Lambda*>(node));
                 break;
             case NodeType::ProcCall:
-                compile_proc_call(static_cast<const ProcCall*>(node));
+                compile_proc_call(static_cast<const ProcCall*>(node), tail);
+                break;
+            case NodeType::Set:
+                compile_set(static_cast<const SetExpr*>(node));
                 break;
             default:
                 throw std::runtime_error("compile_list: Not Implemented");
@@ -126,46 +350,52 @@ namespace Lisp {
 
     }
 
-    void Compiler::compile_atom(const AtomicNode* node) {
-        auto fo = active_objs_.top();
-        uint32_t inst;
-        BVM::BoltValue value;
+    BVM::BoltValue Compiler::atom_value(const AtomicNode* node) const {
         switch(node->get_value()->get_type()) {
             case SExprType::BoolLiteral:
-                value.as_bool = static_cast<const BoolAtom*>(node->get_value())->get_value();
-                value.type = BVM::BoltType::Boolean;
-                break;
+                return BVM::BoltValue::from_bool(static_cast<const BoolAtom*>(node->get_value())->get_value());
             case SExprType::FloatLiteral:
-                value.as_double= static_cast<const FloatAtom*>(node->get_value())->get_value();
-                value.type = BVM::BoltType::Float;
-                break;
+                return BVM::BoltValue::from_double(static_cast<const FloatAtom*>(node->get_value())->get_value());
             case SExprType::IntLiteral:
-                value.as_int = static_cast<const IntAtom*>(node->get_value())->get_value();
-                value.type = BVM::BoltType::Integer;
-                break;
-            case SExprType::SymbolLiteral:
-                return;
+                return BVM::BoltValue::from_int(static_cast<const IntAtom*>(node->get_value())->get_value());
             default:
                 throw std::logic_error("unsupported atomic value");
         }
-        size_t n_consts = fo->consts.size();
-        size_t i;
+    }
 
-        // linear search is terrible but boltvalue is not hashable (yet)
-        for (i = 0; i < n_consts; i++) {
-            if (fo->consts[i] == value)
-                break;
-        }
+    bool SameConstant::operator()(BVM::BoltValue a, BVM::BoltValue b) const {
+        if (a.is_double() && b.is_double())
+            return std::bit_cast<uint64_t>(a.as_double()) == std::bit_cast<uint64_t>(b.as_double());
+        return a == b;
+    }
 
-        if (i == n_consts) {
+    size_t Compiler::add_const(BVM::BoltValue value) {
+        auto fo = active_objs_.top();
+        auto [it, added] = const_indices_.top().try_emplace(value, fo->consts.size());
+        if (added)
             fo->consts.push_back(value);
-        }
+        return it->second;
+    }
 
-        inst = BVM::Emitter::load_const(fo->next_reg - 1, i);
-        fo->instructions.push_back(inst);
+    void Compiler::compile_atom(const AtomicNode* node) {
+        auto fo = active_objs_.top();
+        if (node->get_value()->get_type() == SExprType::SymbolLiteral)
+            return;
+        size_t i = add_const(atom_value(node));
+        fo->instructions.push_back(BVM::Emitter::load_const(fo->next_reg - 1, i));
     }
 
-    void Compiler::compile_if(const IfExpr* node) {
+    /* cond
+     * jmp_false r1, else
+     * texpr
+     * mov if_reg, r2
+     * jmp end
+     * else: fexpr
+     * mov if_reg, r3
+     * end:
+     * both branches inherit the tail position of the if, the condition never
+     * has it */
+    void Compiler::compile_if(const IfExpr* node, bool tail) {
         auto fo = active_objs_.top();
         unsigned int r1, r2, r3, if_reg = fo->next_reg - 1;
         size_t if_pos, else_pos;
@@ -174,38 +404,147 @@ namespace Lisp {
         // reserve space for the instruction
         fo->instructions.push_back(0);
         if_pos = fo->instructions.size();
-        r2 = compile_expr(node->get_texpr());
+        r2 = compile_expr(node->get_texpr(), tail);
+        fo->instructions.push_back(BVM::Emitter::mov(if_reg, r2));
         fo->instructions.push_back(0);
         else_pos = fo->instructions.size();
-        r3 = compile_expr(node->get_fexpr());
+        r3 = compile_expr(node->get_fexpr(), tail);
         dealloc_expr(node->get_cond());
         dealloc_expr(node->get_texpr());
         dealloc_expr(node->get_fexpr());
-        fo->instructions[else_pos - 1] = BVM::Emitter::mov(if_reg, r2);
         fo->instructions.push_back(BVM::Emitter::mov(if_reg, r3));
+        fo->instructions[else_pos - 1] = BVM::Emitter::jmp(fo->instructions.size() - else_pos);
         fo->instructions[if_pos - 1] = BVM::Emitter::jmp_if_false(r1, else_pos - if_pos);
     }
 
-    void Compiler::compile_proc_call(const ProcCall* node) {
+    /* The callee sits in proc_pos (the call's result register) and the
+     * arguments in the registers right after it, where the callee finds them
+     * as its parameters. Nothing past them is live across the call, the
+     * callee's window overwrites it. Variables live in their own registers,
+     * so they are copied into place, upvalues are loaded there directly; a
+     * call in tail position becomes tail_call and reuses the running frame. */
+    void Compiler::compile_proc_call(const ProcCall* node, bool tail) {
         auto fo = active_objs_.top();
-        const Scope* scope = active_scopes_.top();
         auto atom = node->get_proc()->get_value();
         const std::string& name = static_cast<const SymbolAtom*>(atom)->get_value();
+        const Symbol* proc = current_scope()->lookup(name);
         unsigned int proc_pos = fo->next_reg - 1;
+        auto& args = node->get_args();
 
-        for (auto& arg : node->get_args()) {
-            compile_expr(arg.get());
+        if (proc->type == SymbolType::NativeProc && compile_binop(node))
+            return;
+
+        if (proc->type != SymbolType::NativeProc) {
+            const Lambda* callee = inliner_.expand(node, *current_scope(), *active_scopes_.top(), inlined_.size(),
+                    proc_pos + 1);
+            if (callee) {
+                compile_inline(node, callee, tail);
+                return;
+            }
+            if (reads_in_place(node->get_proc()))
+                fo->instructions.push_back(BVM::Emitter::mov(proc_pos, var_reg(name)));
+            else
+                fo->instructions.push_back(BVM::Emitter::get_upval(proc_pos, active_scopes_.top()->find_upval(name)));
         }
 
-        if (scope->lookup(name)->type == SymbolType::NativeProc) {
-            fo->instructions.push_back(BVM::Emitter::call_native(proc_pos, node->get_args().size(), 
-                        static_cast<uint8_t>(native_funcs.at(name))));
+        for (auto& arg : args) {
+            unsigned int reg = compile_expr(arg.get());
+            if (reads_in_place(arg.get()))
+                fo->instructions.push_back(BVM::Emitter::mov(alloc_reg(), reg));
+        }
+
+        if (proc->type == SymbolType::NativeProc) {
+            fo->instructions.push_back(BVM::Emitter::call_native(proc_pos, args.size(),
+                        static_cast<uint8_t>(proc->pid)));
+        } else if (tail) {
+            fo->instructions.push_back(BVM::Emitter::tail_call(proc_pos, args.size()));
         } else {
-            fo->instructions.push_back(BVM::Emitter::call(proc_pos));
+            fo->instructions.push_back(BVM::Emitter::call(proc_pos, args.size()));
         }
 
+        fo->next_reg = proc_pos + 1;
+    }
+
+    /* The arguments land right after proc_pos as they would for a call and
+     * become the callee's parameters there, its other variables follow. Its
+     * body then runs in the running frame, its value moved to proc_pos. */
+    void Compiler::compile_inline(const ProcCall* node, const Lambda* callee, bool tail) {
+        auto fo = active_objs_.top();
+        unsigned int proc_pos = fo->next_reg - 1;
         for (auto& arg : node->get_args()) {
-            dealloc_expr(arg.get());
+            unsigned int reg = compile_expr(arg.get());
+            if (reads_in_place(arg.get()))
+                fo->instructions.push_back(BVM::Emitter::mov(alloc_reg(), reg));
+        }
+        for (auto& [_, v] : callee->get_const_scope().symbol_table) {
+            if (v.type == SymbolType::Variable && v.reg >= node->get_args().size())
+                alloc_reg();
+        }
+
+        inlined_.push_back({&callee->get_const_scope(), proc_pos + 1});
+        auto& exprs = callee->get_exprs();
+        for (size_t i = 0; i < exprs.size(); i++) {
+            bool last = i + 1 == exprs.size();
+            unsigned int reg = compile_expr(exprs[i].get(), tail && last);
+            if (last)
+                fo->instructions.push_back(BVM::Emitter::mov(proc_pos, reg));
+            else
+                dealloc_expr(exprs[i].get());
+        }
+        inlined_.pop_back();
+        fo->next_reg = proc_pos + 1;
+    }
+}
+
+namespace Lisp {
+
+    /* (op a b) for a native arithmetic or comparison op is a single binary
+     * instruction writing straight into the call's result register. A literal
+     * operand is read from the constant pool by the *RK form instead of being
+     * loaded into a register first; a literal on the left is moved to the right
+     * when the op commutes or has a mirrored form. */
+    bool Compiler::compile_binop(const ProcCall* node) {
+        auto fo = active_objs_.top();
+        auto& args = node->get_args();
+        const std::string& name = static_cast<const SymbolAtom*>(node->get_proc()->get_value())->get_value();
+        if (args.size() != 2 || !binops.contains(native_funcs.at(name)))
+            return false;
+
+        const BinopEncoding& enc = binops.at(native_funcs.at(name));
+        uint8_t dst = fo->next_reg - 1;
+        const ASTNode* a = args[0].get();
+        const ASTNode* b = args[1].get();
+
+        if (options_.constant_operands) {
+            const BinopEncoding* rk_enc = nullptr;
+            const ASTNode* reg_operand = nullptr;
+            const ASTNode* const_operand = nullptr;
+            if (is_literal(b)) {
+                rk_enc = &enc;
+                reg_operand = a;
+                const_operand = b;
+            } else if (is_literal(a) && enc.has_mirror) {
+                rk_enc = &binops.at(enc.mirror);
+                reg_operand = b;
+                const_operand = a;
+            }
+
+            if (rk_enc) {
+                size_t k = add_const(atom_value(static_cast<const AtomicNode*>(const_operand)));
+                if (k <= UINT8_MAX) {
+                    unsigned int r = compile_expr(reg_operand);
+                    fo->instructions.push_back(rk_enc->rk(dst, r, k));
+                    dealloc_expr(reg_operand);
+                    return true;
+                }
+            }
         }
+
+        unsigned int ra = compile_expr(a);
+        unsigned int rb = compile_expr(b);
+        fo->instructions.push_back(enc.rr(dst, ra, rb));
+        dealloc_expr(b);
+        dealloc_expr(a);
+        return true;
     }
 }
@@ -5,11 +5,11 @@
 
 namespace Lisp {
 
-    Disassembler::Disassembler(const BVM::FuncObj* func) : func_(func) {}
+    Disassembler::Disassembler(const BVM::Prototype* func) : func_(func) {}
 
     const std::string& Disassembler::disassemble() {
-        for (size_t i = 0; i < func_->instructions.size();i++) {
-            uint32_t inst = func_->instructions[i];
+        for (size_t i = 0; i < func_->code().size();i++) {
+            uint32_t inst = func_->code()[i];
             uint8_t rd, rt, rs;
             rd = BVM::VirtualMachine::decode_rd(inst);
             rt = BVM::VirtualMachine::decode_rt(inst);
@@ -45,17 +45,47 @@ namespace Lisp {
                 case BVM::Opcode::OpLte:
                     out_ += std::format("lte {}, {}, {}\n", rd, rt, rs).data();
                     break;
+                case BVM::Opcode::OpAddRK:
+                    out_ += std::format("add_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpSubRK:
+                    out_ += std::format("sub_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpMulRK:
+                    out_ += std::format("mul_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpDivRK:
+                    out_ += std::format("div_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpEqRK:
+                    out_ += std::format("eq_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpNeRK:
+                    out_ += std::format("ne_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpBtRK:
+                    out_ += std::format("bt_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpBteRK:
+                    out_ += std::format("bte_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpLtRK:
+                    out_ += std::format("lt_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
+                case BVM::Opcode::OpLteRK:
+                    out_ += std::format("lte_rk {}, {}, k{}\n", rd, rt, rs);
+                    break;
                 case BVM::Opcode::OpMov:
                     out_ += std::format("mov {}, {} \n", rd, rt).data();
                     break;
                 case BVM::Opcode::OpRet:
-                    out_ += "ret\n";
+                    out_ += std::format("ret {}\n", rd);
                     break;
                 case BVM::Opcode::OpJmp:
-                    out_ += std::format("jmp {}\n", inst >> 8);
+                    out_ += std::format("jmp {}\n", BVM::VirtualMachine::decode_offset24(inst));
                     break;
                 case BVM::Opcode::OpJmpIfFalse:
-                    out_ += std::format("jmp_false {}, {} \n", rd, inst >> 16);
+                    out_ += std::format("jmp_false {}, {} \n", rd, BVM::VirtualMachine::decode_offset16(inst));
                     break;
                 case BVM::Opcode::OpDefine:
                     out_ += std::format("define {}, {} \n", rd, rs);
@@ -67,7 +97,22 @@ namespace Lisp {
                     out_ += std::format("call_native {}, {}, {}\n", rd, rt, rs);
                     break;
                 case BVM::Opcode::OpCall:
-                    out_ += std::format("call {}\n", rd);
+                    out_ += std::format("call {}, {}\n", rd, rt);
+                    break;
+                case BVM::Opcode::OpTailCall:
+                    out_ += std::format("tail_call {}, {}\n", rd, rt);
+                    break;
+                case BVM::Opcode::OpClosure:
+                    out_ += std::format("closure {}, {}\n", rd, inst >> 16);
+                    break;
+                case BVM::Opcode::OpGetUpval:
+                    out_ += std::format("get_upval {}, {}\n", rd, rt);
+                    break;
+                case BVM::Opcode::OpSetUpval:
+                    out_ += std::format("set_upval {}, {}\n", rd, rt);
+                    break;
+                case BVM::Opcode::OpSchedule:
+                    out_ += std::format("schedule {}, {}\n", rd, rt);
                     break;
                 default:
                     throw std::runtime_error("disassembler: Not Implemented");
@@ -0,0 +1,225 @@
+#include "lisp/inliner.hpp"
+#include <algorithm>
+
+namespace Lisp {
+
+    static inline const std::string& symbol_name(const ASTNode* node) {
+        return static_cast<const SymbolAtom*>(static_cast<const AtomicNode*>(node)->get_value())->get_value();
+    }
+
+    static inline bool is_symbol(const ASTNode* node) {
+        return node->get_type() == NodeType::Atomic
+            && static_cast<const AtomicNode*>(node)->get_value()->get_type() == SExprType::SymbolLiteral;
+    }
+
+    struct Writes {
+        int defines = 0; // binding the name in the lambda scanned
+        bool set = false; // anywhere below it, nested lambdas too
+    };
+
+    static void find_writes(const ASTNode* node, bool nested, std::unordered_map<std::string, Writes>& writes) {
+        switch (node->get_type()) {
+            case NodeType::Define: {
+                auto define = static_cast<const Define*>(node);
+                if (!nested)
+                    writes[define->get_id()].defines++;
+                find_writes(define->get_expr(), nested, writes);
+                break;
+            }
+            case NodeType::Set: {
+                auto set = static_cast<const SetExpr*>(node);
+                writes[set->get_id()].set = true;
+                find_writes(set->get_expr(), nested, writes);
+                break;
+            }
+            case NodeType::IfExpr: {
+                auto if_expr = static_cast<const IfExpr*>(node);
+                find_writes(if_expr->get_cond(), nested, writes);
+                find_writes(if_expr->get_texpr(), nested, writes);
+                find_writes(if_expr->get_fexpr(), nested, writes);
+                break;
+            }
+            case NodeType::ProcCall:
+                for (auto& arg : static_cast<const ProcCall*>(node)->get_args())
+                    find_writes(arg.get(), nested, writes);
+                break;
+            case NodeType::Lambda:
+                for (auto& expr : static_cast<const Lambda*>(node)->get_exprs())
+                    find_writes(expr.get(), true, writes);
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* counts the nodes of a lambda's body into size, false when one of them
+     * keeps it from being inlined or there are more than max_size */
+    static bool inlinable(const ASTNode* node, const Scope& scope, const std::string& self, unsigned int max_size,
+            unsigned int& size) {
+        if (++size > max_size)
+            return false;
+        switch (node->get_type()) {
+            case NodeType::Atomic: {
+                SExprType type = static_cast<const AtomicNode*>(node)->get_value()->get_type();
+                if (type != SExprType::SymbolLiteral)
+                    return type == SExprType::IntLiteral || type == SExprType::FloatLiteral || type == SExprType::BoolLiteral;
+                const std::string& name = symbol_name(node);
+                const Symbol* sym = scope.lookup(name);
+                return name != self && sym && sym->type == SymbolType::Variable;
+            }
+            case NodeType::Define: {
+                auto define = static_cast<const Define*>(node);
+                return define->get_id() != self && inlinable(define->get_expr(), scope, self, max_size, size);
+            }
+            case NodeType::Set: {
+                auto set = static_cast<const SetExpr*>(node);
+                return set->get_id() != self && inlinable(set->get_expr(), scope, self, max_size, size);
+            }
+            case NodeType::IfExpr: {
+                auto if_expr = static_cast<const IfExpr*>(node);
+                return inlinable(if_expr->get_cond(), scope, self, max_size, size)
+                    && inlinable(if_expr->get_texpr(), scope, self, max_size, size)
+                    && inlinable(if_expr->get_fexpr(), scope, self, max_size, size);
+            }
+            case NodeType::ProcCall: {
+                auto call = static_cast<const ProcCall*>(node);
+                const std::string& name = symbol_name(call->get_proc());
+                const Symbol* proc = scope.lookup(name);
+                if (name == self || !proc || call->get_args().size() >= MAX_REGS)
+                    return false;
+                if (proc->type != SymbolType::Variable && proc->type != SymbolType::NativeProc)
+                    return false;
+                return std::all_of(call->get_args().begin(), call->get_args().end(),
+                        [&](auto& arg) { return inlinable(arg.get(), scope, self, max_size, size); });
+            }
+            default:
+                return false;
+        }
+    }
+
+    // sym, found from a lambda inlined into real, is a variable real reads too
+    static bool readable(const Scope& real, const std::string& name, const Symbol* sym) {
+        auto it = real.symbol_table.find(name);
+        if (it != real.symbol_table.end())
+            return &it->second == sym;
+        return real.find_upval(name) >= 0 && real.lookup(name) == sym;
+    }
+
+    Inliner::Inliner(unsigned int max_size, unsigned int max_depth) : max_size_(max_size), max_depth_(max_depth) {}
+
+    void Inliner::scan(const Lambda* node) {
+        if (max_size_ == 0 || max_depth_ == 0)
+            return;
+        const Scope& scope = node->get_const_scope();
+        std::unordered_map<std::string, Writes> writes;
+        for (auto& expr : node->get_exprs()) {
+            if (expr->get_type() != NodeType::Define)
+                continue;
+            auto define = static_cast<const Define*>(expr.get());
+            if (define->get_expr()->get_type() != NodeType::Lambda)
+                continue;
+            const std::string& name = define->get_id();
+            if (writes.empty()) {
+                for (auto& e : node->get_exprs())
+                    find_writes(e.get(), false, writes);
+            }
+            if (writes[name].defines != 1 || writes[name].set)
+                continue;
+
+            auto lambda = static_cast<const Lambda*>(define->get_expr());
+            const Scope& callee = lambda->get_const_scope();
+            unsigned int size = 0;
+            bool ok = !lambda->get_exprs().empty();
+            for (auto& e : lambda->get_exprs())
+                ok = ok && inlinable(e.get(), callee, name, max_size_, size);
+            if (!ok)
+                continue;
+            unsigned int n_vars = std::count_if(callee.symbol_table.begin(), callee.symbol_table.end(),
+                    [](auto& entry) { return entry.second.type == SymbolType::Variable; });
+            pending_[lambda] = {&scope.symbol_table.at(name), {lambda, size, n_vars}};
+        }
+    }
+
+    void Inliner::compiled(const Lambda* node) {
+        auto it = pending_.find(node);
+        if (it == pending_.end())
+            return;
+        candidates_[it->second.first] = it->second.second;
+        pending_.erase(it);
+    }
+
+    const Inliner::Candidate* Inliner::candidate(const ProcCall* call, const Scope& scope, unsigned int depth) const {
+        if (depth >= max_depth_)
+            return nullptr;
+        auto it = candidates_.find(scope.lookup(symbol_name(call->get_proc())));
+        if (it == candidates_.end() || it->second.lambda->get_parameters().size() != call->get_args().size())
+            return nullptr;
+        return &it->second;
+    }
+
+    /* The body never needs more than a register per variable and one per
+     * node, plus what the largest expansion inside it needs. */
+    unsigned int Inliner::frame_size(const Candidate& c, const Scope& real, unsigned int depth) const {
+        const Scope& scope = c.lambda->get_const_scope();
+        unsigned int nested = 0;
+        auto reaches = [&](const std::string& name) {
+            return scope.symbol_table.contains(name) || readable(real, name, scope.lookup(name));
+        };
+
+        std::vector<const ASTNode*> work;
+        for (auto& expr : c.lambda->get_exprs())
+            work.push_back(expr.get());
+        while (!work.empty()) {
+            const ASTNode* node = work.back();
+            work.pop_back();
+            switch (node->get_type()) {
+                case NodeType::Atomic:
+                    if (is_symbol(node) && !reaches(symbol_name(node)))
+                        return 0;
+                    break;
+                case NodeType::Define:
+                    work.push_back(static_cast<const Define*>(node)->get_expr());
+                    break;
+                case NodeType::Set: {
+                    auto set = static_cast<const SetExpr*>(node);
+                    if (!reaches(set->get_id()))
+                        return 0;
+                    work.push_back(set->get_expr());
+                    break;
+                }
+                case NodeType::IfExpr: {
+                    auto if_expr = static_cast<const IfExpr*>(node);
+                    work.push_back(if_expr->get_cond());
+                    work.push_back(if_expr->get_texpr());
+                    work.push_back(if_expr->get_fexpr());
+                    break;
+                }
+                case NodeType::ProcCall: {
+                    auto call = static_cast<const ProcCall*>(node);
+                    const std::string& name = symbol_name(call->get_proc());
+                    const Candidate* inner = scope.symbol_table.contains(name) ? nullptr : candidate(call, scope, depth);
+                    unsigned int n = inner ? frame_size(*inner, real, depth + 1) : 0;
+                    if (n > 0)
+                        nested = std::max(nested, n);
+                    else if (scope.lookup(name)->type != SymbolType::NativeProc && !reaches(name))
+                        return 0;
+                    for (auto& arg : call->get_args())
+                        work.push_back(arg.get());
+                    break;
+                }
+                default:
+                    return 0;
+            }
+        }
+        return c.n_vars + c.size + nested;
+    }
+
+    const Lambda* Inliner::expand(const ProcCall* call, const Scope& scope, const Scope& real, unsigned int depth,
+            unsigned int base) const {
+        const Candidate* c = candidate(call, scope, depth);
+        if (!c)
+            return nullptr;
+        unsigned int n = frame_size(*c, real, depth + 1);
+        return n > 0 && base + n <= MAX_REGS ? c->lambda : nullptr;
+    }
+}
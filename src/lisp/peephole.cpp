@@ -0,0 +1,416 @@
+#include "lisp/peephole.hpp"
+#include "lisp/ssa.hpp"
+#include <bolt_virtual_machine/emitter.h>
+#include <optional>
+
+#define PEEPHOLE_ROUNDS 8 // passes over a prototype, each one only runs when the last changed something
+#define MAX_JUMP_CHAIN 16
+
+namespace Lisp {
+
+    using BVM::Opcode;
+    using BVM::VirtualMachine;
+
+    struct BinopForm {
+        NativeFunc native;
+        bool rk; // rs is a constant index
+    };
+
+    static std::optional<BinopForm> binop_form(Opcode op) {
+        switch (op) {
+            case Opcode::OpAdd: return BinopForm{NativeFunc::Add, false};
+            case Opcode::OpSub: return BinopForm{NativeFunc::Sub, false};
+            case Opcode::OpMul: return BinopForm{NativeFunc::Mul, false};
+            case Opcode::OpDiv: return BinopForm{NativeFunc::Div, false};
+            case Opcode::OpLt: return BinopForm{NativeFunc::Lt, false};
+            case Opcode::OpLte: return BinopForm{NativeFunc::Lte, false};
+            case Opcode::OpBt: return BinopForm{NativeFunc::Bt, false};
+            case Opcode::OpBte: return BinopForm{NativeFunc::Bte, false};
+            case Opcode::OpEq: return BinopForm{NativeFunc::Eq, false};
+            case Opcode::OpNe: return BinopForm{NativeFunc::Ne, false};
+            case Opcode::OpAddRK: return BinopForm{NativeFunc::Add, true};
+            case Opcode::OpSubRK: return BinopForm{NativeFunc::Sub, true};
+            case Opcode::OpMulRK: return BinopForm{NativeFunc::Mul, true};
+            case Opcode::OpDivRK: return BinopForm{NativeFunc::Div, true};
+            case Opcode::OpLtRK: return BinopForm{NativeFunc::Lt, true};
+            case Opcode::OpLteRK: return BinopForm{NativeFunc::Lte, true};
+            case Opcode::OpBtRK: return BinopForm{NativeFunc::Bt, true};
+            case Opcode::OpBteRK: return BinopForm{NativeFunc::Bte, true};
+            case Opcode::OpEqRK: return BinopForm{NativeFunc::Eq, true};
+            case Opcode::OpNeRK: return BinopForm{NativeFunc::Ne, true};
+            default: return std::nullopt;
+        }
+    }
+
+    static void reads(uint32_t inst, RegisterSet& regs) {
+        Opcode op = VirtualMachine::decode_op(inst);
+        int rd = VirtualMachine::decode_rd(inst);
+        int rt = VirtualMachine::decode_rt(inst);
+        if (auto form = binop_form(op)) {
+            regs.set(rt);
+            if (!form->rk)
+                regs.set(VirtualMachine::decode_rs(inst));
+            return;
+        }
+        switch (op) {
+            case Opcode::OpMov:
+                regs.set(rt);
+                break;
+            case Opcode::OpRet:
+            case Opcode::OpJmpIfFalse:
+            case Opcode::OpSetUpval:
+                regs.set(rd);
+                break;
+            case Opcode::OpCall:
+            case Opcode::OpTailCall:
+            case Opcode::OpSchedule:
+                for (int r = rd; r <= rd + rt && r <= UINT8_MAX; r++)
+                    regs.set(r);
+                break;
+            case Opcode::OpCallNative:
+                for (int r = rd + 1; r <= rd + rt && r <= UINT8_MAX; r++)
+                    regs.set(r);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // the register inst writes, -1 for none
+    static int writes(uint32_t inst) {
+        Opcode op = VirtualMachine::decode_op(inst);
+        switch (op) {
+            case Opcode::OpMov:
+            case Opcode::OpConst:
+            case Opcode::OpGetUpval:
+            case Opcode::OpClosure:
+            case Opcode::OpCall:
+            case Opcode::OpCallNative:
+            case Opcode::OpSchedule:
+                return VirtualMachine::decode_rd(inst);
+            default:
+                return binop_form(op) ? VirtualMachine::decode_rd(inst) : -1;
+        }
+    }
+
+    // writes its result and nothing else, so it can just as well write it elsewhere
+    static bool retargetable(Opcode op) {
+        return op == Opcode::OpMov || op == Opcode::OpConst || op == Opcode::OpGetUpval || op == Opcode::OpClosure
+            || binop_form(op);
+    }
+
+    // cannot fail or change anything but its result, gone when nothing reads that
+    static bool removable(Opcode op) {
+        return op == Opcode::OpMov || op == Opcode::OpConst || op == Opcode::OpGetUpval || op == Opcode::OpClosure
+            || op == Opcode::OpEq || op == Opcode::OpNe || op == Opcode::OpEqRK || op == Opcode::OpNeRK;
+    }
+
+    static bool falls_through(Opcode op) {
+        return op != Opcode::OpJmp && op != Opcode::OpRet && op != Opcode::OpTailCall;
+    }
+
+    class Peephole {
+        private:
+            struct Inst {
+                uint32_t word;
+                int target = -1; // where a jump goes, as an index into code_
+                bool dead = false;
+            };
+
+            BVM::Prototype& proto_;
+            const RegisterSet& captured_;
+            const std::function<size_t(BVM::BoltValue)>& add_const_;
+            std::vector<Inst> code_;
+            std::vector<std::vector<size_t>> jumps_to_; // the jumps landing on each instruction
+            std::vector<RegisterSet> live_out_;
+
+            static Opcode op_of(const Inst& inst) { return VirtualMachine::decode_op(inst.word); }
+
+            void find_jumps() {
+                jumps_to_.assign(code_.size() + 1, {});
+                for (size_t i = 0; i < code_.size(); i++) {
+                    if (!code_[i].dead && code_[i].target >= 0)
+                        jumps_to_[code_[i].target].push_back(i);
+                }
+            }
+
+            void decode() {
+                const std::vector<uint32_t>& insts = proto_.instructions;
+                for (size_t i = 0; i < insts.size(); i++) {
+                    Inst inst{insts[i]};
+                    if (op_of(inst) == Opcode::OpJmp)
+                        inst.target = i + 1 + VirtualMachine::decode_offset24(inst.word);
+                    else if (op_of(inst) == Opcode::OpJmpIfFalse)
+                        inst.target = i + 1 + VirtualMachine::decode_offset16(inst.word);
+                    if (inst.target > static_cast<int>(insts.size()))
+                        throw std::runtime_error("peephole: jump out of the prototype");
+                    code_.push_back(inst);
+                }
+            }
+
+            void encode() {
+                std::vector<uint32_t>& insts = proto_.instructions;
+                insts.clear();
+                for (size_t i = 0; i < code_.size(); i++) {
+                    const Inst& inst = code_[i];
+                    int offset = inst.target - static_cast<int>(i) - 1;
+                    if (op_of(inst) == Opcode::OpJmp)
+                        insts.push_back(BVM::Emitter::jmp(offset));
+                    else if (op_of(inst) == Opcode::OpJmpIfFalse)
+                        insts.push_back(BVM::Emitter::jmp_if_false(VirtualMachine::decode_rd(inst.word), offset));
+                    else
+                        insts.push_back(inst.word);
+                }
+            }
+
+            // drops dead instructions, a jump into them goes on to the next live one
+            void compact() {
+                bool again = true;
+                while (again) {
+                    std::vector<int> index(code_.size() + 1);
+                    int n = 0;
+                    for (size_t i = 0; i < code_.size(); i++) {
+                        index[i] = n;
+                        n += !code_[i].dead;
+                    }
+                    index[code_.size()] = n;
+                    std::erase_if(code_, [](const Inst& inst) { return inst.dead; });
+                    again = false;
+                    for (size_t i = 0; i < code_.size(); i++) {
+                        Inst& inst = code_[i];
+                        if (inst.target < 0)
+                            continue;
+                        inst.target = index[inst.target];
+                        if (inst.target == static_cast<int>(i) + 1)
+                            again = inst.dead = true;
+                    }
+                }
+            }
+
+            bool thread_jumps() {
+                bool changed = false;
+                int n = code_.size();
+                for (int i = 0; i < n; i++) {
+                    Inst& inst = code_[i];
+                    if (inst.target < 0)
+                        continue;
+                    int target = inst.target;
+                    for (int hops = 0; hops < MAX_JUMP_CHAIN && target < n && op_of(code_[target]) == Opcode::OpJmp; hops++)
+                        target = code_[target].target;
+                    bool fits = op_of(inst) == Opcode::OpJmp || target - i - 1 <= INT16_MAX;
+                    if (fits && target != inst.target) {
+                        inst.target = target;
+                        changed = true;
+                    }
+                    if (op_of(inst) == Opcode::OpJmp && inst.target < n && op_of(code_[inst.target]) == Opcode::OpRet) {
+                        inst.word = code_[inst.target].word;
+                        inst.target = -1;
+                        changed = true;
+                    }
+                }
+                return changed;
+            }
+
+            /* follows the constants each register holds through straight
+             * line code, folding binops of them and the branches on them */
+            bool fold_constants() {
+                bool changed = false;
+                std::vector<std::optional<BVM::BoltValue>> known(UINT8_MAX + 1);
+                auto forget = [&](int from) {
+                    for (int r = from; r <= UINT8_MAX; r++)
+                        known[r].reset();
+                };
+                find_jumps();
+                for (size_t i = 0; i < code_.size(); i++) {
+                    Inst& inst = code_[i];
+                    if (!jumps_to_[i].empty())
+                        forget(0);
+                    int rd = VirtualMachine::decode_rd(inst.word);
+                    int rt = VirtualMachine::decode_rt(inst.word);
+                    int rs = VirtualMachine::decode_rs(inst.word);
+                    if (auto form = binop_form(op_of(inst))) {
+                        std::optional<BVM::BoltValue> x = known[rt];
+                        std::optional<BVM::BoltValue> y = form->rk ? std::optional(proto_.consts[rs]) : known[rs];
+                        BVM::BoltValue res;
+                        if (x && y && fold_binop(form->native, *x, *y, res)) {
+                            size_t k = add_const_(res);
+                            if (k <= UINT16_MAX) {
+                                inst.word = BVM::Emitter::load_const(rd, k);
+                                changed = true;
+                            }
+                        }
+                    }
+                    switch (op_of(inst)) {
+                        case Opcode::OpConst:
+                            known[rd] = captured_[rd] ? std::nullopt : std::optional(proto_.consts[inst.word >> 16]);
+                            break;
+                        case Opcode::OpMov:
+                            known[rd] = captured_[rd] ? std::nullopt : known[rt];
+                            break;
+                        case Opcode::OpJmpIfFalse:
+                            if (known[rd] && known[rd]->is_false()) {
+                                inst.word = BVM::Emitter::jmp(0);
+                                forget(0);
+                                changed = true;
+                            } else if (known[rd]) {
+                                inst.dead = true;
+                                changed = true;
+                            }
+                            break;
+                        case Opcode::OpJmp:
+                        case Opcode::OpRet:
+                        case Opcode::OpTailCall:
+                            forget(0);
+                            break;
+                        case Opcode::OpCall:
+                        case Opcode::OpCallNative:
+                        case Opcode::OpSchedule:
+                            forget(rd); // the callee's window
+                            break;
+                        default:
+                            if (writes(inst.word) >= 0)
+                                known[writes(inst.word)].reset();
+                            break;
+                    }
+                }
+                return changed;
+            }
+
+            bool remove_unreachable() {
+                std::vector<bool> reached(code_.size(), false);
+                std::vector<int> work = {0};
+                while (!work.empty()) {
+                    size_t i = work.back();
+                    work.pop_back();
+                    if (i >= code_.size() || reached[i])
+                        continue;
+                    reached[i] = true;
+                    if (code_[i].target >= 0)
+                        work.push_back(code_[i].target);
+                    if (falls_through(op_of(code_[i])))
+                        work.push_back(i + 1);
+                }
+                bool changed = false;
+                for (size_t i = 0; i < code_.size(); i++) {
+                    if (!reached[i]) {
+                        code_[i].dead = true;
+                        changed = true;
+                    }
+                }
+                return changed;
+            }
+
+            void liveness() {
+                size_t n = code_.size();
+                std::vector<RegisterSet> live_in(n + 1);
+                live_out_.assign(n, {});
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (size_t i = n; i-- > 0;) {
+                        const Inst& inst = code_[i];
+                        RegisterSet out;
+                        if (falls_through(op_of(inst)))
+                            out |= live_in[i + 1];
+                        if (inst.target >= 0)
+                            out |= live_in[inst.target];
+                        RegisterSet in = out;
+                        if (writes(inst.word) >= 0)
+                            in.reset(writes(inst.word));
+                        reads(inst.word, in);
+                        if (in != live_in[i] || out != live_out_[i]) {
+                            live_in[i] = in;
+                            live_out_[i] = out;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+
+            /* the instructions computing reg for the mov at i, the last one
+             * on every way into it - none when one of those ways ends in
+             * something else or comes through a jump that is not a jmp
+             * right after the instruction */
+            std::vector<size_t> computing(size_t i, int reg) const {
+                auto computes = [&](size_t d) {
+                    const Inst& inst = code_[d];
+                    return !inst.dead && retargetable(op_of(inst)) && writes(inst.word) == reg;
+                };
+                std::vector<size_t> defs;
+                if (i == 0)
+                    return defs;
+                if (falls_through(op_of(code_[i - 1]))) {
+                    if (!computes(i - 1))
+                        return {};
+                    defs.push_back(i - 1);
+                }
+                for (size_t j : jumps_to_[i]) {
+                    bool after_def = op_of(code_[j]) == Opcode::OpJmp && j > 0 && jumps_to_[j].empty()
+                        && computes(j - 1);
+                    if (!after_def)
+                        return {};
+                    defs.push_back(j - 1);
+                }
+                return defs;
+            }
+
+            /* op rX ...; mov rY, rX becomes op rY ... when nothing else
+             * reads rX, at the join of an if for the op ending each branch.
+             * Then moves and stores nothing reads are dropped. */
+            bool remove_moves() {
+                bool changed = false;
+                find_jumps();
+                for (size_t i = 0; i < code_.size(); i++) {
+                    Inst& inst = code_[i];
+                    int rd = VirtualMachine::decode_rd(inst.word);
+                    int rt = VirtualMachine::decode_rt(inst.word);
+                    if (op_of(inst) == Opcode::OpMov && rd == rt) {
+                        inst.dead = changed = true;
+                        continue;
+                    }
+                    if (op_of(inst) == Opcode::OpMov && !captured_[rt] && !live_out_[i][rt]) {
+                        std::vector<size_t> defs = computing(i, rt);
+                        for (size_t d : defs)
+                            code_[d].word = (code_[d].word & ~0xFF00u) | static_cast<uint32_t>(rd) << 8;
+                        if (!defs.empty()) {
+                            inst.dead = changed = true;
+                            continue;
+                        }
+                    }
+                    int w = writes(inst.word);
+                    if (w >= 0 && removable(op_of(inst)) && !captured_[w] && !live_out_[i][w])
+                        inst.dead = changed = true;
+                }
+                return changed;
+            }
+
+        public:
+            Peephole(BVM::Prototype& proto, const RegisterSet& captured, const std::function<size_t(BVM::BoltValue)>& add_const)
+                : proto_(proto), captured_(captured), add_const_(add_const) {}
+
+            void run() {
+                decode();
+                for (int round = 0; round < PEEPHOLE_ROUNDS; round++) {
+                    bool changed = thread_jumps();
+                    changed |= fold_constants();
+                    changed |= remove_unreachable();
+                    compact();
+                    liveness();
+                    changed |= remove_moves();
+                    compact();
+                    if (!changed)
+                        break;
+                }
+                encode();
+            }
+    };
+
+    PeepholeStats peephole(BVM::Prototype& proto, uint16_t id, const RegisterSet& captured,
+            const std::function<size_t(BVM::BoltValue)>& add_const) {
+        PeepholeStats stats = {.proto = id, .before = proto.instructions.size(), .after = 0};
+        Peephole pass(proto, captured, add_const);
+        pass.run();
+        stats.after = proto.instructions.size();
+        return stats;
+    }
+}
@@ -58,11 +58,34 @@ namespace Lisp {
 
     }
 
+    /* A variable of an enclosing lambda becomes an upvalue of every lambda
+     * between it and the reference: the one right inside its owner captures
+     * the register, the deeper ones take it from their parent's upvalues.
+     * Returns the index in scope's upvalues, -1 if name is not a variable. */
+    static int resolve_upval(Scope* scope, const std::string& name) {
+        Scope* parent = scope->parent;
+        if (parent == nullptr)
+            return -1;
+        auto it = parent->symbol_table.find(name);
+        if (it != parent->symbol_table.end()) {
+            if (it->second.type != SymbolType::Variable)
+                return -1;
+            it->second.captured = true;
+            return scope->add_upval(name, true, it->second.reg);
+        }
+        int index = resolve_upval(parent, name);
+        if (index < 0)
+            return -1;
+        return scope->add_upval(name, false, index);
+    }
+
     std::unique_ptr<AtomicNode> SemanticAnalyzer::verify_symbol(std::unique_ptr<SymbolAtom> sexpr) {
         Scope* cur = scopes_.top();
         const std::string& sym = sexpr->get_value();
         if (cur->lookup(sym) == nullptr)
             throw std::runtime_error(std::format("symbol '{}' is not defined", sym.data()));
+        if (!cur->symbol_table.contains(sym))
+            resolve_upval(cur, sym);
 
         return std::make_unique<AtomicNode>(std::move(sexpr));
     }
@@ -83,6 +106,8 @@ namespace Lisp {
                     return verify_lambda(std::move(sexpr));
                 case ExprType::If:
                     return verify_if(std::move(sexpr));
+                case ExprType::Set:
+                    return verify_set(std::move(sexpr));
                 default:
                     std::logic_error("verify_list: Not Implemented");
             }
@@ -112,6 +137,24 @@ namespace Lisp {
     }
 
 
+    /* (set! var expr) assigns a variable that is already defined, here or
+     * in an enclosing lambda */
+    std::unique_ptr<SetExpr> SemanticAnalyzer::verify_set(std::unique_ptr<List> sexpr) {
+        auto& elems = sexpr->get_elems();
+        auto node = std::make_unique<SetExpr>();
+        if (elems.size() != 3 || elems[1]->get_type() != SExprType::SymbolLiteral)
+            throw std::runtime_error("malformed set!");
+        SymbolAtom* sym = static_cast<SymbolAtom*>(elems[1].get());
+        const Symbol* var = scopes_.top()->lookup(sym->get_value());
+        if (var == nullptr || var->type != SymbolType::Variable)
+            throw std::runtime_error(std::format("set!: '{}' is not a variable", sym->get_value().data()));
+        node->set_id(sym->get_value());
+        verify_sexpr(sexpr->move_elem(1));
+        node->set_expr(verify_sexpr(sexpr->move_elem(2)));
+
+        return node;
+    }
+
     std::unique_ptr<IfExpr> SemanticAnalyzer::verify_if(std::unique_ptr<List> sexpr) {
         auto& elems = sexpr->get_elems();
         auto node = std::make_unique<IfExpr>();
@@ -132,25 +175,30 @@ namespace Lisp {
     std::unique_ptr<Lambda> SemanticAnalyzer::verify_lambda(std::unique_ptr<List> sexpr) {
         auto& elems = sexpr->get_elems();
         auto node = std::make_unique<Lambda>();
-        if (elems.size() != 3 || !elems[1]->is_list())
+        if (elems.size() < 3 || !elems[1]->is_list())
             throw std::runtime_error("malformed lambda");
 
+        /* parameters are the first variables of the lambda's scope, so they
+         * land in the registers call copies the arguments into */
+        Scope& scope = node->get_scope();
+        scope.parent = scopes_.top();
+        scopes_.push(&scope);
         List* ps_list = static_cast<List*>(elems[1].get());
         auto& ps = ps_list->get_elems();
         for (size_t i = 0; i < ps.size(); i++) {
             auto e = ps_list->move_elem(i);
-            if (!e->is_atom())
+            if (e->get_type() != SExprType::SymbolLiteral)
                 throw std::runtime_error("not a valid parameter");
-            scopes_.push(&node->get_scope());
-            auto atom = verify_symbol(std::unique_ptr<SymbolAtom>(static_cast<SymbolAtom*>(e.release())));
-            node->insert_parameter(std::move(atom));
+            auto sym = std::unique_ptr<SymbolAtom>(static_cast<SymbolAtom*>(e.release()));
+            scope.insert(sym->get_value(), {static_cast<uint8_t>(scope.n_vars), nullptr, SymbolType::Variable});
+            node->insert_parameter(std::make_unique<AtomicNode>(std::move(sym)));
         }
 
         for (size_t i = 2; i < sexpr->get_elems().size(); i++) {
             auto expr = verify_sexpr(sexpr->move_elem(i));
             node->insert_expr(std::move(expr));
         }
-
+        scopes_.pop();
 
         return node;
     }
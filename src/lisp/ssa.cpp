@@ -0,0 +1,1275 @@
+#include "lisp/ssa.hpp"
+#include "lisp/codegen.hpp"
+#include <bolt_virtual_machine/emitter.h>
+#include <algorithm>
+#include <climits>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace Lisp {
+
+    int SsaFunction::add_block() {
+        blocks.emplace_back();
+        return blocks.size() - 1;
+    }
+
+    int SsaFunction::add_inst(int block, SsaOp op, std::vector<int> args, int imm) {
+        insts.push_back({.op = op, .block = block, .imm = imm, .args = std::move(args)});
+        int id = insts.size() - 1;
+        blocks[block].insts.push_back(id);
+        return id;
+    }
+
+    void SsaFunction::remove_edge(int from, int to) {
+        SsaBlock& b = blocks[to];
+        auto it = std::find(b.preds.begin(), b.preds.end(), from);
+        size_t i = it - b.preds.begin();
+        b.preds.erase(it);
+        for (int phi : b.insts) {
+            if (insts[phi].op != SsaOp::Phi)
+                break;
+            insts[phi].args.erase(insts[phi].args.begin() + i);
+        }
+    }
+
+    static inline const std::string& symbol_name(const ASTNode* node) {
+        return static_cast<const SymbolAtom*>(static_cast<const AtomicNode*>(node)->get_value())->get_value();
+    }
+
+    // a variable of this lambda or an upvalue, what the direct path reads a name from
+    static bool readable(const Scope& scope, const std::string& name) {
+        auto it = scope.symbol_table.find(name);
+        if (it != scope.symbol_table.end())
+            return it->second.type == SymbolType::Variable;
+        return scope.find_upval(name) >= 0;
+    }
+
+    static bool supported(const Scope& scope, const ASTNode* node) {
+        switch (node->get_type()) {
+            case NodeType::Atomic:
+                switch (static_cast<const AtomicNode*>(node)->get_value()->get_type()) {
+                    case SExprType::IntLiteral:
+                    case SExprType::FloatLiteral:
+                    case SExprType::BoolLiteral:
+                        return true;
+                    case SExprType::SymbolLiteral:
+                        return readable(scope, symbol_name(node));
+                    default:
+                        return false;
+                }
+            case NodeType::Define:
+                return supported(scope, static_cast<const Define*>(node)->get_expr());
+            case NodeType::Set: {
+                auto set = static_cast<const SetExpr*>(node);
+                return readable(scope, set->get_id()) && supported(scope, set->get_expr());
+            }
+            case NodeType::IfExpr: {
+                auto if_expr = static_cast<const IfExpr*>(node);
+                return supported(scope, if_expr->get_cond()) && supported(scope, if_expr->get_texpr())
+                    && supported(scope, if_expr->get_fexpr());
+            }
+            case NodeType::Lambda:
+                return true;
+            case NodeType::ProcCall: {
+                auto call = static_cast<const ProcCall*>(node);
+                const std::string& name = symbol_name(call->get_proc());
+                const Symbol* proc = scope.lookup(name);
+                if (call->get_args().size() >= MAX_REGS)
+                    return false;
+                if (proc->type != SymbolType::NativeProc && !readable(scope, name))
+                    return false;
+                for (auto& arg : call->get_args()) {
+                    if (!supported(scope, arg.get()))
+                        return false;
+                }
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    bool ssa_supported(const Lambda* node) {
+        for (auto& expr : node->get_exprs()) {
+            if (!supported(node->get_const_scope(), expr.get()))
+                return false;
+        }
+        return true;
+    }
+
+    /* Builds the blocks of one lambda while walking its body. The current
+     * value of each uncaptured variable is kept in env_ by slot, an if
+     * builds both branches from the same env_ and puts phis where they
+     * disagree. */
+    class SsaBuilder {
+        private:
+            SsaFunction& fn_;
+            const Scope& scope_;
+            const std::function<uint16_t(const Lambda*)>& compile_nested_;
+            const Inliner* inliner_;
+            std::unordered_map<std::string, int> slots_;
+            // the lambdas being built in place of a call, the innermost last, with the slots of their variables
+            std::vector<std::pair<const Scope*, std::unordered_map<std::string, int>>> inlined_;
+            std::vector<int> env_;
+            int cur_ = 0; // -1 once the block has ended in a return or tail call
+
+            inline int emit(SsaOp op, std::vector<int> args = {}, int imm = 0) {
+                return fn_.add_inst(cur_, op, std::move(args), imm);
+            }
+
+            int constant(BVM::BoltValue v) {
+                int i = emit(SsaOp::Const);
+                fn_.insts[i].konst = v;
+                return i;
+            }
+
+            // names are found from here, an inlined lambda's scope while its body is built
+            const Scope& scope() const {
+                return inlined_.empty() ? scope_ : *inlined_.back().first;
+            }
+
+            int* inlined_var(const std::string& name) {
+                if (inlined_.empty())
+                    return nullptr;
+                auto it = inlined_.back().second.find(name);
+                return it == inlined_.back().second.end() ? nullptr : &env_[it->second];
+            }
+
+            int read(const std::string& name) {
+                if (int* v = inlined_var(name))
+                    return *v;
+                auto it = scope_.symbol_table.find(name);
+                if (it == scope_.symbol_table.end())
+                    return emit(SsaOp::GetUpval, {}, scope_.find_upval(name));
+                if (it->second.captured)
+                    return emit(SsaOp::ReadVar, {}, fn_.pin_of[it->second.reg]);
+                return env_[slots_.at(name)];
+            }
+
+            int write(const std::string& name, int v) {
+                auto it = scope_.symbol_table.find(name);
+                if (int* var = inlined_var(name))
+                    *var = emit(SsaOp::Copy, {v});
+                else if (it == scope_.symbol_table.end())
+                    emit(SsaOp::SetUpval, {v}, scope_.find_upval(name));
+                else if (it->second.captured)
+                    emit(SsaOp::WriteVar, {v}, fn_.pin_of[it->second.reg]);
+                else
+                    env_[slots_.at(name)] = emit(SsaOp::Copy, {v});
+                return v;
+            }
+
+            void jump(int from, int to) {
+                fn_.blocks[from].exit = SsaExit::Jump;
+                fn_.blocks[from].succ[0] = to;
+                fn_.blocks[to].preds.push_back(from);
+            }
+
+            int phi(int a, int b) {
+                if (a == b)
+                    return a;
+                return emit(SsaOp::Phi, {a, b});
+            }
+
+            // the branch blocks of an if whose condition was built into cur_
+            std::pair<int, int> branch(int cond) {
+                int from = cur_;
+                fn_.blocks[from].exit = SsaExit::Branch;
+                fn_.blocks[from].operands = {cond};
+                int t = fn_.add_block();
+                fn_.blocks[from].succ[0] = t;
+                fn_.blocks[t].preds.push_back(from);
+                return {from, t};
+            }
+
+            int else_block(int from) {
+                int e = fn_.add_block();
+                fn_.blocks[from].succ[1] = e;
+                fn_.blocks[e].preds.push_back(from);
+                return e;
+            }
+
+            int build_if(const IfExpr* node) {
+                auto [from, t] = branch(build(node->get_cond()));
+                std::vector<int> saved = env_;
+                cur_ = t;
+                int tv = build(node->get_texpr());
+                int t_end = cur_;
+                std::vector<int> t_env = std::move(env_);
+                env_ = std::move(saved);
+                cur_ = else_block(from);
+                int ev = build(node->get_fexpr());
+                int e_end = cur_;
+                int join = fn_.add_block();
+                jump(t_end, join);
+                jump(e_end, join);
+                cur_ = join;
+                int v = phi(tv, ev);
+                for (size_t i = 0; i < env_.size(); i++)
+                    env_[i] = phi(t_env[i], env_[i]);
+                return v;
+            }
+
+            const Lambda* inlined_callee(const ProcCall* node) {
+                if (!inliner_ || scope().lookup(symbol_name(node->get_proc()))->type == SymbolType::NativeProc)
+                    return nullptr;
+                return inliner_->expand(node, scope(), scope_, inlined_.size(), 0);
+            }
+
+            /* the arguments are the values of the callee's parameters, its
+             * other variables start out nil like the lambda's own; in tail
+             * position the body's value is returned, -1 */
+            int build_inline(const ProcCall* node, const Lambda* callee, bool tail) {
+                std::vector<int> args;
+                for (auto& arg : node->get_args())
+                    args.push_back(build(arg.get()));
+                const Scope& callee_scope = callee->get_const_scope();
+                std::vector<std::pair<uint8_t, const std::string*>> vars;
+                for (auto& [name, sym] : callee_scope.symbol_table) {
+                    if (sym.type == SymbolType::Variable)
+                        vars.push_back({sym.reg, &name});
+                }
+                std::sort(vars.begin(), vars.end());
+                size_t n_env = env_.size();
+                std::unordered_map<std::string, int> slots;
+                for (auto [reg, name] : vars) {
+                    slots[*name] = env_.size();
+                    env_.push_back(reg < args.size() ? args[reg] : constant(BVM::BoltValue::nil()));
+                }
+
+                inlined_.push_back({&callee_scope, std::move(slots)});
+                auto& exprs = callee->get_exprs();
+                for (size_t i = 0; i + 1 < exprs.size(); i++)
+                    build(exprs[i].get());
+                int v = -1;
+                if (tail)
+                    build_tail(exprs.back().get());
+                else
+                    v = build(exprs.back().get());
+                inlined_.pop_back();
+                env_.resize(n_env);
+                return v;
+            }
+
+            int build_call(const ProcCall* node) {
+                const std::string& name = symbol_name(node->get_proc());
+                const Symbol* proc = scope().lookup(name);
+                auto& args = node->get_args();
+                if (const Lambda* callee = inlined_callee(node))
+                    return build_inline(node, callee, false);
+                std::vector<int> values;
+                if (proc->type != SymbolType::NativeProc)
+                    values.push_back(read(name));
+                for (auto& arg : args)
+                    values.push_back(build(arg.get()));
+                if (proc->type != SymbolType::NativeProc)
+                    return emit(SsaOp::Call, std::move(values));
+                NativeFunc native = native_funcs.at(name);
+                int i;
+                if (args.size() == 2 && binops.contains(native))
+                    i = emit(SsaOp::Binop, std::move(values));
+                else
+                    i = emit(SsaOp::CallNative, std::move(values), static_cast<int>(proc->pid));
+                fn_.insts[i].native = native;
+                return i;
+            }
+
+        public:
+            SsaBuilder(SsaFunction& fn, const Lambda* node, const std::function<uint16_t(const Lambda*)>& compile_nested,
+                    const Inliner* inliner)
+                    : fn_(fn), scope_(node->get_const_scope()), compile_nested_(compile_nested), inliner_(inliner) {
+                fn_.arity = node->get_parameters().size();
+                fn_.add_block();
+
+                /* captured variables keep a register of their own, packed
+                 * right after the parameters so they do not push every
+                 * call window up */
+                std::vector<std::pair<uint8_t, const std::string*>> vars;
+                for (auto& [name, sym] : scope_.symbol_table) {
+                    if (sym.type == SymbolType::Variable)
+                        vars.push_back({sym.reg, &name});
+                }
+                std::sort(vars.begin(), vars.end());
+                fn_.pin_of.assign(UINT8_MAX + 1, -1);
+                int next_pin = fn_.arity;
+                int nil = constant(BVM::BoltValue::nil());
+                for (auto [reg, name] : vars) {
+                    if (scope_.symbol_table.at(*name).captured) {
+                        fn_.pin_of[reg] = reg < fn_.arity ? reg : next_pin++;
+                        fn_.pinned.push_back(fn_.pin_of[reg]);
+                        continue;
+                    }
+                    slots_[*name] = env_.size();
+                    env_.push_back(reg < fn_.arity ? emit(SsaOp::Param, {}, reg) : nil);
+                }
+            }
+
+            int build(const ASTNode* node) {
+                switch (node->get_type()) {
+                    case NodeType::Atomic: {
+                        const SExpr* value = static_cast<const AtomicNode*>(node)->get_value();
+                        switch (value->get_type()) {
+                            case SExprType::IntLiteral:
+                                return constant(BVM::BoltValue::from_int(static_cast<const IntAtom*>(value)->get_value()));
+                            case SExprType::FloatLiteral:
+                                return constant(BVM::BoltValue::from_double(static_cast<const FloatAtom*>(value)->get_value()));
+                            case SExprType::BoolLiteral:
+                                return constant(BVM::BoltValue::from_bool(static_cast<const BoolAtom*>(value)->get_value()));
+                            default:
+                                return read(symbol_name(node));
+                        }
+                    }
+                    case NodeType::Define: {
+                        auto define = static_cast<const Define*>(node);
+                        return write(define->get_id(), build(define->get_expr()));
+                    }
+                    case NodeType::Set: {
+                        auto set = static_cast<const SetExpr*>(node);
+                        return write(set->get_id(), build(set->get_expr()));
+                    }
+                    case NodeType::IfExpr:
+                        return build_if(static_cast<const IfExpr*>(node));
+                    case NodeType::Lambda: {
+                        uint16_t id = compile_nested_(static_cast<const Lambda*>(node));
+                        fn_.children.push_back(id);
+                        return emit(SsaOp::Closure, {}, id);
+                    }
+                    case NodeType::ProcCall:
+                        return build_call(static_cast<const ProcCall*>(node));
+                    default:
+                        throw std::logic_error("build_ssa: unsupported node");
+                }
+            }
+
+            /* node's value is the lambda's: an if returns from each branch
+             * and a call to anything but a native becomes a tail call */
+            void build_tail(const ASTNode* node) {
+                if (node->get_type() == NodeType::IfExpr) {
+                    auto if_expr = static_cast<const IfExpr*>(node);
+                    auto [from, t] = branch(build(if_expr->get_cond()));
+                    std::vector<int> saved = env_;
+                    cur_ = t;
+                    build_tail(if_expr->get_texpr());
+                    env_ = std::move(saved);
+                    cur_ = else_block(from);
+                    build_tail(if_expr->get_fexpr());
+                    return;
+                }
+                if (node->get_type() == NodeType::ProcCall) {
+                    auto call = static_cast<const ProcCall*>(node);
+                    const std::string& name = symbol_name(call->get_proc());
+                    if (const Lambda* callee = inlined_callee(call)) {
+                        build_inline(call, callee, true);
+                        return;
+                    }
+                    if (scope().lookup(name)->type != SymbolType::NativeProc) {
+                        std::vector<int> values = {read(name)};
+                        for (auto& arg : call->get_args())
+                            values.push_back(build(arg.get()));
+                        fn_.blocks[cur_].exit = SsaExit::TailCall;
+                        fn_.blocks[cur_].operands = std::move(values);
+                        return;
+                    }
+                }
+                int v = build(node);
+                fn_.blocks[cur_].exit = SsaExit::Return;
+                fn_.blocks[cur_].operands = {v};
+            }
+
+            void build_body(const Lambda* node) {
+                auto& exprs = node->get_exprs();
+                for (size_t i = 0; i + 1 < exprs.size(); i++)
+                    build(exprs[i].get());
+                if (exprs.empty()) {
+                    fn_.blocks[cur_].operands = {constant(BVM::BoltValue::nil())};
+                    return;
+                }
+                build_tail(exprs.back().get());
+            }
+    };
+
+    SsaFunction build_ssa(const Lambda* node, const std::function<uint16_t(const Lambda*)>& compile_nested,
+            const Inliner* inliner) {
+        SsaFunction fn;
+        SsaBuilder builder(fn, node, compile_nested, inliner);
+        builder.build_body(node);
+        return fn;
+    }
+
+    // follows copies back to the value they copy
+    static inline int source(const SsaFunction& fn, int v) {
+        while (fn.insts[v].op == SsaOp::Copy)
+            v = fn.insts[v].args[0];
+        return v;
+    }
+
+    static inline bool is_arith(NativeFunc op) {
+        return op == NativeFunc::Add || op == NativeFunc::Sub || op == NativeFunc::Mul || op == NativeFunc::Div;
+    }
+
+    bool fold_binop(NativeFunc op, BVM::BoltValue x, BVM::BoltValue y, BVM::BoltValue& res) {
+        bool ints = BVM::BoltValue::both_int(x, y);
+        bool numbers = x.is_number() && y.is_number();
+        int64_t a = ints ? x.as_int() : 0, b = ints ? y.as_int() : 0;
+        double dx = numbers ? x.to_double() : 0, dy = numbers ? y.to_double() : 0;
+        auto arith = [&](int64_t wide, double d) {
+            if (!ints)
+                res = BVM::BoltValue::from_double(d);
+            else if (wide >= INT_MIN && wide <= INT_MAX)
+                res = BVM::BoltValue::from_int(static_cast<int>(wide));
+            else
+                res = BVM::BoltValue::from_double(d);
+        };
+        auto compare = [&](bool as_int, bool as_double) {
+            res = BVM::BoltValue::from_bool(ints ? as_int : as_double);
+        };
+        if (op == NativeFunc::Eq || op == NativeFunc::Ne) {
+            bool eq = ints ? a == b : numbers ? dx == dy : x == y;
+            res = BVM::BoltValue::from_bool(op == NativeFunc::Eq ? eq : !eq);
+            return true;
+        }
+        if (!numbers)
+            return false;
+        switch (op) {
+            case NativeFunc::Add:
+                arith(a + b, ints ? static_cast<double>(a) + b : dx + dy);
+                break;
+            case NativeFunc::Sub:
+                arith(a - b, ints ? static_cast<double>(a) - b : dx - dy);
+                break;
+            case NativeFunc::Mul:
+                arith(a * b, ints ? static_cast<double>(a) * b : dx * dy);
+                break;
+            case NativeFunc::Div:
+                if (!ints)
+                    res = BVM::BoltValue::from_double(dx / dy);
+                else if (b == 0)
+                    return false;
+                else if (b == -1)
+                    arith(-a, -static_cast<double>(a));
+                else if (a % b == 0)
+                    res = BVM::BoltValue::from_int(a / b);
+                else
+                    res = BVM::BoltValue::from_double(static_cast<double>(a) / b);
+                break;
+            case NativeFunc::Lt:
+                compare(a < b, dx < dy);
+                break;
+            case NativeFunc::Lte:
+                compare(a <= b, dx <= dy);
+                break;
+            case NativeFunc::Bt:
+                compare(a > b, dx > dy);
+                break;
+            case NativeFunc::Bte:
+                compare(a >= b, dx >= dy);
+                break;
+            default:
+                return false;
+        }
+        return true;
+    }
+
+    void fold_constants(SsaFunction& fn, SsaStats& stats) {
+        for (size_t b = 0; b < fn.blocks.size(); b++) {
+            SsaBlock& block = fn.blocks[b];
+            if (block.dead)
+                continue;
+            // every predecessor was dead or branched away from it
+            if (b != 0 && block.preds.empty()) {
+                block.dead = true;
+                for (int i : block.insts)
+                    fn.insts[i].dead = true;
+                int n_succ = block.exit == SsaExit::Branch ? 2 : block.exit == SsaExit::Jump ? 1 : 0;
+                for (int s = 0; s < n_succ; s++)
+                    fn.remove_edge(b, block.succ[s]);
+                continue;
+            }
+            for (int i : block.insts) {
+                SsaInst& inst = fn.insts[i];
+                if (inst.dead)
+                    continue;
+                if (inst.op == SsaOp::Phi) {
+                    int first = source(fn, inst.args[0]);
+                    bool same = std::all_of(inst.args.begin(), inst.args.end(),
+                            [&](int v) { return source(fn, v) == first; });
+                    if (same) {
+                        inst.op = SsaOp::Copy;
+                        inst.args = {first};
+                    }
+                }
+                if (inst.op != SsaOp::Binop)
+                    continue;
+                const SsaInst& x = fn.insts[source(fn, inst.args[0])];
+                const SsaInst& y = fn.insts[source(fn, inst.args[1])];
+                BVM::BoltValue res;
+                if (x.op == SsaOp::Const && y.op == SsaOp::Const && fold_binop(inst.native, x.konst, y.konst, res)) {
+                    inst.op = SsaOp::Const;
+                    inst.konst = res;
+                    inst.args.clear();
+                    stats.folded++;
+                }
+            }
+            if (block.exit != SsaExit::Branch)
+                continue;
+            const SsaInst& cond = fn.insts[source(fn, block.operands[0])];
+            if (cond.op != SsaOp::Const)
+                continue;
+            int taken = cond.konst.is_false() ? 1 : 0;
+            fn.remove_edge(b, block.succ[1 - taken]);
+            block.exit = SsaExit::Jump;
+            block.succ[0] = block.succ[taken];
+            block.succ[1] = -1;
+            block.operands.clear();
+            stats.folded++;
+        }
+    }
+
+    void propagate_copies(SsaFunction& fn, SsaStats& stats) {
+        for (SsaBlock& block : fn.blocks) {
+            if (block.dead)
+                continue;
+            for (int& v : block.operands)
+                v = source(fn, v);
+            for (int i : block.insts) {
+                for (int& v : fn.insts[i].args)
+                    v = source(fn, v);
+            }
+        }
+        for (SsaInst& inst : fn.insts) {
+            if (!inst.dead && inst.op == SsaOp::Copy) {
+                inst.dead = true;
+                stats.copies++;
+            }
+        }
+    }
+
+    /* Walks the dominator tree keeping the binops of the blocks above in a
+     * table, a binop already there with the same operands is the same value:
+     * an earlier one that failed would have ended the run. */
+    void eliminate_common_subexprs(SsaFunction& fn, SsaStats& stats) {
+        size_t n = fn.blocks.size();
+        std::vector<int> idom(n, -1);
+        std::vector<std::vector<int>> children(n);
+        idom[0] = 0;
+        for (size_t b = 1; b < n; b++) {
+            if (fn.blocks[b].dead)
+                continue;
+            int d = -1;
+            for (int p : fn.blocks[b].preds) {
+                if (d < 0) {
+                    d = p;
+                    continue;
+                }
+                int q = p;
+                while (d != q) {
+                    while (d > q)
+                        d = idom[d];
+                    while (q > d)
+                        q = idom[q];
+                }
+            }
+            idom[b] = d;
+            children[d].push_back(b);
+        }
+
+        struct Key {
+            NativeFunc op;
+            int a, b;
+            bool operator==(const Key&) const = default;
+        };
+        struct KeyHash {
+            size_t operator()(const Key& k) const {
+                return std::hash<uint64_t>()((static_cast<uint64_t>(k.a) << 32 | static_cast<uint32_t>(k.b))
+                        * 31 + static_cast<uint64_t>(k.op));
+            }
+        };
+        std::unordered_map<Key, int, KeyHash> available;
+        std::vector<Key> added;
+        // blocks to visit, with the size of added to go back to once their subtree is done
+        std::vector<std::pair<int, size_t>> stack = {{0, 0}};
+        std::vector<int> replace(fn.insts.size(), -1);
+        while (!stack.empty()) {
+            auto [b, mark] = stack.back();
+            stack.pop_back();
+            if (b < 0) {
+                for (size_t i = mark; i < added.size(); i++)
+                    available.erase(added[i]);
+                added.resize(mark);
+                continue;
+            }
+            stack.push_back({-1, added.size()});
+            for (int i : fn.blocks[b].insts) {
+                SsaInst& inst = fn.insts[i];
+                for (int& v : inst.args) {
+                    if (replace[v] >= 0)
+                        v = replace[v];
+                }
+                if (inst.dead || inst.op != SsaOp::Binop)
+                    continue;
+                Key key = {inst.native, inst.args[0], inst.args[1]};
+                bool commutes = inst.native == NativeFunc::Add || inst.native == NativeFunc::Mul
+                    || inst.native == NativeFunc::Eq || inst.native == NativeFunc::Ne;
+                if (commutes && key.a > key.b)
+                    std::swap(key.a, key.b);
+                auto [it, fresh] = available.try_emplace(key, i);
+                if (fresh) {
+                    added.push_back(key);
+                    continue;
+                }
+                replace[i] = it->second;
+                inst.dead = true;
+                stats.cse++;
+            }
+            for (int& v : fn.blocks[b].operands) {
+                if (replace[v] >= 0)
+                    v = replace[v];
+            }
+            // phis of a successor read their arguments at the end of this block
+            for (int s : fn.blocks[b].succ) {
+                if (s < 0)
+                    continue;
+                for (int i : fn.blocks[s].insts) {
+                    if (fn.insts[i].op != SsaOp::Phi)
+                        break;
+                    for (int& v : fn.insts[i].args) {
+                        if (replace[v] >= 0)
+                            v = replace[v];
+                    }
+                }
+            }
+            for (int c : children[b])
+                stack.push_back({c, 0});
+        }
+    }
+
+    static bool is_number(const SsaFunction& fn, int v) {
+        const SsaInst& inst = fn.insts[v];
+        if (inst.op == SsaOp::Const)
+            return inst.konst.is_number();
+        return inst.op == SsaOp::Binop && is_arith(inst.native);
+    }
+
+    // nothing happens when it is left out, it cannot fail and writes nothing
+    static bool removable(const SsaFunction& fn, int v) {
+        const SsaInst& inst = fn.insts[v];
+        switch (inst.op) {
+            case SsaOp::Const:
+            case SsaOp::Param:
+            case SsaOp::Copy:
+            case SsaOp::Phi:
+            case SsaOp::GetUpval:
+            case SsaOp::ReadVar:
+            case SsaOp::Closure:
+                return true;
+            case SsaOp::Binop: {
+                if (inst.native == NativeFunc::Eq || inst.native == NativeFunc::Ne)
+                    return true;
+                if (!is_number(fn, inst.args[0]) || !is_number(fn, inst.args[1]))
+                    return false;
+                if (inst.native != NativeFunc::Div)
+                    return true;
+                const SsaInst& divisor = fn.insts[inst.args[1]];
+                return divisor.op == SsaOp::Const && !(divisor.konst.is_int() && divisor.konst.as_int() == 0);
+            }
+            default:
+                return false;
+        }
+    }
+
+    void eliminate_dead_code(SsaFunction& fn, SsaStats& stats) {
+        std::vector<int> uses(fn.insts.size(), 0);
+        for (SsaBlock& block : fn.blocks) {
+            if (block.dead)
+                continue;
+            for (int v : block.operands)
+                uses[v]++;
+            for (int i : block.insts) {
+                if (!fn.insts[i].dead) {
+                    for (int v : fn.insts[i].args)
+                        uses[v]++;
+                }
+            }
+        }
+        std::vector<int> work;
+        for (size_t i = 0; i < fn.insts.size(); i++) {
+            if (!fn.insts[i].dead && uses[i] == 0 && removable(fn, i))
+                work.push_back(i);
+        }
+        while (!work.empty()) {
+            int i = work.back();
+            work.pop_back();
+            SsaInst& inst = fn.insts[i];
+            inst.dead = true;
+            if (inst.op != SsaOp::Param)
+                stats.dead++;
+            for (int v : inst.args) {
+                if (--uses[v] == 0 && !fn.insts[v].dead && removable(fn, v))
+                    work.push_back(v);
+            }
+        }
+        for (SsaBlock& block : fn.blocks)
+            std::erase_if(block.insts, [&](int i) { return fn.insts[i].dead; });
+    }
+
+    void optimize(SsaFunction& fn, SsaStats& stats) {
+        fold_constants(fn, stats);
+        propagate_copies(fn, stats);
+        eliminate_common_subexprs(fn, stats);
+        eliminate_dead_code(fn, stats);
+    }
+
+    /* Assigns registers with a linear scan over the blocks in order and
+     * emits the instructions.
+     * - every instruction gets a position, the phis of a block its start
+     *   and the moves into successor phis and the exit its end. A value is
+     *   live from its definition to its last use, positions in between
+     *   that it is not actually live at just keep its register.
+     * - a call runs in a window of registers the callee overwrites: the
+     *   base is above everything still live after it, arguments are moved
+     *   into place in parallel. A first scan finds where each window would
+     *   go, a second prefers those registers for the arguments computed
+     *   for it and for its result, so most moves disappear.
+     * - constants that are only read as the K operand of a binop or as an
+     *   argument take no register, arguments are loaded into the window.
+     *   A captured variable read right before its use is read in place and
+     *   a value written to one only is computed into it. */
+    class Lowering {
+        private:
+            struct Interval {
+                int start;
+                int end;
+                int v;
+            };
+
+            // a call, native call or tail call and the window it needs
+            struct Site {
+                int pos;
+                int result; // -1 for none
+                int first;  // window slot of ops[0], 1 when the result is in the base
+                std::vector<int> ops;
+                int base = 0;
+            };
+
+            const SsaFunction& fn_;
+            BVM::Prototype& proto_;
+            const std::function<size_t(BVM::BoltValue)>& add_const_;
+            std::vector<int> layout_, block_start_, block_end_;
+            std::vector<int> pos_, end_, n_uses_, reg_, group_;
+            std::vector<bool> scanned_; // given a register by the scan
+            std::vector<bool> local_; // every use is in the defining block and none by a phi
+            std::vector<int> rk_;     // operand of a binop read from the constant pool, -1 for none
+            std::vector<int> k_;      // its index there
+            std::vector<Interval> intervals_;
+            std::vector<Site> sites_;
+            std::vector<int> site_of_; // by instruction, then by block for tail calls
+            int top_pinned_ = -1;
+            int top_ = 0; // highest register used
+            int scratch_ = -1;
+            bool scratch_used_ = false;
+            std::vector<uint32_t>& code_;
+
+
+            int find(int v) {
+                while (group_[v] != v)
+                    v = group_[v] = group_[group_[v]];
+                return v;
+            }
+
+            void number() {
+                int pos = 0;
+                block_start_.assign(fn_.blocks.size(), -1);
+                block_end_.assign(fn_.blocks.size(), -1);
+                pos_.assign(fn_.insts.size(), -1);
+                for (size_t b = 0; b < fn_.blocks.size(); b++) {
+                    if (fn_.blocks[b].dead)
+                        continue;
+                    layout_.push_back(b);
+                    block_start_[b] = pos++;
+                    for (int i : fn_.blocks[b].insts) {
+                        SsaOp op = fn_.insts[i].op;
+                        pos_[i] = op == SsaOp::Phi || op == SsaOp::Param ? block_start_[b] : pos++;
+                    }
+                    block_end_[b] = pos++;
+                }
+            }
+
+            void use(int v, int at, int block, bool by_phi, bool in_register) {
+                n_uses_[v]++;
+                if (by_phi || block != fn_.insts[v].block)
+                    local_[v] = false;
+                if (in_register)
+                    end_[v] = std::max(end_[v], at);
+            }
+
+            // picks the K operands of binops, then records every use
+            void scan_uses() {
+                size_t n = fn_.insts.size();
+                end_ = pos_;
+                n_uses_.assign(n, 0);
+                local_.assign(n, true);
+                rk_.assign(n, -1);
+                k_.assign(n, -1);
+                for (int b : layout_) {
+                    const SsaBlock& block = fn_.blocks[b];
+                    for (int i : block.insts) {
+                        const SsaInst& inst = fn_.insts[i];
+                        if (inst.op == SsaOp::Phi) {
+                            for (size_t p = 0; p < inst.args.size(); p++)
+                                use(inst.args[p], block_end_[block.preds[p]], block.preds[p], true, true);
+                            continue;
+                        }
+                        if (inst.op == SsaOp::Binop)
+                            pick_constant_operand(i);
+                        bool call = inst.op == SsaOp::Call || inst.op == SsaOp::CallNative;
+                        for (size_t a = 0; a < inst.args.size(); a++) {
+                            int v = inst.args[a];
+                            bool loaded = call && fn_.insts[v].op == SsaOp::Const;
+                            use(v, pos_[i], b, false, rk_[i] != static_cast<int>(a) && !loaded);
+                        }
+                    }
+                    for (int v : block.operands)
+                        use(v, block_end_[b], b, false, block.exit != SsaExit::TailCall || fn_.insts[v].op != SsaOp::Const);
+                }
+            }
+
+            void pick_constant_operand(int i) {
+                const SsaInst& inst = fn_.insts[i];
+                const BinopEncoding& enc = binops.at(inst.native);
+                const SsaInst& x = fn_.insts[inst.args[0]];
+                const SsaInst& y = fn_.insts[inst.args[1]];
+                if (y.op == SsaOp::Const) {
+                    size_t k = add_const_(y.konst);
+                    if (k <= UINT8_MAX) {
+                        rk_[i] = 1;
+                        k_[i] = k;
+                        return;
+                    }
+                }
+                if (x.op == SsaOp::Const && enc.has_mirror) {
+                    size_t k = add_const_(x.konst);
+                    if (k <= UINT8_MAX) {
+                        rk_[i] = 0;
+                        k_[i] = k;
+                    }
+                }
+            }
+
+            // nothing between v and its last use can change the variable's register
+            bool reads_in_place(int v) {
+                const SsaInst& inst = fn_.insts[v];
+                if (!local_[v])
+                    return false;
+                for (int i : fn_.blocks[inst.block].insts) {
+                    if (pos_[i] <= pos_[v])
+                        continue;
+                    if (pos_[i] >= end_[v])
+                        break;
+                    const SsaInst& other = fn_.insts[i];
+                    if (other.op == SsaOp::Call || other.op == SsaOp::CallNative
+                            || (other.op == SsaOp::WriteVar && other.imm == inst.imm))
+                        return false;
+                }
+                return true;
+            }
+
+            /* registers that do not come from the scan: captured variables
+             * read in place and values computed straight into the variable
+             * they are written to */
+            void place_pinned() {
+                reg_.assign(fn_.insts.size(), -1);
+                for (uint8_t r : fn_.pinned)
+                    top_pinned_ = std::max(top_pinned_, static_cast<int>(r));
+                for (int b : layout_) {
+                    const std::vector<int>& insts = fn_.blocks[b].insts;
+                    for (size_t j = 0; j < insts.size(); j++) {
+                        const SsaInst& inst = fn_.insts[insts[j]];
+                        if (inst.op == SsaOp::ReadVar && reads_in_place(insts[j]))
+                            reg_[insts[j]] = inst.imm;
+                        if (inst.op != SsaOp::WriteVar || j == 0)
+                            continue;
+                        int v = inst.args[0], prev = insts[j - 1];
+                        SsaOp op = fn_.insts[v].op;
+                        bool computed = op == SsaOp::Binop || op == SsaOp::Const || op == SsaOp::Closure
+                            || op == SsaOp::GetUpval || op == SsaOp::Call || op == SsaOp::CallNative
+                            || op == SsaOp::ReadVar;
+                        if (v == prev && computed && n_uses_[v] == 1 && reg_[v] < 0)
+                            reg_[v] = inst.imm;
+                    }
+                }
+            }
+
+            bool needs_register(int v) const {
+                const SsaInst& inst = fn_.insts[v];
+                if (inst.dead || reg_[v] >= 0)
+                    return false;
+                switch (inst.op) {
+                    case SsaOp::SetUpval:
+                    case SsaOp::WriteVar:
+                        return false;
+                    case SsaOp::Binop:
+                        return true; // kept for the check it makes, it still writes somewhere
+                    case SsaOp::Const:
+                        return end_[v] > pos_[v];
+                    default:
+                        return n_uses_[v] > 0;
+                }
+            }
+
+            void collect_sites() {
+                site_of_.assign(fn_.insts.size() + fn_.blocks.size(), -1);
+                for (int b : layout_) {
+                    const SsaBlock& block = fn_.blocks[b];
+                    for (int i : block.insts) {
+                        const SsaInst& inst = fn_.insts[i];
+                        if (inst.op != SsaOp::Call && inst.op != SsaOp::CallNative)
+                            continue;
+                        site_of_[i] = sites_.size();
+                        int result = needs_register(i) ? i : -1;
+                        sites_.push_back({pos_[i], result, inst.op == SsaOp::Call ? 0 : 1, inst.args});
+                    }
+                    if (block.exit == SsaExit::TailCall) {
+                        site_of_[fn_.insts.size() + b] = sites_.size();
+                        sites_.push_back({block_end_[b], -1, 0, block.operands});
+                    }
+                }
+            }
+
+            // a value computed for site s and read by nothing after it
+            bool dies_at(const Site& s, int v) const {
+                return scanned_[v] && end_[v] == s.pos;
+            }
+
+            void scan(const std::vector<int>& hints, std::vector<std::vector<Interval>>& by_reg) {
+                std::vector<int> busy(MAX_REGS, -1); // position up to which a register is taken
+                for (uint8_t r : fn_.pinned)
+                    busy[r] = INT_MAX;
+                std::vector<int> group_reg(fn_.insts.size(), -1);
+                by_reg.assign(MAX_REGS, {});
+                for (const Interval& iv : intervals_) {
+                    auto free = [&](int r) { return r >= 0 && r < MAX_REGS && busy[r] <= iv.start; };
+                    const SsaInst& inst = fn_.insts[iv.v];
+                    int g = find(iv.v), r = -1;
+                    if (inst.op == SsaOp::Param)
+                        r = inst.imm;
+                    else if (free(hints[iv.v]))
+                        r = hints[iv.v];
+                    else if (free(group_reg[g]))
+                        r = group_reg[g];
+                    else {
+                        for (int c = 0; c < MAX_REGS && r < 0; c++) {
+                            if (free(c))
+                                r = c;
+                        }
+                    }
+                    if (r < 0)
+                        throw std::runtime_error("compile: lambda needs more than 255 registers");
+                    reg_[iv.v] = r;
+                    busy[r] = iv.end;
+                    if (group_reg[g] < 0)
+                        group_reg[g] = r;
+                    by_reg[r].push_back(iv);
+                }
+            }
+
+            /* the highest register holding a value other than the site's own
+             * anywhere from from to to, -1 if there is none */
+            int highest_taken(const Site& s, int from, int to, bool strictly,
+                    const std::vector<std::vector<Interval>>& by_reg) const {
+                for (int r = MAX_REGS - 1; r >= 0; r--) {
+                    const std::vector<Interval>& ivs = by_reg[r];
+                    auto it = std::lower_bound(ivs.begin(), ivs.end(), from,
+                            [&](const Interval& iv, int p) { return strictly ? iv.end <= p : iv.end < p; });
+                    for (; it != ivs.end() && (strictly ? it->start < to : it->start <= to); it++) {
+                        bool own = it->v == s.result
+                            || (dies_at(s, it->v) && std::find(s.ops.begin(), s.ops.end(), it->v) != s.ops.end());
+                        if (!own)
+                            return r;
+                    }
+                }
+                return -1;
+            }
+
+            void allocate() {
+                size_t n = fn_.insts.size();
+                scanned_.assign(n, false);
+                group_.resize(n);
+                std::iota(group_.begin(), group_.end(), 0);
+                for (int b : layout_) {
+                    for (int i : fn_.blocks[b].insts) {
+                        if (fn_.insts[i].op != SsaOp::Phi)
+                            continue;
+                        for (int v : fn_.insts[i].args)
+                            group_[find(v)] = find(i);
+                    }
+                }
+                for (int b : layout_) {
+                    for (int i : fn_.blocks[b].insts) {
+                        if (needs_register(i))
+                            intervals_.push_back({pos_[i], std::max(end_[i], pos_[i]), i});
+                        scanned_[i] = needs_register(i);
+                    }
+                }
+                std::stable_sort(intervals_.begin(), intervals_.end(),
+                        [](const Interval& a, const Interval& b) { return a.start < b.start; });
+                collect_sites();
+
+                std::vector<int> hints(n, -1);
+                std::vector<std::vector<Interval>> by_reg;
+                scan(hints, by_reg);
+                // a value goes where the call reading it wants it rather than where its own call leaves it
+                std::vector<int> bases;
+                for (Site& s : sites_) {
+                    int from = s.pos;
+                    for (int v : s.ops) {
+                        if (dies_at(s, v))
+                            from = std::min(from, pos_[v]);
+                    }
+                    int base = std::max(top_pinned_, highest_taken(s, from, s.pos, false, by_reg)) + 1;
+                    bases.push_back(base + s.first + static_cast<int>(s.ops.size()) < MAX_REGS ? base : -1);
+                    if (s.result >= 0 && bases.back() >= 0)
+                        hints[s.result] = base;
+                }
+                for (size_t i = 0; i < sites_.size(); i++) {
+                    const Site& s = sites_[i];
+                    for (size_t j = 0; j < s.ops.size() && bases[i] >= 0; j++) {
+                        if (dies_at(s, s.ops[j]))
+                            hints[s.ops[j]] = bases[i] + s.first + j;
+                    }
+                }
+                scan(hints, by_reg);
+
+                /* the lowest base keeps everything live after the call below
+                 * the window, a higher one is taken when more of the
+                 * arguments and the result are already in place there */
+                for (Site& s : sites_) {
+                    int lowest = std::max(top_pinned_, highest_taken(s, s.pos, s.pos, true, by_reg)) + 1;
+                    std::vector<int> candidates;
+                    for (size_t j = 0; j < s.ops.size(); j++) {
+                        if (dies_at(s, s.ops[j]))
+                            candidates.push_back(reg_[s.ops[j]] - s.first - static_cast<int>(j));
+                    }
+                    if (s.result >= 0)
+                        candidates.push_back(reg_[s.result]);
+                    s.base = lowest;
+                    int best = in_place(s, lowest);
+                    for (int base : candidates) {
+                        if (base <= lowest || base + s.first + s.ops.size() >= MAX_REGS)
+                            continue;
+                        int hits = in_place(s, base);
+                        if (hits > best || (hits == best && base < s.base)) {
+                            best = hits;
+                            s.base = base;
+                        }
+                    }
+                    if (s.base + s.first + s.ops.size() >= MAX_REGS)
+                        throw std::runtime_error("compile: lambda needs more than 255 registers");
+                    top_ = std::max(top_, s.base + s.first + static_cast<int>(s.ops.size()) - 1);
+                    top_ = std::max(top_, s.base);
+                }
+                for (size_t v = 0; v < n; v++) {
+                    if (reg_[v] >= 0 && !fn_.insts[v].dead)
+                        top_ = std::max(top_, reg_[v]);
+                }
+                top_ = std::max({top_, top_pinned_, fn_.arity - 1});
+                scratch_ = top_ + 1;
+            }
+
+            int in_place(const Site& s, int base) const {
+                int hits = s.result >= 0 && reg_[s.result] == base;
+                for (size_t j = 0; j < s.ops.size(); j++)
+                    hits += reg_[s.ops[j]] == base + s.first + static_cast<int>(j);
+                return hits;
+            }
+
+            void mov(int dst, int src) {
+                if (dst != src)
+                    code_.push_back(BVM::Emitter::mov(dst, src));
+            }
+
+            // moves (dst, src) at once, a cycle goes through the scratch register
+            void parallel_move(std::vector<std::pair<int, int>> moves) {
+                std::erase_if(moves, [](auto& m) { return m.first == m.second; });
+                while (!moves.empty()) {
+                    bool moved = false;
+                    for (size_t i = 0; i < moves.size(); i++) {
+                        int dst = moves[i].first;
+                        bool read_later = std::any_of(moves.begin(), moves.end(),
+                                [&](auto& m) { return m.second == dst; });
+                        if (read_later)
+                            continue;
+                        mov(dst, moves[i].second);
+                        moves.erase(moves.begin() + i);
+                        moved = true;
+                        break;
+                    }
+                    if (moved)
+                        continue;
+                    if (scratch_ >= MAX_REGS)
+                        throw std::runtime_error("compile: lambda needs more than 255 registers");
+                    int src = moves[0].second;
+                    mov(scratch_, src);
+                    scratch_used_ = true;
+                    for (auto& m : moves) {
+                        if (m.second == src)
+                            m.second = scratch_;
+                    }
+                }
+            }
+
+            // constants are loaded into their slots once the moves are done
+            void window(const Site& s) {
+                std::vector<std::pair<int, int>> moves;
+                for (size_t j = 0; j < s.ops.size(); j++) {
+                    if (fn_.insts[s.ops[j]].op != SsaOp::Const)
+                        moves.push_back({s.base + s.first + j, reg_[s.ops[j]]});
+                }
+                parallel_move(std::move(moves));
+                for (size_t j = 0; j < s.ops.size(); j++) {
+                    const SsaInst& op = fn_.insts[s.ops[j]];
+                    if (op.op == SsaOp::Const)
+                        code_.push_back(BVM::Emitter::load_const(s.base + s.first + j, constant(op.konst)));
+                }
+            }
+
+            uint16_t constant(BVM::BoltValue v) {
+                size_t k = add_const_(v);
+                if (k > UINT16_MAX)
+                    throw std::runtime_error("compile: too many constants");
+                return k;
+            }
+
+            void emit(int i) {
+                const SsaInst& inst = fn_.insts[i];
+                int rd = reg_[i];
+                switch (inst.op) {
+                    case SsaOp::Const:
+                        if (rd >= 0)
+                            code_.push_back(BVM::Emitter::load_const(rd, constant(inst.konst)));
+                        break;
+                    case SsaOp::Binop: {
+                        const BinopEncoding& enc = binops.at(inst.native);
+                        int a = inst.args[0], b = inst.args[1];
+                        if (rk_[i] == 1)
+                            code_.push_back(enc.rk(rd, reg_[a], k_[i]));
+                        else if (rk_[i] == 0)
+                            code_.push_back(binops.at(enc.mirror).rk(rd, reg_[b], k_[i]));
+                        else
+                            code_.push_back(enc.rr(rd, reg_[a], reg_[b]));
+                        break;
+                    }
+                    case SsaOp::CallNative:
+                    case SsaOp::Call: {
+                        const Site& s = sites_[site_of_[i]];
+                        window(s);
+                        uint8_t n = inst.op == SsaOp::Call ? s.ops.size() - 1 : s.ops.size();
+                        if (inst.op == SsaOp::Call)
+                            code_.push_back(BVM::Emitter::call(s.base, n));
+                        else
+                            code_.push_back(BVM::Emitter::call_native(s.base, n, inst.imm));
+                        if (rd >= 0)
+                            mov(rd, s.base);
+                        break;
+                    }
+                    case SsaOp::GetUpval:
+                        code_.push_back(BVM::Emitter::get_upval(rd, inst.imm));
+                        break;
+                    case SsaOp::SetUpval:
+                        code_.push_back(BVM::Emitter::set_upval(reg_[inst.args[0]], inst.imm));
+                        break;
+                    case SsaOp::ReadVar:
+                        mov(rd, inst.imm);
+                        break;
+                    case SsaOp::WriteVar:
+                        mov(inst.imm, reg_[inst.args[0]]);
+                        break;
+                    case SsaOp::Closure:
+                        code_.push_back(BVM::Emitter::closure(rd, inst.imm));
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            void emit_code() {
+                std::vector<size_t> start(fn_.blocks.size());
+                struct Jump {
+                    size_t at;
+                    int target;
+                    int cond; // -1 for jmp
+                };
+                std::vector<Jump> jumps;
+                for (size_t l = 0; l < layout_.size(); l++) {
+                    int b = layout_[l];
+                    int next = l + 1 < layout_.size() ? layout_[l + 1] : -1;
+                    const SsaBlock& block = fn_.blocks[b];
+                    start[b] = code_.size();
+                    for (int i : block.insts)
+                        emit(i);
+                    switch (block.exit) {
+                        case SsaExit::Jump: {
+                            int s = block.succ[0];
+                            const SsaBlock& succ = fn_.blocks[s];
+                            size_t p = std::find(succ.preds.begin(), succ.preds.end(), b) - succ.preds.begin();
+                            std::vector<std::pair<int, int>> moves;
+                            for (int i : succ.insts) {
+                                if (fn_.insts[i].op == SsaOp::Phi && reg_[i] >= 0)
+                                    moves.push_back({reg_[i], reg_[fn_.insts[i].args[p]]});
+                            }
+                            parallel_move(std::move(moves));
+                            if (s != next) {
+                                jumps.push_back({code_.size(), s, -1});
+                                code_.push_back(0);
+                            }
+                            break;
+                        }
+                        case SsaExit::Branch:
+                            jumps.push_back({code_.size(), block.succ[1], reg_[block.operands[0]]});
+                            code_.push_back(0);
+                            if (block.succ[0] != next) {
+                                jumps.push_back({code_.size(), block.succ[0], -1});
+                                code_.push_back(0);
+                            }
+                            break;
+                        case SsaExit::Return:
+                            code_.push_back(BVM::Emitter::ret(reg_[block.operands[0]]));
+                            break;
+                        case SsaExit::TailCall: {
+                            const Site& s = sites_[site_of_[fn_.insts.size() + b]];
+                            window(s);
+                            code_.push_back(BVM::Emitter::tail_call(s.base, s.ops.size() - 1));
+                            break;
+                        }
+                    }
+                }
+                for (const Jump& j : jumps) {
+                    int64_t offset = static_cast<int64_t>(start[j.target]) - static_cast<int64_t>(j.at) - 1;
+                    if (j.cond < 0)
+                        code_[j.at] = BVM::Emitter::jmp(offset);
+                    else if (offset > INT16_MAX)
+                        throw std::runtime_error("compile: branch too far");
+                    else
+                        code_[j.at] = BVM::Emitter::jmp_if_false(j.cond, offset);
+                }
+            }
+
+        public:
+            Lowering(const SsaFunction& fn, BVM::Prototype& proto, const std::function<size_t(BVM::BoltValue)>& add_const)
+                : fn_(fn), proto_(proto), add_const_(add_const), code_(proto.instructions) {}
+
+            void run() {
+                number();
+                scan_uses();
+                place_pinned();
+                allocate();
+                emit_code();
+                proto_.next_reg = std::max(top_ + 1 + scratch_used_, fn_.arity);
+            }
+    };
+
+    void lower_ssa(const SsaFunction& fn, BVM::Prototype& proto, const std::function<size_t(BVM::BoltValue)>& add_const) {
+        Lowering lowering(fn, proto, add_const);
+        lowering.run();
+    }
+}
@@ -0,0 +1,215 @@
+#include "bolt_virtual_machine/scheduler.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace BVM {
+
+    // the worker the current thread is, if any
+    static thread_local const Scheduler* current_scheduler = nullptr;
+    static thread_local size_t current_worker = SIZE_MAX;
+    // Task::started of the innermost task running on the current thread
+    static thread_local uint64_t current_started = 0;
+
+    Scheduler::Scheduler(std::shared_ptr<const Program> program, unsigned n_workers, int64_t slice,
+            size_t stack_slots, size_t nursery_cells)
+            : pool_(std::move(program), 64, stack_slots, nursery_cells), slice_(slice) {
+        if (slice <= 0)
+            throw std::runtime_error("Scheduler: the slice must be positive");
+        if (n_workers == 0)
+            n_workers = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < n_workers; i++)
+            workers_.push_back(std::make_unique<Worker>());
+        for (unsigned i = 0; i < n_workers; i++)
+            threads_.emplace_back(&Scheduler::work, this, i);
+    }
+
+    Scheduler::~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex_);
+            stopping_ = true;
+        }
+        idle_cv_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    Interrupt Scheduler::run(VirtualMachine& vm) {
+        if (&vm.get_program() != &pool_.get_program())
+            throw std::runtime_error("Scheduler: vm runs a different program");
+        vm.set_scheduler(this);
+        Interrupt interrupt;
+        try {
+            for (;;) {
+                vm.set_budget(slice_);
+                interrupt = vm.run();
+                if (interrupt != Interrupt::Yield)
+                    break;
+                if (Task* task = pop(SIZE_MAX))
+                    run_task(task);
+            }
+        } catch (...) {
+            vm.set_scheduler(nullptr);
+            throw;
+        }
+        vm.set_scheduler(nullptr);
+        return interrupt;
+    }
+
+    /* the callee and the arguments are copied into the task's context right
+     * away, the spawner may collect or mutate them as soon as this returns */
+    int Scheduler::spawn(BoltValue callee, NativeArgs args) {
+        auto task = std::make_unique<Task>(pool_.acquire());
+        task->vm->set_scheduler(this);
+        task->vm->setup_call(callee, args);
+
+        Task* t = task.get();
+        int id;
+        {
+            std::lock_guard<std::mutex> lock(tasks_mutex_);
+            id = next_id_++;
+            tasks_.emplace(id, std::move(task));
+        }
+        push(t);
+        return id;
+    }
+
+    /* the joiner takes the task out of the table first, a handle can only
+     * be joined once */
+    Interrupt Scheduler::join(VirtualMachine& vm, int id, BoltValue& res) {
+        std::unique_ptr<Task> task;
+        {
+            std::lock_guard<std::mutex> lock(tasks_mutex_);
+            auto it = tasks_.find(id);
+            if (it == tasks_.end())
+                return Interrupt::IncompatibleTypes;
+            task = std::move(it->second);
+            tasks_.erase(it);
+        }
+
+        size_t self = current_scheduler == this ? current_worker : SIZE_MAX;
+        while (!task->done.load(std::memory_order_acquire)) {
+            // what is queued may be off limits here, wait for that to change
+            size_t seen = queued_.load();
+            if (Task* other = pop(self, current_started)) {
+                run_task(other);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            idle_cv_.wait(lock, [&] {
+                return queued_.load() != seen || task->done.load(std::memory_order_acquire);
+            });
+        }
+
+        Interrupt status = task->status;
+        if (status == Interrupt::Halt) {
+            res = vm.import_value(task->vm->get_return_value());
+            status = Interrupt::Ok;
+        }
+        return status;
+    }
+
+    /* the owner pops from the back, thieves from the front - a yielded task
+     * goes to the front to let every other task on its worker run first */
+    void Scheduler::push(Task* task, bool behind) {
+        size_t target = current_scheduler == this ? current_worker : next_victim_++ % workers_.size();
+        {
+            std::lock_guard<std::mutex> lock(workers_[target]->mutex);
+            if (behind)
+                workers_[target]->tasks.push_front(task);
+            else
+                workers_[target]->tasks.push_back(task);
+        }
+        queued_++;
+        wake();
+    }
+
+    static Task* take(std::deque<Task*>& tasks, bool newest, uint64_t after) {
+        auto eligible = [after](Task* t) { return t->started == 0 || t->started > after; };
+        if (newest) {
+            auto it = std::find_if(tasks.rbegin(), tasks.rend(), eligible);
+            if (it == tasks.rend())
+                return nullptr;
+            Task* task = *it;
+            tasks.erase(std::next(it).base());
+            return task;
+        }
+        auto it = std::find_if(tasks.begin(), tasks.end(), eligible);
+        if (it == tasks.end())
+            return nullptr;
+        Task* task = *it;
+        tasks.erase(it);
+        return task;
+    }
+
+    Task* Scheduler::pop(size_t self, uint64_t after) {
+        if (queued_.load() == 0)
+            return nullptr;
+        if (self < workers_.size()) {
+            Worker& own = *workers_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (Task* task = take(own.tasks, true, after)) {
+                queued_--;
+                return task;
+            }
+        }
+        size_t n = workers_.size();
+        size_t start = self < n ? self + 1 : next_victim_.load();
+        for (size_t i = 0; i < n; i++) {
+            Worker& victim = *workers_[(start + i) % n];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (Task* task = take(victim.tasks, false, after)) {
+                queued_--;
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    /* nothing may touch the task once done is set, its joiner frees it */
+    void Scheduler::run_task(Task* task) {
+        if (task->started == 0)
+            task->started = ++next_start_;
+        uint64_t outer = current_started;
+        current_started = task->started;
+        Interrupt status;
+        try {
+            task->vm->set_budget(slice_);
+            status = task->vm->run();
+        } catch (...) {
+            status = Interrupt::TaskFailed;
+        }
+        current_started = outer;
+        if (status == Interrupt::Yield) {
+            push(task, true);
+            return;
+        }
+        task->status = status;
+        task->done.store(true, std::memory_order_release);
+        wake();
+    }
+
+    /* taking the lock orders the wakeup after any waiter's predicate check.
+     * Everyone is woken: a joiner may not be allowed to run what was queued
+     * while an idle worker is. */
+    void Scheduler::wake() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex_);
+        }
+        idle_cv_.notify_all();
+    }
+
+    void Scheduler::work(size_t self) {
+        current_scheduler = this;
+        current_worker = self;
+        for (;;) {
+            if (Task* task = pop(self)) {
+                run_task(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            idle_cv_.wait(lock, [&] { return stopping_ || queued_.load() > 0; });
+            if (stopping_ && queued_.load() == 0)
+                return;
+        }
+    }
+}
@@ -0,0 +1,934 @@
+#include "bolt_virtual_machine/jit.hpp"
+
+#ifdef BVM_JIT
+
+#include "bolt_virtual_machine/assembler.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+/* Loop traces. A loop is closed by a backward jump to its header or by a
+ * prototype tail calling itself, which loops back to instruction 0. Once
+ * one has closed TRACE_THRESHOLD times, the interpreter or native code asks
+ * Jit::trace for a trace of it:
+ * - recording runs one iteration through execute() and keeps every
+ *   instruction with the types of the values it read
+ * - the recording is replayed over an abstract frame that knows, for every
+ *   register, whether it still is what the frame holds, a constant, the
+ *   running closure or a number or boolean unboxed in a machine register.
+ *   Constants fold, a compare feeding a branch becomes a guard on the flags
+ *   and the registers read before they are written are loaded and type
+ *   checked once per entry, ahead of the loop - so are upvalues, nothing a
+ *   trace runs can change them
+ * - every guard has a snapshot of the abstract frame. Failing writes back
+ *   what the frame is missing and leaves for the interpreter at the
+ *   instruction the recording did not take.
+ * Values get machine registers by linear scan, a trace needing more than
+ * there are is not compiled. So are loops whose types change from one
+ * iteration to the next and anything else outside of moves, constants,
+ * arithmetic, comparisons, branches and upvalue loads. */
+
+namespace BVM {
+
+    namespace {
+        constexpr uint32_t NO_VALUE = UINT32_MAX;
+
+        // a number or boolean unboxed into a machine register
+        struct Value {
+            enum Kind : uint8_t { Int, Double, Bool } kind;
+            uint32_t start = 0, end = 0; // live range, in positions of the trace
+            int reg = -1;                // a general purpose register for Int and Bool, xmm for Double
+        };
+
+        // where a frame register's value is while the trace runs
+        struct Slot {
+            enum Where : uint8_t {
+                Frame, // in the frame, where the interpreter left it
+                Const, // k, known while compiling
+                Self,  // the running closure
+                Reg,   // unboxed, value
+            } where = Frame;
+            BoltValue k = BoltValue::nil();
+            uint32_t value = NO_VALUE;
+
+            static Slot constant(BoltValue k) { return {Const, k, NO_VALUE}; }
+            static Slot reg(uint32_t value) { return {Reg, BoltValue::nil(), value}; }
+
+            bool operator==(const Slot& other) const {
+                if (where != other.where)
+                    return false;
+                if (where == Const)
+                    return k.get_type() == other.k.get_type() && k == other.k;
+                return where != Reg || value == other.value;
+            }
+        };
+
+        // what a failing guard writes back to the frame, and where the interpreter goes on
+        struct Snapshot {
+            uint32_t ip;
+            Interrupt status;
+            std::vector<std::pair<uint8_t, Slot>> slots;
+        };
+
+        struct Ir {
+            enum Op : uint8_t {
+                // ahead of the loop, once per entry - failing leaves before anything happened
+                Load,       // dst = frame register r, checked to be of dst's kind
+                LoadUpval,  // dst = upvalue r, the same
+                CheckFrame, // frame register r holds x, a Const or Self
+                CheckUpval, // upvalue r holds the running closure
+                CheckOpen,  // no open upvalue points into the frame, a tail call would close it
+                // the loop
+                Arith,      // dst = x op y, exits where the interpreter's result is not of dst's kind
+                Compare,    // dst = x op y or, fused with a branch, exits unless x op y is expect
+                Test,       // exits unless x is expect
+                Charge,     // takes cost from the budget, exits with Yield when it runs out
+                Store,      // frame register r = x, at the end of an iteration
+            } op;
+            Opcode bop = Opcode::OpAdd;
+            uint8_t r = 0;
+            uint32_t dst = NO_VALUE;
+            Slot x = {}, y = {};
+            bool expect = false;
+            int32_t cost = 0;
+            int snapshot = -1;
+        };
+
+        struct Plan {
+            std::vector<Value> values;
+            std::vector<Ir> head, body;
+            std::vector<Snapshot> snapshots;
+            // a value read before the loop writes it and the one it takes for the next iteration
+            std::vector<std::pair<uint32_t, Slot>> phis;
+        };
+
+        bool kind_of(BoltType type, Value::Kind& kind) {
+            switch(type) {
+                case BoltType::Integer: kind = Value::Int; return true;
+                case BoltType::Float: kind = Value::Double; return true;
+                case BoltType::Boolean: kind = Value::Bool; return true;
+                default: return false;
+            }
+        }
+
+        bool kind_of(const Plan& plan, const Slot& s, Value::Kind& kind) {
+            if (s.where == Slot::Reg) {
+                kind = plan.values[s.value].kind;
+                return true;
+            }
+            return s.where == Slot::Const && kind_of(s.k.get_type(), kind);
+        }
+
+        bool is_eq(Opcode op) {
+            return op == Opcode::OpEq || op == Opcode::OpNe || op == Opcode::OpEqRK || op == Opcode::OpNeRK;
+        }
+
+        // the generic opcode of an RK form
+        Opcode register_form(Opcode op) {
+            if (op >= Opcode::OpAddRK && op <= Opcode::OpNeRK) {
+                static const Opcode forms[] = {
+                    Opcode::OpAdd, Opcode::OpSub, Opcode::OpMul, Opcode::OpDiv, Opcode::OpLt, Opcode::OpLte,
+                    Opcode::OpBt, Opcode::OpBte, Opcode::OpEq, Opcode::OpNe,
+                };
+                return forms[static_cast<uint8_t>(op) - static_cast<uint8_t>(Opcode::OpAddRK)];
+            }
+            return op;
+        }
+
+        /* x op y on two int constants where the interpreter's result is an
+         * int or a boolean too, false when it is not */
+        bool fold(Opcode op, int x, int y, BoltValue& res) {
+            int r;
+            switch(register_form(op)) {
+                case Opcode::OpAdd: if (__builtin_add_overflow(x, y, &r)) return false; break;
+                case Opcode::OpSub: if (__builtin_sub_overflow(x, y, &r)) return false; break;
+                case Opcode::OpMul: if (__builtin_mul_overflow(x, y, &r)) return false; break;
+                case Opcode::OpDiv:
+                    if (y == 0 || y == -1 || x % y != 0)
+                        return false;
+                    r = x / y;
+                    break;
+                case Opcode::OpLt: res = BoltValue::from_bool(x < y); return true;
+                case Opcode::OpLte: res = BoltValue::from_bool(x <= y); return true;
+                case Opcode::OpBt: res = BoltValue::from_bool(x > y); return true;
+                case Opcode::OpBte: res = BoltValue::from_bool(x >= y); return true;
+                case Opcode::OpEq: res = BoltValue::from_bool(x == y); return true;
+                case Opcode::OpNe: res = BoltValue::from_bool(x != y); return true;
+                default: return false;
+            }
+            res = BoltValue::from_int(r);
+            return true;
+        }
+
+        /* Replays the recorded iteration over the abstract frame into plan,
+         * false for anything a trace cannot do. */
+        bool build(const Prototype* proto, size_t header, const std::vector<TraceStep>& steps, Plan& plan) {
+            const size_t n_regs = proto->next_reg;
+            std::vector<Slot> frame(n_regs);
+            std::vector<Slot> entry(n_regs); // what the loop starts with
+            std::vector<uint32_t> upvals(256, NO_VALUE);
+            std::vector<bool> checked(256, false);
+            bool checked_open = false;
+
+            auto new_value = [&](Value::Kind kind) {
+                plan.values.push_back({kind});
+                return static_cast<uint32_t>(plan.values.size() - 1);
+            };
+            // the frame's value of r the first time the loop reads it, the same every iteration after
+            auto read = [&](uint8_t r, BoltType seen, Slot& out) {
+                if (r >= n_regs)
+                    return false;
+                if (frame[r].where == Slot::Frame) {
+                    Value::Kind kind;
+                    if (!kind_of(seen, kind))
+                        return false;
+                    uint32_t v = new_value(kind);
+                    plan.head.push_back({.op = Ir::Load, .r = r, .dst = v});
+                    frame[r] = entry[r] = Slot::reg(v);
+                }
+                out = frame[r];
+                return true;
+            };
+            auto snapshot = [&](uint32_t ip, Interrupt status) {
+                Snapshot snap{ip, status, {}};
+                for (size_t r = 0; r < n_regs; r++) {
+                    if (frame[r].where != Slot::Frame)
+                        snap.slots.push_back({static_cast<uint8_t>(r), frame[r]});
+                }
+                plan.snapshots.push_back(std::move(snap));
+                return static_cast<int>(plan.snapshots.size() - 1);
+            };
+            // where the recording went after steps[i]
+            auto next_ip = [&](size_t i) {
+                return i + 1 < steps.size() ? steps[i + 1].ip : static_cast<uint32_t>(header);
+            };
+            /* the iteration is over: charge it, then make the frame what the
+             * next one starts with */
+            auto close = [&](int32_t cost) {
+                plan.body.push_back({.op = Ir::Charge, .cost = cost, .snapshot = snapshot(header, Interrupt::Yield)});
+                for (size_t r = 0; r < n_regs; r++) {
+                    const Slot& end = frame[r];
+                    if (entry[r].where == Slot::Reg) {
+                        uint32_t phi = entry[r].value;
+                        Value::Kind kind;
+                        // a type that changes from one iteration to the next has no trace
+                        if (!kind_of(plan, end, kind) || kind != plan.values[phi].kind)
+                            return false;
+                        if (!(end == entry[r]))
+                            plan.phis.push_back({phi, end});
+                    } else if (end.where == Slot::Const || end.where == Slot::Self) {
+                        // true of every iteration once it is true of the first
+                        plan.head.push_back({.op = Ir::CheckFrame, .r = static_cast<uint8_t>(r), .x = end});
+                    } else if (end.where == Slot::Reg) {
+                        plan.body.push_back({.op = Ir::Store, .r = static_cast<uint8_t>(r), .x = end});
+                    }
+                }
+                /* from the second iteration on the frame is behind on what
+                 * the loop carries in registers, exits before it is read
+                 * again write it back as well */
+                for (Snapshot& snap : plan.snapshots) {
+                    for (size_t r = 0; r < n_regs; r++) {
+                        bool written = std::any_of(snap.slots.begin(), snap.slots.end(), [&](const auto& s) { return s.first == r; });
+                        if (entry[r].where == Slot::Reg && !written)
+                            snap.slots.push_back({static_cast<uint8_t>(r), entry[r]});
+                    }
+                }
+                return true;
+            };
+
+            for (size_t i = 0; i < steps.size(); i++) {
+                const TraceStep& step = steps[i];
+                const bool last = i + 1 == steps.size();
+                uint32_t inst = step.inst;
+                Opcode op = VirtualMachine::decode_op(inst);
+                uint8_t rd = VirtualMachine::decode_rd(inst);
+                uint8_t rt = VirtualMachine::decode_rt(inst);
+                uint8_t rs = VirtualMachine::decode_rs(inst);
+                // a jump's offset is where other instructions have rd
+                if (op != Opcode::OpJmp && rd >= n_regs)
+                    return false;
+
+                switch(op) {
+                    case Opcode::OpMov: {
+                        Slot x;
+                        if (!read(rt, step.types[0], x))
+                            return false;
+                        frame[rd] = x;
+                        break;
+                    }
+
+                    case Opcode::OpConst:
+                        frame[rd] = Slot::constant(proto->consts.at(inst >> 16));
+                        break;
+
+                    case Opcode::OpJmp:
+                        if (last)
+                            return close(static_cast<int32_t>(step.ip + 1 - header));
+                        break;
+
+                    case Opcode::OpJmpIfFalse: {
+                        Slot x;
+                        if (!read(rd, step.types[0], x))
+                            return false;
+                        uint32_t fall = step.ip + 1;
+                        uint32_t target = fall + VirtualMachine::decode_offset16(inst);
+                        bool jumped = next_ip(i) != fall;
+                        if (x.where == Slot::Const) {
+                            if (x.k.is_false() != jumped)
+                                return false;
+                        } else if (plan.values[x.value].kind == Value::Bool) {
+                            plan.body.push_back({.op = Ir::Test, .x = x, .expect = !jumped,
+                                    .snapshot = snapshot(jumped ? fall : target, Interrupt::Ok)});
+                            frame[rd] = Slot::constant(BoltValue::from_bool(!jumped));
+                        } else if (jumped) {
+                            return false; // a number is never false
+                        }
+                        if (last)
+                            return jumped && target == header && close(static_cast<int32_t>(fall - target));
+                        break;
+                    }
+
+                    case Opcode::OpAdd: case Opcode::OpSub: case Opcode::OpMul: case Opcode::OpDiv:
+                    case Opcode::OpAddRK: case Opcode::OpSubRK: case Opcode::OpMulRK: case Opcode::OpDivRK:
+                    case Opcode::OpLt: case Opcode::OpLte: case Opcode::OpBt: case Opcode::OpBte:
+                    case Opcode::OpEq: case Opcode::OpNe:
+                    case Opcode::OpLtRK: case Opcode::OpLteRK: case Opcode::OpBtRK: case Opcode::OpBteRK:
+                    case Opcode::OpEqRK: case Opcode::OpNeRK: {
+                        Slot x, y;
+                        if (!read(rt, step.types[0], x))
+                            return false;
+                        if (op >= Opcode::OpAddRK && op <= Opcode::OpNeRK)
+                            y = Slot::constant(proto->consts.at(rs));
+                        else if (!read(rs, step.types[1], y))
+                            return false;
+                        Value::Kind kx, ky;
+                        if (!kind_of(plan, x, kx) || !kind_of(plan, y, ky) || kx == Value::Bool || ky == Value::Bool)
+                            return false;
+                        const bool both_int = kx == Value::Int && ky == Value::Int;
+                        // ucomisd cannot tell equal from unordered on its own
+                        if (is_eq(op) && !both_int)
+                            return false;
+                        BoltValue folded;
+                        if (x.where == Slot::Const && y.where == Slot::Const && both_int
+                                && fold(op, x.k.as_int(), y.k.as_int(), folded)) {
+                            frame[rd] = Slot::constant(folded);
+                            break;
+                        }
+
+                        if (!is_compare(op)) {
+                            // the type of an int division depends on the values, it keeps the recorded one
+                            bool inexact = both_int && register_form(op) == Opcode::OpDiv
+                                && step.types[2] == BoltType::Float;
+                            uint32_t v = new_value(both_int && !inexact ? Value::Int : Value::Double);
+                            plan.body.push_back({.op = Ir::Arith, .bop = register_form(op), .dst = v, .x = x, .y = y,
+                                    .snapshot = snapshot(step.ip, Interrupt::Ok)});
+                            frame[rd] = Slot::reg(v);
+                            break;
+                        }
+
+                        // a branch on the result right after decides it with the flags
+                        if (!last && VirtualMachine::decode_op(steps[i + 1].inst) == Opcode::OpJmpIfFalse
+                                && VirtualMachine::decode_rd(steps[i + 1].inst) == rd) {
+                            const TraceStep& branch = steps[++i];
+                            uint32_t fall = branch.ip + 1;
+                            uint32_t target = fall + VirtualMachine::decode_offset16(branch.inst);
+                            bool jumped = next_ip(i) != fall;
+                            // what the exit writes back is the outcome the recording did not see
+                            frame[rd] = Slot::constant(BoltValue::from_bool(jumped));
+                            int snap = snapshot(jumped ? fall : target, Interrupt::Ok);
+                            plan.body.push_back({.op = Ir::Compare, .bop = register_form(op), .x = x, .y = y,
+                                    .expect = !jumped, .snapshot = snap});
+                            frame[rd] = Slot::constant(BoltValue::from_bool(!jumped));
+                            if (i + 1 == steps.size())
+                                return jumped && target == header && close(static_cast<int32_t>(fall - target));
+                            break;
+                        }
+                        uint32_t v = new_value(Value::Bool);
+                        plan.body.push_back({.op = Ir::Compare, .bop = register_form(op), .dst = v, .x = x, .y = y});
+                        frame[rd] = Slot::reg(v);
+                        break;
+                    }
+
+                    case Opcode::OpGetUpval:
+                        if (step.self) {
+                            if (!checked[rt])
+                                plan.head.push_back({.op = Ir::CheckUpval, .r = rt});
+                            checked[rt] = true;
+                            frame[rd] = Slot{Slot::Self};
+                            break;
+                        }
+                        if (upvals[rt] == NO_VALUE) {
+                            Value::Kind kind;
+                            if (!kind_of(step.types[0], kind))
+                                return false;
+                            upvals[rt] = new_value(kind);
+                            plan.head.push_back({.op = Ir::LoadUpval, .r = rt, .dst = upvals[rt]});
+                        }
+                        frame[rd] = Slot::reg(upvals[rt]);
+                        break;
+
+                    /* only ever the last step, back to instruction 0 of the
+                     * same frame: the arguments become the first registers,
+                     * the rest of the window is cleared */
+                    case Opcode::OpTailCall: {
+                        if (!last || header != 0 || frame[rd].where != Slot::Self)
+                            return false;
+                        std::vector<Slot> args(rt);
+                        for (uint8_t a = 0; a < rt; a++) {
+                            if (!read(rd + 1 + a, step.types[a], args[a]))
+                                return false;
+                        }
+                        if (!checked_open)
+                            plan.head.push_back({.op = Ir::CheckOpen});
+                        checked_open = true;
+                        for (size_t r = 0; r < n_regs; r++)
+                            frame[r] = r < rt ? args[r] : Slot::constant(BoltValue::nil());
+                        return close(1);
+                    }
+
+                    default:
+                        return false;
+                }
+            }
+            return false;
+        }
+
+        /* Live ranges and linear scan. Positions count the head from 0,
+         * then the body, and end is past the last instruction where the
+         * values for the next iteration are taken. Whatever the head
+         * defines lives through the whole loop. */
+        bool allocate(Plan& plan) {
+            const uint32_t loop = plan.head.size();
+            const uint32_t end = loop + 1 + plan.body.size();
+            auto use = [&](const Slot& s, uint32_t at) {
+                if (s.where == Slot::Reg)
+                    plan.values[s.value].end = std::max(plan.values[s.value].end, at);
+            };
+            for (uint32_t i = 0; i < plan.head.size(); i++) {
+                if (plan.head[i].dst != NO_VALUE)
+                    plan.values[plan.head[i].dst] = {plan.values[plan.head[i].dst].kind, i, end};
+            }
+            for (uint32_t i = 0; i < plan.body.size(); i++) {
+                const Ir& ir = plan.body[i];
+                uint32_t at = loop + 1 + i;
+                if (ir.dst != NO_VALUE)
+                    plan.values[ir.dst] = {plan.values[ir.dst].kind, at, at};
+                use(ir.x, at);
+                use(ir.y, at);
+                if (ir.snapshot >= 0) {
+                    for (auto& [r, s] : plan.snapshots[ir.snapshot].slots)
+                        use(s, at);
+                }
+            }
+            for (auto& [phi, next] : plan.phis)
+                use(next, end);
+
+            static const Assembler::Reg gprs[] = {
+                Assembler::R8, Assembler::R9, Assembler::R10, Assembler::R11,
+                Assembler::R14, Assembler::R15, Assembler::RSI, Assembler::RDI,
+            };
+            std::vector<int> free_gprs(std::begin(gprs), std::end(gprs));
+            std::vector<int> free_xmms;
+            for (int x = 15; x >= 2; x--)
+                free_xmms.push_back(x);
+            std::vector<uint32_t> order(plan.values.size()), active;
+            for (uint32_t v = 0; v < order.size(); v++)
+                order[v] = v;
+            std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                return plan.values[a].start < plan.values[b].start;
+            });
+            for (uint32_t v : order) {
+                Value& value = plan.values[v];
+                std::erase_if(active, [&](uint32_t other) {
+                    const Value& o = plan.values[other];
+                    if (o.end >= value.start)
+                        return false;
+                    (o.kind == Value::Double ? free_xmms : free_gprs).push_back(o.reg);
+                    return true;
+                });
+                std::vector<int>& pool = value.kind == Value::Double ? free_xmms : free_gprs;
+                if (pool.empty())
+                    return false;
+                value.reg = pool.back();
+                pool.pop_back();
+                active.push_back(v);
+            }
+            return true;
+        }
+    }
+
+    /* Runs one iteration of the loop at vm's ip_ through execute(), noting
+     * every instruction and the types it reads, and charges the budget
+     * like the interpreter would have. True when it came back to the
+     * header. False leaves the frame at the first instruction a trace
+     * cannot contain, not yet run, or wherever an interrupt stopped it. */
+    bool Jit::record(VirtualMachine& vm, std::vector<TraceStep>& steps, Interrupt& interrupt) {
+        const Prototype* proto = vm.frame_proto();
+        std::span<const uint32_t> code = proto->code();
+        const size_t header = vm.ip_;
+        auto self = [&vm](BoltValue v) {
+            return v.get_type() == BoltType::Closure && v.as_func() == vm.stack_[vm.fp_ + 1].as_func();
+        };
+        interrupt = Interrupt::Ok;
+        size_t ip = header;
+        while (steps.size() < TRACE_MAX_LENGTH && ip < code.size()) {
+            uint32_t inst = code[ip];
+            Opcode op = VirtualMachine::decode_op(inst);
+            uint8_t rd = VirtualMachine::decode_rd(inst);
+            uint8_t rt = VirtualMachine::decode_rt(inst);
+            uint8_t rs = VirtualMachine::decode_rs(inst);
+            TraceStep step{static_cast<uint32_t>(ip), inst, {}, false};
+            switch(op) {
+                case Opcode::OpMov:
+                    step.types = {vm.reg(rt).get_type()};
+                    break;
+                case Opcode::OpConst: case Opcode::OpJmp: case Opcode::OpGetUpval:
+                    break;
+                case Opcode::OpJmpIfFalse:
+                    step.types = {vm.reg(rd).get_type()};
+                    break;
+                case Opcode::OpAdd: case Opcode::OpSub: case Opcode::OpMul: case Opcode::OpDiv:
+                case Opcode::OpLt: case Opcode::OpLte: case Opcode::OpBt: case Opcode::OpBte:
+                case Opcode::OpEq: case Opcode::OpNe:
+                    step.types = {vm.reg(rt).get_type(), vm.reg(rs).get_type()};
+                    break;
+                case Opcode::OpAddRK: case Opcode::OpSubRK: case Opcode::OpMulRK: case Opcode::OpDivRK:
+                case Opcode::OpLtRK: case Opcode::OpLteRK: case Opcode::OpBtRK: case Opcode::OpBteRK:
+                case Opcode::OpEqRK: case Opcode::OpNeRK:
+                    step.types = {vm.reg(rt).get_type(), proto->consts.at(rs).get_type()};
+                    break;
+                case Opcode::OpTailCall:
+                    if (!self(vm.reg(rd)))
+                        return false;
+                    for (uint8_t a = 0; a < rt; a++)
+                        step.types.push_back(vm.reg(rd + 1 + a).get_type());
+                    break;
+                default:
+                    return false;
+            }
+
+            vm.ip_ = ip + 1;
+            interrupt = vm.execute(inst);
+            if (interrupt != Interrupt::Ok)
+                return false;
+            if (op == Opcode::OpDiv || op == Opcode::OpDivRK)
+                step.types.push_back(vm.reg(rd).get_type());
+            if (op == Opcode::OpGetUpval) {
+                step.types = {vm.reg(rd).get_type()};
+                step.self = self(vm.reg(rd));
+            }
+            steps.push_back(std::move(step));
+
+            if (op == Opcode::OpTailCall) {
+                if ((vm.budget_ -= 1) <= 0)
+                    interrupt = Interrupt::Yield;
+                return header == 0;
+            }
+            if (vm.ip_ <= ip) {
+                if ((vm.budget_ -= ip + 1 - vm.ip_) <= 0)
+                    interrupt = Interrupt::Yield;
+                return vm.ip_ == header;
+            }
+            ip = vm.ip_;
+        }
+        return false;
+    }
+
+    const uint8_t* Jit::trace(VirtualMachine& vm, Interrupt& interrupt) {
+        interrupt = Interrupt::Ok;
+        if (trace_threshold_ == TRACE_OFF)
+            return nullptr;
+        Loop& loop = loops_[static_cast<uint64_t>(vm.frame_proto()->id) << 32 | vm.ip_];
+        if (loop.trace != nullptr || loop.attempts >= TRACE_ATTEMPTS)
+            return loop.trace;
+
+        loop.attempts++;
+        size_t header = vm.ip_;
+        std::vector<TraceStep> steps;
+        const uint8_t* trace = nullptr;
+        if (record(vm, steps, interrupt))
+            trace = compile_trace(vm, header, steps);
+        if (trace == nullptr) {
+            stats_.trace_aborts++;
+            return nullptr;
+        }
+        loop.trace = trace;
+        stats_.traces++;
+        return interrupt == Interrupt::Ok ? trace : nullptr;
+    }
+
+    /* The head checks and loads, then the loop with its guards branching to
+     * exit stubs placed after it. Native code conventions are the baseline
+     * JIT's: frame base in rbx, the vm in r12 and the budget in r13. rax,
+     * rcx, rdx, xmm0 and xmm1 are scratch, the rest of the caller saved and
+     * the two free callee saved registers hold values. */
+    const uint8_t* Jit::compile_trace(VirtualMachine& vm, size_t header, const std::vector<TraceStep>& steps) {
+        using A = Assembler;
+        constexpr int32_t TAG = BoltValue::TAG_WORD_OFFSET;
+        const Prototype* proto = vm.frame_proto();
+        Plan plan;
+        if (!trampoline() || !build(proto, header, steps, plan) || !allocate(plan))
+            return nullptr;
+
+        A a;
+        int bail = a.new_label(), loop = a.new_label();
+        std::vector<int> exits(plan.snapshots.size());
+        for (int& l : exits)
+            l = a.new_label();
+        auto gpr = [&](const Slot& s) { return static_cast<A::Reg>(plan.values[s.value].reg); };
+        auto xmm = [&](const Slot& s) { return plan.values[s.value].reg; };
+        auto kind = [&](const Slot& s) {
+            Value::Kind k = Value::Int;
+            kind_of(plan, s, k);
+            return k;
+        };
+
+        // value of kind at [base + disp] into reg, leaving the trace unless it is one
+        auto load = [&](Value::Kind k, int reg, A::Reg base, int32_t disp) {
+            if (k == Value::Double) {
+                emit_guard_double(a, base, disp, bail);
+                a.movsd_load(reg, base, disp);
+                return;
+            }
+            a.cmp_imm32(base, disp + TAG, k == Value::Int ? BoltValue::INT_TAG_WORD : BoltValue::BOOL_TAG_WORD);
+            a.jcc(A::NE, bail);
+            if (k == Value::Int)
+                a.load32(static_cast<A::Reg>(reg), base, disp);
+            else
+                a.load8(static_cast<A::Reg>(reg), base, disp);
+        };
+        // leaves the trace unless [base + disp] is the running closure
+        auto check_self = [&](A::Reg base, int32_t disp) {
+            a.load64(A::RCX, base, disp);
+            a.cmp64(A::RBX, sizeof(BoltValue), A::RCX);
+            a.jcc(A::NE, bail);
+            if (sizeof(BoltValue) > 8) {
+                a.load32(A::RCX, base, disp + TAG);
+                a.cmp_ecx(A::RBX, sizeof(BoltValue) + TAG);
+                a.jcc(A::NE, bail);
+            }
+        };
+        auto check_const = [&](int32_t disp, BoltValue k) {
+            if (sizeof(BoltValue) == 8) {
+                uint64_t word;
+                std::memcpy(&word, &k, sizeof(word));
+                a.mov_imm64(A::RAX, word);
+                a.cmp64(A::RBX, disp, A::RAX);
+                a.jcc(A::NE, bail);
+                return;
+            }
+            a.cmp_imm32(A::RBX, disp + TAG, static_cast<uint32_t>(k.get_type()));
+            a.jcc(A::NE, bail);
+            switch(k.get_type()) {
+                case BoltType::Integer:
+                    a.cmp_imm32(A::RBX, disp, k.as_int());
+                    a.jcc(A::NE, bail);
+                    break;
+                case BoltType::Boolean:
+                    a.cmp_imm8(A::RBX, disp, k.as_bool());
+                    a.jcc(A::NE, bail);
+                    break;
+                case BoltType::Nil:
+                    break;
+                default: {
+                    // a double's bits or a pointer
+                    uint64_t payload;
+                    std::memcpy(&payload, &k, sizeof(payload));
+                    a.mov_imm64(A::RAX, payload);
+                    a.cmp64(A::RBX, disp, A::RAX);
+                    a.jcc(A::NE, bail);
+                    break;
+                }
+            }
+        };
+        // frame register r = s
+        auto materialize = [&](uint8_t r, const Slot& s) {
+            int32_t disp = operand(r);
+            switch(s.where) {
+                case Slot::Frame:
+                    break;
+                case Slot::Self:
+                    emit_copy_value(a, A::RBX, sizeof(BoltValue), A::RBX, disp, A::RAX);
+                    break;
+                case Slot::Const: {
+                    uint64_t words[sizeof(BoltValue) / 8];
+                    std::memcpy(words, &s.k, sizeof(BoltValue));
+                    for (size_t w = 0; w < sizeof(BoltValue) / 8; w++) {
+                        a.mov_imm64(A::RAX, words[w]);
+                        a.store64(A::RBX, disp + w * 8, A::RAX);
+                    }
+                    break;
+                }
+                case Slot::Reg:
+                    if (kind(s) == Value::Double) {
+                        a.movsd_store(xmm(s), A::RBX, disp);
+                        if (BoltValue::DOUBLE_TAG_WORD_STORED)
+                            a.store_imm32(A::RBX, disp + TAG, BoltValue::DOUBLE_TAG_WORD_MIN);
+                    } else {
+                        a.store32(A::RBX, disp, gpr(s));
+                        a.store_imm32(A::RBX, disp + TAG, kind(s) == Value::Int ? BoltValue::INT_TAG_WORD : BoltValue::BOOL_TAG_WORD);
+                    }
+                    break;
+            }
+        };
+        auto int_into = [&](A::Reg dst, const Slot& s) {
+            if (s.where == Slot::Const)
+                a.mov_imm32(dst, s.k.as_int());
+            else
+                a.mov32(dst, gpr(s));
+        };
+        // s as a double in xmm unless it already is one in a register, which is returned
+        auto double_in = [&](int reg, const Slot& s) {
+            if (s.where == Slot::Const) {
+                a.mov_imm64(A::RAX, std::bit_cast<uint64_t>(s.k.to_double()));
+                a.movq(reg, A::RAX);
+            } else if (kind(s) == Value::Int) {
+                a.cvtsi2sd(reg, gpr(s));
+            } else {
+                return xmm(s);
+            }
+            return reg;
+        };
+
+        for (const Ir& ir : plan.head) {
+            switch(ir.op) {
+                case Ir::Load:
+                    load(plan.values[ir.dst].kind, plan.values[ir.dst].reg, A::RBX, operand(ir.r));
+                    break;
+                case Ir::LoadUpval:
+                    emit_upval_location(a, ir.r);
+                    load(plan.values[ir.dst].kind, plan.values[ir.dst].reg, A::RAX, 0);
+                    break;
+                case Ir::CheckUpval:
+                    emit_upval_location(a, ir.r);
+                    check_self(A::RAX, 0);
+                    break;
+                case Ir::CheckFrame:
+                    if (ir.x.where == Slot::Self)
+                        check_self(A::RBX, operand(ir.r));
+                    else
+                        check_const(operand(ir.r), ir.x.k);
+                    break;
+                case Ir::CheckOpen: {
+                    int none = a.new_label();
+                    a.mov_imm64(A::RAX, reinterpret_cast<uintptr_t>(&vm.open_upvals_));
+                    a.load64(A::RAX, A::RAX, 0);
+                    a.test_rax();
+                    a.jcc(A::E, none);
+                    a.load64(A::RAX, A::RAX, upval_location_offset());
+                    a.cmp(A::RAX, A::RBX);
+                    a.jcc(A::BE, bail);
+                    a.bind(none);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        a.bind(loop);
+        for (const Ir& ir : plan.body) {
+            int exit = ir.snapshot >= 0 ? exits[ir.snapshot] : -1;
+            switch(ir.op) {
+                case Ir::Arith:
+                    if (kind(ir.x) == Value::Int && kind(ir.y) == Value::Int && ir.bop == Opcode::OpDiv
+                            && plan.values[ir.dst].kind == Value::Double) {
+                        // leaves for the interpreter where its result is an int or an error
+                        if (ir.y.where == Slot::Const && (ir.y.k.as_int() == 0 || ir.y.k.as_int() == -1)) {
+                            a.jmp(exit);
+                            break;
+                        }
+                        int_into(A::RAX, ir.x);
+                        int_into(A::RCX, ir.y);
+                        if (ir.y.where != Slot::Const) {
+                            a.test_ecx();
+                            a.jcc(A::E, exit);
+                            a.cmp_ecx(static_cast<uint32_t>(-1));
+                            a.jcc(A::E, exit);
+                        }
+                        a.cdq();
+                        a.idiv_ecx();
+                        a.test_edx();
+                        a.jcc(A::E, exit);
+                        // idiv left the divisor in ecx
+                        int_into(A::RAX, ir.x);
+                        a.cvtsi2sd(0, A::RAX);
+                        a.cvtsi2sd(1, A::RCX);
+                        a.divsd(0, 1);
+                        a.movsd(plan.values[ir.dst].reg, 0);
+                    } else if (plan.values[ir.dst].kind == Value::Int) {
+                        int_into(A::RAX, ir.x);
+                        if (ir.bop == Opcode::OpDiv) {
+                            // what needs an error or a double is the interpreter's
+                            if (ir.y.where == Slot::Const && (ir.y.k.as_int() == 0 || ir.y.k.as_int() == -1)) {
+                                a.jmp(exit);
+                                break;
+                            }
+                            int_into(A::RCX, ir.y);
+                            if (ir.y.where != Slot::Const) {
+                                a.test_ecx();
+                                a.jcc(A::E, exit);
+                                a.cmp_ecx(static_cast<uint32_t>(-1));
+                                a.jcc(A::E, exit);
+                            }
+                            a.cdq();
+                            a.idiv_ecx();
+                            a.test_edx();
+                            a.jcc(A::NE, exit);
+                        } else if (ir.y.where == Slot::Const) {
+                            uint32_t imm = ir.y.k.as_int();
+                            if (ir.bop == Opcode::OpAdd)
+                                a.add_eax(imm);
+                            else if (ir.bop == Opcode::OpSub)
+                                a.sub_eax(imm);
+                            else
+                                a.imul_eax(imm);
+                            a.jcc(A::O, exit);
+                        } else {
+                            if (ir.bop == Opcode::OpAdd)
+                                a.add32(A::RAX, gpr(ir.y));
+                            else if (ir.bop == Opcode::OpSub)
+                                a.sub32(A::RAX, gpr(ir.y));
+                            else
+                                a.imul32(A::RAX, gpr(ir.y));
+                            a.jcc(A::O, exit);
+                        }
+                        a.mov32(static_cast<A::Reg>(plan.values[ir.dst].reg), A::RAX);
+                    } else {
+                        int x = double_in(0, ir.x);
+                        if (x != 0)
+                            a.movsd(0, x);
+                        int y = double_in(1, ir.y);
+                        switch(ir.bop) {
+                            case Opcode::OpAdd: a.addsd(0, y); break;
+                            case Opcode::OpSub: a.subsd(0, y); break;
+                            case Opcode::OpMul: a.mulsd(0, y); break;
+                            default: a.divsd(0, y); break;
+                        }
+                        // a NaN goes through from_double in the interpreter
+                        a.ucomisd(0, 0);
+                        a.jcc(A::P, exit);
+                        a.movsd(plan.values[ir.dst].reg, 0);
+                    }
+                    break;
+
+                case Ir::Compare: {
+                    A::Cond cc;
+                    if (kind(ir.x) == Value::Int && kind(ir.y) == Value::Int) {
+                        int_into(A::RAX, ir.x);
+                        if (ir.y.where == Slot::Const)
+                            a.cmp_eax(static_cast<uint32_t>(ir.y.k.as_int()));
+                        else
+                            a.cmp32(A::RAX, gpr(ir.y));
+                        cc = condition(ir.bop);
+                    } else {
+                        bool swap;
+                        cc = double_condition(ir.bop, swap);
+                        int x = double_in(0, ir.x), y = double_in(1, ir.y);
+                        if (swap)
+                            a.ucomisd(y, x);
+                        else
+                            a.ucomisd(x, y);
+                    }
+                    if (ir.dst == NO_VALUE) {
+                        a.jcc(ir.expect ? A::negate(cc) : cc, exit);
+                    } else {
+                        a.set_eax(cc);
+                        a.mov32(static_cast<A::Reg>(plan.values[ir.dst].reg), A::RAX);
+                    }
+                    break;
+                }
+
+                case Ir::Test:
+                    a.test32(gpr(ir.x), gpr(ir.x));
+                    a.jcc(ir.expect ? A::E : A::NE, exit);
+                    break;
+
+                case Ir::Charge:
+                    a.sub64_imm32(A::R13, 0, ir.cost);
+                    a.jcc(A::LE, exit);
+                    break;
+
+                case Ir::Store:
+                    materialize(ir.r, ir.x);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        /* the values the next iteration starts with, a parallel move: one
+         * whose destination is still to be read waits, a cycle of them goes
+         * through the scratch register */
+        struct Move {
+            int dst;
+            int src; // -1 for a constant
+            BoltValue k;
+        };
+        for (bool doubles : {false, true}) {
+            const int scratch = doubles ? 0 : A::RAX;
+            std::vector<Move> moves;
+            for (auto& [phi, next] : plan.phis) {
+                if ((plan.values[phi].kind == Value::Double) != doubles)
+                    continue;
+                int src = next.where == Slot::Reg ? plan.values[next.value].reg : -1;
+                if (src != plan.values[phi].reg)
+                    moves.push_back({plan.values[phi].reg, src, next.k});
+            }
+            auto move = [&](int dst, int src) {
+                if (doubles)
+                    a.movsd(dst, src);
+                else
+                    a.mov32(static_cast<A::Reg>(dst), static_cast<A::Reg>(src));
+            };
+            while (std::any_of(moves.begin(), moves.end(), [](const Move& m) { return m.src >= 0; })) {
+                auto ready = std::find_if(moves.begin(), moves.end(), [&](const Move& m) {
+                    return m.src >= 0 && std::none_of(moves.begin(), moves.end(), [&](const Move& o) { return o.src == m.dst; });
+                });
+                if (ready == moves.end()) {
+                    auto cycle = std::find_if(moves.begin(), moves.end(), [](const Move& m) { return m.src >= 0; });
+                    move(scratch, cycle->dst);
+                    for (Move& m : moves) {
+                        if (m.src == cycle->dst)
+                            m.src = scratch;
+                    }
+                    continue;
+                }
+                move(ready->dst, ready->src);
+                moves.erase(ready);
+            }
+            for (const Move& m : moves) {
+                if (doubles) {
+                    a.mov_imm64(A::RAX, std::bit_cast<uint64_t>(m.k.to_double()));
+                    a.movq(m.dst, A::RAX);
+                } else {
+                    a.mov_imm32(static_cast<A::Reg>(m.dst), m.k.is_int() ? m.k.as_int() : m.k.as_bool());
+                }
+            }
+        }
+        a.jmp(loop);
+
+        for (size_t s = 0; s < plan.snapshots.size(); s++) {
+            const Snapshot& snap = plan.snapshots[s];
+            a.bind(exits[s]);
+            for (auto& [r, slot] : snap.slots)
+                materialize(r, slot);
+            a.mov_imm64(A::RAX, reinterpret_cast<uintptr_t>(&stats_.trace_exits));
+            a.add64_imm8(A::RAX, 0, 1);
+            a.mov_imm64(A::RAX, exit_word(snap.ip, snap.status));
+            a.jmp(leave_);
+        }
+        // nothing has changed yet, the interpreter runs the loop instead
+        a.bind(bail);
+        a.mov_imm64(A::RAX, exit_word(header, Interrupt::Ok));
+        a.jmp(leave_);
+
+        const uint8_t* base = a.link(arena_);
+        if (base != nullptr)
+            stats_.code_bytes += a.size();
+        return base;
+    }
+}
+
+#endif
@@ -1,69 +1,883 @@
 #include "bolt_virtual_machine/vm.hpp"
 #include "bolt_virtual_machine/instruction.hpp"
+#include "bolt_virtual_machine/jit.hpp"
+#include "bolt_virtual_machine/scheduler.hpp"
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <cstring>
 #include <cstdint>
-#include <fstream>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#if defined(__GNUC__) || defined(__clang__)
+#define CHECKED_ADD(a, b, r) __builtin_add_overflow(a, b, r)
+#define CHECKED_SUB(a, b, r) __builtin_sub_overflow(a, b, r)
+#define CHECKED_MUL(a, b, r) __builtin_mul_overflow(a, b, r)
+#else
+static inline bool narrow_overflows(int64_t wide, int* r) {
+    *r = static_cast<int>(wide);
+    return wide != *r;
+}
+#define CHECKED_ADD(a, b, r) narrow_overflows(static_cast<int64_t>(a) + (b), r)
+#define CHECKED_SUB(a, b, r) narrow_overflows(static_cast<int64_t>(a) - (b), r)
+#define CHECKED_MUL(a, b, r) narrow_overflows(static_cast<int64_t>(a) * (b), r)
+#endif
+
+/* int-int is checked first; a result that does not fit an int is promoted to
+ * a double instead of wrapping around. Any other mix of numbers is computed
+ * in double precision after converting the int side. */
+#define ARITH_OP(name, op, checked) \
+    static inline Interrupt name(BoltValue x, BoltValue y, BoltValue& res) { \
+        int r; \
+        if (BoltValue::both_int(x, y)) [[likely]] { \
+            if (!checked(x.as_int(), y.as_int(), &r)) [[likely]] \
+                res = BoltValue::from_int(r); \
+            else \
+                res = BoltValue::from_double(static_cast<double>(x.as_int()) op y.as_int()); \
+        } \
+        else if (x.is_number() && y.is_number()) \
+            res = BoltValue::from_double(x.to_double() op y.to_double()); \
+        else \
+            return Interrupt::IncompatibleTypes; \
+        return Interrupt::Ok; \
+    }
 
-#define BINARY_OP(op, rd, x, y) \
-    if (x.type == BoltType::Integer && y.type == BoltType::Integer) \
-        set_register_value(rd, {.as_int = x.as_int op y.as_int, .type = BoltType::Integer}); \
-    else if ((x.type == BoltType::Integer && y.type == BoltType::Float) \
-            || (x.type == BoltType::Float && y.type == BoltType::Integer) \
-            || (x.type == BoltType::Float && y.type == BoltType::Float)) \
-        set_register_value(rd, {.as_double = x.as_double op y.as_double, .type = BoltType::Float}); \
-    else \
-        return Interrupt::IncompatibleTypes; \
+#define COMPARE_OP(name, op) \
+    static inline Interrupt name(BoltValue x, BoltValue y, BoltValue& res) { \
+        if (BoltValue::both_int(x, y)) [[likely]] \
+            res = BoltValue::from_bool(x.as_int() op y.as_int()); \
+        else if (x.is_number() && y.is_number()) \
+            res = BoltValue::from_bool(x.to_double() op y.to_double()); \
+        else \
+            return Interrupt::IncompatibleTypes; \
+        return Interrupt::Ok; \
+    }
 
 
 namespace BVM {
 
-    VirtualMachine::VirtualMachine() {}
-    VirtualMachine::~VirtualMachine() {}
+    ARITH_OP(arith_add, +, CHECKED_ADD);
+    ARITH_OP(arith_sub, -, CHECKED_SUB);
+    ARITH_OP(arith_mul, *, CHECKED_MUL);
+    COMPARE_OP(compare_lt, <);
+    COMPARE_OP(compare_lte, <=);
+    COMPARE_OP(compare_bt, >);
+    COMPARE_OP(compare_bte, >=);
 
+    /* exact int quotients stay ints, everything else becomes a double */
+    static inline Interrupt arith_div(BoltValue x, BoltValue y, BoltValue& res) {
+        if (BoltValue::both_int(x, y)) [[likely]] {
+            int a = x.as_int(), b = y.as_int();
+            if (b == 0)
+                return Interrupt::DivisionByZero;
+            if (b == -1)
+                res = a == INT_MIN ? BoltValue::from_double(-static_cast<double>(a)) : BoltValue::from_int(-a);
+            else if (a % b == 0)
+                res = BoltValue::from_int(a / b);
+            else
+                res = BoltValue::from_double(static_cast<double>(a) / b);
+        }
+        else if (x.is_number() && y.is_number())
+            res = BoltValue::from_double(x.to_double() / y.to_double());
+        else
+            return Interrupt::IncompatibleTypes;
+        return Interrupt::Ok;
+    }
 
-    /* Bolt File Layout 
-     * n_funcs
-     * [Prototypes]
-     * */
+    /* numbers compare by value across int/double, anything else by identity */
+    static inline Interrupt compare_eq(BoltValue x, BoltValue y, BoltValue& res) {
+        if (BoltValue::both_int(x, y)) [[likely]]
+            res = BoltValue::from_bool(x.as_int() == y.as_int());
+        else if (x.is_number() && y.is_number())
+            res = BoltValue::from_bool(x.to_double() == y.to_double());
+        else
+            res = BoltValue::from_bool(x == y);
+        return Interrupt::Ok;
+    }
 
-    /* Protoype Structure
-     * n_locals
-     * n_consts
-     * [constants]
-     * n_insts
-     * [instructions]
-     * */
+    static inline Interrupt compare_ne(BoltValue x, BoltValue y, BoltValue& res) {
+        compare_eq(x, y, res);
+        res = BoltValue::from_bool(!res.as_bool());
+        return Interrupt::Ok;
+    }
 
-    void VirtualMachine::load_program(const char* file) {
-        std::ifstream in(file, std::ios::binary);
-        int n;
-        in.read(reinterpret_cast<char*>(&n), 4);
+    /* the generic entries of the builtins - arithmetic folds left to right,
+     * a single argument is combined with the op's identity ((- x) is 0 - x),
+     * comparisons hold when they hold for every adjacent pair */
+#define NATIVE_FOLD(name, fn, identity) \
+    static Interrupt name(VirtualMachine&, NativeArgs args, BoltValue& res) { \
+        BoltValue acc = BoltValue::from_int(identity); \
+        size_t i = 0; \
+        if (args.size() > 1) \
+            acc = args[i++]; \
+        for (; i < args.size(); i++) { \
+            Interrupt interrupt = fn(acc, args[i], acc); \
+            if (interrupt != Interrupt::Ok) \
+                return interrupt; \
+        } \
+        res = acc; \
+        return Interrupt::Ok; \
+    }
 
+#define NATIVE_CHAIN(name, fn) \
+    static Interrupt name(VirtualMachine&, NativeArgs args, BoltValue& res) { \
+        BoltValue r = BoltValue::from_bool(true); \
+        for (size_t i = 1; i < args.size() && r.as_bool(); i++) { \
+            Interrupt interrupt = fn(args[i - 1], args[i], r); \
+            if (interrupt != Interrupt::Ok) \
+                return interrupt; \
+        } \
+        res = r; \
+        return Interrupt::Ok; \
     }
 
-    void VirtualMachine::setup_entry_point() {
-        Prototype* main = callables_.at(0).get();
-        ClosureObj main_clsr = {.type = ClosureObj::CLSR_VIRTUAL, .as_virtual = {.proto = main} };
-        BoltValue prev_fp = {.as_int = -1, .type = BoltType::Integer };
-        BoltValue ret_addr = {.as_int = 0, .type = BoltType::Integer };
-        BoltValue func = {.as_func = &main_clsr, .type = BoltType::Closure};
-        push(prev_fp);
-        push(ret_addr);
+    NATIVE_FOLD(native_add, arith_add, 0);
+    NATIVE_FOLD(native_sub, arith_sub, 0);
+    NATIVE_FOLD(native_mul, arith_mul, 1);
+    NATIVE_FOLD(native_div, arith_div, 1);
+    NATIVE_CHAIN(native_lt, compare_lt);
+    NATIVE_CHAIN(native_lte, compare_lte);
+    NATIVE_CHAIN(native_bt, compare_bt);
+    NATIVE_CHAIN(native_bte, compare_bte);
+    NATIVE_CHAIN(native_eq, compare_eq);
+
+    // true when no two arguments are equal
+    static Interrupt native_ne(VirtualMachine&, NativeArgs args, BoltValue& res) {
+        BoltValue r = BoltValue::from_bool(true);
+        for (size_t i = 0; i < args.size(); i++) {
+            for (size_t j = i + 1; j < args.size(); j++) {
+                compare_ne(args[i], args[j], r);
+                if (!r.as_bool()) {
+                    res = r;
+                    return Interrupt::Ok;
+                }
+            }
+        }
+        res = r;
+        return Interrupt::Ok;
+    }
+
+#undef NATIVE_FOLD
+#undef NATIVE_CHAIN
+
+    static Interrupt native_cons(VirtualMachine& vm, NativeArgs args, BoltValue& res) {
+        res = BoltValue::from_cons(vm.new_cons(args[0], args[1]));
+        return Interrupt::Ok;
+    }
+
+    static Interrupt native_car(VirtualMachine&, NativeArgs args, BoltValue& res) {
+        if (args[0].get_type() != BoltType::Cons)
+            return Interrupt::IncompatibleTypes;
+        res = args[0].as_cons()->car;
+        return Interrupt::Ok;
+    }
+
+    static Interrupt native_cdr(VirtualMachine&, NativeArgs args, BoltValue& res) {
+        if (args[0].get_type() != BoltType::Cons)
+            return Interrupt::IncompatibleTypes;
+        res = args[0].as_cons()->cdr;
+        return Interrupt::Ok;
+    }
+
+    static Interrupt native_set_car(VirtualMachine& vm, NativeArgs args, BoltValue& res) {
+        if (args[0].get_type() != BoltType::Cons)
+            return Interrupt::IncompatibleTypes;
+        vm.set_car(args[0].as_cons(), args[1]);
+        res = BoltValue::nil();
+        return Interrupt::Ok;
+    }
+
+    static Interrupt native_set_cdr(VirtualMachine& vm, NativeArgs args, BoltValue& res) {
+        if (args[0].get_type() != BoltType::Cons)
+            return Interrupt::IncompatibleTypes;
+        vm.set_cdr(args[0].as_cons(), args[1]);
+        res = BoltValue::nil();
+        return Interrupt::Ok;
+    }
+
+    static Interrupt native_join(VirtualMachine& vm, NativeArgs args, BoltValue& res) {
+        if (vm.get_scheduler() == nullptr)
+            return Interrupt::NoScheduler;
+        if (!args[0].is_int())
+            return Interrupt::IncompatibleTypes;
+        return vm.get_scheduler()->join(vm, args[0].as_int(), res);
+    }
+
+    /* One PROT_NONE guard page sits below the stack, overflow is checked
+     * before every frame is pushed so it only catches vm bugs. The frame
+     * records follow the stack in the same mapping. The mapping is never
+     * filled: every slot from sp_ up is written (the callable, arguments or
+     * clear_registers) before anything reads it. */
+    static inline size_t page_round(size_t bytes, size_t page) {
+        return (bytes + page - 1) / page * page;
+    }
+
+    static inline size_t mapping_size(size_t stack_slots, size_t page) {
+        return page + page_round(stack_slots * sizeof(BoltValue), page) + page_round(stack_slots * sizeof(CallFrame), page);
+    }
+
+    VirtualMachine::VirtualMachine(size_t stack_slots) : VirtualMachine(nullptr, stack_slots) {}
+
+    VirtualMachine::VirtualMachine(std::shared_ptr<const Program> program, size_t stack_slots, size_t nursery_cells)
+            : heap_(nursery_cells) {
+        if (program == nullptr)
+            program_ = std::make_shared<Program>();
+        else if (program->is_frozen())
+            program_ = std::const_pointer_cast<Program>(program);
+        else
+            throw std::runtime_error("VirtualMachine: a shared program must be frozen");
+        // room for a callable and every register an instruction can name
+        if (stack_slots < 1 + 256 || stack_slots > INT32_MAX / 2)
+            throw std::runtime_error("VirtualMachine: invalid stack size");
+        size_t page = sysconf(_SC_PAGESIZE);
+        void* p = mmap(nullptr, mapping_size(stack_slots, page), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+        mprotect(p, page, PROT_NONE);
+        stack_ = reinterpret_cast<BoltValue*>(static_cast<uint8_t*>(p) + page);
+        frames_ = reinterpret_cast<CallFrame*>(reinterpret_cast<uint8_t*>(stack_) + page_round(stack_slots * sizeof(BoltValue), page));
+        stack_size_ = stack_slots;
+        sp_ = fp_ = stack_size_;
+        ret_val_ = BoltValue::nil();
+        set_jit(true);
+    }
+
+    VirtualMachine::~VirtualMachine() {
+        size_t page = sysconf(_SC_PAGESIZE);
+        munmap(reinterpret_cast<uint8_t*>(stack_) - page, mapping_size(stack_size_, page));
+    }
+
+    Program::Program() {
+        // registered in Primitives order so a Primitives value is its native id
+        register_native("+", native_add, NATIVE_VARIADIC, arith_add);
+        register_native("-", native_sub, NATIVE_VARIADIC, arith_sub);
+        register_native("*", native_mul, NATIVE_VARIADIC, arith_mul);
+        register_native("/", native_div, NATIVE_VARIADIC, arith_div);
+        register_native("<", native_lt, NATIVE_VARIADIC, compare_lt);
+        register_native("<=", native_lte, NATIVE_VARIADIC, compare_lte);
+        register_native(">", native_bt, NATIVE_VARIADIC, compare_bt);
+        register_native(">=", native_bte, NATIVE_VARIADIC, compare_bte);
+        register_native("/=", native_ne, NATIVE_VARIADIC, compare_ne);
+        register_native("=", native_eq, NATIVE_VARIADIC, compare_eq);
+        register_native("cons", native_cons, 2);
+        register_native("car", native_car, 1);
+        register_native("cdr", native_cdr, 1);
+        register_native("set-car!", native_set_car, 2);
+        register_native("set-cdr!", native_set_cdr, 2);
+        register_native("join", native_join, 1);
+    }
+
+    void Program::check_mutable(const char* what) const {
+        if (frozen_)
+            throw std::runtime_error(std::string(what) + ": program is frozen");
+    }
+
+    uint8_t Program::register_native(std::string name, NativeFn fn, int arity, NativeBinaryFn binary) {
+        check_mutable("register_native");
+        if (natives_.size() >= MAX_NATIVES)
+            throw std::runtime_error("register_native: native table is full");
+        if (find_native(name) >= 0)
+            throw std::runtime_error("register_native: " + name + " is already registered");
+        if (fn == nullptr || arity < NATIVE_VARIADIC || arity > UINT8_MAX)
+            throw std::runtime_error("register_native: invalid native " + name);
+        natives_.push_back({.name = std::move(name), .fn = fn, .arity = arity, .binary = binary});
+        return natives_.size() - 1;
+    }
+
+    int Program::find_native(const std::string& name) const {
+        for (size_t i = 0; i < natives_.size(); i++) {
+            if (natives_[i].name == name)
+                return i;
+        }
+        return -1;
+    }
+
+
+    static BoltValue decode_const(const ConstRecord& rec) {
+        switch(static_cast<BoltType>(rec.type)) {
+            case BoltType::Integer: {
+                int64_t v = static_cast<int64_t>(rec.payload);
+                if (v < INT_MIN || v > INT_MAX)
+                    throw std::runtime_error("load_program: integer constant out of range");
+                return BoltValue::from_int(v);
+            }
+            case BoltType::Float: return BoltValue::from_double(std::bit_cast<double>(rec.payload));
+            case BoltType::Boolean: return BoltValue::from_bool(rec.payload != 0);
+            case BoltType::Nil: return BoltValue::nil();
+            default:
+                throw std::runtime_error("load_program: unsupported constant type");
+        }
+    }
+
+    /* see bytecode.hpp for the layout - everything is validated before a
+     * single prototype is handed to the vm */
+    void Program::load_program(const char* file, bool verify_checksum) {
+        check_mutable("load_program");
+        auto image = std::make_unique<MappedFile>(file);
+        const uint8_t* base = image->data();
+        size_t size = image->size();
+
+        FileHeader header;
+        if (size < sizeof(header))
+            throw std::runtime_error("load_program: truncated header");
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, BOLT_MAGIC, sizeof(BOLT_MAGIC)) != 0)
+            throw std::runtime_error("load_program: not a bolt file");
+        if (header.version != BOLT_VERSION || header.header_size != sizeof(header))
+            throw std::runtime_error("load_program: unsupported version");
+        if (header.file_size != size)
+            throw std::runtime_error("load_program: file size mismatch");
+        if (header.n_sections > (size - sizeof(header)) / sizeof(SectionEntry))
+            throw std::runtime_error("load_program: truncated section table");
+        if (verify_checksum) {
+            Checksum checksum;
+            checksum.update(base + sizeof(header), size - sizeof(header));
+            if (checksum.digest() != header.checksum)
+                throw std::runtime_error("load_program: checksum mismatch");
+        }
+
+        std::vector<std::unique_ptr<Prototype>> protos(header.n_protos);
+        std::vector<int64_t> n_consts(header.n_protos, -1);
+        std::vector<bool> has_code(header.n_protos, false);
+        for (auto& p : protos)
+            p = std::make_unique<Prototype>();
+
+        const uint8_t* table = base + sizeof(header);
+        for (uint32_t i = 0; i < header.n_sections; i++) {
+            SectionEntry s;
+            std::memcpy(&s, table + i * sizeof(s), sizeof(s));
+            if (s.proto >= header.n_protos || s.offset % SECTION_ALIGN != 0
+                    || s.offset > size || s.size > size - s.offset)
+                throw std::runtime_error("load_program: bad section");
+            Prototype* proto = protos[s.proto].get();
+            const uint8_t* data = base + s.offset;
+
+            switch(s.kind) {
+                case SectionKind::Proto: {
+                    ProtoRecord rec;
+                    if (s.size != sizeof(rec))
+                        throw std::runtime_error("load_program: bad prototype section");
+                    std::memcpy(&rec, data, sizeof(rec));
+                    proto->arity = rec.arity;
+                    proto->n_locals = rec.n_locals;
+                    proto->next_reg = rec.next_reg;
+                    n_consts[s.proto] = rec.n_consts;
+                    break;
+                }
+                case SectionKind::Consts: {
+                    if (s.size % sizeof(ConstRecord) != 0)
+                        throw std::runtime_error("load_program: bad constant section");
+                    // constants are few and small, they are decoded into the pool
+                    for (size_t off = 0; off < s.size; off += sizeof(ConstRecord)) {
+                        ConstRecord rec;
+                        std::memcpy(&rec, data + off, sizeof(rec));
+                        proto->consts.push_back(decode_const(rec));
+                    }
+                    break;
+                }
+                case SectionKind::Upvals:
+                    if (s.size % sizeof(UpvalRecord) != 0)
+                        throw std::runtime_error("load_program: bad upvalue section");
+                    for (size_t off = 0; off < s.size; off += sizeof(UpvalRecord)) {
+                        UpvalRecord rec;
+                        std::memcpy(&rec, data + off, sizeof(rec));
+                        if (rec.in_stack > 1)
+                            throw std::runtime_error("load_program: bad upvalue section");
+                        proto->upvals.push_back({.in_stack = rec.in_stack == 1, .index = rec.index});
+                    }
+                    break;
+                case SectionKind::Code:
+                    if (s.size % sizeof(uint32_t) != 0)
+                        throw std::runtime_error("load_program: bad code section");
+                    proto->image = {reinterpret_cast<const uint32_t*>(data), s.size / sizeof(uint32_t)};
+                    has_code[s.proto] = true;
+                    break;
+                default:
+                    // sections from newer writers that this vm does not need
+                    break;
+            }
+        }
+
+        for (size_t i = 0; i < protos.size(); i++) {
+            if (n_consts[i] < 0 || !has_code[i] || protos[i]->consts.size() != static_cast<size_t>(n_consts[i]))
+                throw std::runtime_error("load_program: incomplete prototype");
+        }
+
+        // lowering may still throw, the image has to outlive whatever got loaded
+        images_.push_back(std::move(image));
+        for (auto& p : protos)
+            load_callable(std::move(p));
+    }
+
+    /* pushes the outermost frame, its ret halts the vm */
+    void VirtualMachine::enter(BoltValue func) {
+        const Prototype* proto = func.as_func()->as_virtual.proto;
         push(func);
-        fp_ = STACK_SIZE - 1;
-        sp_ -= main->next_reg; // callable_ref + prev_fp + return addr
+        fp_ = sp_ - 1;
+        sp_ = fp_ - proto->next_reg + 1;
+        depth_ = 0;
+        clear_registers(0, proto->next_reg);
+        code_ = stream(proto);
+    }
 
+    /* Both drop whatever ran before, an upvalue still open on the old stack
+     * is closed first so closures that escaped it keep their values. */
+    void VirtualMachine::setup_entry_point() {
+        close_upvals();
+        sp_ = stack_size_;
+        ip_ = 0;
+        // allocated before the frame exists, the old stack is not a root anymore
+        enter(BoltValue::from_func(new_closure(program_->get_callable(0))));
     };
 
+    void VirtualMachine::setup_call(BoltValue callee, NativeArgs args) {
+        if (callee.get_type() != BoltType::Closure || callee.as_func()->type != ClosureObj::CLSR_VIRTUAL)
+            throw std::runtime_error("setup_call: callee is not a bytecode closure");
+        close_upvals();
+        sp_ = stack_size_;
+        ip_ = 0;
+        enter(import_value(callee));
+        // every argument is rooted in its register before the next one allocates
+        for (uint8_t i = 0; i < args.size(); i++) {
+            BoltValue v = import_value(args[i]);
+            set_register_value(i, v);
+        }
+    }
+
+    #define MAX_IMPORT_DEPTH 1024 // nesting through car and upvalues, the cdr spine is walked iteratively
+
+    BoltValue VirtualMachine::import_value(BoltValue v) {
+        ImportMemo memo;
+        return import_value(v, 0, memo);
+    }
+
+    /* memo maps every closure and upvalue copied so far to its copy, which
+     * keeps upvalues shared between closures shared and lets a closure that
+     * captured itself (any recursive local function) be copied at all */
+    BoltValue VirtualMachine::import_value(BoltValue v, int depth, ImportMemo& memo) {
+        switch(v.get_type()) {
+            case BoltType::Closure: {
+                ClosureObj* src = v.as_func();
+                if (src->type == ClosureObj::CLSR_NATIVE)
+                    return BoltValue::from_func(new_native_closure(src->as_native.fn));
+                if (auto it = memo.find(src); it != memo.end())
+                    return BoltValue::from_func(static_cast<ClosureObj*>(it->second));
+                if (depth >= MAX_IMPORT_DEPTH)
+                    throw std::runtime_error("import_value: closures nested too deeply");
+                ClosureObj* clsr = new_closure(src->as_virtual.proto);
+                memo[src] = clsr;
+                // the copy is rooted on the stack while its upvalues are filled in
+                push(BoltValue::from_func(clsr));
+                for (uint32_t i = 0; i < src->as_virtual.n_upvals; i++) {
+                    UpvalObj* src_up = src->upvals()[i];
+                    if (src_up == nullptr)
+                        continue;
+                    if (auto it = memo.find(src_up); it != memo.end()) {
+                        clsr->upvals()[i] = static_cast<UpvalObj*>(it->second);
+                        continue;
+                    }
+                    UpvalObj* up = new_upval();
+                    clsr->upvals()[i] = up;
+                    memo[src_up] = up;
+                    BoltValue captured = import_value(*src_up->location, depth + 1, memo);
+                    heap_.write_barrier(up, captured);
+                    up->closed = captured;
+                }
+                pop();
+                return BoltValue::from_func(clsr);
+            }
+            case BoltType::Cons: {
+                if (depth >= MAX_IMPORT_DEPTH)
+                    throw std::runtime_error("import_value: list nested too deeply");
+                // copied cars wait on the stack, which keeps them alive, and
+                // the list is rebuilt back to front
+                int32_t base = sp_;
+                for (; v.get_type() == BoltType::Cons; v = v.as_cons()->cdr) {
+                    if (sp_ == 0)
+                        throw std::runtime_error("import_value: list too long");
+                    BoltValue car = import_value(v.as_cons()->car, depth + 1, memo);
+                    push(car);
+                }
+                BoltValue list = import_value(v, depth + 1, memo);
+                while (sp_ < base) {
+                    BoltValue car = pop();
+                    list = BoltValue::from_cons(new_cons(car, list));
+                }
+                return list;
+            }
+            default:
+                return v;
+        }
+    }
+
+    void VirtualMachine::reset() {
+        sp_ = fp_ = stack_size_;
+        depth_ = 0;
+        open_upvals_ = nullptr;
+        ip_ = 0;
+        budget_ = BUDGET_UNLIMITED;
+        code_ = nullptr;
+        ret_val_ = BoltValue::nil();
+        // nothing is rooted anymore, the whole heap goes
+        collect_garbage();
+    }
+
+    /* the upvalues start out null, the collector skips them until they are
+     * filled in */
+    ClosureObj* VirtualMachine::new_closure(const Prototype* proto) {
+        maybe_collect();
+        uint32_t n_upvals = proto->upvals.size();
+        ClosureObj* clsr = heap_.alloc<ClosureObj>(sizeof(ClosureObj) + n_upvals * sizeof(UpvalObj*));
+        clsr->type = ClosureObj::CLSR_VIRTUAL;
+        clsr->as_virtual.proto = proto;
+        clsr->as_virtual.n_upvals = n_upvals;
+        std::fill_n(clsr->upvals(), n_upvals, nullptr);
+        return clsr;
+    }
+
+    // a closed upvalue holding nil
+    UpvalObj* VirtualMachine::new_upval() {
+        maybe_collect();
+        UpvalObj* up = heap_.alloc<UpvalObj>();
+        up->closed = BoltValue::nil();
+        up->location = &up->closed;
+        up->next_open = nullptr;
+        return up;
+    }
+
+    /* the open upvalue of slot, created on first capture - closures created
+     * by the same frame share the variable */
+    UpvalObj* VirtualMachine::capture(BoltValue* slot) {
+        UpvalObj** link = &open_upvals_;
+        while (*link != nullptr && (*link)->location < slot)
+            link = &(*link)->next_open;
+        if (*link != nullptr && (*link)->location == slot)
+            return *link;
+        // open upvalues are roots, link stays valid through a collection
+        UpvalObj* up = new_upval();
+        up->location = slot;
+        up->next_open = *link;
+        *link = up;
+        return up;
+    }
+
+    /* the list is sorted deepest frame first, so the upvalues of the frames
+     * at or below level are a prefix of it */
+    void VirtualMachine::close_upvals(const BoltValue* level) {
+        if (level == nullptr)
+            level = stack_ + stack_size_;
+        while (open_upvals_ != nullptr && open_upvals_->location <= level) {
+            UpvalObj* up = open_upvals_;
+            open_upvals_ = up->next_open;
+            heap_.write_barrier(up, *up->location);
+            up->closed = *up->location;
+            up->location = &up->closed;
+            up->next_open = nullptr;
+        }
+    }
+
+    /* the closure is rooted in rd before capturing allocates, the upvalues
+     * come from our registers or from the closure we are running */
+    void VirtualMachine::make_closure(uint8_t rd, uint32_t id) {
+        if (id >= program_->n_callables())
+            throw std::runtime_error("closure: unknown prototype");
+        const Prototype* proto = program_->get_callable(id);
+        ClosureObj* clsr = new_closure(proto);
+        set_register_value(rd, BoltValue::from_func(clsr));
+        ClosureObj* enclosing = stack_[fp_ + 1].as_func();
+        for (uint32_t i = 0; i < proto->upvals.size(); i++) {
+            UpvalDesc desc = proto->upvals[i];
+            if (desc.in_stack) {
+                if (desc.index >= frame_proto()->next_reg)
+                    throw std::runtime_error("closure: captured register out of range");
+                clsr->upvals()[i] = capture(&reg(desc.index));
+            } else {
+                if (desc.index >= enclosing->as_virtual.n_upvals)
+                    throw std::runtime_error("closure: upvalue index out of range");
+                clsr->upvals()[i] = enclosing->upvals()[desc.index];
+            }
+        }
+    }
+
+    ClosureObj* VirtualMachine::new_native_closure(NativeFn fn) {
+        maybe_collect();
+        ClosureObj* clsr = heap_.alloc<ClosureObj>();
+        clsr->type = ClosureObj::CLSR_NATIVE;
+        clsr->as_native.fn = fn;
+        return clsr;
+    }
+
+    /* cells are bump allocated in the nursery, a full nursery costs a minor
+     * collection - and a major one when promotion pushed the old generation
+     * over its threshold */
+    Cons* VirtualMachine::new_cons(BoltValue car, BoltValue cdr) {
+        Cons* cell = heap_.alloc_cons();
+        if (cell == nullptr) [[unlikely]] {
+            collect_young(false, car, cdr);
+            if (heap_.should_collect())
+                collect_garbage(car, cdr);
+            cell = heap_.alloc_cons();
+            if (cell == nullptr) {
+                // every young cell survived, make room by promoting them all
+                collect_young(true, car, cdr);
+                cell = heap_.alloc_cons();
+            }
+        }
+        cell->car = car;
+        cell->cdr = cdr;
+        return cell;
+    }
+
+    void VirtualMachine::collect_young(bool tenure_all, BoltValue& extra_a, BoltValue& extra_b) {
+        heap_.begin_minor(tenure_all);
+        for (int32_t i = sp_; i < stack_size_; i++)
+            stack_[i] = heap_.evacuate(stack_[i]);
+        ret_val_ = heap_.evacuate(ret_val_);
+        extra_a = heap_.evacuate(extra_a);
+        extra_b = heap_.evacuate(extra_b);
+        // constant pools never point into the nursery
+        heap_.finish_minor();
+    }
+
+    void VirtualMachine::collect_garbage(BoltValue& extra_a, BoltValue& extra_b) {
+        collect_young(true, extra_a, extra_b);
+        heap_.begin();
+        for (int32_t i = sp_; i < stack_size_; i++)
+            heap_.mark_value(stack_[i]);
+        // open upvalues no live closure holds anymore are still on the list
+        for (UpvalObj* up = open_upvals_; up != nullptr; up = up->next_open)
+            heap_.mark_object(up);
+        heap_.mark_value(ret_val_);
+        heap_.mark_value(extra_a);
+        heap_.mark_value(extra_b);
+        heap_.finish();
+    }
+
+    void VirtualMachine::set_nursery_size(size_t cells) {
+        BoltValue a = BoltValue::nil(), b = BoltValue::nil();
+        collect_young(true, a, b);
+        heap_.resize_nursery(cells);
+    }
+
+    /* registers a frame has not written yet may hold values left behind by
+     * an earlier frame, possibly already collected */
+    void VirtualMachine::clear_registers(unsigned int from, unsigned int to) {
+        for (unsigned int r = from; r < to; r++)
+            stack_[fp_ - r] = BoltValue::nil();
+    }
+
     void VirtualMachine::handle_interrupt(Interrupt interrupt) {
         return;
     }
 
+    static inline int16_t reg_offset(uint8_t r) {
+        return -r;
+    }
+
+    static inline uint8_t reg_index(int16_t offset) {
+        return -offset;
+    }
+
+    void Program::load_callable(std::unique_ptr<Prototype> callable) {
+        check_mutable("load_callable");
+        callable->id = callables_.size();
+        lower(callable.get());
+        callables_.push_back(std::move(callable));
+    }
+
+    /* validates the prototype and decodes its operands, the handlers are
+     * left for each context to thread into its own copy */
+    void Program::lower(Prototype* proto) {
+        for (BoltValue k : proto->consts) {
+            if (k.get_type() == BoltType::Cons || k.get_type() == BoltType::Closure)
+                throw std::runtime_error("lower: constants must be immediates");
+        }
+
+        proto->decoded.clear();
+        proto->decoded.reserve(proto->code().size());
+        for (uint32_t inst : proto->code()) {
+            uint8_t op = static_cast<uint8_t>(inst);
+            if (op >= N_BYTECODE_OPS)
+                throw std::runtime_error("lower: invalid opcode");
+
+            DecodedInst d = {
+                .handler = nullptr,
+                .k = nullptr,
+                .imm = static_cast<int32_t>(inst >> 16),
+                .rd = reg_offset(VirtualMachine::decode_rd(inst)),
+                .rt = reg_offset(VirtualMachine::decode_rt(inst)),
+                .rs = reg_offset(VirtualMachine::decode_rs(inst)),
+                .op = VirtualMachine::decode_op(inst),
+                .deopts = 0,
+                .count = 0,
+            };
+
+            switch(d.op) {
+                case Opcode::OpConst:
+                    if (static_cast<size_t>(d.imm) >= proto->consts.size())
+                        throw std::runtime_error("lower: constant index out of range");
+                    d.k = &proto->consts[d.imm];
+                    break;
+                case Opcode::OpJmpIfFalse:
+                    d.imm = VirtualMachine::decode_offset16(inst);
+                    break;
+                case Opcode::OpJmp:
+                    d.imm = VirtualMachine::decode_offset24(inst);
+                    break;
+                case Opcode::OpCall:
+                case Opcode::OpTailCall:
+                case Opcode::OpSchedule:
+                    d.imm = VirtualMachine::decode_rt(inst);
+                    break;
+                case Opcode::OpGetUpval:
+                case Opcode::OpSetUpval:
+                    if (VirtualMachine::decode_rt(inst) >= proto->upvals.size())
+                        throw std::runtime_error("lower: upvalue index out of range");
+                    d.imm = VirtualMachine::decode_rt(inst);
+                    break;
+                case Opcode::OpCallNative:
+                    // nargs | native id << 8
+                    if (VirtualMachine::decode_rs(inst) >= natives_.size())
+                        throw std::runtime_error("lower: unknown native function");
+                    break;
+                case Opcode::OpAddRK:
+                case Opcode::OpSubRK:
+                case Opcode::OpMulRK:
+                case Opcode::OpDivRK:
+                case Opcode::OpLtRK:
+                case Opcode::OpLteRK:
+                case Opcode::OpBtRK:
+                case Opcode::OpBteRK:
+                case Opcode::OpEqRK:
+                case Opcode::OpNeRK:
+                    if (VirtualMachine::decode_rs(inst) >= proto->consts.size())
+                        throw std::runtime_error("lower: constant index out of range");
+                    d.k = &proto->consts[VirtualMachine::decode_rs(inst)];
+                    break;
+                default:
+                    break;
+            }
+            proto->decoded.push_back(d);
+        }
+    }
+
+    DecodedInst* VirtualMachine::instantiate(const Prototype* proto) {
+        static const void* const* const labels = [this] {
+            const void* const* l = nullptr;
+            dispatch(&l);
+            return l;
+        }();
+        if (proto->id >= streams_.size())
+            streams_.resize(program_->n_callables());
+        DecodedStream& code = streams_.at(proto->id);
+        code = proto->decoded;
+        if (labels) {
+            for (DecodedInst& d : code)
+                d.handler = labels[static_cast<uint8_t>(d.op)];
+        }
+        return code.data();
+    }
+
+    /* The callee's window starts at the caller's register rd + 1, where the
+     * arguments already are. sp_ only ever moves down on a call: a window
+     * ending above it would leave caller registers the collector no longer
+     * scans, and that come back as roots after the ret. */
+    Interrupt VirtualMachine::call(uint8_t rd, uint8_t n_args) {
+        BoltValue f = get_register_value(rd);
+        if (f.as_func()->type == ClosureObj::CLSR_NATIVE)
+            return f.as_func()->as_native.fn(*this, NativeArgs(&reg(rd + 1), n_args), reg(rd));
+        const Prototype* callee = f.as_func()->as_virtual.proto;
+        int32_t callee_fp = fp_ - rd - 1;
+        int32_t callee_sp = callee_fp - static_cast<int32_t>(callee->next_reg) + 1;
+        if (callee_sp < 0)
+            return Interrupt::StackOverFlow;
+
+        frames_[depth_++] = {.fp = fp_, .sp = sp_, .ip = static_cast<uint32_t>(ip_)};
+        fp_ = callee_fp;
+        sp_ = std::min(sp_, callee_sp);
+        clear_registers(n_args, callee->next_reg);
+        ip_ = 0;
+        code_ = stream(callee);
+        return Interrupt::Ok;
+    }
+
+    /* The callee reuses the running frame: the CallFrame of our caller stays,
+     * so its ret goes straight back there and a loop written as recursion
+     * runs in constant stack. The callee takes the callable slot and the
+     * arguments are moved down to the first registers in ascending order,
+     * which never overwrites one that is still to be read since
+     * rd + 1 + i > i. */
+    Interrupt VirtualMachine::tail_call(uint8_t rd, uint8_t n_args) {
+        BoltValue f = get_register_value(rd);
+        if (f.as_func()->type == ClosureObj::CLSR_NATIVE) {
+            Interrupt interrupt = f.as_func()->as_native.fn(*this, NativeArgs(&reg(rd + 1), n_args), reg(rd));
+            if (interrupt != Interrupt::Ok)
+                return interrupt;
+            return ret(rd);
+        }
+        const Prototype* callee = f.as_func()->as_virtual.proto;
+        int32_t callee_sp = fp_ - static_cast<int32_t>(callee->next_reg) + 1;
+        if (callee_sp < 0)
+            return Interrupt::StackOverFlow;
+
+        close_frame_upvals();
+        stack_[fp_ + 1] = f;
+        for (int i = 0; i < n_args; i++)
+            stack_[fp_ - i] = stack_[fp_ - (rd + 1 + i)];
+        sp_ = std::min(sp_, callee_sp);
+        clear_registers(n_args, callee->next_reg);
+        ip_ = 0;
+        code_ = stream(callee);
+        return Interrupt::Ok;
+    }
+
+    /* the task handle (an int for join) replaces the callee in rd */
+    Interrupt VirtualMachine::schedule(uint8_t rd, uint8_t n_args) {
+        if (scheduler_ == nullptr)
+            return Interrupt::NoScheduler;
+        BoltValue f = get_register_value(rd);
+        if (f.get_type() != BoltType::Closure || f.as_func()->type != ClosureObj::CLSR_VIRTUAL)
+            return Interrupt::IncompatibleTypes;
+        int id = scheduler_->spawn(f, NativeArgs(&reg(rd + 1), n_args));
+        set_register_value(rd, BoltValue::from_int(id));
+        return Interrupt::Ok;
+    }
+
+    /* natives run on the caller's frame and write their result to rd, the
+     * binary entry skips the variadic loop of the generic one */
+    Interrupt VirtualMachine::call_native(uint8_t rd, uint8_t n_args, uint8_t id) {
+        const NativeEntry& native = program_->get_native(id);
+        if (native.arity != NATIVE_VARIADIC && native.arity != n_args)
+            return Interrupt::ArityMismatch;
+        if (n_args == 2 && native.binary)
+            return native.binary(reg(rd + 1), reg(rd + 2), reg(rd));
+        return native.fn(*this, NativeArgs(&reg(rd + 1), n_args), reg(rd));
+    }
+
+    /* the result replaces the callee in the caller's frame, which is the
+     * slot right above our window */
+    Interrupt VirtualMachine::ret(uint8_t rd) {
+        BoltValue v = get_register_value(rd);
+        close_frame_upvals();
+        if (depth_ == 0) {
+            ret_val_ = v;
+            return Interrupt::Halt;
+        }
+        stack_[fp_ + 1] = v;
+        const CallFrame& caller = frames_[--depth_];
+        fp_ = caller.fp;
+        sp_ = caller.sp;
+        ip_ = caller.ip;
+        code_ = stream(frame_proto());
+        return Interrupt::Ok;
+    }
+
 
     Interrupt VirtualMachine::execute(uint32_t inst) {
         uint8_t rd, rs, rt;
-        BoltValue rdv, rsv, rtv;
         Opcode op;
 
         op = decode_op(inst);
@@ -76,32 +890,69 @@ namespace BVM {
                 set_register_value(rd, get_register_value(rt));
                 break;
 
-            case Opcode::OpRet:
-                ip_ = stack_[fp_ + 1].as_int;
-                sp_ = fp_;
-                fp_ = stack_[fp_].as_int;
-                stack_[sp_] = get_register_value(rd);
+            case Opcode::OpConst:
+                set_register_value(rd, frame_proto()->consts.at(inst >> 16));
                 break;
 
+            case Opcode::OpAdd: return arith_add(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpSub: return arith_sub(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpMul: return arith_mul(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpDiv: return arith_div(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpLt: return compare_lt(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpLte: return compare_lte(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpBt: return compare_bt(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpBte: return compare_bte(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpEq: return compare_eq(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpNe: return compare_ne(get_register_value(rt), get_register_value(rs), reg(rd));
+            case Opcode::OpAddRK: return arith_add(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpSubRK: return arith_sub(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpMulRK: return arith_mul(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpDivRK: return arith_div(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpLtRK: return compare_lt(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpLteRK: return compare_lte(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpBtRK: return compare_bt(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpBteRK: return compare_bte(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpEqRK: return compare_eq(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+            case Opcode::OpNeRK: return compare_ne(get_register_value(rt), frame_proto()->consts.at(rs), reg(rd));
+
+            case Opcode::OpJmp:
+                ip_ += decode_offset24(inst);
+                break;
+
+            case Opcode::OpJmpIfFalse:
+                if (get_register_value(rd).is_false())
+                    ip_ += decode_offset16(inst);
+                break;
+
+            case Opcode::OpRet:
+                return ret(rd);
+
             case Opcode::OpCall:
-            {
-                BoltValue f = get_register_value(rd);
-                uint16_t n_args = static_cast<uint16_t>(inst); // get lowest 16 bits
-                if (f.as_func->type == ClosureObj::CLSR_VIRTUAL) {
-                    push({.as_int = fp_, .type = BoltType::Integer});
-                    push({.as_int = static_cast<int>(ip_), .type = BoltType::Integer});
-                    push({.as_func = f.as_func, .type = BoltType::Closure});
-                    fp_ = sp_ + 3;
-                    sp_ -= n_args;
-                    ip_ = 0;
-                } else {
-                    push({.as_int = fp_, .type = BoltType::Integer});
-                    push({.as_int = static_cast<int>(ip_), .type = BoltType::Integer});
-                    fp_ = sp_ + 2;
-                    sp_ -= n_args;
-                }
+                return call(rd, rt);
+
+            case Opcode::OpTailCall:
+                return tail_call(rd, rt);
+
+            case Opcode::OpSchedule:
+                return schedule(rd, rt);
+
+            case Opcode::OpClosure:
+                make_closure(rd, inst >> 16);
                 break;
-            }
+
+            case Opcode::OpGetUpval:
+                set_register_value(rd, *stack_[fp_ + 1].as_func()->upvals()[rt]->location);
+                break;
+
+            case Opcode::OpSetUpval:
+                set_upval(stack_[fp_ + 1].as_func()->upvals()[rt], get_register_value(rd));
+                break;
+
+            case Opcode::OpCallNative:
+                if (rs >= program_->n_natives())
+                    throw std::runtime_error("unknown native function");
+                return call_native(rd, rt, rs);
+
             default:
                 throw std::runtime_error("opcode not implemented or recognized");
 
@@ -109,17 +960,468 @@ namespace BVM {
         return Interrupt::Ok;
     }
 
-    void VirtualMachine::run() {
-        uint32_t inst = fetch();
+    Interrupt VirtualMachine::run() {
+        return dispatch(nullptr);
+    }
+
+    void VirtualMachine::set_jit(bool enabled, uint32_t threshold) {
+#ifdef BVM_JIT
+        if (!enabled)
+            jit_.reset();
+        else if (jit_ == nullptr)
+            jit_ = std::make_unique<Jit>(threshold);
+        else
+            jit_->set_threshold(threshold);
+#else
+        (void)enabled;
+        (void)threshold;
+#endif
+    }
+
+    void VirtualMachine::set_tracing(bool enabled, uint32_t threshold) {
+#ifdef BVM_JIT
+        if (jit_ != nullptr)
+            jit_->set_trace_threshold(enabled ? threshold : TRACE_OFF);
+#else
+        (void)enabled;
+        (void)threshold;
+#endif
+    }
+
+    JitStats VirtualMachine::get_jit_stats() const {
+#ifdef BVM_JIT
+        if (jit_ != nullptr)
+            return jit_->get_stats();
+#endif
+        return JitStats{};
+    }
+
+    /* With BVM_COMPUTED_GOTO every handler ends by jumping straight to the
+     * label stored in the next decoded instruction, so there is no call, no
+     * bounds-checked switch and no Interrupt round trip per instruction. The
+     * fallback expands the same handlers into the cases of a switch.
+     * The interpreter keeps pc and the frame base in locals and only syncs
+     * ip_ when control leaves the current frame.
+     * Called with a non-null labels it only publishes its dispatch table so
+     * instantiate() can thread the handlers into decoded instructions. */
+    Interrupt VirtualMachine::dispatch(const void* const** labels) {
+#ifdef BVM_COMPUTED_GOTO
+#define BVM_LABEL_ADDR(op) &&L_##op,
+        static const void* dispatch_table[] = {
+            BVM_OPCODES(BVM_LABEL_ADDR)
+            BVM_QUICK_OPCODES(BVM_LABEL_ADDR)
+        };
+#undef BVM_LABEL_ADDR
+        if (labels) {
+            *labels = dispatch_table;
+            return Interrupt::Ok;
+        }
+#else
+        if (labels) {
+            *labels = nullptr;
+            return Interrupt::Ok;
+        }
+#endif
+
         Interrupt interrupt;
+        DecodedInst* pc = code_ + ip_;
+        DecodedInst* d;
+        BoltValue* frame = stack_ + fp_;
+        uint64_t quick_hits = 0;
+
+/* a frame whose prototype has native code continues there, counting the
+ * call makes a prototype hot */
+#ifdef BVM_JIT
+        const uint8_t* const* native;
+#define JIT_ENTER(count) \
+        if (jit_ != nullptr && (native = jit_->lookup(frame_proto(), count)) != nullptr) \
+            goto jit
+/* d closed a loop when loop holds, which gets a trace once it has done
+ * that often enough */
+#define TRACE_ENTER(loop) \
+        if ((loop) && jit_ != nullptr && ++d->count >= jit_->trace_threshold()) [[unlikely]] \
+            goto trace
+#else
+#define JIT_ENTER(count)
+#define TRACE_ENTER(loop)
+#endif
+
+#ifdef BVM_COMPUTED_GOTO
+#define TARGET(op) L_##op:
+#define DISPATCH() \
+        d = pc++; \
+        goto *d->handler
+#define REWRITE(inst, new_op) \
+        (inst)->op = Opcode::new_op; \
+        (inst)->handler = dispatch_table[static_cast<uint8_t>(Opcode::new_op)]
+
+        JIT_ENTER(false);
+        DISPATCH();
+#else
+#define TARGET(op) case Opcode::op:
+#define DISPATCH() continue
+#define REWRITE(inst, new_op) (inst)->op = Opcode::new_op
+
+        JIT_ENTER(false);
         for (;;) {
-            interrupt = execute(inst);
-            if (interrupt != Interrupt::Ok) {
-                handle_interrupt(interrupt);
-                return;
+        d = pc++;
+        switch(d->op) {
+#endif
+
+/* yields once the budget runs out, the state is saved as for any other
+ * interrupt and run() resumes right where it stopped */
+#define CHARGE(cost) \
+        if ((budget_ -= (cost)) <= 0) [[unlikely]] { \
+            interrupt = Interrupt::Yield; \
+            goto exit; \
+        }
+
+#define QUICKEN(new_op) \
+        REWRITE(d, new_op); \
+        quicken_stats_.quickened++
+
+#define DEOPT(generic_op) \
+        REWRITE(d, generic_op); \
+        d->deopts++; \
+        quicken_stats_.misses++
+
+        TARGET(OpMov) {
+            frame[d->rd] = frame[d->rt];
+            DISPATCH();
+        }
+
+        TARGET(OpCall) {
+            ip_ = pc - code_;
+            interrupt = call(reg_index(d->rd), d->imm);
+            if (interrupt != Interrupt::Ok)
+                goto exit;
+            pc = code_ + ip_;
+            frame = stack_ + fp_;
+            CHARGE(1);
+            JIT_ENTER(true);
+            DISPATCH();
+        }
+
+        TARGET(OpTailCall) {
+            ip_ = pc - code_;
+            [[maybe_unused]] DecodedInst* caller = code_;
+            interrupt = tail_call(reg_index(d->rd), d->imm);
+            if (interrupt != Interrupt::Ok)
+                goto exit;
+            pc = code_ + ip_;
+            frame = stack_ + fp_;
+            CHARGE(1);
+            TRACE_ENTER(code_ == caller);
+            JIT_ENTER(true);
+            DISPATCH();
+        }
+
+        TARGET(OpRet) {
+            interrupt = ret(reg_index(d->rd));
+            if (interrupt != Interrupt::Ok)
+                goto exit;
+            pc = code_ + ip_;
+            frame = stack_ + fp_;
+            JIT_ENTER(false);
+            DISPATCH();
+        }
+
+        // may collect, frame[1] is rooted as the running closure
+        TARGET(OpClosure) {
+            make_closure(reg_index(d->rd), d->imm);
+            DISPATCH();
+        }
+
+        TARGET(OpGetUpval) {
+            frame[d->rd] = *frame[1].as_func()->upvals()[d->imm]->location;
+            DISPATCH();
+        }
+
+        TARGET(OpSetUpval) {
+            set_upval(frame[1].as_func()->upvals()[d->imm], frame[d->rd]);
+            DISPATCH();
+        }
+
+        /* a constant feeding the add right after it is fused with that add
+         * while the add sees ints on both sides */
+        TARGET(OpConst) {
+            frame[d->rd] = *d->k;
+            if (d->deopts < QUICKEN_LIMIT) [[unlikely]] {
+                if (static_cast<size_t>(pc - code_) < frame_proto()->decoded.size()
+                        && (pc->op == Opcode::OpAdd || pc->op == Opcode::OpAddII)
+                        && (pc->rt == d->rd || pc->rs == d->rd)
+                        && BoltValue::both_int(frame[pc->rt], frame[pc->rs])) {
+                    QUICKEN(OpConstAddII);
+                } else {
+                    d->deopts = QUICKEN_LIMIT;
+                }
             }
-            
+            DISPATCH();
         }
+
+        TARGET(OpConstAddII) {
+            frame[d->rd] = *d->k;
+            BoltValue x = frame[pc->rt], y = frame[pc->rs];
+            int r;
+            if (BoltValue::both_int(x, y) && !CHECKED_ADD(x.as_int(), y.as_int(), &r)) [[likely]] {
+                frame[pc->rd] = BoltValue::from_int(r);
+                pc++;
+                quick_hits++;
+                DISPATCH();
+            }
+            // leave the add to run on its own
+            DEOPT(OpConst);
+            DISPATCH();
+        }
+
+        /* Generic binary instructions run their helper and, while the
+         * instruction is still allowed to, pick a specialized form from the
+         * operand types they just saw. The second operand is a register or,
+         * for *RK forms, the pre-resolved constant. */
+#define REG_Y frame[d->rs]
+#define CONST_Y (*d->k)
+
+#define BINARY_TARGET(op, fn, Y, quicken) \
+        TARGET(op) { \
+            BoltValue x = frame[d->rt], y = Y; \
+            interrupt = fn(x, y, frame[d->rd]); \
+            if (interrupt != Interrupt::Ok) [[unlikely]] \
+                goto exit; \
+            if (d->deopts < QUICKEN_LIMIT) [[unlikely]] { \
+                quicken \
+            } \
+            DISPATCH(); \
+        }
+
+#define QUICKEN_II_FF(ii, ff) \
+            if (BoltValue::both_int(x, y)) { QUICKEN(ii); } \
+            else if (x.is_double() && y.is_double()) { QUICKEN(ff); } \
+            else d->deopts = QUICKEN_LIMIT;
+
+#define QUICKEN_II(ii) \
+            if (BoltValue::both_int(x, y)) { QUICKEN(ii); } \
+            else d->deopts = QUICKEN_LIMIT;
+
+#define QUICKEN_FF(ff) \
+            if (x.is_double() && y.is_double()) { QUICKEN(ff); } \
+            else d->deopts = QUICKEN_LIMIT;
+
+        /* comparisons whose result is only branched on by the next
+         * instruction also absorb that branch - unless it jumps backwards,
+         * backward branches stay separate so they keep charging the budget */
+#define QUICKEN_CMP(ii, ii_jmp, ff) \
+            if (BoltValue::both_int(x, y)) { \
+                if (static_cast<size_t>(pc - code_) < frame_proto()->decoded.size() \
+                        && pc->op == Opcode::OpJmpIfFalse && pc->rd == d->rd && pc->imm >= 0) { \
+                    d->imm = pc->imm; \
+                    QUICKEN(ii_jmp); \
+                } else { \
+                    QUICKEN(ii); \
+                } \
+            } \
+            else { ff }
+
+#define NO_QUICKEN d->deopts = QUICKEN_LIMIT;
+
+        BINARY_TARGET(OpAdd, arith_add, REG_Y, QUICKEN_II_FF(OpAddII, OpAddFF))
+        BINARY_TARGET(OpSub, arith_sub, REG_Y, QUICKEN_II_FF(OpSubII, OpSubFF))
+        BINARY_TARGET(OpMul, arith_mul, REG_Y, QUICKEN_II_FF(OpMulII, OpMulFF))
+        BINARY_TARGET(OpDiv, arith_div, REG_Y, QUICKEN_FF(OpDivFF))
+        BINARY_TARGET(OpLt, compare_lt, REG_Y, QUICKEN_CMP(OpLtII, OpLtIIJmp, QUICKEN_FF(OpLtFF)))
+        BINARY_TARGET(OpLte, compare_lte, REG_Y, QUICKEN_CMP(OpLteII, OpLteIIJmp, QUICKEN_FF(OpLteFF)))
+        BINARY_TARGET(OpBt, compare_bt, REG_Y, QUICKEN_CMP(OpBtII, OpBtIIJmp, QUICKEN_FF(OpBtFF)))
+        BINARY_TARGET(OpBte, compare_bte, REG_Y, QUICKEN_CMP(OpBteII, OpBteIIJmp, QUICKEN_FF(OpBteFF)))
+        BINARY_TARGET(OpEq, compare_eq, REG_Y, QUICKEN_CMP(OpEqII, OpEqIIJmp, NO_QUICKEN))
+        BINARY_TARGET(OpNe, compare_ne, REG_Y, QUICKEN_CMP(OpNeII, OpNeIIJmp, NO_QUICKEN))
+        BINARY_TARGET(OpAddRK, arith_add, CONST_Y, QUICKEN_II(OpAddRKII))
+        BINARY_TARGET(OpSubRK, arith_sub, CONST_Y, QUICKEN_II(OpSubRKII))
+        BINARY_TARGET(OpMulRK, arith_mul, CONST_Y, QUICKEN_II(OpMulRKII))
+        BINARY_TARGET(OpDivRK, arith_div, CONST_Y, NO_QUICKEN)
+        BINARY_TARGET(OpLtRK, compare_lt, CONST_Y, QUICKEN_CMP(OpLtRKII, OpLtRKIIJmp, NO_QUICKEN))
+        BINARY_TARGET(OpLteRK, compare_lte, CONST_Y, QUICKEN_CMP(OpLteRKII, OpLteRKIIJmp, NO_QUICKEN))
+        BINARY_TARGET(OpBtRK, compare_bt, CONST_Y, QUICKEN_CMP(OpBtRKII, OpBtRKIIJmp, NO_QUICKEN))
+        BINARY_TARGET(OpBteRK, compare_bte, CONST_Y, QUICKEN_CMP(OpBteRKII, OpBteRKIIJmp, NO_QUICKEN))
+        BINARY_TARGET(OpEqRK, compare_eq, CONST_Y, QUICKEN_CMP(OpEqRKII, OpEqRKIIJmp, NO_QUICKEN))
+        BINARY_TARGET(OpNeRK, compare_ne, CONST_Y, QUICKEN_CMP(OpNeRKII, OpNeRKIIJmp, NO_QUICKEN))
+#undef BINARY_TARGET
+#undef QUICKEN_II_FF
+#undef QUICKEN_II
+#undef QUICKEN_FF
+#undef QUICKEN_CMP
+#undef NO_QUICKEN
+
+        /* Specialized forms: the guard is the only type check. A failing guard
+         * rewrites the instruction back to its generic opcode and finishes
+         * this execution through the generic helper. */
+#define SPECIALIZED_TARGET(op, generic_op, Y, guard, fast, fn) \
+        TARGET(op) { \
+            BoltValue x = frame[d->rt], y = Y; \
+            if (guard) [[likely]] { \
+                fast \
+                quick_hits++; \
+                DISPATCH(); \
+            } \
+            DEOPT(generic_op); \
+            interrupt = fn(x, y, frame[d->rd]); \
+            if (interrupt != Interrupt::Ok) [[unlikely]] \
+                goto exit; \
+            DISPATCH(); \
+        }
+
+#define BOTH_INT BoltValue::both_int(x, y)
+#define BOTH_DOUBLE (x.is_double() && y.is_double())
+
+#define ARITH_II(op, checked) \
+        int r; \
+        if (!checked(x.as_int(), y.as_int(), &r)) [[likely]] \
+            frame[d->rd] = BoltValue::from_int(r); \
+        else \
+            frame[d->rd] = BoltValue::from_double(static_cast<double>(x.as_int()) op y.as_int());
+
+#define ARITH_FF(op) frame[d->rd] = BoltValue::from_double(x.as_double() op y.as_double());
+#define CMP_II(op) frame[d->rd] = BoltValue::from_bool(x.as_int() op y.as_int());
+#define CMP_FF(op) frame[d->rd] = BoltValue::from_bool(x.as_double() op y.as_double());
+
+        // pc points at the fused jump: skip it, or take it when the test fails
+#define CMP_II_JMP(op) \
+        bool taken = !(x.as_int() op y.as_int()); \
+        frame[d->rd] = BoltValue::from_bool(!taken); \
+        pc += taken ? 1 + d->imm : 1;
+
+        SPECIALIZED_TARGET(OpAddII, OpAdd, REG_Y, BOTH_INT, ARITH_II(+, CHECKED_ADD), arith_add)
+        SPECIALIZED_TARGET(OpSubII, OpSub, REG_Y, BOTH_INT, ARITH_II(-, CHECKED_SUB), arith_sub)
+        SPECIALIZED_TARGET(OpMulII, OpMul, REG_Y, BOTH_INT, ARITH_II(*, CHECKED_MUL), arith_mul)
+        SPECIALIZED_TARGET(OpAddFF, OpAdd, REG_Y, BOTH_DOUBLE, ARITH_FF(+), arith_add)
+        SPECIALIZED_TARGET(OpSubFF, OpSub, REG_Y, BOTH_DOUBLE, ARITH_FF(-), arith_sub)
+        SPECIALIZED_TARGET(OpMulFF, OpMul, REG_Y, BOTH_DOUBLE, ARITH_FF(*), arith_mul)
+        SPECIALIZED_TARGET(OpDivFF, OpDiv, REG_Y, BOTH_DOUBLE, ARITH_FF(/), arith_div)
+        SPECIALIZED_TARGET(OpLtII, OpLt, REG_Y, BOTH_INT, CMP_II(<), compare_lt)
+        SPECIALIZED_TARGET(OpLteII, OpLte, REG_Y, BOTH_INT, CMP_II(<=), compare_lte)
+        SPECIALIZED_TARGET(OpBtII, OpBt, REG_Y, BOTH_INT, CMP_II(>), compare_bt)
+        SPECIALIZED_TARGET(OpBteII, OpBte, REG_Y, BOTH_INT, CMP_II(>=), compare_bte)
+        SPECIALIZED_TARGET(OpEqII, OpEq, REG_Y, BOTH_INT, CMP_II(==), compare_eq)
+        SPECIALIZED_TARGET(OpNeII, OpNe, REG_Y, BOTH_INT, CMP_II(!=), compare_ne)
+        SPECIALIZED_TARGET(OpLtFF, OpLt, REG_Y, BOTH_DOUBLE, CMP_FF(<), compare_lt)
+        SPECIALIZED_TARGET(OpLteFF, OpLte, REG_Y, BOTH_DOUBLE, CMP_FF(<=), compare_lte)
+        SPECIALIZED_TARGET(OpBtFF, OpBt, REG_Y, BOTH_DOUBLE, CMP_FF(>), compare_bt)
+        SPECIALIZED_TARGET(OpBteFF, OpBte, REG_Y, BOTH_DOUBLE, CMP_FF(>=), compare_bte)
+        SPECIALIZED_TARGET(OpLtIIJmp, OpLt, REG_Y, BOTH_INT, CMP_II_JMP(<), compare_lt)
+        SPECIALIZED_TARGET(OpLteIIJmp, OpLte, REG_Y, BOTH_INT, CMP_II_JMP(<=), compare_lte)
+        SPECIALIZED_TARGET(OpBtIIJmp, OpBt, REG_Y, BOTH_INT, CMP_II_JMP(>), compare_bt)
+        SPECIALIZED_TARGET(OpBteIIJmp, OpBte, REG_Y, BOTH_INT, CMP_II_JMP(>=), compare_bte)
+        SPECIALIZED_TARGET(OpEqIIJmp, OpEq, REG_Y, BOTH_INT, CMP_II_JMP(==), compare_eq)
+        SPECIALIZED_TARGET(OpNeIIJmp, OpNe, REG_Y, BOTH_INT, CMP_II_JMP(!=), compare_ne)
+        SPECIALIZED_TARGET(OpAddRKII, OpAddRK, CONST_Y, BOTH_INT, ARITH_II(+, CHECKED_ADD), arith_add)
+        SPECIALIZED_TARGET(OpSubRKII, OpSubRK, CONST_Y, BOTH_INT, ARITH_II(-, CHECKED_SUB), arith_sub)
+        SPECIALIZED_TARGET(OpMulRKII, OpMulRK, CONST_Y, BOTH_INT, ARITH_II(*, CHECKED_MUL), arith_mul)
+        SPECIALIZED_TARGET(OpLtRKII, OpLtRK, CONST_Y, BOTH_INT, CMP_II(<), compare_lt)
+        SPECIALIZED_TARGET(OpLteRKII, OpLteRK, CONST_Y, BOTH_INT, CMP_II(<=), compare_lte)
+        SPECIALIZED_TARGET(OpBtRKII, OpBtRK, CONST_Y, BOTH_INT, CMP_II(>), compare_bt)
+        SPECIALIZED_TARGET(OpBteRKII, OpBteRK, CONST_Y, BOTH_INT, CMP_II(>=), compare_bte)
+        SPECIALIZED_TARGET(OpEqRKII, OpEqRK, CONST_Y, BOTH_INT, CMP_II(==), compare_eq)
+        SPECIALIZED_TARGET(OpNeRKII, OpNeRK, CONST_Y, BOTH_INT, CMP_II(!=), compare_ne)
+        SPECIALIZED_TARGET(OpLtRKIIJmp, OpLtRK, CONST_Y, BOTH_INT, CMP_II_JMP(<), compare_lt)
+        SPECIALIZED_TARGET(OpLteRKIIJmp, OpLteRK, CONST_Y, BOTH_INT, CMP_II_JMP(<=), compare_lte)
+        SPECIALIZED_TARGET(OpBtRKIIJmp, OpBtRK, CONST_Y, BOTH_INT, CMP_II_JMP(>), compare_bt)
+        SPECIALIZED_TARGET(OpBteRKIIJmp, OpBteRK, CONST_Y, BOTH_INT, CMP_II_JMP(>=), compare_bte)
+        SPECIALIZED_TARGET(OpEqRKIIJmp, OpEqRK, CONST_Y, BOTH_INT, CMP_II_JMP(==), compare_eq)
+        SPECIALIZED_TARGET(OpNeRKIIJmp, OpNeRK, CONST_Y, BOTH_INT, CMP_II_JMP(!=), compare_ne)
+#undef SPECIALIZED_TARGET
+#undef BOTH_INT
+#undef BOTH_DOUBLE
+#undef ARITH_II
+#undef ARITH_FF
+#undef CMP_II
+#undef CMP_FF
+#undef CMP_II_JMP
+#undef REG_Y
+#undef CONST_Y
+
+        TARGET(OpJmp) {
+            pc += d->imm;
+            if (d->imm < 0) {
+                CHARGE(-d->imm);
+                TRACE_ENTER(true);
+            }
+            DISPATCH();
+        }
+
+        TARGET(OpJmpIfFalse) {
+            if (frame[d->rd].is_false()) {
+                pc += d->imm;
+                if (d->imm < 0) {
+                    CHARGE(-d->imm);
+                    TRACE_ENTER(true);
+                }
+            }
+            DISPATCH();
+        }
+
+        TARGET(OpCallNative) {
+            interrupt = call_native(reg_index(d->rd), d->imm & 0xFF, d->imm >> 8);
+            if (interrupt != Interrupt::Ok)
+                goto exit;
+            DISPATCH();
+        }
+
+        TARGET(OpSchedule) {
+            interrupt = schedule(reg_index(d->rd), d->imm);
+            if (interrupt != Interrupt::Ok)
+                goto exit;
+            DISPATCH();
+        }
+
+        TARGET(OpDefine)
+            throw std::runtime_error("opcode not implemented or recognized");
+
+#ifdef BVM_JIT
+jit:
+        ip_ = pc - code_;
+        interrupt = jit_->run(*this, native);
+        pc = code_ + ip_;
+        if (interrupt != Interrupt::Ok)
+            goto exit;
+        frame = stack_ + fp_;
+        DISPATCH();
+
+/* a loop that has no trace yet starts counting again, one that has runs it
+ * and continues natively after a side exit where it can */
+trace:
+        ip_ = pc - code_;
+        {
+            const uint8_t* trace = jit_->trace(*this, interrupt);
+            if (trace == nullptr)
+                d->count = 0;
+            else
+                interrupt = jit_->run_trace(*this, trace);
+        }
+        pc = code_ + ip_;
+        if (interrupt != Interrupt::Ok)
+            goto exit;
+        frame = stack_ + fp_;
+        JIT_ENTER(false);
+        DISPATCH();
+#endif
+
+#ifndef BVM_COMPUTED_GOTO
+        default:
+            throw std::runtime_error("opcode not implemented or recognized");
+        }
+        }
+#endif
+#undef TARGET
+#undef DISPATCH
+#undef REWRITE
+#undef QUICKEN
+#undef DEOPT
+#undef CHARGE
+#undef JIT_ENTER
+#undef TRACE_ENTER
+
+exit:
+        ip_ = pc - code_;
+        quicken_stats_.hits += quick_hits;
+        handle_interrupt(interrupt);
+        return interrupt;
     }
 }
-
@@ -0,0 +1,57 @@
+#include "bolt_virtual_machine/vm_pool.hpp"
+#include <stdexcept>
+
+namespace BVM {
+
+    VmPool::Lease& VmPool::Lease::operator=(Lease&& other) noexcept {
+        if (this != &other) {
+            if (vm_)
+                pool_->release(std::move(vm_));
+            pool_ = other.pool_;
+            vm_ = std::move(other.vm_);
+        }
+        return *this;
+    }
+
+    VmPool::Lease::~Lease() {
+        if (vm_)
+            pool_->release(std::move(vm_));
+    }
+
+    VmPool::VmPool(std::shared_ptr<const Program> program, size_t max_idle, size_t stack_slots, size_t nursery_cells)
+            : program_(std::move(program)), stack_slots_(stack_slots), nursery_cells_(nursery_cells), max_idle_(max_idle) {
+        if (program_ == nullptr || !program_->is_frozen())
+            throw std::runtime_error("VmPool: the program must be frozen");
+    }
+
+    VmPool::Lease VmPool::acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!idle_.empty()) {
+                std::unique_ptr<VirtualMachine> vm = std::move(idle_.back());
+                idle_.pop_back();
+                return Lease(this, std::move(vm));
+            }
+        }
+        // built outside the lock, creating a context maps its stack and nursery
+        return Lease(this, std::make_unique<VirtualMachine>(program_, stack_slots_, nursery_cells_));
+    }
+
+    /* the reset happens on release so idle contexts hold no garbage, a
+     * context that fails to reset is dropped rather than handed out again */
+    void VmPool::release(std::unique_ptr<VirtualMachine> vm) {
+        try {
+            vm->reset();
+        } catch (...) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < max_idle_)
+            idle_.push_back(std::move(vm));
+    }
+
+    size_t VmPool::n_idle() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return idle_.size();
+    }
+}
@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+#include <heap_area.hpp>
+#include <set>
+
+TEST(HeapAreaTests, TestSizeClasses) {
+    BVM::HeapArea area;
+    EXPECT_EQ(area.block_size(1), 16);
+    EXPECT_EQ(area.block_size(16), 16);
+    EXPECT_EQ(area.block_size(17), 32);
+    EXPECT_EQ(area.block_size(130), 160);
+    EXPECT_EQ(area.block_size(HEAP_MAX_SMALL), HEAP_MAX_SMALL);
+    EXPECT_GE(area.block_size(HEAP_MAX_SMALL + 1), HEAP_MAX_SMALL + 1);
+}
+
+TEST(HeapAreaTests, TestAlignmentAndDistinctBlocks) {
+    BVM::HeapArea area;
+    std::set<void*> seen;
+    for (int i = 0; i < 10000; i++) {
+        void* p = area.allocate(48);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % HEAP_GRANULE, 0);
+        EXPECT_TRUE(seen.insert(p).second);
+    }
+    EXPECT_GT(area.get_stats().n_runs, 1);
+}
+
+TEST(HeapAreaTests, TestFreedBlockIsReused) {
+    BVM::HeapArea area;
+    void* a = area.allocate(40);
+    area.allocate(40);
+    area.free(a, 40);
+    EXPECT_EQ(area.get_stats().free_bytes, 48);
+    EXPECT_EQ(area.allocate(33), a);
+    EXPECT_EQ(area.get_stats().free_bytes, 0);
+}
+
+TEST(HeapAreaTests, TestStats) {
+    BVM::HeapArea area;
+    void* p = area.allocate(20);
+    const BVM::HeapAreaStats& s = area.get_stats();
+    EXPECT_EQ(s.reserved_bytes, HEAP_RUN_SIZE);
+    EXPECT_EQ(s.used_bytes, 32);
+    EXPECT_EQ(s.requested_bytes, 20);
+    EXPECT_DOUBLE_EQ(s.internal_fragmentation(), 1.0 - 20.0 / 32.0);
+
+    void* big = area.allocate(100000);
+    EXPECT_EQ(s.n_large, 1);
+    area.free(big, 100000);
+    area.free(p, 20);
+    EXPECT_EQ(s.n_large, 0);
+    EXPECT_EQ(s.used_bytes, 0);
+    EXPECT_EQ(s.reserved_bytes, HEAP_RUN_SIZE);
+}
+
+TEST(HeapAreaTests, TestCreateDestroy) {
+    struct Obj { int64_t a = 7; double b = 1.5; };
+    BVM::HeapArea area;
+    Obj* o = area.create<Obj>();
+    EXPECT_EQ(o->a, 7);
+    area.destroy(o);
+    EXPECT_EQ(area.get_stats().used_bytes, 0);
+}
@@ -5,14 +5,15 @@
 BVM::VirtualMachine vm;
 const uint8_t rd = 0, rt = 1, rs = 2;
 
+#include <climits>
 #include <cstdint>
 
 class InstructionTests: public ::testing::Test {
     protected:
         void SetUp() override {
-            std::unique_ptr<BVM::Callable> main_func = std::make_unique<BVM::Callable>();
-            main_func->name = "main";
+            std::unique_ptr<BVM::Prototype> main_func = std::make_unique<BVM::Prototype>();
             main_func->n_locals = 3;
+            main_func->next_reg = 3;
             vm.load_callable(std::move(main_func));
             vm.setup_entry_point();
         }
@@ -21,33 +22,488 @@ class InstructionTests: public ::testing::Test {
 
 
 TEST_F(InstructionTests, TestSetup) {
-    EXPECT_EQ(vm.get_stack_entry(STACK_SIZE - 1).as_int, -1);
-    EXPECT_EQ(vm.get_stack_entry(STACK_SIZE - 2).as_int, 0);
-    BVM::Callable* main_func = vm.get_callable(0);
-    BVM::BoltValue ref = vm.get_stack_entry(STACK_SIZE - 3);
-    EXPECT_EQ(ref.as_func, main_func);
+    const BVM::Prototype* main_func = vm.get_callable(0);
+    BVM::BoltValue ref = vm.get_stack_entry(vm.get_stack_size() - 1);
+    EXPECT_EQ(ref.as_func()->as_virtual.proto, main_func);
+    EXPECT_EQ(vm.get_call_depth(), 0);
+    // register 0 sits right below the callable
+    vm.set_register_value(0, BVM::BoltValue::from_int(5));
+    EXPECT_EQ(vm.get_stack_entry(vm.get_stack_size() - 2).as_int(), 5);
 }
 
 TEST_F(InstructionTests, TestAdd) {
-    vm.set_register_value(rt, {.as_int = 1, .type = BVM::BoltType::Integer});
-    vm.set_register_value(rs, {.as_int = 1, .type = BVM::BoltType::Integer});
+    vm.set_register_value(rt, BVM::BoltValue::from_int(1));
+    vm.set_register_value(rs, BVM::BoltValue::from_int(1));
     BVM::Interrupt interrupt = vm.execute(BVM::Emitter::add(rd, rt, rs));
     EXPECT_EQ(interrupt, BVM::Interrupt::Ok);
-    EXPECT_EQ(vm.get_register_value(rd).as_int, 2);
+    EXPECT_EQ(vm.get_register_value(rd).as_int(), 2);
 }
 
 TEST_F(InstructionTests, TestFadd) {
-    vm.set_register_value(rt, {.as_double = 2.5, .type = BVM::BoltType::Float});
-    vm.set_register_value(rs, {.as_double = 2.6, .type = BVM::BoltType::Float});
+    vm.set_register_value(rt, BVM::BoltValue::from_double(2.5));
+    vm.set_register_value(rs, BVM::BoltValue::from_double(2.6));
     BVM::Interrupt interrupt = vm.execute(BVM::Emitter::add(rd, rt, rs));
     EXPECT_EQ(interrupt, BVM::Interrupt::Ok);
-    EXPECT_EQ(vm.get_register_value(rd).as_double, 5.1);
+    EXPECT_EQ(vm.get_register_value(rd).as_double(), 5.1);
 }
 
 TEST_F(InstructionTests, TestMov) {
-    vm.set_register_value(rt, {.as_int = 10, .type = BVM::BoltType::Integer});
+    vm.set_register_value(rt, BVM::BoltValue::from_int(10));
     BVM::Interrupt interrupt = vm.execute(BVM::Emitter::mov(rd, rt));
     EXPECT_EQ(interrupt, BVM::Interrupt::Ok);
-    EXPECT_EQ(vm.get_register_value(rd).as_int, 10);
+    EXPECT_EQ(vm.get_register_value(rd).as_int(), 10);
 }
 
+
+TEST(RunTests, TestCallRet) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 2;
+    main_func->instructions = {BVM::Emitter::call(0, 1), BVM::Emitter::ret(0)};
+    auto callee = std::make_unique<BVM::Prototype>();
+    callee->arity = 1;
+    callee->next_reg = 1;
+    callee->instructions = {BVM::Emitter::ret(0)};
+
+    local_vm.load_callable(std::move(main_func));
+    local_vm.load_callable(std::move(callee));
+    local_vm.setup_entry_point();
+    local_vm.set_register_value(0, BVM::BoltValue::from_func(local_vm.new_closure(local_vm.get_callable(1))));
+    local_vm.set_register_value(1, BVM::BoltValue::from_int(42));
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 42);
+}
+
+/* the callee's registers are the caller's argument registers, a write to
+ * its parameter shows up in the caller and the result lands in rd */
+TEST(RunTests, TestArgumentsShareRegisters) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 4;
+    main_func->instructions = {BVM::Emitter::call(1, 1), BVM::Emitter::ret(2)};
+    auto callee = std::make_unique<BVM::Prototype>();
+    callee->arity = 1;
+    callee->next_reg = 2;
+    callee->consts = {BVM::BoltValue::from_int(7)};
+    callee->instructions = {
+        BVM::Emitter::mov(1, 0),
+        BVM::Emitter::load_const(0, 0),
+        BVM::Emitter::ret(1),
+    };
+
+    local_vm.load_callable(std::move(main_func));
+    local_vm.load_callable(std::move(callee));
+    local_vm.setup_entry_point();
+    local_vm.set_register_value(0, BVM::BoltValue::from_int(1));
+    local_vm.set_register_value(1, BVM::BoltValue::from_func(local_vm.new_closure(local_vm.get_callable(1))));
+    local_vm.set_register_value(2, BVM::BoltValue::from_int(42));
+    EXPECT_EQ(local_vm.run(), BVM::Interrupt::Halt);
+    EXPECT_EQ(local_vm.get_call_depth(), 0);
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 7);
+    EXPECT_EQ(local_vm.get_register_value(0).as_int(), 1);
+    EXPECT_EQ(local_vm.get_register_value(1).as_int(), 42);
+}
+
+/* main keeps x in register 0, the closure increments it through an upvalue:
+ * open while main runs, closed over the last value once main returns */
+TEST(RunTests, TestUpvalues) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->consts = {BVM::BoltValue::from_int(10)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(0, 0),
+        BVM::Emitter::closure(1, 1),
+        BVM::Emitter::mov(2, 1),
+        BVM::Emitter::call(2, 0),
+        BVM::Emitter::mov(2, 1),
+        BVM::Emitter::call(2, 0),
+        BVM::Emitter::ret(1),
+    };
+    auto inc = std::make_unique<BVM::Prototype>();
+    inc->next_reg = 1;
+    inc->upvals = {{.in_stack = true, .index = 0}};
+    inc->consts = {BVM::BoltValue::from_int(1)};
+    inc->instructions = {
+        BVM::Emitter::get_upval(0, 0),
+        BVM::Emitter::add_rk(0, 0, 0),
+        BVM::Emitter::set_upval(0, 0),
+        BVM::Emitter::ret(0),
+    };
+
+    local_vm.load_callable(std::move(main_func));
+    local_vm.load_callable(std::move(inc));
+    local_vm.setup_entry_point();
+    EXPECT_EQ(local_vm.run(), BVM::Interrupt::Halt);
+    EXPECT_EQ(local_vm.get_register_value(0).as_int(), 12);
+    BVM::ClosureObj* f = local_vm.get_return_value().as_func();
+    BVM::UpvalObj* up = f->upvals()[0];
+    EXPECT_EQ(up->location, &up->closed);
+    EXPECT_EQ(up->closed.as_int(), 12);
+
+    // running the closure on its own works on the closed copy
+    local_vm.setup_call(BVM::BoltValue::from_func(f), BVM::NativeArgs(nullptr, 0));
+    EXPECT_EQ(local_vm.run(), BVM::Interrupt::Halt);
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 13);
+}
+
+TEST(RunTests, TestLowerRejectsUpvalueOutOfRange) {
+    BVM::VirtualMachine local_vm;
+    auto proto = std::make_unique<BVM::Prototype>();
+    proto->next_reg = 1;
+    proto->instructions = {BVM::Emitter::get_upval(0, 0), BVM::Emitter::ret(0)};
+    EXPECT_THROW(local_vm.load_callable(std::move(proto)), std::runtime_error);
+}
+
+TEST(RunTests, TestLowerRejectsInvalidOpcode) {
+    BVM::VirtualMachine local_vm;
+    auto proto = std::make_unique<BVM::Prototype>();
+    proto->instructions = {0xff};
+    EXPECT_THROW(local_vm.load_callable(std::move(proto)), std::runtime_error);
+}
+
+TEST_F(InstructionTests, TestAddOverflowPromotes) {
+    vm.set_register_value(rt, BVM::BoltValue::from_int(INT_MAX));
+    vm.set_register_value(rs, BVM::BoltValue::from_int(1));
+    EXPECT_EQ(vm.execute(BVM::Emitter::add(rd, rt, rs)), BVM::Interrupt::Ok);
+    EXPECT_EQ(vm.get_register_value(rd).get_type(), BVM::BoltType::Float);
+    EXPECT_EQ(vm.get_register_value(rd).as_double(), static_cast<double>(INT_MAX) + 1);
+}
+
+TEST_F(InstructionTests, TestMixedMul) {
+    vm.set_register_value(rt, BVM::BoltValue::from_int(3));
+    vm.set_register_value(rs, BVM::BoltValue::from_double(0.5));
+    EXPECT_EQ(vm.execute(BVM::Emitter::mul(rd, rt, rs)), BVM::Interrupt::Ok);
+    EXPECT_EQ(vm.get_register_value(rd).as_double(), 1.5);
+}
+
+TEST_F(InstructionTests, TestDiv) {
+    vm.set_register_value(rt, BVM::BoltValue::from_int(7));
+    vm.set_register_value(rs, BVM::BoltValue::from_int(2));
+    EXPECT_EQ(vm.execute(BVM::Emitter::div(rd, rt, rs)), BVM::Interrupt::Ok);
+    EXPECT_EQ(vm.get_register_value(rd).as_double(), 3.5);
+    vm.set_register_value(rt, BVM::BoltValue::from_int(8));
+    EXPECT_EQ(vm.execute(BVM::Emitter::div(rd, rt, rs)), BVM::Interrupt::Ok);
+    EXPECT_EQ(vm.get_register_value(rd).as_int(), 4);
+    vm.set_register_value(rs, BVM::BoltValue::from_int(0));
+    EXPECT_EQ(vm.execute(BVM::Emitter::div(rd, rt, rs)), BVM::Interrupt::DivisionByZero);
+}
+
+TEST_F(InstructionTests, TestCompare) {
+    vm.set_register_value(rt, BVM::BoltValue::from_int(1));
+    vm.set_register_value(rs, BVM::BoltValue::from_double(1.5));
+    EXPECT_EQ(vm.execute(BVM::Emitter::lt(rd, rt, rs)), BVM::Interrupt::Ok);
+    EXPECT_TRUE(vm.get_register_value(rd).as_bool());
+    EXPECT_EQ(vm.execute(BVM::Emitter::eq(rd, rt, rs)), BVM::Interrupt::Ok);
+    EXPECT_FALSE(vm.get_register_value(rd).as_bool());
+    vm.set_register_value(rs, BVM::BoltValue::from_bool(true));
+    EXPECT_EQ(vm.execute(BVM::Emitter::lt(rd, rt, rs)), BVM::Interrupt::IncompatibleTypes);
+}
+
+/* sums 0..9 with a backward jump */
+TEST(RunTests, TestLoop) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 5;
+    main_func->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(10), BVM::BoltValue::from_int(1)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(0, 0),     // i = 0
+        BVM::Emitter::load_const(1, 1),     // n = 10
+        BVM::Emitter::load_const(2, 0),     // acc = 0
+        BVM::Emitter::load_const(3, 2),     // 1
+        BVM::Emitter::lt(4, 0, 1),
+        BVM::Emitter::jmp_if_false(4, 3),
+        BVM::Emitter::add(2, 2, 0),
+        BVM::Emitter::add(0, 0, 3),
+        BVM::Emitter::jmp(-5),
+        BVM::Emitter::ret(2),
+    };
+    local_vm.load_callable(std::move(main_func));
+    local_vm.setup_entry_point();
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 45);
+}
+
+TEST(RunTests, TestQuickening) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->instructions = {BVM::Emitter::add(2, 0, 1), BVM::Emitter::ret(2)};
+    local_vm.load_callable(std::move(main_func));
+
+    local_vm.setup_entry_point();
+    local_vm.set_register_value(0, BVM::BoltValue::from_int(1));
+    local_vm.set_register_value(1, BVM::BoltValue::from_int(2));
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 3);
+    EXPECT_EQ(local_vm.get_quicken_stats().quickened, 1);
+
+    local_vm.setup_entry_point();
+    local_vm.set_register_value(0, BVM::BoltValue::from_int(5));
+    local_vm.set_register_value(1, BVM::BoltValue::from_int(2));
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 7);
+    EXPECT_EQ(local_vm.get_quicken_stats().hits, 1);
+
+    // the int guard fails: deoptimize and still produce the right value
+    local_vm.setup_entry_point();
+    local_vm.set_register_value(0, BVM::BoltValue::from_double(0.5));
+    local_vm.set_register_value(1, BVM::BoltValue::from_int(2));
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_double(), 2.5);
+    EXPECT_EQ(local_vm.get_quicken_stats().misses, 1);
+}
+
+TEST(RunTests, TestFusedCompareJump) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 5;
+    main_func->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(100), BVM::BoltValue::from_int(1)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(0, 0),
+        BVM::Emitter::load_const(1, 1),
+        BVM::Emitter::lt(4, 0, 1),
+        BVM::Emitter::jmp_if_false(4, 3),
+        BVM::Emitter::load_const(3, 2),
+        BVM::Emitter::add(0, 0, 3),
+        BVM::Emitter::jmp(-5),
+        BVM::Emitter::ret(0),
+    };
+    // counts what the interpreter dispatches, a trace would take the loop over
+    local_vm.set_tracing(false);
+    local_vm.load_callable(std::move(main_func));
+    local_vm.setup_entry_point();
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 100);
+    // lt + jmp_false and const + add run fused after the first iteration, the
+    // add is also quickened on its own during that first iteration
+    EXPECT_EQ(local_vm.get_quicken_stats().quickened, 3);
+    EXPECT_EQ(local_vm.get_quicken_stats().hits, 99 + 100);
+    EXPECT_EQ(local_vm.get_quicken_stats().misses, 0);
+}
+
+TEST(RunTests, TestConstantOperands) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(100), BVM::BoltValue::from_int(1)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(0, 0),
+        BVM::Emitter::lt_rk(1, 0, 1),
+        BVM::Emitter::jmp_if_false(1, 2),
+        BVM::Emitter::add_rk(0, 0, 2),
+        BVM::Emitter::jmp(-4),
+        BVM::Emitter::mul_rk(2, 0, 2),
+        BVM::Emitter::ret(2),
+    };
+    local_vm.load_callable(std::move(main_func));
+    local_vm.setup_entry_point();
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 100);
+    EXPECT_EQ(local_vm.get_quicken_stats().misses, 0);
+
+    // the single-step path agrees with run()
+    local_vm.setup_entry_point();
+    while (local_vm.execute(local_vm.fetch()) == BVM::Interrupt::Ok);
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 100);
+}
+
+TEST(RunTests, TestLowerRejectsConstantOutOfRange) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 2;
+    main_func->instructions = {BVM::Emitter::add_rk(1, 0, 0), BVM::Emitter::ret(1)};
+    EXPECT_THROW(local_vm.load_callable(std::move(main_func)), std::runtime_error);
+}
+
+TEST(RunTests, TestCallNative) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 8;
+    main_func->consts = {BVM::BoltValue::from_int(1), BVM::BoltValue::from_int(2), BVM::BoltValue::from_double(3.5)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(1, 0),
+        BVM::Emitter::load_const(2, 1),
+        BVM::Emitter::load_const(3, 2),
+        BVM::Emitter::call_native(0, 3, static_cast<uint8_t>(BVM::Primitives::Add)),
+        BVM::Emitter::load_const(5, 0),
+        BVM::Emitter::load_const(6, 1),
+        BVM::Emitter::load_const(7, 2),
+        BVM::Emitter::call_native(4, 3, static_cast<uint8_t>(BVM::Primitives::Lt)),
+        BVM::Emitter::ret(0),
+    };
+    local_vm.load_callable(std::move(main_func));
+    local_vm.setup_entry_point();
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_double(), 6.5);
+    EXPECT_TRUE(local_vm.get_register_value(4).as_bool());
+}
+
+static BVM::Interrupt native_sq(BVM::VirtualMachine&, BVM::NativeArgs args, BVM::BoltValue& res) {
+    if (!args[0].is_int())
+        return BVM::Interrupt::IncompatibleTypes;
+    res = BVM::BoltValue::from_int(args[0].as_int() * args[0].as_int());
+    return BVM::Interrupt::Ok;
+}
+
+TEST(RunTests, TestRegisterNative) {
+    BVM::VirtualMachine local_vm;
+    uint8_t id = local_vm.register_native("sq", native_sq, 1);
+    EXPECT_EQ(local_vm.find_native("sq"), id);
+    EXPECT_EQ(local_vm.find_native("+"), static_cast<int>(BVM::Primitives::Add));
+    EXPECT_EQ(local_vm.find_native("nope"), -1);
+    EXPECT_THROW(local_vm.register_native("sq", native_sq, 1), std::runtime_error);
+
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->consts = {BVM::BoltValue::from_int(7)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(1, 0),
+        BVM::Emitter::call_native(0, 1, id),
+        BVM::Emitter::ret(0),
+    };
+    local_vm.load_callable(std::move(main_func));
+    local_vm.setup_entry_point();
+    local_vm.run();
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 49);
+
+    // called with the wrong number of arguments
+    local_vm.setup_entry_point();
+    local_vm.set_register_value(2, BVM::BoltValue::from_int(1));
+    EXPECT_EQ(local_vm.execute(BVM::Emitter::call_native(0, 2, id)), BVM::Interrupt::ArityMismatch);
+}
+
+TEST(RunTests, TestLowerRejectsUnknownNative) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 2;
+    main_func->instructions = {BVM::Emitter::call_native(0, 1, 200), BVM::Emitter::ret(0)};
+    EXPECT_THROW(local_vm.load_callable(std::move(main_func)), std::runtime_error);
+}
+
+/* f(self, n) = n == 0 ? 0 : f(self, n - 1) + 1, called from main as f(f, depth) */
+static void setup_recursion(BVM::VirtualMachine& vm, int depth) {
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->instructions = {BVM::Emitter::call(0, 2), BVM::Emitter::ret(0)};
+    auto f = std::make_unique<BVM::Prototype>();
+    f->arity = 2;
+    f->next_reg = 6;
+    f->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(1)};
+    f->instructions = {
+        BVM::Emitter::eq_rk(2, 1, 0),
+        BVM::Emitter::jmp_if_false(2, 1),
+        BVM::Emitter::ret(1),
+        BVM::Emitter::mov(3, 0),
+        BVM::Emitter::mov(4, 0),
+        BVM::Emitter::sub_rk(5, 1, 1),
+        BVM::Emitter::call(3, 2),
+        BVM::Emitter::add_rk(3, 3, 1),
+        BVM::Emitter::ret(3),
+    };
+    vm.load_callable(std::move(main_func));
+    vm.load_callable(std::move(f));
+    vm.setup_entry_point();
+    BVM::BoltValue clsr = BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(1)));
+    vm.set_register_value(0, clsr);
+    vm.set_register_value(1, clsr);
+    vm.set_register_value(2, BVM::BoltValue::from_int(depth));
+}
+
+static BVM::Interrupt run_recursion(BVM::VirtualMachine& vm, int depth) {
+    setup_recursion(vm, depth);
+    return vm.run();
+}
+
+TEST(RunTests, TestDeepRecursion) {
+    BVM::VirtualMachine local_vm;
+    EXPECT_EQ(run_recursion(local_vm, 100000), BVM::Interrupt::Halt);
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 100000);
+}
+
+TEST(RunTests, TestStackLimit) {
+    BVM::VirtualMachine local_vm(4096);
+    EXPECT_EQ(local_vm.get_stack_size(), 4096);
+    EXPECT_EQ(run_recursion(local_vm, 100000), BVM::Interrupt::StackOverFlow);
+    EXPECT_THROW(BVM::VirtualMachine(16), std::runtime_error);
+}
+
+/* f(self, n, acc) = n == 0 ? acc : f(self, n - 1, acc + 1) with the recursive
+ * call in tail position, deeper than a small stack could hold as frames */
+TEST(RunTests, TestTailCallRunsInConstantStack) {
+    BVM::VirtualMachine local_vm(4096);
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 4;
+    main_func->instructions = {BVM::Emitter::call(0, 3), BVM::Emitter::ret(0)};
+    auto f = std::make_unique<BVM::Prototype>();
+    f->arity = 3;
+    f->next_reg = 8;
+    f->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(1)};
+    f->instructions = {
+        BVM::Emitter::eq_rk(3, 1, 0),
+        BVM::Emitter::jmp_if_false(3, 1),
+        BVM::Emitter::ret(2),
+        BVM::Emitter::mov(4, 0),
+        BVM::Emitter::mov(5, 0),
+        BVM::Emitter::sub_rk(6, 1, 1),
+        BVM::Emitter::add_rk(7, 2, 1),
+        BVM::Emitter::tail_call(4, 3),
+    };
+    local_vm.load_callable(std::move(main_func));
+    local_vm.load_callable(std::move(f));
+    local_vm.setup_entry_point();
+    BVM::BoltValue clsr = BVM::BoltValue::from_func(local_vm.new_closure(local_vm.get_callable(1)));
+    local_vm.set_register_value(0, clsr);
+    local_vm.set_register_value(1, clsr);
+    local_vm.set_register_value(2, BVM::BoltValue::from_int(100000));
+    local_vm.set_register_value(3, BVM::BoltValue::from_int(0));
+    // every iteration runs in the frame main called
+    local_vm.set_budget(1000);
+    while (local_vm.run() == BVM::Interrupt::Yield) {
+        EXPECT_EQ(local_vm.get_call_depth(), 1);
+        local_vm.set_budget(1000);
+    }
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 100000);
+}
+
+TEST(RunTests, TestBudgetYieldsAtBackwardJumps) {
+    BVM::VirtualMachine local_vm;
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(1000), BVM::BoltValue::from_int(1)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(0, 0),
+        BVM::Emitter::lt_rk(1, 0, 1),
+        BVM::Emitter::jmp_if_false(1, 2),
+        BVM::Emitter::add_rk(0, 0, 2),
+        BVM::Emitter::jmp(-4),
+        BVM::Emitter::ret(0),
+    };
+    local_vm.load_callable(std::move(main_func));
+    local_vm.setup_entry_point();
+
+    // every iteration costs the 4 instructions of the loop body
+    int yields = 0;
+    local_vm.set_budget(100);
+    while (local_vm.run() == BVM::Interrupt::Yield) {
+        EXPECT_LE(local_vm.get_budget(), 0);
+        local_vm.set_budget(100);
+        yields++;
+    }
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 1000);
+    EXPECT_EQ(yields, 1000 * 4 / 100);
+}
+
+TEST(RunTests, TestBudgetYieldsAtCalls) {
+    BVM::VirtualMachine local_vm;
+    setup_recursion(local_vm, 1000);
+    int yields = 0;
+    local_vm.set_budget(10);
+    while (local_vm.run() == BVM::Interrupt::Yield) {
+        local_vm.set_budget(10);
+        yields++;
+    }
+    EXPECT_EQ(local_vm.get_return_value().as_int(), 1000);
+    // one call into f from main and one per level, ten to a slice
+    EXPECT_EQ(yields, 1001 / 10);
+}
@@ -0,0 +1,238 @@
+#include "bolt_virtual_machine/vm.hpp"
+#include "bolt_virtual_machine/jit.hpp"
+#include "bolt_virtual_machine/emitter.h"
+#include "lisp/lexer.hpp"
+#include "lisp/parser.hpp"
+#include "lisp/codegen.hpp"
+#include <gtest/gtest.h>
+
+#ifdef BVM_JIT
+
+static std::vector<std::unique_ptr<BVM::Prototype>> compile(const std::string& src) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    // the helpers these tests call have to stay calls to get hot
+    Lisp::Compiler compiler("/dev/null", {.inline_depth = 0});
+    compiler.compile(program.get());
+    return compiler.release_objs();
+}
+
+/* runs src to completion with the JIT at the given threshold, or without
+ * it for threshold < 0, tracing loops after trace_threshold iterations */
+static BVM::BoltValue run(const std::string& src, int threshold, BVM::JitStats* stats = nullptr,
+        uint32_t trace_threshold = TRACE_OFF) {
+    BVM::VirtualMachine vm(4096);
+    vm.set_jit(threshold >= 0, threshold < 0 ? 0 : threshold);
+    vm.set_tracing(trace_threshold != TRACE_OFF, trace_threshold);
+    for (auto& p : compile(src))
+        vm.load_callable(std::move(p));
+    vm.setup_entry_point();
+    vm.run();
+    if (stats)
+        *stats = vm.get_jit_stats();
+    return vm.get_return_value();
+}
+
+static void expect_same(const std::string& src) {
+    BVM::BoltValue interpreted = run(src, -1);
+    BVM::JitStats stats;
+    BVM::BoltValue native = run(src, 0, &stats);
+    EXPECT_GT(stats.compiled, 0u) << src;
+    EXPECT_EQ(stats.failed, 0u) << src;
+    EXPECT_TRUE(interpreted == native) << src;
+}
+
+TEST(JitTests, TestMatchesInterpreter) {
+    expect_same("(define fact (lambda (n) (if (= n 0) 1 (* n (fact (- n 1)))))) (fact 10)");
+    expect_same("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))) (loop 10000 0)");
+    expect_same("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 20)");
+    expect_same("(define f (lambda (a b) (if (>= a b) (- a b) (* a 2.5)))) (+ (f 7 3) (f 1 4))");
+    expect_same("(define make-counter (lambda () (define n 0) (lambda () (set! n (+ n 1)) n)))"
+                "(define c (make-counter)) (c) (c) (c)");
+    expect_same("(define q (lambda (a b) (+ (/ a b) (/ a 4)))) (+ (q 12 4) (q 7 2) (q (- 0 9) 3))");
+    expect_same("(define q (lambda (a) (/ a 0))) (+ (q 6.5) (q 3.5))");
+    expect_same("(define g (lambda (x) (* (+ x 1.5) (- x 2)))) (+ (g 3) (g 2.5) (if (< (g 1) 0.5) 1 2))");
+}
+
+TEST(JitTests, TestOverflowBecomesDouble) {
+    BVM::BoltValue v = run("(define sq (lambda (x) (* x x))) (sq 100000)", 0);
+    ASSERT_TRUE(v.is_double());
+    EXPECT_EQ(v.as_double(), 1e10);
+    v = run("(define inc (lambda (x) (+ x 1))) (inc 2147483647)", 0);
+    ASSERT_TRUE(v.is_double());
+    EXPECT_EQ(v.as_double(), 2147483648.0);
+}
+
+TEST(JitTests, TestDivisionByZero) {
+    BVM::VirtualMachine vm(4096);
+    vm.set_jit(true, 0);
+    for (auto& p : compile("(define q (lambda (a) (/ a 0))) (q 7)"))
+        vm.load_callable(std::move(p));
+    vm.setup_entry_point();
+    EXPECT_EQ(vm.run(), BVM::Interrupt::DivisionByZero);
+    EXPECT_EQ(vm.get_jit_stats().compiled, 1u);
+}
+
+TEST(JitTests, TestThreshold) {
+    const char* src = "(define loop (lambda (n) (if (= n 0) 0 (loop (- n 1))))) (loop 50)";
+    BVM::JitStats stats;
+    run(src, 100, &stats);
+    EXPECT_EQ(stats.compiled, 0u);
+    run(src, 10, &stats);
+    EXPECT_EQ(stats.compiled, 1u);
+    EXPECT_GT(stats.code_bytes, 0u);
+    EXPECT_GT(stats.entries, 0u);
+}
+
+TEST(JitTests, TestDisable) {
+    BVM::VirtualMachine vm;
+    EXPECT_TRUE(vm.jit_enabled());
+    vm.set_jit(false);
+    EXPECT_FALSE(vm.jit_enabled());
+    EXPECT_EQ(vm.get_jit_stats().compiled, 0u);
+}
+
+/* a budget running out under native code yields, and resuming picks up in
+ * the same frame */
+TEST(JitTests, TestYieldResumes) {
+    BVM::VirtualMachine vm(4096);
+    vm.set_jit(true, 0);
+    for (auto& p : compile("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))) (loop 10000 0)"))
+        vm.load_callable(std::move(p));
+    vm.setup_entry_point();
+    int yields = 0;
+    vm.set_budget(97);
+    BVM::Interrupt interrupt;
+    while ((interrupt = vm.run()) == BVM::Interrupt::Yield) {
+        yields++;
+        vm.set_budget(97);
+    }
+    EXPECT_GT(yields, 0);
+    EXPECT_EQ(vm.get_return_value().as_int(), 50005000);
+}
+
+static BVM::Interrupt native_throw(BVM::VirtualMachine&, BVM::NativeArgs, BVM::BoltValue&) {
+    throw std::runtime_error("native_throw");
+}
+
+/* an exception thrown below native code comes out of run() */
+TEST(JitTests, TestExceptionPropagates) {
+    BVM::VirtualMachine vm;
+    vm.set_jit(true, 0);
+    uint8_t id = vm.register_native("throw", native_throw, 0);
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 2;
+    main_func->instructions = {BVM::Emitter::call(0, 0), BVM::Emitter::ret(0)};
+    auto callee = std::make_unique<BVM::Prototype>();
+    callee->next_reg = 2;
+    callee->instructions = {BVM::Emitter::call_native(0, 0, id), BVM::Emitter::ret(0)};
+    vm.load_callable(std::move(main_func));
+    vm.load_callable(std::move(callee));
+    vm.setup_entry_point();
+    vm.set_register_value(0, BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(1))));
+    EXPECT_THROW(vm.run(), std::runtime_error);
+    EXPECT_EQ(vm.get_jit_stats().compiled, 1u);
+}
+
+/* traced from the interpreter and from native code, the result is the
+ * interpreter's */
+static BVM::JitStats expect_same_traced(const std::string& src) {
+    BVM::BoltValue interpreted = run(src, -1);
+    BVM::JitStats stats;
+    EXPECT_TRUE(interpreted == run(src, 1 << 30, &stats, 2)) << src;
+    EXPECT_GT(stats.traces, 0u) << src;
+    EXPECT_TRUE(interpreted == run(src, 0, &stats, 2)) << src;
+    EXPECT_GT(stats.traces, 0u) << src;
+    return stats;
+}
+
+TEST(JitTests, TestTraceMatchesInterpreter) {
+    expect_same_traced("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))) (loop 10000 0)");
+    expect_same_traced("(define k 3) (define loop (lambda (n acc) (if (<= n 0) acc (loop (- n 1) (+ acc k))))) (loop 500 7)");
+    expect_same_traced("(define loop (lambda (n a b) (if (= n 0) (- a b) (if (< n 50) (loop (- n 1) (+ a 1) b) (loop (- n 1) a (+ b 2))))))"
+                       "(loop 100 0 0)");
+    expect_same_traced("(define loop (lambda (n x) (if (> n 0) (loop (- n 1) (+ (* x 0.5) 1.5)) x))) (loop 1000 0.0)");
+    expect_same_traced("(define loop (lambda (n b) (if (> n 0) (loop (- n 1) (if b (< n 50) (> n 30))) b))) (loop 100 (< 1 2))");
+}
+
+TEST(JitTests, TestTraceBackwardJump) {
+    for (int threshold : {1 << 30, 0}) {
+        BVM::VirtualMachine vm;
+        vm.set_jit(true, threshold);
+        vm.set_tracing(true, 2);
+        auto main_func = std::make_unique<BVM::Prototype>();
+        main_func->next_reg = 5;
+        main_func->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(1000), BVM::BoltValue::from_int(1)};
+        main_func->instructions = {
+            BVM::Emitter::load_const(0, 0),     // i = 0
+            BVM::Emitter::load_const(1, 1),     // n = 1000
+            BVM::Emitter::load_const(2, 0),     // acc = 0
+            BVM::Emitter::load_const(3, 2),     // 1
+            BVM::Emitter::lt(4, 0, 1),
+            BVM::Emitter::jmp_if_false(4, 3),
+            BVM::Emitter::add(2, 2, 0),
+            BVM::Emitter::add(0, 0, 3),
+            BVM::Emitter::jmp(-5),
+            BVM::Emitter::ret(2),
+        };
+        vm.load_callable(std::move(main_func));
+        vm.setup_entry_point();
+        vm.run();
+        EXPECT_EQ(vm.get_return_value().as_int(), 499500);
+        EXPECT_EQ(vm.get_jit_stats().traces, 1u);
+        EXPECT_EQ(vm.get_jit_stats().trace_exits, 1u);
+    }
+}
+
+/* ints leave the trace where they would overflow, and types that change
+ * between iterations never get one */
+TEST(JitTests, TestTraceSideExits) {
+    const char* src = "(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (* acc 2))))) (loop 40 1)";
+    BVM::JitStats stats = expect_same_traced(src);
+    EXPECT_GT(stats.trace_exits, 0u);
+    BVM::BoltValue v = run(src, 0, nullptr, 2);
+    ASSERT_TRUE(v.is_double());
+    EXPECT_EQ(v.as_double(), 1099511627776.0);
+
+    stats = expect_same_traced("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc (/ n 2)))))) (loop 101 0)");
+    EXPECT_GT(stats.trace_exits, 0u);
+
+    src = "(define loop (lambda (n x) (if (= n 0) x (loop (- n 1) (if (< x 1.2) 1.5 1))))) (loop 101 1)";
+    EXPECT_TRUE(run(src, -1) == run(src, 0, &stats, 2));
+    EXPECT_EQ(stats.traces, 0u);
+    EXPECT_GT(stats.trace_aborts, 0u);
+}
+
+TEST(JitTests, TestTraceYieldResumes) {
+    for (int threshold : {1 << 30, 0}) {
+        BVM::VirtualMachine vm(4096);
+        vm.set_jit(true, threshold);
+        vm.set_tracing(true, 2);
+        for (auto& p : compile("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))) (loop 10000 0)"))
+            vm.load_callable(std::move(p));
+        vm.setup_entry_point();
+        int yields = 0;
+        vm.set_budget(97);
+        while (vm.run() == BVM::Interrupt::Yield) {
+            yields++;
+            vm.set_budget(97);
+        }
+        EXPECT_GT(yields, 0);
+        EXPECT_EQ(vm.get_return_value().as_int(), 50005000);
+        EXPECT_EQ(vm.get_jit_stats().traces, 1u);
+    }
+}
+
+TEST(JitTests, TestTracingOff) {
+    BVM::JitStats stats;
+    run("(define loop (lambda (n) (if (= n 0) 0 (loop (- n 1))))) (loop 500)", 0, &stats);
+    EXPECT_EQ(stats.traces, 0u);
+    EXPECT_EQ(stats.trace_aborts, 0u);
+}
+
+#endif
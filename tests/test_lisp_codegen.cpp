@@ -0,0 +1,244 @@
+#include <gtest/gtest.h>
+#include <bolt_virtual_machine/vm.hpp>
+#include <lisp/codegen.hpp>
+#include <filesystem>
+#include <fstream>
+
+static std::vector<std::unique_ptr<BVM::Prototype>> compile(const std::string& src, Lisp::CompilerOptions options = {},
+        const std::string& out = "/dev/null") {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler(out, options);
+    compiler.compile(program.get());
+    return compiler.release_objs();
+}
+
+static BVM::BoltValue run(std::vector<std::unique_ptr<BVM::Prototype>> protos) {
+    BVM::VirtualMachine vm;
+    for (auto& p : protos)
+        vm.load_callable(std::move(p));
+    vm.setup_entry_point();
+    vm.run();
+    return vm.get_return_value();
+}
+
+static bool contains_op(const BVM::Prototype* proto, BVM::Opcode op) {
+    for (uint32_t inst : proto->instructions) {
+        if (BVM::VirtualMachine::decode_op(inst) == op)
+            return true;
+    }
+    return false;
+}
+
+TEST(CodegenTests, TestConstantOperands) {
+    auto protos = compile("(define x 7) (+ x 1)", {.peephole = false});
+    EXPECT_TRUE(contains_op(protos[0].get(), BVM::Opcode::OpAddRK));
+    EXPECT_EQ(run(std::move(protos)).as_int(), 8);
+}
+
+TEST(CodegenTests, TestMirroredComparison) {
+    // (< 10 x) is emitted as (> x 10)
+    auto protos = compile("(define x 7) (< 10 x)", {.peephole = false});
+    EXPECT_TRUE(contains_op(protos[0].get(), BVM::Opcode::OpBtRK));
+    EXPECT_FALSE(run(std::move(protos)).as_bool());
+}
+
+TEST(CodegenTests, TestNonCommutativeLiteralLeft) {
+    auto protos = compile("(define x 7) (- 10 x)", {.peephole = false});
+    EXPECT_FALSE(contains_op(protos[0].get(), BVM::Opcode::OpSubRK));
+    EXPECT_EQ(run(std::move(protos)).as_int(), 3);
+}
+
+TEST(CodegenTests, TestRegisterOperandsOnly) {
+    const char* src = "(define x 3) (if (< x 10) (* x 20) (- x 10))";
+    auto rr = compile(src, {.constant_operands = false, .peephole = false});
+    auto rk = compile(src, {.peephole = false});
+    EXPECT_LT(rk[0]->instructions.size(), rr[0]->instructions.size());
+    EXPECT_EQ(run(std::move(rr)).as_int(), 60);
+    EXPECT_EQ(run(std::move(rk)).as_int(), 60);
+}
+
+/* every distinct literal gets one slot, whatever else is in the pool */
+TEST(CodegenTests, TestConstantPool) {
+    std::string src = "(define t 0)";
+    for (int i = 0; i < 3000; i++)
+        src += " (set! t (+ t " + std::to_string(i % 1000) + " " + std::to_string(i % 1000) + ".5))";
+    src += " t";
+    auto protos = compile(src, {.peephole = false});
+    const std::vector<BVM::BoltValue>& consts = protos[0]->consts;
+    EXPECT_EQ(consts.size(), 2000u); // the define's 0 and the literal 0 share one
+    for (uint32_t inst : protos[0]->instructions) {
+        if (BVM::VirtualMachine::decode_op(inst) == BVM::Opcode::OpConst)
+            ASSERT_LT(inst >> 16, consts.size());
+    }
+    EXPECT_EQ(run(std::move(protos)).as_double(), 3 * (999 * 1000 / 2) * 2 + 3 * 1000 * 0.5);
+
+    // an int and a double of the same value are different constants
+    protos = compile("(define x (+ 1 1.0)) (= x 2)", {.peephole = false});
+    EXPECT_EQ(protos[0]->consts.size(), 3u);
+}
+
+TEST(CodegenTests, TestVariadicNatives) {
+    auto protos = compile("(+ 1 2 3 4)");
+    EXPECT_TRUE(contains_op(protos[0].get(), BVM::Opcode::OpCallNative));
+    EXPECT_EQ(run(std::move(protos)).as_int(), 10);
+    EXPECT_TRUE(run(compile("(< 1 2 3)")).as_bool());
+    EXPECT_FALSE(run(compile("(< 1 3 2)")).as_bool());
+    EXPECT_EQ(run(compile("(- 5)")).as_int(), -5);
+    EXPECT_FALSE(run(compile("(/= 1 2 1)")).as_bool());
+}
+
+/* runs prototype 1 - the first lambda of the program - as f(f, n, 0) */
+static BVM::Interrupt run_lambda(std::vector<std::unique_ptr<BVM::Prototype>> protos, int n, BVM::BoltValue& res) {
+    BVM::VirtualMachine vm(4096);
+    for (auto& p : protos)
+        vm.load_callable(std::move(p));
+    BVM::BoltValue f = BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(1)));
+    BVM::BoltValue args[3] = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(n), f};
+    vm.setup_call(f, BVM::NativeArgs(&args[2], 3));
+    BVM::Interrupt interrupt = vm.run();
+    res = vm.get_return_value();
+    return interrupt;
+}
+
+TEST(CodegenTests, TestTailCalls) {
+    const char* src = "(lambda (f n acc) (if (= n 0) acc (f f (- n 1) (+ acc 1))))";
+    auto protos = compile(src);
+    EXPECT_TRUE(contains_op(protos[1].get(), BVM::Opcode::OpTailCall));
+    EXPECT_FALSE(contains_op(protos[1].get(), BVM::Opcode::OpCall));
+    BVM::BoltValue res;
+    EXPECT_EQ(run_lambda(std::move(protos), 100000, res), BVM::Interrupt::Halt);
+    EXPECT_EQ(res.as_int(), 100000);
+}
+
+TEST(CodegenTests, TestNonTailCalls) {
+    // the result of the recursive call is still needed by the +
+    const char* src = "(lambda (f n acc) (if (= n 0) acc (+ 1 (f f (- n 1) acc))))";
+    auto protos = compile(src);
+    EXPECT_TRUE(contains_op(protos[1].get(), BVM::Opcode::OpCall));
+    EXPECT_FALSE(contains_op(protos[1].get(), BVM::Opcode::OpTailCall));
+    BVM::BoltValue res;
+    EXPECT_EQ(run_lambda(compile(src), 100, res), BVM::Interrupt::Halt);
+    EXPECT_EQ(res.as_int(), 100);
+    EXPECT_EQ(run_lambda(std::move(protos), 100000, res), BVM::Interrupt::StackOverFlow);
+}
+
+TEST(CodegenTests, TestCounterClosures) {
+    const char* src =
+        "(define make-counter (lambda () (define n 0) (lambda () (set! n (+ n 1)) n)))"
+        "(define c (make-counter)) (c) (c)"
+        "(define d (make-counter)) (d)"
+        "(+ (c) (d))";
+    auto protos = compile(src);
+    EXPECT_TRUE(contains_op(protos[1].get(), BVM::Opcode::OpClosure));
+    EXPECT_TRUE(contains_op(protos[2].get(), BVM::Opcode::OpSetUpval));
+    EXPECT_EQ(run(std::move(protos)).as_int(), 5);
+}
+
+TEST(CodegenTests, TestSharedUpvalue) {
+    const char* src =
+        "(define make (lambda () (define n 0)"
+        "    (define inc (lambda () (set! n (+ n 1))))"
+        "    (define get (lambda () n))"
+        "    (inc) (inc) (get)))"
+        "(make)";
+    EXPECT_EQ(run(compile(src)).as_int(), 2);
+}
+
+TEST(CodegenTests, TestNestedCapture) {
+    // x reaches the innermost lambda through the upvalues of the middle one
+    const char* src = "(define x 5) (define f (lambda (a) (lambda (b) (+ x a b)))) (define g (f 1)) (g 2)";
+    EXPECT_EQ(run(compile(src)).as_int(), 8);
+}
+
+TEST(CodegenTests, TestRecursiveClosures) {
+    const char* fact = "(define fact (lambda (n) (if (= n 0) 1 (* n (fact (- n 1)))))) (fact 10)";
+    EXPECT_EQ(run(compile(fact)).as_int(), 3628800);
+    const char* loop = "(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))) (loop 10000 0)";
+    auto protos = compile(loop);
+    EXPECT_TRUE(contains_op(protos[1].get(), BVM::Opcode::OpTailCall));
+    EXPECT_EQ(run(std::move(protos)).as_int(), 50005000);
+}
+
+TEST(CodegenTests, TestOnlyCapturedVariablesEscape) {
+    Lisp::Lexer lexer("(define x 1) (define y 2) (lambda (a) (+ a x)) y");
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    const Lisp::Scope& globals = program->get_const_scope();
+    EXPECT_TRUE(globals.symbol_table.at("x").captured);
+    EXPECT_FALSE(globals.symbol_table.at("y").captured);
+    auto lambda = static_cast<const Lisp::Lambda*>(program->get_exprs()[2].get());
+    ASSERT_EQ(lambda->get_const_scope().upvals.size(), 1);
+    EXPECT_FALSE(lambda->get_const_scope().symbol_table.at("a").captured);
+}
+
+class BytecodeFileTest : public ::testing::Test {
+protected:
+    std::string path;
+
+    void SetUp() override {
+        path = (std::filesystem::temp_directory_path() / "bvm_codegen_test.bolt").string();
+        compile("(define x 2.5) (define y (if (< x 10) (* x 4) 0)) (+ y 1 2)", {}, path);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove(path);
+    }
+
+    void corrupt(size_t offset) {
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekg(offset);
+        char c = f.get();
+        f.seekp(offset);
+        f.put(c ^ 0x5a);
+    }
+};
+
+TEST_F(BytecodeFileTest, TestRoundTrip) {
+    BVM::VirtualMachine vm;
+    vm.load_program(path.c_str());
+    // loaded code is used in place, it is not copied into the prototype
+    EXPECT_TRUE(vm.get_callable(0)->instructions.empty());
+    EXPECT_FALSE(vm.get_callable(0)->code().empty());
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(vm.get_callable(0)->code().data()) % BVM::SECTION_ALIGN, 0);
+    vm.setup_entry_point();
+    vm.run();
+    EXPECT_EQ(vm.get_return_value().as_double(), 13.0);
+}
+
+TEST_F(BytecodeFileTest, TestChecksumMismatch) {
+    corrupt(std::filesystem::file_size(path) - 1);
+    BVM::VirtualMachine vm;
+    EXPECT_THROW(vm.load_program(path.c_str()), std::runtime_error);
+}
+
+TEST_F(BytecodeFileTest, TestBadMagic) {
+    corrupt(0);
+    BVM::VirtualMachine vm;
+    EXPECT_THROW(vm.load_program(path.c_str(), false), std::runtime_error);
+}
+
+TEST_F(BytecodeFileTest, TestMissingFile) {
+    BVM::VirtualMachine vm;
+    EXPECT_THROW(vm.load_program((path + ".missing").c_str()), std::runtime_error);
+}
+
+TEST_F(BytecodeFileTest, TestRoundTripUpvalues) {
+    compile("(define x 5) (define f (lambda (a) (lambda (b) (+ x a b)))) (define g (f 1)) (g 2)", {}, path);
+    BVM::VirtualMachine vm;
+    vm.load_program(path.c_str());
+    EXPECT_EQ(vm.get_callable(2)->upvals.size(), 2);
+    EXPECT_FALSE(vm.get_callable(2)->upvals[0].in_stack);
+    vm.setup_entry_point();
+    vm.run();
+    EXPECT_EQ(vm.get_return_value().as_int(), 8);
+}
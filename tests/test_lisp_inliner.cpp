@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+#include <bolt_virtual_machine/vm.hpp>
+#include <lisp/codegen.hpp>
+
+static std::vector<std::unique_ptr<BVM::Prototype>> compile(const std::string& src, Lisp::CompilerOptions options = {}) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler("/dev/null", options);
+    compiler.compile(program.get());
+    return compiler.release_objs();
+}
+
+static BVM::Interrupt run(std::vector<std::unique_ptr<BVM::Prototype>> protos, BVM::BoltValue& res) {
+    BVM::VirtualMachine vm(4096);
+    for (auto& p : protos)
+        vm.load_callable(std::move(p));
+    vm.setup_entry_point();
+    BVM::Interrupt interrupt = vm.run();
+    res = vm.get_return_value();
+    return interrupt;
+}
+
+static BVM::BoltValue run(std::vector<std::unique_ptr<BVM::Prototype>> protos) {
+    BVM::BoltValue res;
+    run(std::move(protos), res);
+    return res;
+}
+
+static size_t n_calls(const BVM::Prototype* proto) {
+    size_t n = 0;
+    for (uint32_t inst : proto->instructions) {
+        BVM::Opcode op = BVM::VirtualMachine::decode_op(inst);
+        n += op == BVM::Opcode::OpCall || op == BVM::Opcode::OpTailCall;
+    }
+    return n;
+}
+
+/* same result inlined and called, on both code generators */
+static void expect_same(const std::string& src) {
+    BVM::BoltValue expected, got;
+    BVM::Interrupt interrupt = run(compile(src, {.inline_depth = 0}), expected);
+    EXPECT_EQ(run(compile(src), got), interrupt) << src;
+    EXPECT_TRUE(expected == got) << src;
+    EXPECT_EQ(run(compile(src, {.ssa = true}), got), interrupt) << src;
+    EXPECT_TRUE(expected == got) << src;
+}
+
+TEST(InlinerTests, TestMatchesCalls) {
+    expect_same("(define sq (lambda (x) (* x x))) (define f (lambda (n) (+ (sq n) (sq (+ n 1))))) (f 4)");
+    expect_same("(define g (lambda (x y) (define t (- x y)) (set! t (* t 2)) (if (< t 0) (- 0 t) t)))"
+                "(define f (lambda (a) (+ (g a 3) (g 3 a) (g a a)))) (f 1)");
+    expect_same("(define n 0) (define bump (lambda (d) (set! n (+ n d)) n)) (bump 3) (bump 4) (* (bump 1) n)");
+    expect_same("(define half (lambda (x) (/ x 2))) (define loop (lambda (n acc) (if (= n 0) acc"
+                "(loop (- n 1) (+ acc (half n)))))) (loop 100 0)");
+    expect_same("(define dec (lambda (x) (- x 1))) (define down (lambda (n) (if (= n 0) 0 (down (dec n))))) (down 50)");
+    expect_same("(define make (lambda (k) (define scale (lambda (x) (* x k))) (lambda (y) (+ (scale y) (scale 1)))))"
+                "(define m (make 3)) (m 5)");
+    expect_same("(define safe (lambda (x) (/ 1 x))) (define f (lambda (x) (+ (safe x) 1))) (f 0)");
+    expect_same("(define x 10) (define shadow (lambda (x) (* x 2))) (define f (lambda (x) (+ x (shadow (+ x 1))))) (f x)");
+}
+
+TEST(InlinerTests, TestHelperCallsInlined) {
+    const char* src = "(define sq (lambda (x) (* x x))) (define f (lambda (n) (+ (sq n) 1))) (f 4)";
+    auto protos = compile(src);
+    EXPECT_EQ(n_calls(protos[2].get()), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 17);
+    EXPECT_EQ(n_calls(compile(src, {.inline_depth = 0})[2].get()), 1u);
+    EXPECT_EQ(n_calls(compile(src, {.ssa = true})[2].get()), 0u);
+}
+
+TEST(InlinerTests, TestInlinedTailCall) {
+    // the call the inlined body ends with is still the lambda's tail call
+    const char* src = "(define next (lambda (f n acc) (f (- n 1) (+ acc 1))))"
+                      "(define loop (lambda (n acc) (if (= n 0) acc (next loop n acc)))) (loop 100000 0)";
+    auto protos = compile(src);
+    size_t tail_calls = 0;
+    for (uint32_t inst : protos[2]->instructions)
+        tail_calls += BVM::VirtualMachine::decode_op(inst) == BVM::Opcode::OpTailCall;
+    EXPECT_EQ(tail_calls, 1u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 100000);
+}
+
+TEST(InlinerTests, TestRecursionCalls) {
+    auto protos = compile("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 10)");
+    EXPECT_EQ(n_calls(protos[1].get()), 2u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 55);
+}
+
+/* a name that is set! or defined twice may not hold the lambda by the
+ * time it is called */
+TEST(InlinerTests, TestRebindingCalls) {
+    auto protos = compile("(define h (lambda (x) x)) (set! h (lambda (x) (* x 2))) (h 3)");
+    EXPECT_EQ(n_calls(protos[0].get()), 1u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 6);
+    protos = compile("(define h (lambda (x) x)) (define h (lambda (x) (* x 3))) (h 3)");
+    EXPECT_EQ(n_calls(protos[0].get()), 1u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 9);
+}
+
+TEST(InlinerTests, TestSizeAndDepth) {
+    const char* src = "(define inc (lambda (x) (+ x 1))) (define twice (lambda (x) (inc (inc x))))"
+                      "(define f (lambda (n) (twice n))) (f 1)";
+    auto protos = compile(src);
+    EXPECT_EQ(n_calls(protos[3].get()), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 3);
+    // twice alone cannot be inlined, f does not see inc
+    EXPECT_EQ(n_calls(compile(src, {.inline_depth = 1})[3].get()), 1u);
+    EXPECT_EQ(n_calls(compile(src, {.inline_size = 2})[3].get()), 1u);
+}
+
+TEST(InlinerTests, TestClosuresCalled) {
+    const char* src = "(define adder (lambda (k) (lambda (x) (+ x k)))) (define f (lambda (n) (adder n))) (define a (f 2)) (a 5)";
+    auto protos = compile(src);
+    EXPECT_EQ(n_calls(protos[3].get()), 1u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 7);
+}
+
+/* what the body reads around it has to be readable at the call */
+TEST(InlinerTests, TestEnclosingVariables) {
+    const char* src = "(define k 5) (define addk (lambda (x) (+ x k))) (define f (lambda (n) (addk n))) (+ (f 1) (addk 2))";
+    auto protos = compile(src);
+    EXPECT_EQ(n_calls(protos[0].get()), 0u);
+    EXPECT_EQ(n_calls(protos[2].get()), 1u); // f has no k to read
+    EXPECT_EQ(run(std::move(protos)).as_int(), 13);
+}
@@ -0,0 +1,147 @@
+#include <gtest/gtest.h>
+#include <bolt_virtual_machine/vm.hpp>
+#include <lisp/codegen.hpp>
+
+static std::vector<std::unique_ptr<BVM::Prototype>> compile(const std::string& src, Lisp::CompilerOptions options = {},
+        std::vector<Lisp::PeepholeStats>* stats = nullptr) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler("/dev/null", options);
+    compiler.compile(program.get());
+    if (stats)
+        *stats = compiler.get_peephole_stats();
+    return compiler.release_objs();
+}
+
+static BVM::Interrupt run(std::vector<std::unique_ptr<BVM::Prototype>> protos, BVM::BoltValue& res) {
+    BVM::VirtualMachine vm(4096);
+    for (auto& p : protos)
+        vm.load_callable(std::move(p));
+    vm.setup_entry_point();
+    BVM::Interrupt interrupt = vm.run();
+    res = vm.get_return_value();
+    return interrupt;
+}
+
+static BVM::BoltValue run(std::vector<std::unique_ptr<BVM::Prototype>> protos) {
+    BVM::BoltValue res;
+    run(std::move(protos), res);
+    return res;
+}
+
+static size_t count_op(const BVM::Prototype* proto, BVM::Opcode op) {
+    size_t n = 0;
+    for (uint32_t inst : proto->instructions)
+        n += BVM::VirtualMachine::decode_op(inst) == op;
+    return n;
+}
+
+/* same result with and without the pass, on both code generators */
+static void expect_same(const std::string& src) {
+    BVM::BoltValue expected, got;
+    BVM::Interrupt interrupt = run(compile(src, {.peephole = false}), expected);
+    EXPECT_EQ(run(compile(src), got), interrupt) << src;
+    EXPECT_TRUE(expected == got) << src;
+    EXPECT_EQ(run(compile(src, {.ssa = true}), got), interrupt) << src;
+    EXPECT_TRUE(expected == got) << src;
+}
+
+TEST(PeepholeTests, TestMatchesUnoptimized) {
+    expect_same("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 15)");
+    expect_same("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))) (loop 1000 0)");
+    expect_same("(define f (lambda (x) (define y (* x 2)) (if (> y 10) (set! y (- y 10)) (set! y (+ y 1))) (* y 3)))"
+                "(+ (f 2) (f 9))");
+    expect_same("(define f (lambda (x) (if (if (< x 3) (> x 0) (= x 7)) (if (= x 1) 10 20) 30)))"
+                "(+ (f 1) (f 2) (f 5) (f 7))");
+    expect_same("(define x 2.5) (define y (if (< x 10) (* x 4) 0)) (+ y 1 2)");
+    expect_same("(define f (lambda (x) (/ x 0))) (f 4)");
+    expect_same("(/ 1 (* (- 0 1) 0.0))"); // -0.0, not the 0.0 already in the pool
+}
+
+TEST(PeepholeTests, TestDefineComputedInPlace) {
+    const char* src = "(define f (lambda (x) (define y (* x 2)) (define z y) (+ z 1))) (f 3)";
+    auto plain = compile(src, {.peephole = false});
+    auto protos = compile(src);
+    EXPECT_GT(count_op(plain[1].get(), BVM::Opcode::OpMov), 0u);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMov), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 7);
+}
+
+TEST(PeepholeTests, TestSelfMoves) {
+    auto protos = compile("(define f (lambda (x) (set! x x) (+ x 1))) (f 4)");
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMov), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 5);
+}
+
+TEST(PeepholeTests, TestIfComputedInPlace) {
+    auto protos = compile("(define f (lambda (x) (define y (if (< x 0) (- 0 x) (* x 2))) (+ y 1))) (f (- 0 3))");
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMov), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 4);
+}
+
+TEST(PeepholeTests, TestJumpThreading) {
+    auto protos = compile("(define f (lambda (x) (if (< x 0) (if (< x (- 0 10)) 1 2) 3))) (f (- 0 20))");
+    const std::vector<uint32_t>& code = protos[1]->instructions;
+    for (size_t i = 0; i < code.size(); i++) {
+        BVM::Opcode op = BVM::VirtualMachine::decode_op(code[i]);
+        if (op != BVM::Opcode::OpJmp && op != BVM::Opcode::OpJmpIfFalse)
+            continue;
+        int32_t offset = op == BVM::Opcode::OpJmp ? BVM::VirtualMachine::decode_offset24(code[i])
+            : BVM::VirtualMachine::decode_offset16(code[i]);
+        ASSERT_LT(i + 1 + offset, code.size());
+        BVM::Opcode target = BVM::VirtualMachine::decode_op(code[i + 1 + offset]);
+        EXPECT_NE(target, BVM::Opcode::OpJmp);
+        EXPECT_NE(target, BVM::Opcode::OpRet) << "a jump to a ret is that ret";
+        EXPECT_NE(offset, 0);
+    }
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpRet), 3u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 1);
+}
+
+TEST(PeepholeTests, TestConstantBranches) {
+    auto protos = compile("(define f (lambda (x) (if (< 1 2) (+ x 1) (* x 2)))) (f 4)");
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpJmpIfFalse), 0u);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMulRK), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 5);
+
+    // false and only false jumps
+    EXPECT_EQ(run(compile("(if (> 1 2) 1 2)")).as_int(), 2);
+    EXPECT_EQ(run(compile("(if 0 1 2)")).as_int(), 1);
+}
+
+TEST(PeepholeTests, TestFailingOpsKept) {
+    BVM::BoltValue res;
+    EXPECT_EQ(run(compile("(define f (lambda (x) (+ x 1) 7)) (f (< 1 2))"), res), BVM::Interrupt::IncompatibleTypes);
+    EXPECT_EQ(run(compile("(define x (/ 1 0)) 3"), res), BVM::Interrupt::DivisionByZero);
+}
+
+/* a write to a captured register looks dead in the lambda that does it but
+ * the closures sharing it read it */
+TEST(PeepholeTests, TestCapturedRegistersKept) {
+    EXPECT_EQ(run(compile("(define x 1) (define get (lambda () x)) (set! x 5) (get)")).as_int(), 5);
+    const char* src = "(define make (lambda () (define n 0) (define inc (lambda () (set! n (+ n 1)) n))"
+                      "(set! n 10) inc)) (define c (make)) (c) (c)";
+    EXPECT_EQ(run(compile(src)).as_int(), 12);
+    EXPECT_EQ(run(compile(src, {.ssa = true})).as_int(), 12);
+}
+
+TEST(PeepholeTests, TestStats) {
+    std::vector<Lisp::PeepholeStats> stats;
+    auto protos = compile("(define f (lambda (x) (define y (* x 2)) (+ y 1))) (define g (lambda () (f 1))) (g)", {}, &stats);
+    ASSERT_EQ(stats.size(), protos.size());
+    size_t before = 0, after = 0;
+    for (const Lisp::PeepholeStats& s : stats) {
+        EXPECT_LE(s.after, s.before);
+        EXPECT_EQ(s.after, protos[s.proto]->instructions.size());
+        before += s.before;
+        after += s.after;
+    }
+    EXPECT_LT(after, before);
+    compile("(+ 1 2)", {.peephole = false}, &stats);
+    EXPECT_TRUE(stats.empty());
+}
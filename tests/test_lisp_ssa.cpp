@@ -0,0 +1,177 @@
+#include <gtest/gtest.h>
+#include <bolt_virtual_machine/vm.hpp>
+#include <lisp/codegen.hpp>
+
+static std::vector<std::unique_ptr<BVM::Prototype>> compile(const std::string& src, bool ssa,
+        Lisp::SsaStats* stats = nullptr) {
+    Lisp::Lexer lexer(src);
+    lexer.tokenize();
+    auto toks = lexer.get_tokens();
+    Lisp::Parser parser(toks);
+    auto nodes = parser.parse();
+    Lisp::SemanticAnalyzer sa(nodes);
+    std::unique_ptr<Lisp::Lambda> program = sa.verify();
+    Lisp::Compiler compiler("/dev/null", {.ssa = ssa, .peephole = false});
+    compiler.compile(program.get());
+    if (stats)
+        *stats = compiler.get_ssa_stats();
+    return compiler.release_objs();
+}
+
+static BVM::Interrupt run(std::vector<std::unique_ptr<BVM::Prototype>> protos, BVM::BoltValue& res) {
+    BVM::VirtualMachine vm(4096);
+    for (auto& p : protos)
+        vm.load_callable(std::move(p));
+    vm.setup_entry_point();
+    BVM::Interrupt interrupt = vm.run();
+    res = vm.get_return_value();
+    return interrupt;
+}
+
+static BVM::BoltValue run(std::vector<std::unique_ptr<BVM::Prototype>> protos) {
+    BVM::BoltValue res;
+    run(std::move(protos), res);
+    return res;
+}
+
+static size_t count_op(const BVM::Prototype* proto, BVM::Opcode op) {
+    size_t n = 0;
+    for (uint32_t inst : proto->instructions)
+        n += BVM::VirtualMachine::decode_op(inst) == op;
+    return n;
+}
+
+static size_t n_instructions(const std::vector<std::unique_ptr<BVM::Prototype>>& protos) {
+    size_t n = 0;
+    for (auto& p : protos)
+        n += p->instructions.size();
+    return n;
+}
+
+/* same result as the direct path in no more instructions */
+static void expect_same(const std::string& src) {
+    auto direct = compile(src, false);
+    auto ssa = compile(src, true);
+    EXPECT_LE(n_instructions(ssa), n_instructions(direct)) << src;
+    BVM::BoltValue expected, got;
+    BVM::Interrupt direct_interrupt = run(std::move(direct), expected);
+    EXPECT_EQ(run(std::move(ssa), got), direct_interrupt) << src;
+    EXPECT_TRUE(expected == got) << src;
+}
+
+TEST(SsaTests, TestMatchesDirectPath) {
+    expect_same("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 15)");
+    expect_same("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))) (loop 1000 0)");
+    expect_same("(define f (lambda (a b) (if (>= a b) (- a b) (* a 2.5)))) (+ (f 7 3) (f 1 4))");
+    expect_same("(define f (lambda (x) (define y (* x 2)) (if (> y 10) (set! y (- y 10)) (set! y (+ y 1))) (* y 3)))"
+                "(+ (f 2) (f 9))");
+    expect_same("(define g (lambda (a b c) (- (* a b) c))) (define f (lambda (x) (g (g x 2 1) (g 3 x 2) (+ x 1)))) (f 4)");
+    expect_same("(define swap (lambda (n a b) (if (= n 0) (- a b) (swap (- n 1) b a)))) (swap 7 10 3)");
+    expect_same("(define f (lambda (x) (/ x 0))) (f 4)");
+    expect_same("(+ 1 2 3 (- 5) (< 1 2 3))");
+}
+
+TEST(SsaTests, TestClosures) {
+    expect_same("(define make-counter (lambda () (define n 0) (lambda () (set! n (+ n 1)) n)))"
+                "(define c (make-counter)) (c) (c) (c)");
+    expect_same("(define make (lambda (x) (define get (lambda () x)) (set! x (* x 10)) get)) (define g (make 4)) (g)");
+    expect_same("(define fact (lambda (n) (if (= n 0) 1 (* n (fact (- n 1)))))) (fact 10)");
+    expect_same("(define outer (lambda (a) (define b 1) (lambda (c) (lambda () (set! b (+ b c)) (+ a b)))))"
+                "(define h (outer 10)) (define f (h 5)) (f) (f)");
+    expect_same("(define acc 0) (define add (lambda (n) (set! acc (+ acc n)) acc)) (add 3) (add 4) (* acc 2)");
+}
+
+TEST(SsaTests, TestConstantFolding) {
+    Lisp::SsaStats stats;
+    auto protos = compile("(define x (+ (* 2 3) 4)) (- x 1)", true, &stats);
+    EXPECT_EQ(count_op(protos[0].get(), BVM::Opcode::OpAdd) + count_op(protos[0].get(), BVM::Opcode::OpMulRK)
+            + count_op(protos[0].get(), BVM::Opcode::OpSubRK), 0u);
+    EXPECT_EQ(stats.folded, 3u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 9);
+
+    // folded the way the VM computes them
+    BVM::BoltValue v = run(compile("(* 100000 100000)", true));
+    ASSERT_TRUE(v.is_double());
+    EXPECT_EQ(v.as_double(), 1e10);
+    v = run(compile("(/ 7 2)", true));
+    ASSERT_TRUE(v.is_double());
+    EXPECT_EQ(v.as_double(), 3.5);
+    EXPECT_EQ(run(compile("(/ 6 3)", true)).as_int(), 2);
+    EXPECT_TRUE(run(compile("(= 1 1.0)", true)).as_bool());
+
+    // what would interrupt is left for run time
+    BVM::BoltValue res;
+    EXPECT_EQ(run(compile("(/ 1 0)", true), res), BVM::Interrupt::DivisionByZero);
+    EXPECT_EQ(run(compile("(+ 1 (< 1 2))", true), res), BVM::Interrupt::IncompatibleTypes);
+}
+
+TEST(SsaTests, TestBranchFolding) {
+    Lisp::SsaStats stats;
+    auto protos = compile("(define f (lambda (x) (if (< 1 2) (+ x 1) (* x 2)))) (f 4)", true, &stats);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpJmpIfFalse), 0u);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMulRK), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 5);
+}
+
+TEST(SsaTests, TestCopyPropagation) {
+    Lisp::SsaStats stats;
+    auto protos = compile("(define f (lambda (x) (define y x) (define z y) (+ z 1))) (f 4)", true, &stats);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMov), 0u);
+    EXPECT_GE(stats.copies, 2u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 5);
+}
+
+TEST(SsaTests, TestCommonSubexpressions) {
+    Lisp::SsaStats stats;
+    auto protos = compile("(define f (lambda (x y) (* (+ x y) (+ y x)))) (f 3 4)", true, &stats);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpAdd), 1u);
+    EXPECT_EQ(stats.cse, 1u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 49);
+
+    // only where the first one dominates the second
+    protos = compile("(define f (lambda (x y) (if (< x y) (+ x y) (- (+ x y) 1)))) (f 5 1)", true, &stats);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpAdd), 2u);
+    EXPECT_EQ(stats.cse, 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 5);
+}
+
+TEST(SsaTests, TestDeadCode) {
+    Lisp::SsaStats stats;
+    auto protos = compile("(define f (lambda (x) (define unused (= x 2)) (define g (lambda () x)) x)) (f 4)", true, &stats);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpEqRK), 0u);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpClosure), 0u);
+    EXPECT_GE(stats.dead, 2u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 4);
+
+    // an unused value that can fail still checks its operands
+    BVM::BoltValue res;
+    EXPECT_EQ(run(compile("(define f (lambda (x) (+ x 1) 7)) (f (< 1 2))", true), res),
+            BVM::Interrupt::IncompatibleTypes);
+}
+
+TEST(SsaTests, TestFewerRegisters) {
+    const char* src = "(define f (lambda (x) (define a (+ x 1)) (define b (* a 2)) (define c (- b 3))"
+                      "(define d (* c c)) (define e (+ d a)) e)) (f 5)";
+    auto direct = compile(src, false);
+    auto ssa = compile(src, true);
+    EXPECT_LT(ssa[1]->next_reg, direct[1]->next_reg);
+    EXPECT_LT(ssa[1]->instructions.size(), direct[1]->instructions.size());
+    EXPECT_EQ(run(std::move(ssa)).as_int(), 87);
+}
+
+/* arguments computed where the callee's window will be are not moved there */
+TEST(SsaTests, TestCallWindows) {
+    auto protos = compile("(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1))))) (loop 10 0)", true);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMov), 0u);
+    protos = compile("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 10)", true);
+    EXPECT_EQ(count_op(protos[1].get(), BVM::Opcode::OpMov), 0u);
+    EXPECT_EQ(run(std::move(protos)).as_int(), 55);
+}
+
+TEST(SsaTests, TestRegisterLimit) {
+    std::string src = "(define f (lambda (x) ";
+    for (int i = 0; i < 300; i++)
+        src += "(+ (* x " + std::to_string(i) + ") ";
+    src += "x" + std::string(300, ')') + ")) (f 1)";
+    EXPECT_THROW(compile(src, true), std::runtime_error);
+}
@@ -0,0 +1,145 @@
+#include <gtest/gtest.h>
+#include <bolt_virtual_machine/scheduler.hpp>
+
+/* main(f, x, y) = f(x, y) */
+static std::unique_ptr<BVM::Prototype> make_main() {
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 3;
+    main_func->instructions = {BVM::Emitter::call(0, 2), BVM::Emitter::ret(0)};
+    return main_func;
+}
+
+/* fib(self, n) = n < 2 ? n : join(schedule self(self, n - 1)) + self(self, n - 2) */
+static std::unique_ptr<BVM::Prototype> make_fib(uint8_t join) {
+    auto f = std::make_unique<BVM::Prototype>();
+    f->arity = 2;
+    f->next_reg = 11;
+    f->consts = {BVM::BoltValue::from_int(2), BVM::BoltValue::from_int(1)};
+    f->instructions = {
+        BVM::Emitter::lt_rk(2, 1, 0),
+        BVM::Emitter::jmp_if_false(2, 1),
+        BVM::Emitter::ret(1),
+        BVM::Emitter::mov(3, 0),
+        BVM::Emitter::mov(4, 0),
+        BVM::Emitter::sub_rk(5, 1, 1),
+        BVM::Emitter::schedule(3, 2),
+        BVM::Emitter::mov(6, 0),
+        BVM::Emitter::mov(7, 0),
+        BVM::Emitter::sub_rk(8, 1, 0),
+        BVM::Emitter::call(6, 2),
+        BVM::Emitter::mov(10, 3),
+        BVM::Emitter::call_native(9, 1, join),
+        BVM::Emitter::add(9, 9, 6),
+        BVM::Emitter::ret(9),
+    };
+    return f;
+}
+
+class SchedulerTest : public ::testing::Test {
+protected:
+    std::shared_ptr<const BVM::Program> program;
+    uint8_t join_id;
+
+    void SetUp() override {
+        auto p = std::make_shared<BVM::Program>();
+        join_id = p->find_native("join");
+        p->load_callable(make_main());
+        p->load_callable(make_fib(join_id));
+
+        // second(self, l) = car(cdr(l))
+        auto second = std::make_unique<BVM::Prototype>();
+        second->arity = 2;
+        second->next_reg = 4;
+        second->instructions = {
+            BVM::Emitter::mov(3, 1),
+            BVM::Emitter::call_native(2, 1, p->find_native("cdr")),
+            BVM::Emitter::mov(3, 2),
+            BVM::Emitter::call_native(2, 1, p->find_native("car")),
+            BVM::Emitter::ret(2),
+        };
+        p->load_callable(std::move(second));
+
+        // div(self, x) = x / 0
+        auto div = std::make_unique<BVM::Prototype>();
+        div->arity = 2;
+        div->next_reg = 3;
+        div->consts = {BVM::BoltValue::from_int(0)};
+        div->instructions = {BVM::Emitter::div_rk(2, 1, 0), BVM::Emitter::ret(2)};
+        p->load_callable(std::move(div));
+        p->freeze();
+        program = p;
+    }
+};
+
+TEST_F(SchedulerTest, TestNestedSpawnAndJoin) {
+    for (unsigned n_workers : {1u, 4u}) {
+        BVM::Scheduler scheduler(program, n_workers);
+        BVM::VirtualMachine vm(program);
+        vm.setup_entry_point();
+        BVM::BoltValue fib = BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(1)));
+        vm.set_register_value(0, fib);
+        vm.set_register_value(1, fib);
+        vm.set_register_value(2, BVM::BoltValue::from_int(15));
+        EXPECT_EQ(scheduler.run(vm), BVM::Interrupt::Halt);
+        EXPECT_EQ(vm.get_return_value().as_int(), 610);
+        EXPECT_EQ(vm.get_scheduler(), nullptr);
+    }
+}
+
+TEST_F(SchedulerTest, TestArgumentsAreImported) {
+    BVM::VirtualMachine vm(program);
+    vm.setup_entry_point();
+    BVM::BoltValue list = BVM::BoltValue::nil();
+    for (int i = 3; i > 0; i--) {
+        list = BVM::BoltValue::from_cons(vm.new_cons(BVM::BoltValue::from_int(i), list));
+        vm.set_register_value(2, list);
+    }
+    // a task context runs second(nil, (1 2 3)) on a copy of the list
+    BVM::VirtualMachine task(program);
+    BVM::BoltValue args[2] = {list, BVM::BoltValue::nil()};
+    task.setup_call(BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(2))), BVM::NativeArgs(&args[1], 2));
+    EXPECT_EQ(task.run(), BVM::Interrupt::Halt);
+    EXPECT_EQ(task.get_return_value().as_int(), 2);
+
+    // the copy is independent of the original
+    BVM::BoltValue copy = task.import_value(list);
+    EXPECT_NE(copy.as_cons(), list.as_cons());
+    EXPECT_EQ(copy.as_cons()->cdr.as_cons()->cdr.as_cons()->car.as_int(), 3);
+}
+
+TEST_F(SchedulerTest, TestTaskErrorsReachTheJoiner) {
+    BVM::Scheduler scheduler(program, 2);
+    BVM::VirtualMachine vm(program);
+    vm.setup_entry_point();
+    BVM::BoltValue div = BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(3)));
+    BVM::BoltValue args[2] = {BVM::BoltValue::from_int(7), div};
+    int id = scheduler.spawn(div, BVM::NativeArgs(&args[1], 2));
+    BVM::BoltValue res;
+    EXPECT_EQ(scheduler.join(vm, id, res), BVM::Interrupt::DivisionByZero);
+    // a handle is gone once joined
+    EXPECT_EQ(scheduler.join(vm, id, res), BVM::Interrupt::IncompatibleTypes);
+}
+
+TEST_F(SchedulerTest, TestScheduleNeedsScheduler) {
+    BVM::VirtualMachine vm(program);
+    vm.setup_entry_point();
+    BVM::BoltValue fib = BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(1)));
+    vm.set_register_value(0, fib);
+    vm.set_register_value(1, fib);
+    vm.set_register_value(2, BVM::BoltValue::from_int(5));
+    EXPECT_EQ(vm.run(), BVM::Interrupt::NoScheduler);
+}
+
+TEST_F(SchedulerTest, TestPreemptedTasksComplete) {
+    // a single worker switching tasks every few reductions
+    BVM::Scheduler scheduler(program, 1, 5);
+    BVM::VirtualMachine vm(program);
+    vm.setup_entry_point();
+    BVM::BoltValue fib = BVM::BoltValue::from_func(vm.new_closure(vm.get_callable(1)));
+    vm.set_register_value(0, fib);
+    vm.set_register_value(1, fib);
+    vm.set_register_value(2, BVM::BoltValue::from_int(12));
+    EXPECT_EQ(scheduler.run(vm), BVM::Interrupt::Halt);
+    EXPECT_EQ(vm.get_return_value().as_int(), 144);
+    EXPECT_THROW(BVM::Scheduler(program, 1, 0), std::runtime_error);
+}
@@ -0,0 +1,105 @@
+#include "bolt_virtual_machine/value.hpp"
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_set>
+
+TEST(ValueTests, IntRoundTrip) {
+    for (int i : {0, 1, -1, std::numeric_limits<int>::max(), std::numeric_limits<int>::min()}) {
+        BVM::BoltValue v = BVM::BoltValue::from_int(i);
+        EXPECT_EQ(v.get_type(), BVM::BoltType::Integer);
+        EXPECT_TRUE(v.is_int());
+        EXPECT_EQ(v.as_int(), i);
+    }
+}
+
+TEST(ValueTests, DoubleRoundTrip) {
+    for (double d : {0.0, -0.0, 5.1, -1e300, std::numeric_limits<double>::infinity()}) {
+        BVM::BoltValue v = BVM::BoltValue::from_double(d);
+        EXPECT_EQ(v.get_type(), BVM::BoltType::Float);
+        EXPECT_EQ(v.as_double(), d);
+    }
+    BVM::BoltValue nan = BVM::BoltValue::from_double(-std::numeric_limits<double>::quiet_NaN());
+    EXPECT_EQ(nan.get_type(), BVM::BoltType::Float);
+    EXPECT_TRUE(std::isnan(nan.as_double()));
+}
+
+TEST(ValueTests, PointerRoundTrip) {
+    BVM::ClosureObj* f = reinterpret_cast<BVM::ClosureObj*>(0x7ffd12345678);
+    BVM::BoltValue v = BVM::BoltValue::from_func(f);
+    EXPECT_EQ(v.get_type(), BVM::BoltType::Closure);
+    EXPECT_EQ(v.as_func(), f);
+    EXPECT_EQ(BVM::BoltValue::nil().get_type(), BVM::BoltType::Nil);
+    EXPECT_EQ(BVM::BoltValue::from_bool(true).as_bool(), true);
+}
+
+TEST(ValueTests, HashAgreesWithEquality) {
+    std::hash<BVM::BoltValue> hash;
+    EXPECT_EQ(hash(BVM::BoltValue::from_int(12345)), hash(BVM::BoltValue::from_int(12345)));
+    EXPECT_EQ(hash(BVM::BoltValue::from_double(2.5)), hash(BVM::BoltValue::from_double(2.5)));
+    EXPECT_EQ(hash(BVM::BoltValue::from_double(0.0)), hash(BVM::BoltValue::from_double(-0.0)));
+    EXPECT_EQ(hash(BVM::BoltValue::from_bool(true)), hash(BVM::BoltValue::from_bool(true)));
+    EXPECT_EQ(hash(BVM::BoltValue::nil()), hash(BVM::BoltValue::nil()));
+
+    // same payload, different type
+    EXPECT_NE(hash(BVM::BoltValue::from_int(1)), hash(BVM::BoltValue::from_bool(true)));
+    EXPECT_NE(hash(BVM::BoltValue::from_int(0)), hash(BVM::BoltValue::nil()));
+
+    std::unordered_set<size_t> hashes;
+    for (int i = 0; i < 1000; i++) {
+        hashes.insert(hash(BVM::BoltValue::from_int(i)));
+        hashes.insert(hash(BVM::BoltValue::from_double(i + 0.5)));
+    }
+    EXPECT_EQ(hashes.size(), 2000u);
+}
+
+TEST(ValueTests, BothInt) {
+    BVM::BoltValue i = BVM::BoltValue::from_int(-7);
+    BVM::BoltValue d = BVM::BoltValue::from_double(3.0);
+    BVM::BoltValue b = BVM::BoltValue::from_bool(false);
+    EXPECT_TRUE(BVM::BoltValue::both_int(i, i));
+    EXPECT_FALSE(BVM::BoltValue::both_int(i, d));
+    EXPECT_FALSE(BVM::BoltValue::both_int(d, i));
+    EXPECT_FALSE(BVM::BoltValue::both_int(i, b));
+}
+
+/* the layout the JIT relies on: a value written as two 32-bit words reads
+ * back as the int or boolean, and the tag word tells them apart */
+static BVM::BoltValue from_words(uint32_t payload, uint32_t tag) {
+    BVM::BoltValue v = BVM::BoltValue::nil();
+    std::memcpy(reinterpret_cast<uint8_t*>(&v), &payload, 4);
+    std::memcpy(reinterpret_cast<uint8_t*>(&v) + BVM::BoltValue::TAG_WORD_OFFSET, &tag, 4);
+    return v;
+}
+
+TEST(ValueTests, TagWords) {
+    BVM::BoltValue i = from_words(static_cast<uint32_t>(-42), BVM::BoltValue::INT_TAG_WORD);
+    EXPECT_TRUE(i.is_int());
+    EXPECT_EQ(i.as_int(), -42);
+    EXPECT_TRUE(from_words(0, BVM::BoltValue::BOOL_TAG_WORD).is_false());
+    EXPECT_TRUE(from_words(1, BVM::BoltValue::BOOL_TAG_WORD).as_bool());
+    EXPECT_FALSE(BVM::BoltValue::from_double(1.5).is_int());
+
+    uint32_t tag;
+    BVM::BoltValue d = BVM::BoltValue::from_double(-2.0);
+    std::memcpy(&tag, reinterpret_cast<uint8_t*>(&d) + BVM::BoltValue::TAG_WORD_OFFSET, 4);
+    EXPECT_NE(tag, BVM::BoltValue::INT_TAG_WORD);
+    EXPECT_NE(tag, BVM::BoltValue::BOOL_TAG_WORD);
+
+    // every double, whatever its bits, has a tag word in the double range
+    for (double x : {-2.0, 0.0, 1e300, -std::numeric_limits<double>::infinity(), std::nan("")}) {
+        BVM::BoltValue v = BVM::BoltValue::from_double(x);
+        std::memcpy(&tag, reinterpret_cast<uint8_t*>(&v) + BVM::BoltValue::TAG_WORD_OFFSET, 4);
+        EXPECT_LT(tag - BVM::BoltValue::DOUBLE_TAG_WORD_MIN, BVM::BoltValue::DOUBLE_TAG_WORD_SPAN);
+    }
+    for (BVM::BoltValue v : {i, BVM::BoltValue::from_bool(true), BVM::BoltValue::nil()}) {
+        std::memcpy(&tag, reinterpret_cast<uint8_t*>(&v) + BVM::BoltValue::TAG_WORD_OFFSET, 4);
+        EXPECT_GE(tag - BVM::BoltValue::DOUBLE_TAG_WORD_MIN, BVM::BoltValue::DOUBLE_TAG_WORD_SPAN);
+    }
+
+    uint64_t word;
+    BVM::BoltValue f = BVM::BoltValue::from_func(reinterpret_cast<BVM::ClosureObj*>(0x7f0012345670));
+    std::memcpy(&word, &f, 8);
+    EXPECT_EQ(word & BVM::BoltValue::POINTER_MASK, 0x7f0012345670u);
+}
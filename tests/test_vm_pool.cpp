@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include <bolt_virtual_machine/vm_pool.hpp>
+#include <thread>
+
+/* main counts r0 from 0 to 1000 and returns it */
+static std::shared_ptr<const BVM::Program> make_program() {
+    auto program = std::make_shared<BVM::Program>();
+    auto main_func = std::make_unique<BVM::Prototype>();
+    main_func->next_reg = 2;
+    main_func->consts = {BVM::BoltValue::from_int(0), BVM::BoltValue::from_int(1000), BVM::BoltValue::from_int(1)};
+    main_func->instructions = {
+        BVM::Emitter::load_const(0, 0),
+        BVM::Emitter::lt_rk(1, 0, 1),
+        BVM::Emitter::jmp_if_false(1, 2),
+        BVM::Emitter::add_rk(0, 0, 2),
+        BVM::Emitter::jmp(-4),
+        BVM::Emitter::ret(0),
+    };
+    program->load_callable(std::move(main_func));
+    program->freeze();
+    return program;
+}
+
+TEST(VmPoolTest, TestSharedProgram) {
+    auto program = make_program();
+    BVM::VirtualMachine a(program), b(program);
+    a.setup_entry_point();
+    b.setup_entry_point();
+    EXPECT_EQ(a.run(), BVM::Interrupt::Halt);
+    EXPECT_EQ(b.run(), BVM::Interrupt::Halt);
+    EXPECT_EQ(a.get_return_value().as_int(), 1000);
+    EXPECT_EQ(b.get_return_value().as_int(), 1000);
+    EXPECT_EQ(a.get_callable(0), b.get_callable(0));
+    // quickening rewrote each context's copy, never the shared code
+    EXPECT_GT(a.get_quicken_stats().quickened, 0);
+    EXPECT_EQ(program->get_callable(0)->decoded[1].op, BVM::Opcode::OpLtRK);
+}
+
+TEST(VmPoolTest, TestFrozenProgramRejectsLoads) {
+    auto program = std::make_shared<BVM::Program>();
+    EXPECT_THROW(BVM::VirtualMachine vm(program), std::runtime_error);
+    EXPECT_THROW(BVM::VmPool pool(program), std::runtime_error);
+
+    BVM::VirtualMachine vm(make_program());
+    EXPECT_THROW(vm.load_callable(std::make_unique<BVM::Prototype>()), std::runtime_error);
+
+    BVM::VirtualMachine owner;
+    owner.load_callable(std::make_unique<BVM::Prototype>());
+    auto shared = owner.share_program();
+    EXPECT_TRUE(shared->is_frozen());
+    auto native = [](BVM::VirtualMachine&, BVM::NativeArgs, BVM::BoltValue&) { return BVM::Interrupt::Ok; };
+    EXPECT_THROW(owner.register_native("f", native), std::runtime_error);
+}
+
+TEST(VmPoolTest, TestLowerRejectsHeapConstants) {
+    BVM::VirtualMachine vm;
+    auto func = std::make_unique<BVM::Prototype>();
+    func->consts = {BVM::BoltValue::from_func(vm.new_native_closure(nullptr))};
+    func->instructions = {BVM::Emitter::ret(0)};
+    EXPECT_THROW(vm.load_callable(std::move(func)), std::runtime_error);
+}
+
+TEST(VmPoolTest, TestContextsAreRecycled) {
+    BVM::VmPool pool(make_program(), 2);
+    BVM::VirtualMachine* first;
+    {
+        auto vm = pool.acquire();
+        first = vm.get();
+        vm->setup_entry_point();
+        vm->run();
+        for (int i = 0; i < 10; i++)
+            vm->new_cons(BVM::BoltValue::from_int(i), BVM::BoltValue::nil());
+    }
+    EXPECT_EQ(pool.n_idle(), 1);
+
+    auto vm = pool.acquire();
+    EXPECT_EQ(vm.get(), first);
+    EXPECT_EQ(pool.n_idle(), 0);
+    // the reset dropped the last run's heap but kept its quickened code
+    EXPECT_EQ(vm->get_return_value().get_type(), BVM::BoltType::Nil);
+    EXPECT_EQ(vm->get_gc_stats().live_objects, 0);
+    uint64_t quickened = vm->get_quicken_stats().quickened;
+    vm->setup_entry_point();
+    vm->run();
+    EXPECT_EQ(vm->get_return_value().as_int(), 1000);
+    EXPECT_EQ(vm->get_quicken_stats().quickened, quickened);
+
+    // only max_idle contexts are kept
+    {
+        auto a = pool.acquire(), b = pool.acquire(), c = pool.acquire();
+    }
+    EXPECT_EQ(pool.n_idle(), 2);
+}
+
+TEST(VmPoolTest, TestConcurrentExecutions) {
+    BVM::VmPool pool(make_program());
+    std::vector<std::thread> threads;
+    std::vector<int> failures(8, 0);
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&pool, &failures, t] {
+            for (int i = 0; i < 200; i++) {
+                auto vm = pool.acquire();
+                vm->setup_entry_point();
+                if (vm->run() != BVM::Interrupt::Halt || vm->get_return_value().as_int() != 1000)
+                    failures[t]++;
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    for (int f : failures)
+        EXPECT_EQ(f, 0);
+    EXPECT_LE(pool.n_idle(), 8);
+}